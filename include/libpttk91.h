@@ -0,0 +1,141 @@
+/**
+ *******************************************************************************
+ * @file    libpttk91.h
+ * @author  Olli Vanhoja
+ * @brief   Embedding API of the PTTK91 library.
+ *******************************************************************************
+ */
+
+/* libpttk91
+ * =========
+ * `make lib` builds libpttk91.a and libpttk91.so from everything but the
+ * command line front end, without the debug output of VM_DEBUG. This header
+ * is the whole API, instances are opaque. Any number of instances can run in
+ * one process, each on one thread at a time.
+ *
+ * Every instance carries its host callbacks in a struct pttk91_host. IN, OUT
+ * and SVC go to the callbacks of the instance, NULL callbacks use the
+ * platform devices and SVCs. With alloc and free the memory of the instance
+ * is taken from the host, otherwise it's reserved with vm_mem_alloc() and
+ * committed on first touch.
+ *
+ * Instances of the same program can share one decoded code, e.g. the code of
+ * a program from the program cache, see program.h.
+ *
+ * Process wide state
+ * ------------------
+ * The library keeps no global state of its own but some of its modules
+ * change the state of the process:
+ * + Watchpoints (watch.h) install a SIGSEGV handler for the process when the
+ *   first watchpoints are initialized and keep the watchpoints of the running
+ *   VM in a thread local variable. A fault outside of the watched pages
+ *   restores the previous handler and faults again.
+ * + server_start() (server.h) ignores SIGPIPE for the process so that a
+ *   client closing its connection doesn't kill the server.
+ */
+
+#ifndef LIBPTTK91_H
+#define LIBPTTK91_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reasons for pttk91_run() to return, same as VM_STOP_x */
+#define PTTK91_STOP_HALT        0 /*!< Halted by the program or by the host */
+#define PTTK91_STOP_ERROR       1 /*!< Runtime error, see pttk91_error() */
+#define PTTK91_STOP_BREAKPOINT  2 /*!< Breakpoint trap */
+#define PTTK91_STOP_WATCH       3 /*!< Stopped after a write to a watched page */
+#define PTTK91_STOP_RETURN      4 /*!< Returned from pttk91_call() */
+#define PTTK91_STOP_WAIT        5 /*!< IN or OUT would block */
+
+/** Return value of a device callback to suspend the instance, see VM_IO_WAIT */
+#define PTTK91_IO_WAIT          -1
+
+/**
+ * Embedded VM instance.
+ */
+struct pttk91_vm;
+
+/** Decoded code, see code.h */
+struct vm_code;
+
+/**
+ * Host callbacks of an instance.
+ * Every callback gets arg as its first argument, see struct vm_io.
+ */
+struct pttk91_host {
+    int (*in)(void * arg, int device, int * value);
+    int (*out)(void * arg, int device, int value);
+    void * arg;
+
+    /**
+     * SVC handler.
+     * Registers of the instance are accessed with pttk91_reg() and
+     * pttk91_set_reg().
+     * @return 0 if handled; 1 if the SVC is illegal; -1 to run the
+     *         built-in SVC.
+     */
+    int (*svc)(void * arg, struct pttk91_vm * vm, int call_code);
+
+    /** Allocator of instance memory, both or neither must be given */
+    void * (*alloc)(void * arg, size_t size);
+    void (*free)(void * arg, void * ptr, size_t size);
+};
+
+/* Portable functions */
+/**
+ * Create an instance and load an image to its memory.
+ * @param host host callbacks, NULL for the platform defaults.
+ * @param code_size end address of the code section.
+ * @param memsize size of the memory in words, 0 to size it by the static
+ *                footprint of the image, see footprint.h.
+ * @param code decoded code of the image or NULL, not copied.
+ * @return the instance or NULL on error.
+ */
+struct pttk91_vm * pttk91_create(const struct pttk91_host * host, const uint32_t * image,
+                                 int image_size, int code_size, int memsize,
+                                 const struct vm_code * code);
+
+/**
+ * Run an instance until it stops.
+ * @return reason why the instance stopped, one of PTTK91_STOP_x.
+ */
+int pttk91_run(struct pttk91_vm * vm);
+
+/**
+ * Call a subroutine of the program of an instance, see vm_call().
+ */
+int pttk91_call(struct pttk91_vm * vm, int entry, const int * args, int nargs,
+                int * result);
+
+/**
+ * Get the last runtime error of an instance, one of VM_ERR_x of vm.h.
+ */
+int pttk91_error(const struct pttk91_vm * vm);
+
+/**
+ * Get a register of an instance.
+ * @param reg register number, 0 to 7.
+ * @return the value of the register or 0 if reg is invalid.
+ */
+int pttk91_reg(const struct pttk91_vm * vm, int reg);
+
+/**
+ * Set a register of an instance.
+ * @param reg register number, 0 to 7; invalid numbers are ignored.
+ */
+void pttk91_set_reg(struct pttk91_vm * vm, int reg, int value);
+
+/**
+ * Get the memory of an instance.
+ * @param memsize returns the size of the memory in words if not NULL.
+ */
+uint32_t * pttk91_mem(struct pttk91_vm * vm, int * memsize);
+
+/**
+ * Destroy an instance.
+ */
+void pttk91_destroy(struct pttk91_vm * vm);
+/* End of portable functions */
+
+#endif /* LIBPTTK91_H */
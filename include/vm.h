@@ -9,7 +9,144 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stdint.h>
 #include "pttk91.h"
+#include "config.h"
+
+/* Error codes */
+#define VM_ERR_NO_ERROR                 0
+#define VM_ERR_INVALID_OPCODE           1
+#define VM_ERR_PARAM_ERROR              2
+#define VM_ERR_ADDRESS_OUT_OF_BOUNDS    3
+#define VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS 4
+#define VM_ERR_REGISTER_OUT_OF_BOUNDS   5
+#define VM_ERR_PC_OUT_OF_BOUNDS         6
+#define VM_ERR_BAD_ACCESS_MODE          7
+#define VM_ERR_ILLEGAL_SVC              8
+#define VM_ERR_INVALID_DEVICE           9
+#define VM_ERR_TRACE_DIVERGED           10
+
+/* Reasons for vm_run() to return */
+#define VM_STOP_HALT        0 /*!< Halted by the program or by the host */
+#define VM_STOP_ERROR       1 /*!< Runtime error, see vm_state.error */
+#define VM_STOP_BREAKPOINT  2 /*!< Breakpoint trap, PC points to the trap */
+#define VM_STOP_WATCH       3 /*!< Stopped after a write to a watched page */
+#define VM_STOP_RETURN      4 /*!< Returned from the subroutine of vm_call() */
+#define VM_STOP_WAIT        5 /*!< IN or OUT would block, PC points to it */
+#define VM_STOP_SLICE       6 /*!< End of a slice, see vm_state.slice */
+
+/** Return value of a device handler to suspend the VM, see vm_io */
+#define VM_IO_WAIT          -1
+
+/** Words per page of the dirty page map as a power of two */
+#define VM_DIRTY_SHIFT      10
+
+/** Words per page of the MMIO window as a power of two */
+#define VM_MMIO_SHIFT       8
+
+/** Return address of the frame pushed by vm_call() */
+#define VM_CALL_RETURN      INT32_MIN
+
+/* Comparison flags */
+#define VM_CMP_NONE         INT64_MAX /*!< No comparison done, all flags clear */
+#define VM_SR_GRE(state)    ((state)->cmp > 0 && (state)->cmp != VM_CMP_NONE)
+#define VM_SR_EQU(state)    ((state)->cmp == 0)
+#define VM_SR_LES(state)    ((state)->cmp < 0)
+
+/* State register bits as seen by the program */
+#define VM_SR_BIT_GRE   31
+#define VM_SR_BIT_EQU   30
+#define VM_SR_BIT_LES   29
+#define VM_SR_BIT_OVF   28
+#define VM_SR_BIT_DIV   27
+#define VM_SR_BIT_UNI   26
+#define VM_SR_BIT_FMA   25
+#define VM_SR_BIT_DEI   24
+#define VM_SR_BIT_SVC   23
+#define VM_SR_BIT_PRI   22
+#define VM_SR_BIT_NIN   21
+
+/* Internal operations replacing instruction sequences, see vm_insn.xop */
+#define VM_XOP_SEQ              1 /*!< Run a sequence with one dispatch */
+#define VM_XOP_COMP_JCC         2 /*!< COMP followed by a conditional jump */
+#define VM_XOP_LOAD_ADD_STORE   3 /*!< Add a constant to a variable */
+#define VM_XOP_DROP             4 /*!< Run the first instruction, skip the rest */
+#define VM_XOP_LOOP             5 /*!< Counted loop executed on the host */
+#define VM_XOP_MAX_LEN          8 /*!< Maximum length of a sequence */
+
+struct trace;
+struct fuse_profile;
+struct smp;
+struct vm_state;
+
+/**
+ * Decoded instruction.
+ */
+struct vm_insn {
+    int opcode;     /*!< Operation code */
+    int rj;         /*!< First operand register */
+    int m;          /*!< Addressing mode */
+    int ri;         /*!< Index register */
+    int imm;        /*!< Address part */
+    int xop;        /*!< Internal operation replacing the sequence, 0 if none */
+    int len;        /*!< Number of instructions executed by xop */
+};
+
+/**
+ * Decoded code section.
+ * Records are indexed by instruction address. A record starting a fused
+ * sequence keeps its own instruction and the following records are left
+ * untouched so the code can be entered at any address.
+ */
+struct vm_code {
+    int len;                /*!< Number of decoded instructions */
+    struct vm_insn * insn;
+    int removed;            /*!< Instructions removed by optimization */
+    int threaded;           /*!< Jumps retargeted past other jumps */
+};
+
+/**
+ * Host callbacks of a vm instance.
+ * Every callback gets arg as its first argument, NULL callbacks use the
+ * platform defaults. Device handlers return zero if no error. A handler
+ * that can't transfer the value yet returns VM_IO_WAIT, the VM stops with
+ * VM_STOP_WAIT and executes the IN or OUT again when it's resumed by
+ * setting running.
+ */
+struct vm_io {
+    int (*in)(void * arg, int device, int * value);
+    int (*out)(void * arg, int device, int value);
+    void * arg;
+
+    /**
+     * SVC handler.
+     * @return 0 if handled; 1 if the SVC is illegal; -1 to run the
+     *         built-in SVC.
+     */
+    int (*svc)(void * arg, struct vm_state * state, uint32_t * mem, int call_code);
+};
+
+/**
+ * Device mapped to the MMIO window, see mmio.h.
+ * Handlers get the word offset in the page of the device and return zero if
+ * no error.
+ */
+struct vm_mmio_dev {
+    int (*read)(void * arg, int offset, int * value);
+    int (*write)(void * arg, int offset, int value);
+    void * arg;
+};
+
+/**
+ * MMIO window of a vm instance.
+ * The window starts at or above the memory size, so ordinary memory accesses
+ * never reach it.
+ */
+struct vm_mmio {
+    int base;       /*!< First address of the window, page aligned */
+    int npages;     /*!< Size of the window in pages of 2^VM_MMIO_SHIFT words */
+    const struct vm_mmio_dev ** page; /*!< Device of each page or NULL */
+};
 
 /**
  * Virtual machine state.
@@ -17,22 +154,27 @@
 struct vm_state {
     int regs[PTTK91_NUM_REGS];
     int pc; /* Program counter */
+#if VM_VECTOR == 1
+    int32_t vregs[PTTK91_NUM_VREGS][PTTK91_VLEN]; /*!< Vector registers */
+#endif
 
     /* Rest of variables are for internal use */
-    int opcode;
-    /* operands: */
-    int rj;
-    int m;
-    int ri;
-    int imm;
+    struct vm_insn ir; /*!< Instruction register */
+
+    /**
+     * Result of the last COMP as the signed difference of the operands.
+     * The gre, equ and les bits of the state register are derived from this
+     * value only when a branch or a SR read needs them.
+     */
+    int64_t cmp;
 
     /**
      * State register
      *
      * <b>index:</b>
-     * + gre - greater
-     * + equ - equal
-     * + les - less
+     * + gre - greater, see VM_SR_GRE()
+     * + equ - equal, see VM_SR_EQU()
+     * + les - less, see VM_SR_LES()
      * + ovf - arithmetic overflow
      * + div - divide by zero
      * + uni - unknown instruction
@@ -43,9 +185,6 @@ struct vm_state {
      * + nin - interrupts disabled
      */
     struct sr_t {
-        unsigned int gre : 1;
-        unsigned int equ : 1;
-        unsigned int les : 1;
         unsigned int ovf : 1;
         unsigned int div : 1;
         unsigned int uni : 1;
@@ -62,11 +201,71 @@ struct vm_state {
     /** End address of the code section */
     int code_sec_end;
 
-    /** the VM runs until this flag becomes 0 */
-    int running;
+    /** the VM runs until this flag becomes 0, may be cleared asynchronously */
+    volatile int running;
+
+    /** Reason why the VM stopped running, one of VM_STOP_x */
+    volatile int stop;
+
+    /** Last runtime error code */
+    int error;
+
+    /** Number of vm_call() frames running */
+    int call_depth;
+
+    /**
+     * Number of instructions executed by the interpreter. Straight-line code
+     * is counted when the control leaves it, so the count is up to date
+     * when vm_run() or vm_step() returns.
+     */
+    uint64_t count;
+    int count_pc; /*!< Start of the code not yet counted */
+
+    /**
+     * Number of instructions vm_run() executes before it stops with
+     * VM_STOP_SLICE, 0 for no limit. The slice is checked on jumps, calls
+     * and returns, so a run continues to the end of its straight-line code.
+     */
+    uint64_t slice;
+    uint64_t slice_end; /*!< Count at the end of the slice of vm_run() */
+
+#if VM_METRICS == 1
+    /** Numbers of SVC, IN and OUT instructions executed, see metrics.h */
+    uint64_t svc_count;
+    uint64_t in_count;
+    uint64_t out_count;
+#endif
+
+    /** Execution trace, NULL if not tracing */
+    struct trace * trace;
+
+    /** Decoded code, NULL if the instructions are decoded from the memory */
+    const struct vm_code * code;
+
+    /** Opcode pair profile, NULL if not profiling */
+    struct fuse_profile * profile;
+
+    /** CPUs sharing the memory, NULL if SVC spawn is not available */
+    struct smp * smp;
+
+    /** Host callbacks, NULL to use the platform devices and SVCs */
+    const struct vm_io * io;
+
+    /** Dirty page map of the memory, NULL if writes are not tracked */
+    uint8_t * dirty;
+
+    /** MMIO window, NULL if none; used only if VM_MMIO is enabled */
+    const struct vm_mmio * mmio;
 };
 
 void vm_init_state(struct vm_state * state, int code_size, int memsize);
 void vm_run(struct vm_state * state, uint32_t * mem);
+int vm_step(struct vm_state * state, uint32_t * mem);
+int vm_call(struct vm_state * state, uint32_t * mem, int entry,
+            const int * args, int nargs, int * result);
+int vm_decode(struct vm_insn * ins, uint32_t instr);
+uint32_t vm_get_sr(const struct vm_state * state);
+void vm_show_regs(const struct vm_state * state);
+const char * vm_stop_name(int stop);
 
 #endif /* VM_H */
@@ -0,0 +1,274 @@
+/**
+ *******************************************************************************
+ * @file    aot.c
+ * @author  Olli Vanhoja
+ * @brief   Ahead-of-time translation of programs to C.
+ *******************************************************************************
+ */
+
+#include "aot.h"
+
+/**
+ * Emit the second operand of an instruction to v.
+ * @return 0 if the operand was emitted; 1 if the interpreter is needed.
+ */
+static int emit_operand(FILE * out, const struct vm_insn * ins, int pc)
+{
+    if (ins->m == PTTK91_ADDRMOD_0) {
+        if (ins->ri)
+            fprintf(out, "            v = %d + r[%d];\n", ins->imm, ins->ri);
+        else
+            fprintf(out, "            v = %d;\n", ins->imm);
+        return 0;
+    }
+
+    if (ins->m == PTTK91_ADDRMOD_1) {
+        if (ins->ri)
+            fprintf(out, "            a = %d + r[%d];\n", ins->imm, ins->ri);
+        else
+            fprintf(out, "            a = %d;\n", ins->imm);
+        fprintf(out, "            if (AOT_LOAD_OOB(a, state)) AOT_STEP(%d)\n", pc);
+        fprintf(out, "            v = (int)mem[a];\n");
+        return 0;
+    }
+
+    /* Indirect memory fetch */
+    return 1;
+}
+
+static const char * branch_cond(const struct vm_insn * ins, char * buf, size_t len)
+{
+    const char * fmt;
+
+    switch (ins->opcode) {
+    case PTTK91_JUMP:
+        return "1";
+    case PTTK91_JNEG:
+        fmt = "r[%d] < 0";
+        break;
+    case PTTK91_JZER:
+        fmt = "r[%d] == 0";
+        break;
+    case PTTK91_JPOS:
+        fmt = "r[%d] > 0";
+        break;
+    case PTTK91_JNNEG:
+        fmt = "r[%d] >= 0";
+        break;
+    case PTTK91_JNZER:
+        fmt = "r[%d] != 0";
+        break;
+    case PTTK91_JNPOS:
+        fmt = "r[%d] <= 0";
+        break;
+    case PTTK91_JLES:
+        return "cmp < 0";
+    case PTTK91_JEQU:
+        return "cmp == 0";
+    case PTTK91_JGRE:
+        return "cmp > 0 && cmp != VM_CMP_NONE";
+    case PTTK91_JNLES:
+        return "cmp >= 0 && cmp != VM_CMP_NONE";
+    case PTTK91_JNEQU:
+        return "cmp != 0 && cmp != VM_CMP_NONE";
+    case PTTK91_JNGRE:
+        return "cmp <= 0";
+    default:
+        return NULL;
+    }
+
+    snprintf(buf, len, fmt, ins->rj);
+    return buf;
+}
+
+/**
+ * Emit one instruction.
+ * @return 0 if the instruction was translated; 1 if the interpreter is needed.
+ */
+static int emit_insn(FILE * out, const struct vm_insn * ins, int pc)
+{
+    const int rj = ins->rj;
+    const char * cond;
+    const char * op = NULL;
+    char buf[40];
+
+    switch (ins->opcode) {
+    case PTTK91_NOP:
+        return 0;
+
+    case PTTK91_STORE:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            if (AOT_STORE_OOB(v, state)) AOT_STEP(%d)\n", pc);
+        fprintf(out, "            if (AOT_CODE_WRITE(v, CODE_SIZE)) AOT_LEAVE(%d)\n", pc);
+        fprintf(out, "            mem[v] = r[%d];\n", rj);
+        return 0;
+    case PTTK91_LOAD:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            r[%d] = v;\n", rj);
+        return 0;
+
+    case PTTK91_ADD:
+        op = "+";
+        break;
+    case PTTK91_SUB:
+        op = "-";
+        break;
+    case PTTK91_MUL:
+        op = "*";
+        break;
+    case PTTK91_AND:
+        op = "&";
+        break;
+    case PTTK91_OR:
+        op = "|";
+        break;
+    case PTTK91_XOR:
+        op = "^";
+        break;
+    case PTTK91_SHL:
+        op = "<<";
+        break;
+    case PTTK91_SHR:
+        op = ">>";
+        break;
+
+    case PTTK91_DIV:
+    case PTTK91_MOD:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            if (v == 0) AOT_STEP(%d)\n", pc);
+        fprintf(out, "            r[%d] = r[%d] %s v;\n", rj, rj,
+                (ins->opcode == PTTK91_DIV) ? "/" : "%");
+        return 0;
+    case PTTK91_NOT:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            r[%d] = ~(unsigned int)r[%d];\n", rj, rj);
+        return 0;
+    case PTTK91_SHRA:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            r[%d] = arithmetic_right_shift(r[%d], (unsigned int)v);\n",
+                rj, rj);
+        return 0;
+
+    case PTTK91_COMP:
+        if (emit_operand(out, ins, pc))
+            return 1;
+        fprintf(out, "            cmp = (int64_t)r[%d] - v;\n", rj);
+        return 0;
+
+    default:
+        cond = branch_cond(ins, buf, sizeof(buf));
+        /* Only direct jumps are translated */
+        if (!cond || ins->m != PTTK91_ADDRMOD_0 || ins->ri != 0)
+            return 1;
+        fprintf(out, "            if (%s) AOT_BRANCH(%d, %d)\n", cond, pc, ins->imm);
+        return 0;
+    }
+
+    /* Binary arithmetic and logic, computed unsigned to wrap like the host */
+    if (emit_operand(out, ins, pc))
+        return 1;
+    fprintf(out, "            r[%d] = (unsigned int)r[%d] %s (unsigned int)v;\n", rj, rj, op);
+    return 0;
+}
+
+static void emit_image(FILE * out, const uint32_t * image, int image_size,
+                       int code_size, const char * name)
+{
+    int i;
+
+    fprintf(out, "#define CODE_SIZE %d\n\n", code_size);
+    fprintf(out, "const uint32_t %s_image[] = {", name);
+    for (i = 0; i < image_size; i++) {
+        fprintf(out, "%s0x%08x%s", (i % 6) ? " " : "\n    ",
+                (unsigned int)image[i], (i + 1 < image_size) ? "," : "");
+    }
+    fprintf(out, "\n};\n");
+    fprintf(out, "const int %s_image_size = %d;\n", name, image_size);
+    fprintf(out, "const int %s_code_size = %d;\n\n", name, code_size);
+}
+
+static void emit_main(FILE * out, const char * name)
+{
+    fprintf(out,
+            "#ifdef AOT_MAIN\n"
+            "#include <stdlib.h>\n\n"
+            "int main(int argc, char * argv[])\n"
+            "{\n"
+            "    int memsize = (argc > 1) ? atoi(argv[1]) : 1024;\n"
+            "    struct vm_state state;\n"
+            "    uint32_t * mem;\n\n"
+            "    if (memsize < %s_image_size || !(mem = vm_mem_alloc(memsize))) {\n"
+            "        fprintf(stderr, \"Can't allocate memory for the VM.\\n\");\n"
+            "        return 2;\n"
+            "    }\n"
+            "    memcpy(mem, %s_image, sizeof(%s_image));\n"
+            "    vm_init_state(&state, %s_code_size, memsize);\n"
+            "    %s_run(&state, mem);\n"
+            "    vm_mem_free(mem, memsize);\n\n"
+            "    return (state.stop == VM_STOP_ERROR) ? 1 : 0;\n"
+            "}\n"
+            "#endif\n",
+            name, name, name, name, name);
+}
+
+int aot_translate(FILE * out, const uint32_t * image, int image_size,
+                  int code_size, const char * name)
+{
+    struct vm_insn ins;
+    int pc;
+    int interp = 0;
+
+    if (image_size <= 0 || code_size > image_size)
+        return -1;
+
+    fprintf(out, "/* Translated from a PTTK91 image, do not edit. */\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    emit_image(out, image, image_size, code_size, name);
+
+    fprintf(out,
+            "void %s_run(struct vm_state * state, uint32_t * mem)\n"
+            "{\n"
+            "    int r[PTTK91_NUM_REGS];\n"
+            "    int64_t cmp;\n"
+            "    int a, v, entry;\n\n"
+            "    (void)a;\n"
+            "    (void)v;\n"
+            "    if (state->trace) {\n"
+            "        vm_run(state, mem);\n"
+            "        return;\n"
+            "    }\n\n"
+            "    state->stop = VM_STOP_HALT;\n"
+            "    AOT_RESTORE();\n"
+            "    while (state->running) {\n"
+            "        entry = state->pc;\n"
+            "        switch (state->pc) {\n", name);
+
+    /* The last word of the code section is writable and left to the
+     * interpreter. */
+    for (pc = 0; pc < code_size; pc++) {
+        fprintf(out, "        case %d: /* %08x */\n", pc, (unsigned int)image[pc]);
+        if (vm_decode(&ins, image[pc]) || emit_insn(out, &ins, pc)) {
+            fprintf(out, "            AOT_STEP(%d)\n", pc);
+            interp++;
+        }
+    }
+
+    fprintf(out,
+            "            AOT_COUNT(CODE_SIZE);\n"
+            "            state->pc = CODE_SIZE;\n"
+            "            continue;\n"
+            "        default:\n"
+            "            AOT_STEP(state->pc)\n"
+            "        }\n"
+            "    }\n"
+            "    AOT_SAVE();\n"
+            "}\n\n");
+    emit_main(out, name);
+
+    return ferror(out) ? -1 : interp;
+}
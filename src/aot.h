@@ -0,0 +1,109 @@
+/**
+ *******************************************************************************
+ * @file    aot.h
+ * @author  Olli Vanhoja
+ * @brief   Ahead-of-time translation of programs to C.
+ *******************************************************************************
+ */
+
+/* AOT translation
+ * ===============
+ * A loaded image is translated to a C function that runs the program on the
+ * same struct vm_state and memory layout as the interpreter. The function
+ * is a switch on PC over one case label per instruction of the code section
+ * so straight code falls through and a branch continues from the switch.
+ * Registers and the comparison result are kept in local variables and
+ * written back to the state when leaving the generated code.
+ *
+ * Computed jumps, indirect addressing, subroutines, stack, I/O and SVC
+ * instructions are executed by the interpreter with vm_step() and so is
+ * every instruction that would fail, so runtime errors are reported the
+ * same way as when interpreting. Stores to the code section leave the
+ * generated code for good if the code area is writable.
+ *
+ * Generated code doesn't record traces and it updates PC only on branches,
+ * so it falls back to the interpreter when tracing and shouldn't be used
+ * with watchpoints. Executed instructions are added to state->count when
+ * straight code is left, i.e. once per block, not per instruction.
+ */
+
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "pttk91.h"
+#include "arit.h"
+#include "mem.h"
+#include "vm.h"
+#include "config.h"
+
+/* Helpers for the generated code */
+#if VM_CODE_AREA_RW == 0
+#define AOT_STORE_OOB(addr, state) \
+    ((unsigned int)(addr) >= (unsigned int)(state)->memsize || (addr) < (state)->code_sec_end)
+#define AOT_CODE_WRITE(addr, code_size) 0
+#else
+#define AOT_STORE_OOB(addr, state) ((unsigned int)(addr) >= (unsigned int)(state)->memsize)
+#define AOT_CODE_WRITE(addr, code_size) ((addr) < (code_size))
+#endif
+#define AOT_LOAD_OOB(addr, state) ((unsigned int)(addr) >= (unsigned int)(state)->memsize)
+
+/* Sync the local registers with the vm state */
+#define AOT_SAVE() do {                                                         \
+        memcpy(state->regs, r, sizeof(r));                                      \
+        state->cmp = cmp;                                                       \
+    } while (0)
+#define AOT_RESTORE() do {                                                      \
+        memcpy(r, state->regs, sizeof(r));                                      \
+        cmp = state->cmp;                                                       \
+    } while (0)
+
+/* Count the instructions executed since straight code was entered at
+ * entry, at is the address of the next instruction */
+#define AOT_COUNT(at) (state->count += (uint64_t)((at) - entry))
+
+/* Take a branch from the instruction at the address at */
+#define AOT_BRANCH(at, target) {                                                \
+        AOT_COUNT((at) + 1);                                                    \
+        state->pc = (target);                                                   \
+        continue;                                                               \
+    }
+
+/* Execute the instruction at pc with the interpreter */
+#define AOT_STEP(at) {                                                          \
+        AOT_COUNT(at);                                                          \
+        AOT_SAVE();                                                             \
+        state->pc = (at);                                                       \
+        vm_step(state, mem);                                                    \
+        AOT_RESTORE();                                                          \
+        continue;                                                               \
+    }
+
+/* Continue from pc with the interpreter */
+#define AOT_LEAVE(at) {                                                         \
+        AOT_COUNT(at);                                                          \
+        AOT_SAVE();                                                             \
+        state->pc = (at);                                                       \
+        vm_run(state, mem);                                                     \
+        return;                                                                 \
+    }
+/* End of helpers */
+
+/**
+ * Translate a program to C.
+ * The generated file defines <name>_image[], <name>_image_size,
+ * <name>_code_size and <name>_run(state, mem), and main() if it's compiled
+ * with AOT_MAIN defined.
+ * @param out output file.
+ * @param image loaded image.
+ * @param image_size size of the image in words.
+ * @param code_size end address of the code section.
+ * @param name prefix of the generated symbols, a valid C identifier.
+ * @return number of instructions left to the interpreter or -1 on error.
+ */
+int aot_translate(FILE * out, const uint32_t * image, int image_size,
+                  int code_size, const char * name);
+
+#endif /* AOT_H */
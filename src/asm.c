@@ -0,0 +1,616 @@
+/**
+ *******************************************************************************
+ * @file    asm.c
+ * @author  Olli Vanhoja
+ * @brief   TTK91 assembler.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "pttk91.h"
+#include "asm.h"
+
+#define ASM_LINE_MAX    256 /*!< Maximum length of a source line */
+
+/* Operand forms */
+#define F_NONE      0 /*!< No operands */
+#define F_RJ        1 /*!< Rj */
+#define F_RJ_OP     2 /*!< Rj, operand */
+#define F_OP        3 /*!< [Rj,] operand */
+#define F_ADDR      0x10 /*!< Operand is an address, one less fetch */
+#define F_VJ        0x20 /*!< Rj is a vector register */
+#define F_VI        0x40 /*!< Operand is a vector register */
+#define F_FORM(form) ((form) & 0xf)
+
+/* Pseudo instructions */
+#define P_DC        1
+#define P_DS        2
+#define P_EQU       3
+
+struct mnemonic {
+    const char * name;
+    uint32_t opcode;
+    int form;
+    int pseudo;
+};
+
+static const struct mnemonic mnemonics[] = {
+    { "nop",    PTTK91_NOP,     F_NONE,             0 },
+    { "store",  PTTK91_STORE,   F_RJ_OP | F_ADDR,   0 },
+    { "load",   PTTK91_LOAD,    F_RJ_OP,            0 },
+    { "in",     PTTK91_IN,      F_RJ_OP,            0 },
+    { "out",    PTTK91_OUT,     F_RJ_OP,            0 },
+    { "add",    PTTK91_ADD,     F_RJ_OP,            0 },
+    { "sub",    PTTK91_SUB,     F_RJ_OP,            0 },
+    { "mul",    PTTK91_MUL,     F_RJ_OP,            0 },
+    { "div",    PTTK91_DIV,     F_RJ_OP,            0 },
+    { "mod",    PTTK91_MOD,     F_RJ_OP,            0 },
+    { "and",    PTTK91_AND,     F_RJ_OP,            0 },
+    { "or",     PTTK91_OR,      F_RJ_OP,            0 },
+    { "xor",    PTTK91_XOR,     F_RJ_OP,            0 },
+    { "shl",    PTTK91_SHL,     F_RJ_OP,            0 },
+    { "shr",    PTTK91_SHR,     F_RJ_OP,            0 },
+    { "not",    PTTK91_NOT,     F_RJ,               0 },
+    { "shra",   PTTK91_SHRA,    F_RJ_OP,            0 },
+    { "comp",   PTTK91_COMP,    F_RJ_OP,            0 },
+    { "jump",   PTTK91_JUMP,    F_OP | F_ADDR,      0 },
+    { "jneg",   PTTK91_JNEG,    F_RJ_OP | F_ADDR,   0 },
+    { "jzer",   PTTK91_JZER,    F_RJ_OP | F_ADDR,   0 },
+    { "jpos",   PTTK91_JPOS,    F_RJ_OP | F_ADDR,   0 },
+    { "jnneg",  PTTK91_JNNEG,   F_RJ_OP | F_ADDR,   0 },
+    { "jnzer",  PTTK91_JNZER,   F_RJ_OP | F_ADDR,   0 },
+    { "jnpos",  PTTK91_JNPOS,   F_RJ_OP | F_ADDR,   0 },
+    { "jles",   PTTK91_JLES,    F_OP | F_ADDR,      0 },
+    { "jequ",   PTTK91_JEQU,    F_OP | F_ADDR,      0 },
+    { "jgre",   PTTK91_JGRE,    F_OP | F_ADDR,      0 },
+    { "jnles",  PTTK91_JNLES,   F_OP | F_ADDR,      0 },
+    { "jnequ",  PTTK91_JNEQU,   F_OP | F_ADDR,      0 },
+    { "jngre",  PTTK91_JNGRE,   F_OP | F_ADDR,      0 },
+    { "call",   PTTK91_CALL,    F_RJ_OP | F_ADDR,   0 },
+    { "exit",   PTTK91_EXIT,    F_RJ_OP,            0 },
+    { "push",   PTTK91_PUSH,    F_RJ_OP,            0 },
+    { "pop",    PTTK91_POP,     F_RJ_OP,            0 },
+    { "pushr",  PTTK91_PUSHR,   F_RJ,               0 },
+    { "popr",   PTTK91_POPR,    F_RJ,               0 },
+    { "cas",    PTTK91_CAS,     F_RJ_OP | F_ADDR,   0 },
+    { "xadd",   PTTK91_XADD,    F_RJ_OP | F_ADDR,   0 },
+    { "vload",  PTTK91_VLOAD,   F_RJ_OP | F_ADDR | F_VJ, 0 },
+    { "vstore", PTTK91_VSTORE,  F_RJ_OP | F_ADDR | F_VJ, 0 },
+    { "vsplat", PTTK91_VSPLAT,  F_RJ_OP | F_VJ,     0 },
+    { "vadd",   PTTK91_VADD,    F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vsub",   PTTK91_VSUB,    F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vmul",   PTTK91_VMUL,    F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vand",   PTTK91_VAND,    F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vor",    PTTK91_VOR,     F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vcomp",  PTTK91_VCOMP,   F_RJ_OP | F_VJ | F_VI, 0 },
+    { "vsum",   PTTK91_VSUM,    F_RJ_OP | F_VI,     0 },
+    { "vmin",   PTTK91_VMIN,    F_RJ_OP | F_VI,     0 },
+    { "vmax",   PTTK91_VMAX,    F_RJ_OP | F_VI,     0 },
+    { "svc",    PTTK91_SVC,     F_RJ_OP,            0 },
+    { "dc",     0,              0,                  P_DC },
+    { "ds",     0,              0,                  P_DS },
+    { "equ",    0,              0,                  P_EQU },
+};
+
+static const struct {
+    const char * name;
+    int value;
+} builtins[] = {
+    { "crt",    0 },
+    { "kbd",    1 },
+    { "stdin",  6 },
+    { "stdout", 7 },
+    { "halt",   11 },
+    { "read",   12 },
+    { "write",  13 },
+    { "time",   14 },
+    { "date",   15 },
+    { "spawn",  16 },
+    { "join",   17 },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int error(struct asm_state * as, const char * msg)
+{
+    as->error = msg;
+    as->error_line = as->line;
+    return 1;
+}
+
+/**
+ * Grow an array to hold at least n elements.
+ * @return 0 if no error; 1 if out of memory.
+ */
+static int grow(void ** arr, int * size, int n, size_t elem_size)
+{
+    void * p;
+    int new_size;
+
+    if (n <= *size)
+        return 0;
+
+    new_size = (*size) ? *size : 64;
+    while (new_size < n)
+        new_size *= 2;
+    p = realloc(*arr, (size_t)new_size * elem_size);
+    if (!p)
+        return 1;
+    *arr = p;
+    *size = new_size;
+    return 0;
+}
+
+/**
+ * Get the index of a symbol, adding an undefined symbol if not found.
+ * @return index of the symbol or -1 if error.
+ */
+static int sym_get(struct asm_state * as, const char * name)
+{
+    const struct symbol * sym;
+    int old_size = as->symtab.size;
+    uint8_t * kind;
+
+    sym = symtab_find(&(as->symtab), name);
+    if (sym)
+        return (int)(sym - as->symtab.syms);
+
+    if (symtab_add(&(as->symtab), name, 0)) {
+        error(as, "invalid symbol");
+        return -1;
+    }
+    if (as->symtab.size != old_size) {
+        kind = realloc(as->sym_kind, as->symtab.size);
+        if (!kind) {
+            error(as, "out of memory");
+            return -1;
+        }
+        as->sym_kind = kind;
+    }
+    as->sym_kind[as->symtab.count - 1] = ASM_SYM_UNDEF;
+
+    return as->symtab.count - 1;
+}
+
+/**
+ * Define a symbol.
+ * @return 0 if no error; 1 if error.
+ */
+static int sym_define(struct asm_state * as, const char * name, int kind, int value)
+{
+    int i;
+
+    i = sym_get(as, name);
+    if (i < 0)
+        return 1;
+    if ((as->sym_kind[i] & ~ASM_SYM_USED) != ASM_SYM_UNDEF
+        && (as->sym_kind[i] & ~ASM_SYM_USED) != ASM_SYM_BUILTIN) {
+        return error(as, "symbol redefined");
+    }
+
+    as->sym_kind[i] = kind;
+    as->symtab.syms[i].value = value;
+    return 0;
+}
+
+int asm_init(struct asm_state * as)
+{
+    size_t i;
+
+    memset(as, 0, sizeof(struct asm_state));
+    symtab_init(&(as->symtab));
+
+    for (i = 0; i < ARRAY_SIZE(builtins); i++) {
+        if (sym_define(as, builtins[i].name, ASM_SYM_BUILTIN, builtins[i].value))
+            return 2;
+    }
+    return 0;
+}
+
+void asm_free(struct asm_state * as)
+{
+    free(as->code);
+    free(as->data);
+    free(as->sym_kind);
+    free(as->fixups);
+    symtab_free(&(as->symtab));
+}
+
+static char * skip_space(char * p)
+{
+    while (isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
+static void trim_end(char * p)
+{
+    char * end = p + strlen(p);
+
+    while (end > p && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+}
+
+/**
+ * Cut the next word and convert it to lower case.
+ * @return pointer to the word; *p points to the rest of the line.
+ */
+static char * next_word(char ** p)
+{
+    char * word = skip_space(*p);
+    char * end = word;
+
+    while (*end && !isspace((unsigned char)*end)) {
+        *end = tolower((unsigned char)*end);
+        end++;
+    }
+    if (*end)
+        *end++ = '\0';
+    *p = end;
+
+    return word;
+}
+
+static const struct mnemonic * find_mnemonic(const char * name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(mnemonics); i++) {
+        if (strcmp(mnemonics[i].name, name) == 0)
+            return &mnemonics[i];
+    }
+    return NULL;
+}
+
+/**
+ * Parse a register name.
+ * @return register number or -1 if not a register.
+ */
+static int parse_reg(const char * s)
+{
+    if (strcmp(s, "sp") == 0)
+        return PTTK91_SP;
+    if (strcmp(s, "fp") == 0)
+        return PTTK91_FP;
+    if (s[0] == 'r' && s[1] >= '0' && s[1] < '0' + PTTK91_NUM_REGS && s[2] == '\0')
+        return s[1] - '0';
+    return -1;
+}
+
+/**
+ * Parse a vector register name.
+ * @return register number or -1 if not a vector register.
+ */
+static int parse_vreg(const char * s)
+{
+    if (s[0] == 'v' && s[1] >= '0' && s[1] < '0' + PTTK91_NUM_VREGS && s[2] == '\0')
+        return s[1] - '0';
+    return -1;
+}
+
+static int is_symbol(const char * s)
+{
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return 0;
+    while (*++s) {
+        if (!isalnum((unsigned char)*s) && *s != '_')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Parse a value that must be known now.
+ * @return 0 if no error; 1 if error.
+ */
+static int parse_const(struct asm_state * as, const char * s, int * value)
+{
+    const struct symbol * sym;
+    char * end;
+    int kind;
+
+    if (is_symbol(s)) {
+        sym = symtab_find(&(as->symtab), s);
+        if (!sym)
+            return error(as, "undefined symbol");
+        kind = as->sym_kind[sym - as->symtab.syms] & ~ASM_SYM_USED;
+        if (kind != ASM_SYM_CODE && kind != ASM_SYM_ABS && kind != ASM_SYM_BUILTIN)
+            return error(as, "value must be a constant");
+        as->sym_kind[sym - as->symtab.syms] |= (kind == ASM_SYM_BUILTIN) ? ASM_SYM_USED : 0;
+        *value = sym->value;
+        return 0;
+    }
+
+    *value = (int)strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0')
+        return error(as, "invalid value");
+    return 0;
+}
+
+/**
+ * Check that a value fits the address part of an instruction.
+ * The VM reads the address part as unsigned, so negative values are rejected
+ * instead of being read back as 65536 + value.
+ */
+static int check_imm(struct asm_state * as, int value)
+{
+    if (value < 0 || value > 65535)
+        return error(as, "value out of range");
+    return 0;
+}
+
+/**
+ * Parse the second operand of an instruction.
+ * @param instr instruction word where the operand is encoded.
+ * @return 0 if no error; 1 if error.
+ */
+static int parse_operand(struct asm_state * as, char * s, int form, uint32_t * instr)
+{
+    char * paren;
+    int mode = 1;
+    int ri = 0;
+    int value = 0;
+    int reg;
+
+    if (*s == '=') {
+        mode = 0;
+        s++;
+    } else if (*s == '@') {
+        mode = 2;
+        s++;
+    }
+    s = skip_space(s);
+    for (paren = s; *paren; paren++)
+        *paren = tolower((unsigned char)*paren);
+
+    reg = parse_reg(s);
+    if (reg >= 0) {
+        /* Register operand */
+        ri = reg;
+        mode--;
+        s = "0";
+    } else {
+        paren = strchr(s, '(');
+        if (paren) {
+            char * close = strchr(paren, ')');
+
+            if (!close || close[1] != '\0')
+                return error(as, "invalid index register");
+            *close = '\0';
+            *paren = '\0';
+            ri = parse_reg(skip_space(paren + 1));
+            if (ri < 0)
+                return error(as, "invalid index register");
+            trim_end(s);
+        }
+    }
+
+    if (form & F_ADDR)
+        mode--;
+    if (mode < 0)
+        return error(as, "invalid addressing mode");
+
+    if (is_symbol(s)) {
+        int i = sym_get(as, s);
+        int kind;
+
+        if (i < 0)
+            return 1;
+        kind = as->sym_kind[i] & ~ASM_SYM_USED;
+        if (kind == ASM_SYM_BUILTIN)
+            as->sym_kind[i] |= ASM_SYM_USED;
+        if (kind == ASM_SYM_CODE || kind == ASM_SYM_ABS || kind == ASM_SYM_BUILTIN) {
+            value = as->symtab.syms[i].value;
+        } else {
+            /* Resolved by asm_finish() */
+            if (grow((void **)&(as->fixups), &(as->fixup_size),
+                     as->fixup_count + 1, sizeof(struct asm_fixup))) {
+                return error(as, "out of memory");
+            }
+            as->fixups[as->fixup_count].addr = as->code_len;
+            as->fixups[as->fixup_count].sym = i;
+            as->fixups[as->fixup_count].line = as->line;
+            as->fixup_count++;
+        }
+    } else if (parse_const(as, s, &value)) {
+        return 1;
+    }
+    if (check_imm(as, value))
+        return 1;
+
+    *instr |= ((uint32_t)mode << PTTK91_M_POS)
+              | ((uint32_t)ri << PTTK91_RI_POS)
+              | ((uint32_t)value & 0xffff);
+    return 0;
+}
+
+static int emit_code(struct asm_state * as, uint32_t instr)
+{
+    if (grow((void **)&(as->code), &(as->code_size), as->code_len + 1, sizeof(uint32_t)))
+        return error(as, "out of memory");
+    as->code[as->code_len++] = instr;
+    return 0;
+}
+
+static int emit_data(struct asm_state * as, uint32_t value, int n)
+{
+    if (n < 0)
+        return error(as, "invalid size");
+    if (grow((void **)&(as->data), &(as->data_size), as->data_len + n, sizeof(uint32_t)))
+        return error(as, "out of memory");
+    while (n--)
+        as->data[as->data_len++] = value;
+    return 0;
+}
+
+static int assemble_pseudo(struct asm_state * as, const char * label,
+                           const struct mnemonic * mn, char * args)
+{
+    int value;
+
+    trim_end(args);
+    if (parse_const(as, args, &value))
+        return 1;
+
+    switch (mn->pseudo) {
+    case P_DC:
+        if (*label && sym_define(as, label, ASM_SYM_DATA, as->data_len))
+            return 1;
+        return emit_data(as, (uint32_t)value, 1);
+    case P_DS:
+        if (*label && sym_define(as, label, ASM_SYM_DATA, as->data_len))
+            return 1;
+        return emit_data(as, 0, value);
+    default: /* P_EQU */
+        if (!*label)
+            return error(as, "missing label");
+        return sym_define(as, label, ASM_SYM_ABS, value);
+    }
+}
+
+int asm_line(struct asm_state * as, const char * src)
+{
+    char buf[ASM_LINE_MAX];
+    const struct mnemonic * mn;
+    char * p = buf;
+    char * label = "";
+    char * word;
+    char * op2 = NULL;
+    uint32_t instr;
+    int reg;
+
+    as->line++;
+    if (strlen(src) >= sizeof(buf))
+        return error(as, "line too long");
+    strcpy(buf, src);
+    word = strchr(buf, ';');
+    if (word)
+        *word = '\0';
+
+    word = next_word(&p);
+    if (*word == '\0')
+        return 0; /* Empty line */
+
+    mn = find_mnemonic(word);
+    if (!mn) {
+        label = word;
+        if (!is_symbol(label) || strlen(label) >= SYMTAB_NAME_MAX)
+            return error(as, "invalid label");
+        word = next_word(&p);
+        mn = find_mnemonic(word);
+        if (!mn)
+            return error(as, (*word) ? "unknown instruction" : "missing instruction");
+    }
+
+    p = skip_space(p);
+    if (mn->pseudo)
+        return assemble_pseudo(as, label, mn, p);
+
+    if (*label && sym_define(as, label, ASM_SYM_CODE, as->code_len))
+        return 1;
+
+    /* Split the operands */
+    trim_end(p);
+    op2 = strchr(p, ',');
+    if (op2) {
+        *op2++ = '\0';
+        trim_end(p);
+        op2 = skip_space(op2);
+    }
+
+    instr = mn->opcode;
+    switch (F_FORM(mn->form)) {
+    case F_NONE:
+        if (*p)
+            return error(as, "unexpected operand");
+        break;
+    case F_OP:
+        if (!op2) {
+            /* Rj is optional */
+            op2 = p;
+            break;
+        }
+        /* Fall through */
+    case F_RJ:
+    case F_RJ_OP:
+        word = next_word(&p);
+        reg = (mn->form & F_VJ) ? parse_vreg(word) : parse_reg(word);
+        if (reg < 0 || *skip_space(p))
+            return error(as, "invalid register");
+        instr |= (uint32_t)reg << PTTK91_RJ_POS;
+        if (F_FORM(mn->form) == F_RJ && op2)
+            return error(as, "unexpected operand");
+        if (F_FORM(mn->form) != F_RJ && (!op2 || *op2 == '\0'))
+            return error(as, "missing operand");
+        break;
+    }
+
+    if (op2 && (mn->form & F_VI)) {
+        word = next_word(&op2);
+        reg = parse_vreg(word);
+        if (reg < 0 || *skip_space(op2))
+            return error(as, "invalid vector register");
+        instr |= (uint32_t)reg << PTTK91_RI_POS;
+    } else if (op2 && parse_operand(as, op2, mn->form, &instr)) {
+        return 1;
+    }
+
+    return emit_code(as, instr);
+}
+
+int asm_finish(struct asm_state * as)
+{
+    const struct asm_fixup * fix;
+    int i, value;
+
+    /* Relocate data symbols after the code */
+    for (i = 0; i < as->symtab.count; i++) {
+        if (as->sym_kind[i] == ASM_SYM_DATA) {
+            as->symtab.syms[i].value += as->code_len;
+            as->sym_kind[i] = ASM_SYM_ABS;
+        }
+    }
+
+    for (i = 0; i < as->fixup_count; i++) {
+        fix = &(as->fixups[i]);
+        as->line = fix->line;
+        if (as->sym_kind[fix->sym] == ASM_SYM_UNDEF)
+            return error(as, "undefined symbol");
+
+        value = as->symtab.syms[fix->sym].value;
+        if (check_imm(as, value))
+            return 1;
+        as->code[fix->addr] |= (uint32_t)value & 0xffff;
+    }
+    as->fixup_count = 0;
+
+    return 0;
+}
+
+int asm_image(const struct asm_state * as, uint32_t * mem, int memsize,
+              int * code_size, int * image_size, struct symtab * symtab)
+{
+    int i;
+
+    if (as->code_len + as->data_len > memsize)
+        return 2;
+
+    memcpy(mem, as->code, as->code_len * sizeof(uint32_t));
+    memcpy(mem + as->code_len, as->data, as->data_len * sizeof(uint32_t));
+    /* Same as in b91: address of the last instruction */
+    *code_size = as->code_len - 1;
+    *image_size = as->code_len + as->data_len;
+
+    if (!symtab)
+        return 0;
+    for (i = 0; i < as->symtab.count; i++) {
+        if (as->sym_kind[i] == ASM_SYM_BUILTIN)
+            continue; /* Unused */
+        if (symtab_add(symtab, as->symtab.syms[i].name, as->symtab.syms[i].value))
+            return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ *******************************************************************************
+ * @file    asm.h
+ * @author  Olli Vanhoja
+ * @brief   TTK91 assembler.
+ *******************************************************************************
+ */
+
+/* Assembler
+ * =========
+ * Source lines are assembled in a single pass. Code is placed from address
+ * zero and data defined with DC and DS is placed after the code, so the
+ * address of a data symbol and any forward reference is known only at the
+ * end. Those references are recorded as fixups and patched by asm_finish().
+ *
+ *     [label] opcode [Rj,] [=|@]value[(Ri)]
+ *     [label] opcode [Rj,] [=|@]Ri
+ *     [label] opcode Vj|Rj, Vi         vector instructions, see vector.h
+ *     [label] DC value
+ *     [label] DS size
+ *     label   EQU value
+ *
+ * The value of an operand is the unsigned 16-bit address part, 0..65535,
+ * larger and negative values are rejected, e.g. -1 is loaded with
+ * "load r1, =0" and "sub r1, =1".
+ *
+ * Names are case insensitive and comments start with ';'. The standard
+ * device and SVC symbols (crt, kbd, stdin, stdout, halt, read, write, time,
+ * date, spawn and join) are predefined.
+ */
+
+#ifndef ASM_H
+#define ASM_H
+
+#include <stdint.h>
+#include "symtab.h"
+
+/**
+ * Reference to a symbol that is resolved at the end.
+ */
+struct asm_fixup {
+    int addr;   /*!< Address of the instruction in code */
+    int sym;    /*!< Index of the symbol in symtab */
+    int line;   /*!< Source line */
+};
+
+/**
+ * Assembler state.
+ */
+struct asm_state {
+    int line;           /*!< Number of the current source line */
+    const char * error; /*!< Error message, NULL if no error */
+    int error_line;     /*!< Source line of the error */
+
+    uint32_t * code;
+    int code_len;
+    int code_size;      /*!< Allocated size of code */
+    uint32_t * data;
+    int data_len;
+    int data_size;      /*!< Allocated size of data */
+
+    struct symtab symtab;
+    uint8_t * sym_kind; /*!< Kind of each symbol in symtab, ASM_SYM_x */
+    struct asm_fixup * fixups;
+    int fixup_count;
+    int fixup_size;     /*!< Allocated size of fixups */
+};
+
+#define ASM_SYM_UNDEF   0 /*!< Referenced but not defined yet */
+#define ASM_SYM_CODE    1 /*!< Code address */
+#define ASM_SYM_DATA    2 /*!< Offset in the data section */
+#define ASM_SYM_ABS     3 /*!< Constant defined with EQU */
+#define ASM_SYM_BUILTIN 4 /*!< Predefined constant */
+#define ASM_SYM_USED    0x80 /*!< Predefined constant used by the program */
+
+/**
+ * Initialize the assembler.
+ * @return 0 if no error; 2 if out of memory.
+ */
+int asm_init(struct asm_state * as);
+void asm_free(struct asm_state * as);
+
+/**
+ * Assemble a source line.
+ * @param src line without the line terminator.
+ * @return 0 if no error; 1 if error, see as->error.
+ */
+int asm_line(struct asm_state * as, const char * src);
+
+/**
+ * Resolve the remaining references after the last line.
+ * @return 0 if no error; 1 if error, see as->error.
+ */
+int asm_finish(struct asm_state * as);
+
+/**
+ * Copy the assembled program to memory.
+ * @param code_size returns the end address of the code section.
+ * @param image_size returns the number of words copied.
+ * @param symtab symbol table where the symbols are added, can be NULL.
+ * @return 0 if no error; 2 if the program doesn't fit.
+ */
+int asm_image(const struct asm_state * as, uint32_t * mem, int memsize,
+              int * code_size, int * image_size, struct symtab * symtab);
+
+/* Portable functions */
+/**
+ * Assemble a source file and load it to the memory.
+ * Parameters and return values are the same as with b91_loader_load().
+ */
+int asm_load(uint32_t * mem, int memsize, int * code_size, int * image_size,
+             struct symtab * symtab, const char * name);
+/* End of portable functions */
+
+#endif /* ASM_H */
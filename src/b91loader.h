@@ -8,5 +8,10 @@
 
 #ifndef B91_LOADER_H
 #define B91_LOADER_H
+#include "symtab.h"
 int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const char * name);
+int b91_loader_load(uint32_t * mem, int memsize, int * code_size, int * image_size,
+                    struct symtab * symtab, const char * name);
+int b91_write(const uint32_t * mem, int code_size, int image_size,
+              const struct symtab * symtab, const char * name);
 #endif /* B91_LOADER_H */
@@ -0,0 +1,59 @@
+/**
+ *******************************************************************************
+ * @file    batch.h
+ * @author  Olli Vanhoja
+ * @brief   Batch runs of many programs and inputs in one process.
+ *******************************************************************************
+ */
+
+/* Batch mode
+ * ==========
+ * A batch is a list of jobs, each job runs a program with the values of an
+ * input file. The batch is read from
+ * + a manifest file with one `program [input]` pair per line, blank lines
+ *   and lines starting with '#' are ignored,
+ * + a directory, every .b91 and .k91 file in it is a job and `name.in` is
+ *   the input of `name.b91`, if it exists, or
+ * + "-", a manifest read from stdin as a stream.
+ *
+ * Every distinct program is loaded once and jobs run in parallel on a pool
+ * of threads, each in its own memory. IN from KBD reads the next value of the
+ * input file and OUT to CRT is collected to the result, other devices are
+ * invalid. The result of every job is written as one JSON object per line
+ * in the order the jobs finish:
+ *
+ *     {"job":0,"program":"a.b91","input":null,"stop":"halt","error":0,
+ *      "output":[16],"instructions":42,"wall_us":12}
+ *
+ * stop is the name of the stop reason of the VM, see vm_stop_name(), e.g.
+ * "halt", "error" or "breakpoint". If the job couldn't be run it's "load"
+ * if the program could not be loaded, "input" if the input file could not be
+ * read or "memory" if out of memory. Debug output of the VM goes to stderr.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include "program.h"
+#include "metrics.h"
+#include "config.h"
+
+#define BATCH_QUEUE_LEN 64  /*!< Jobs read ahead of the threads */
+
+/* Portable functions */
+/**
+ * Run a batch.
+ * @param source manifest file, directory or "-" for stdin.
+ * @param threads number of threads or 0 for one per CPU.
+ * @param memsize size of the memory of every job in words or
+ *                PROGRAM_MEMSIZE_AUTO to size it for each program.
+ * @param out stream where results are written.
+ * @param metrics segment where the threads publish metrics or NULL.
+ * @return 0 if no error; 1 if the batch can't be read; 2 if out of memory.
+ */
+int batch_run(struct program_cache * pc, const char * source, int threads,
+              int memsize, FILE * out, struct metrics_shm * metrics);
+/* End of portable functions */
+
+#endif /* BATCH_H */
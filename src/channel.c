@@ -0,0 +1,147 @@
+/**
+ *******************************************************************************
+ * @file    channel.c
+ * @author  Olli Vanhoja
+ * @brief   Message channels between vm instances.
+ *******************************************************************************
+ */
+
+#include <string.h>
+#include "inp.h"
+#include "outp.h"
+#include "channel.h"
+
+int channel_init(struct channel * ch, uint32_t size)
+{
+    ch->eof = 0;
+    ch->broken = 0;
+    ch->seq = 0;
+    ch->waiters = 0;
+
+    return mmio_ring_init(&ch->ring, size);
+}
+
+void channel_free(struct channel * ch)
+{
+    mmio_ring_free(&ch->ring);
+}
+
+void channel_close_write(struct channel * ch)
+{
+    __atomic_store_n(&ch->eof, 1, __ATOMIC_RELEASE);
+    channel_wake(ch);
+}
+
+void channel_close_read(struct channel * ch)
+{
+    __atomic_store_n(&ch->broken, 1, __ATOMIC_RELEASE);
+    channel_wake(ch);
+}
+
+static int port_in(void * arg, int device, int * value)
+{
+    struct channel_port * port = (struct channel_port *)arg;
+    struct channel * ch = port->in;
+
+    if (device != INP_KBD || !ch)
+        return inp_handler(device, value);
+
+    if (port->in_pos == port->in_len) {
+        port->in_pos = 0;
+        port->in_len = mmio_ring_pop(&ch->ring, port->in_buf, CHANNEL_BATCH);
+        if (port->in_len > 0) {
+            channel_wake(ch);
+        } else {
+            if (!__atomic_load_n(&ch->eof, __ATOMIC_ACQUIRE)) {
+                port->wait = CHANNEL_WAIT_IN;
+                return VM_IO_WAIT;
+            }
+            /* Words pushed just before the producer stopped */
+            port->in_len = mmio_ring_pop(&ch->ring, port->in_buf, CHANNEL_BATCH);
+            if (port->in_len == 0)
+                return 1;
+        }
+    }
+
+    *value = (int)port->in_buf[port->in_pos++];
+    return 0;
+}
+
+static int port_out(void * arg, int device, int value)
+{
+    struct channel_port * port = (struct channel_port *)arg;
+
+    if (device != OUTP_CRT || !port->out)
+        return outp_handler(device, value);
+
+    if (port->out_len == CHANNEL_BATCH) {
+        switch (channel_port_flush(port)) {
+        case -1:
+            return 1;
+        case 1:
+            if (port->out_len == CHANNEL_BATCH) {
+                port->wait = CHANNEL_WAIT_OUT;
+                return VM_IO_WAIT;
+            }
+            break;
+        }
+    }
+
+    port->out_buf[port->out_len++] = (uint32_t)value;
+    return 0;
+}
+
+void channel_port_init(struct channel_port * port, struct channel * in,
+                       struct channel * out)
+{
+    memset(port, 0, sizeof(struct channel_port));
+    port->in = in;
+    port->out = out;
+    port->io.in = port_in;
+    port->io.out = port_out;
+    port->io.arg = port;
+}
+
+int channel_port_flush(struct channel_port * port)
+{
+    uint32_t n;
+
+    if (!port->out || port->out_len == 0)
+        return 0;
+    if (__atomic_load_n(&port->out->broken, __ATOMIC_ACQUIRE))
+        return -1;
+
+    n = mmio_ring_push(&port->out->ring, port->out_buf, port->out_len);
+    if (n > 0)
+        channel_wake(port->out);
+    port->out_len -= n;
+    memmove(port->out_buf, port->out_buf + n, port->out_len * sizeof(uint32_t));
+
+    return (port->out_len) ? 1 : 0;
+}
+
+int channel_port_ready(const struct channel_port * port)
+{
+    const struct mmio_ring * ring;
+
+    switch (port->wait) {
+    case CHANNEL_WAIT_IN:
+        ring = &port->in->ring;
+        return mmio_ring_count(ring) > 0
+               || __atomic_load_n(&port->in->eof, __ATOMIC_ACQUIRE);
+    case CHANNEL_WAIT_OUT:
+        ring = &port->out->ring;
+        return mmio_ring_count(ring) < ring->size
+               || __atomic_load_n(&port->out->broken, __ATOMIC_ACQUIRE);
+    default:
+        return 1;
+    }
+}
+
+void channel_port_close(struct channel_port * port)
+{
+    if (port->in)
+        channel_close_read(port->in);
+    if (port->out)
+        channel_close_write(port->out);
+}
@@ -0,0 +1,157 @@
+/**
+ *******************************************************************************
+ * @file    channel.h
+ * @author  Olli Vanhoja
+ * @brief   Message channels between vm instances.
+ *******************************************************************************
+ */
+
+/* Channels
+ * ========
+ * A channel is a lock-free single producer single consumer ring of words,
+ * the ring device of mmio.h, connecting the OUT to CRT of one instance to
+ * the IN from KBD of another one. The ports of an instance pass other
+ * devices, and the ends left unconnected, to the platform handlers.
+ *
+ * A port moves the words in batches of CHANNEL_BATCH, so the ring is
+ * touched once per batch rather than once per word. IN from an empty
+ * channel and OUT to a full one suspend the instance with VM_STOP_WAIT and
+ * the instruction is executed again when the instance is resumed. The
+ * output buffered by a port is pushed when the buffer fills and when the
+ * instance suspends or stops, see channel_port_flush(). Stages of a
+ * pipeline run in slices of CHANNEL_SLICE instructions and push their
+ * output at the end of every slice too, so a stage that computes long
+ * between its OUTs doesn't hold back the words it has written.
+ *
+ * When the producer stops, the consumer reads the rest of the channel and
+ * then IN fails with VM_ERR_INVALID_DEVICE. When the consumer stops, OUT of
+ * the producer fails the same way.
+ *
+ * channel_run() runs a pipeline of instances, each on its own host thread.
+ * A suspended stage spins for a while until its channel is ready, so the
+ * stages pass words without system calls while they have a core each, and
+ * then sleeps until the other end of the channel moves words or stops. Every
+ * push, pop and close wakes the sleepers of the channel, see channel_wake().
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "mmio.h"
+#include "metrics.h"
+#include "config.h"
+
+#define CHANNEL_BATCH       64   /*!< Words moved by a port at a time */
+#define CHANNEL_MAX_STAGES  16   /*!< Maximum length of a pipeline */
+#define CHANNEL_SIZE        4096 /*!< Words in a channel of the VM pipeline */
+#define CHANNEL_SLICE       65536 /*!< Instructions a stage runs between pushes */
+
+/* Direction a port waits for */
+#define CHANNEL_WAIT_IN     1
+#define CHANNEL_WAIT_OUT    2
+
+struct channel {
+    struct mmio_ring ring;
+    int eof;    /*!< The producer has stopped */
+    int broken; /*!< The consumer has stopped */
+
+    /* Rest of variables are for internal use */
+    uint32_t seq;       /*!< Changed by every push, pop and close */
+    uint32_t waiters;   /*!< Number of threads sleeping on seq */
+};
+
+/**
+ * Connection of an instance to its channels.
+ */
+struct channel_port {
+    struct channel * in;    /*!< Read by IN from KBD, NULL if none */
+    struct channel * out;   /*!< Written by OUT to CRT, NULL if none */
+    struct vm_io io;        /*!< Callbacks of the instance */
+
+    /* Rest of variables are for internal use */
+    int wait;               /*!< CHANNEL_WAIT_x the port waits for, 0 if none */
+    int in_pos;
+    int in_len;
+    int out_len;
+    uint32_t in_buf[CHANNEL_BATCH];
+    uint32_t out_buf[CHANNEL_BATCH];
+};
+
+/**
+ * Stage of a pipeline.
+ */
+struct channel_stage {
+    struct vm_state * state;
+    uint32_t * mem;
+    struct channel_port port;
+};
+
+/**
+ * Initialize a channel.
+ * @param size size of the channel in words, power of 2.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int channel_init(struct channel * ch, uint32_t size);
+
+/**
+ * Free a channel.
+ */
+void channel_free(struct channel * ch);
+
+/**
+ * Mark that the producer of a channel has stopped.
+ */
+void channel_close_write(struct channel * ch);
+
+/**
+ * Mark that the consumer of a channel has stopped.
+ */
+void channel_close_read(struct channel * ch);
+
+/**
+ * Initialize a port, set state->io to &port->io to connect an instance.
+ * @param in channel read by the instance or NULL.
+ * @param out channel written by the instance or NULL.
+ */
+void channel_port_init(struct channel_port * port, struct channel * in,
+                       struct channel * out);
+
+/**
+ * Push the output buffered by a port to its channel.
+ * @return 0 if the buffer is empty; 1 if the channel is full; -1 if the
+ *         consumer has stopped.
+ */
+int channel_port_flush(struct channel_port * port);
+
+/**
+ * Check if a suspended instance can continue.
+ * @return nonzero if the channel the port waits for is ready.
+ */
+int channel_port_ready(const struct channel_port * port);
+
+/**
+ * Close the channels of a stopped instance.
+ * The buffered output must be flushed first.
+ */
+void channel_port_close(struct channel_port * port);
+
+/* Portable functions */
+/**
+ * Wake the threads waiting for a channel after it has changed.
+ */
+void channel_wake(struct channel * ch);
+
+/**
+ * Run a pipeline until all of its stages have stopped.
+ * The ports of the stages must be initialized and the instances loaded.
+ * @param stage stages of the pipeline.
+ * @param n number of stages, at most CHANNEL_MAX_STAGES.
+ * @param metrics segment where the stages publish metrics or NULL.
+ * @return 0 if no error; 1 if the stages can't be started.
+ */
+int channel_run(struct channel_stage * stage, int n, struct metrics_shm * metrics);
+/* End of portable functions */
+
+#endif /* CHANNEL_H */
@@ -0,0 +1,89 @@
+/**
+ *******************************************************************************
+ * @file    checkpoint.h
+ * @author  Olli Vanhoja
+ * @brief   Forking, snapshots and checkpoints of vm instances.
+ *******************************************************************************
+ */
+
+/* Forking
+ * =======
+ * vm_snapshot() freezes the state and the memory of an instance. The memory
+ * is scanned once and only the pages that are not zero are copied, the rest
+ * stay holes. An instance forked from a snapshot with vm_fork() maps the
+ * frozen memory copy-on-write, so forking costs the same regardless of the
+ * size of the memory and forks share every page none of them has written.
+ * vm_restore() discards the memory of an instance and maps the snapshot
+ * again.
+ *
+ * The memory of forked instances is freed with vm_mem_free(). An instance
+ * given to vm_restore() must have its memory from vm_mem_alloc() or
+ * vm_fork(), not from the allocator of a host.
+ *
+ * A snapshot can be saved to a checkpoint file that stores only the pages
+ * that are not zero. The stored pages follow the page index in the file,
+ * loading copies them to a new snapshot like vm_snapshot() does. Checkpoints
+ * are in the byte order of the host and the state is saved as it is, clear
+ * running before taking the snapshot and set it to resume a guest.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define CHECKPOINT_PAGE_WORDS 1024 /*!< Page size of checkpoint files */
+
+struct vm_snapshot {
+    struct vm_state state;  /*!< State of the instance */
+    int fd;                 /*!< Frozen memory */
+};
+
+/* Portable functions */
+/**
+ * Take a snapshot of an instance.
+ * The trace, profile, SMP and dirty page map of the state are not part of
+ * the snapshot.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int vm_snapshot(struct vm_snapshot * snap, const struct vm_state * state,
+                const uint32_t * mem);
+
+/**
+ * Fork a new instance from a snapshot.
+ * @param state returns the state of the new instance.
+ * @return memory of the new instance or NULL if out of memory.
+ */
+uint32_t * vm_fork(const struct vm_snapshot * snap, struct vm_state * state);
+
+/**
+ * Restore an instance to a snapshot.
+ * The memory size of the instance must match the snapshot.
+ * @return 0 if no error; 1 if the memory can't be mapped.
+ */
+int vm_restore(const struct vm_snapshot * snap, struct vm_state * state,
+               uint32_t * mem);
+
+/**
+ * Free a snapshot, instances forked from it are not affected.
+ */
+void vm_snapshot_free(struct vm_snapshot * snap);
+
+/**
+ * Save a snapshot to a checkpoint file.
+ * @return 0 if no error; 1 if the file can't be written.
+ */
+int checkpoint_save(const struct vm_snapshot * snap, const char * path);
+
+/**
+ * Load a checkpoint file to a snapshot.
+ * The snapshot has no decoded code nor host callbacks.
+ * @return 0 if no error; 1 if the file can't be read; 2 if the file is not
+ *         a checkpoint of this build.
+ */
+int checkpoint_load(struct vm_snapshot * snap, const char * path);
+/* End of portable functions */
+
+#endif /* CHECKPOINT_H */
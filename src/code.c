@@ -0,0 +1,92 @@
+/**
+ *******************************************************************************
+ * @file    code.c
+ * @author  Olli Vanhoja
+ * @brief   Pre-decoded code of a program.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "code.h"
+
+static struct vm_code * code_alloc(int len)
+{
+    struct vm_code * code;
+
+    code = malloc(sizeof(struct vm_code));
+    if (!code)
+        return NULL;
+
+    code->len = (len > 0) ? len : 0;
+    code->removed = 0;
+    code->threaded = 0;
+    code->insn = calloc(code->len + 1, sizeof(struct vm_insn));
+    if (!code->insn) {
+        free(code);
+        return NULL;
+    }
+
+    return code;
+}
+
+struct vm_code * code_decode(const uint32_t * image, int code_size)
+{
+    struct vm_code * code;
+    int i;
+
+    code = code_alloc(code_size);
+    if (!code)
+        return NULL;
+
+    for (i = 0; i < code->len; i++) {
+        /* Invalid instructions are decoded again and reported at run time */
+        if (vm_decode(&(code->insn[i]), image[i]))
+            code->insn[i].opcode = -1;
+    }
+
+    return code;
+}
+
+struct vm_code * code_clone(const struct vm_code * code)
+{
+    struct vm_code * copy;
+
+    copy = code_alloc(code->len);
+    if (!copy)
+        return NULL;
+    memcpy(copy->insn, code->insn, code->len * sizeof(struct vm_insn));
+    copy->removed = code->removed;
+    copy->threaded = code->threaded;
+
+    return copy;
+}
+
+void code_free(struct vm_code * code)
+{
+    if (!code)
+        return;
+    free(code->insn);
+    free(code);
+}
+
+void code_patch(struct vm_code * code, int addr, uint32_t instr)
+{
+    struct vm_insn * ins;
+    int i;
+
+    if (addr < 0 || addr >= code->len)
+        return;
+
+    ins = &(code->insn[addr]);
+    if (vm_decode(ins, instr))
+        ins->opcode = -1;
+
+    for (i = addr - 1; i >= 0 && i > addr - VM_XOP_MAX_LEN; i--) {
+        ins = &(code->insn[i]);
+        if (ins->xop && i + ins->len > addr) {
+            ins->xop = 0;
+            ins->len = 1;
+        }
+    }
+}
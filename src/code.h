@@ -0,0 +1,42 @@
+/**
+ *******************************************************************************
+ * @file    code.h
+ * @author  Olli Vanhoja
+ * @brief   Pre-decoded code of a program.
+ *******************************************************************************
+ */
+
+#ifndef CODE_H
+#define CODE_H
+
+#include <stdint.h>
+#include "vm.h"
+
+/**
+ * Decode the code section of an image.
+ * The last word of the code section is left out because it's writable by the
+ * program.
+ * @param image loaded image.
+ * @param code_size end address of the code section.
+ * @return pointer to the decoded code or NULL if out of memory.
+ */
+struct vm_code * code_decode(const uint32_t * image, int code_size);
+
+/**
+ * Make a private copy of decoded code.
+ * @return pointer to the copy or NULL if out of memory.
+ */
+struct vm_code * code_clone(const struct vm_code * code);
+
+void code_free(struct vm_code * code);
+
+/**
+ * Replace a single instruction in decoded code.
+ * Fused sequences covering the address are split back to single
+ * instructions.
+ * @param addr address of the instruction.
+ * @param instr new instruction word.
+ */
+void code_patch(struct vm_code * code, int addr, uint32_t instr);
+
+#endif /* CODE_H */
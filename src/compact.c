@@ -0,0 +1,270 @@
+/**
+ *******************************************************************************
+ * @file    compact.c
+ * @author  Olli Vanhoja
+ * @brief   Memory compaction of idle vm instances.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+#include "compact.h"
+
+/* A run header is followed by the literal words of the run */
+#define RUN(zeros, literals)    (((uint32_t)(zeros) << 16) | (uint32_t)(literals))
+#define RUN_ZEROS(run)          ((run) >> 16)
+#define RUN_LITERALS(run)       ((run) & 0xffff)
+
+/**
+ * Block of encoded pages.
+ * A block is freed when no page in it is live.
+ */
+struct compact_block {
+    struct compact_block * next;
+    size_t used;            /*!< Allocated words */
+    size_t live;            /*!< Words of live pages */
+    uint32_t data[];
+};
+
+#define BLOCK_WORDS ((COMPACT_BLOCK_SIZE - sizeof(struct compact_block)) / sizeof(uint32_t))
+
+static int npages(const struct compact_inst * inst)
+{
+    return (inst->state->memsize + COMPACT_PAGE_WORDS - 1) / COMPACT_PAGE_WORDS;
+}
+
+static int page_len(const struct compact_inst * inst, int page)
+{
+    const int left = inst->state->memsize - page * COMPACT_PAGE_WORDS;
+
+    return (left < COMPACT_PAGE_WORDS) ? left : COMPACT_PAGE_WORDS;
+}
+
+/**
+ * Get word i of the pristine image, zero after the image.
+ */
+static uint32_t pristine(const struct compact_inst * inst, int i)
+{
+    return (i < inst->image_size) ? inst->image[i] : 0;
+}
+
+/**
+ * Encode the difference of a page to the pristine image.
+ * @param out buffer of len + 1 words.
+ * @return length of the encoded page in words, 0 if the page is pristine.
+ */
+static uint32_t encode(const struct compact_inst * inst, int first, int len,
+                       uint32_t * out)
+{
+    uint32_t n = 0;
+    uint32_t * run;
+    int i = 0, zeros;
+
+    while (i < len) {
+        for (zeros = 0; i < len && inst->mem[first + i] == pristine(inst, first + i); i++)
+            zeros++;
+        if (i == len)
+            break;
+
+        run = &out[n++];
+        *run = RUN(zeros, 0);
+        for (; i < len && inst->mem[first + i] != pristine(inst, first + i); i++) {
+            out[n++] = inst->mem[first + i] ^ pristine(inst, first + i);
+            (*run)++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Write a word unless the memory holds it already.
+ * Released pages of a mapped image or snapshot read as the mapped file, so
+ * pages that still match it stay shared.
+ */
+static inline void restore(uint32_t * mem, int i, uint32_t value)
+{
+    if (mem[i] != value)
+        mem[i] = value;
+}
+
+static void decode(const struct compact_inst * inst, int first, int len,
+                   const struct compact_page * cp)
+{
+    uint32_t * mem = inst->mem;
+    uint32_t k = 0, l;
+    int i = 0, end;
+
+    while (k < cp->len) {
+        l = RUN_LITERALS(cp->data[k]);
+        end = i + (int)RUN_ZEROS(cp->data[k++]);
+        for (; i < end; i++)
+            restore(mem, first + i, pristine(inst, first + i));
+        for (; l > 0; l--, i++)
+            restore(mem, first + i, cp->data[k++] ^ pristine(inst, first + i));
+    }
+    for (; i < len; i++)
+        restore(mem, first + i, pristine(inst, first + i));
+}
+
+static uint32_t * block_alloc(struct compact_pool * pool, uint32_t len,
+                              struct compact_block ** block)
+{
+    struct compact_block * b = pool->blocks;
+    uint32_t * p;
+
+    if (!b || b->used + len > BLOCK_WORDS) {
+        b = malloc(COMPACT_BLOCK_SIZE);
+        if (!b)
+            return NULL;
+        b->used = 0;
+        b->live = 0;
+        b->next = pool->blocks;
+        pool->blocks = b;
+        pool->bytes += COMPACT_BLOCK_SIZE;
+    }
+
+    p = &b->data[b->used];
+    b->used += len;
+    b->live += len;
+    pool->stored += len * sizeof(uint32_t);
+    *block = b;
+    return p;
+}
+
+static void block_release(struct compact_pool * pool, struct compact_block * block,
+                          uint32_t len)
+{
+    struct compact_block ** bp;
+
+    block->live -= len;
+    pool->stored -= len * sizeof(uint32_t);
+    if (block->live > 0 || block == pool->blocks)
+        return;
+
+    /* Only the newest block is allocated from */
+    for (bp = &pool->blocks; *bp != block; bp = &(*bp)->next);
+    *bp = block->next;
+    pool->bytes -= COMPACT_BLOCK_SIZE;
+    free(block);
+}
+
+static void release_pages(struct compact_pool * pool, struct compact_inst * inst)
+{
+    int page;
+
+    for (page = 0; page < npages(inst); page++) {
+        if (inst->pages[page].data)
+            block_release(pool, inst->pages[page].block, inst->pages[page].len);
+    }
+    free(inst->pages);
+    inst->pages = NULL;
+}
+
+/**
+ * Compact the memory of an instance.
+ * @return 0 if no error; 1 if out of memory.
+ */
+static int compact(struct compact_pool * pool, struct compact_inst * inst)
+{
+    uint32_t buf[COMPACT_PAGE_WORDS + 1];
+    struct compact_page * cp;
+    int page, first, len;
+
+    inst->pages = calloc(npages(inst), sizeof(struct compact_page));
+    if (!inst->pages)
+        return 1;
+
+    for (page = 0; page < npages(inst); page++) {
+        cp = &inst->pages[page];
+        first = page * COMPACT_PAGE_WORDS;
+        len = page_len(inst, page);
+        cp->len = encode(inst, first, len, buf);
+        if (cp->len == 0)
+            continue;
+
+        cp->data = block_alloc(pool, cp->len, &cp->block);
+        if (!cp->data) {
+            cp->len = 0;
+            release_pages(pool, inst);
+            return 1;
+        }
+        memcpy(cp->data, buf, cp->len * sizeof(uint32_t));
+    }
+
+    vm_mem_discard(inst->mem, 0, inst->state->memsize);
+    return 0;
+}
+
+void compact_pool_init(struct compact_pool * pool, uint64_t idle)
+{
+    memset(pool, 0, sizeof(struct compact_pool));
+    pool->idle = idle;
+}
+
+void compact_pool_free(struct compact_pool * pool)
+{
+    while (pool->head)
+        compact_resume(pool, pool->head);
+}
+
+void compact_suspend(struct compact_pool * pool, struct compact_inst * inst,
+                     uint64_t now)
+{
+    inst->suspended_at = now;
+    inst->pages = NULL;
+    inst->next = NULL;
+    inst->prev = pool->tail;
+    if (pool->tail)
+        pool->tail->next = inst;
+    else
+        pool->head = inst;
+    pool->tail = inst;
+    if (!pool->pending)
+        pool->pending = inst;
+}
+
+void compact_resume(struct compact_pool * pool, struct compact_inst * inst)
+{
+    int page;
+
+    if (pool->pending == inst)
+        pool->pending = inst->next;
+    if (inst->prev)
+        inst->prev->next = inst->next;
+    else
+        pool->head = inst->next;
+    if (inst->next)
+        inst->next->prev = inst->prev;
+    else
+        pool->tail = inst->prev;
+    inst->prev = NULL;
+    inst->next = NULL;
+
+    if (!inst->pages)
+        return;
+
+    /* Released pages read as zero or as the mapped file, e.g. the
+     * snapshot of a fork, so dropped zero pages are checked too */
+    for (page = 0; page < npages(inst); page++)
+        decode(inst, page * COMPACT_PAGE_WORDS, page_len(inst, page), &inst->pages[page]);
+    release_pages(pool, inst);
+}
+
+int compact_idle(struct compact_pool * pool, uint64_t now)
+{
+    int n = 0;
+
+    /* The list is in the order of suspension, nothing is idle if the clock
+     * went backwards */
+    while (pool->pending && now >= pool->pending->suspended_at
+           && now - pool->pending->suspended_at >= pool->idle) {
+        if (compact(pool, pool->pending))
+            break;
+        pool->pending = pool->pending->next;
+        n++;
+    }
+
+    return n;
+}
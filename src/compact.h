@@ -0,0 +1,116 @@
+/**
+ *******************************************************************************
+ * @file    compact.h
+ * @author  Olli Vanhoja
+ * @brief   Memory compaction of idle vm instances.
+ *******************************************************************************
+ */
+
+/* Idle compaction
+ * ===============
+ * A host multiplexing many instances marks an instance suspended with
+ * compact_suspend() when it stops running it, e.g. while the instance waits
+ * for input or for its next time slice, and calls compact_idle()
+ * periodically. Instances suspended for longer than the idle time of the
+ * pool are compacted page by page:
+ *
+ * - pages equal to the pristine image of the program are dropped,
+ * - zero pages are dropped,
+ * - other pages are XORed with the image, run length encoded and stored in
+ *   the blocks of the pool.
+ *
+ * The memory of a compacted instance is released but stays reserved.
+ * compact_resume() must be called before the instance runs again, it
+ * restores the pages of a compacted instance and writes only the words that
+ * differ from what the released memory reads, so pages of a mapped program
+ * image that were not written stay shared. The memory of the instances must
+ * come from vm_mem_alloc(), program_map() or vm_fork(). A pool is used by
+ * one thread at a time.
+ *
+ * The pool is for hosts that keep instances suspended, e.g. waiting for
+ * external events. Batch and server jobs run to completion without being
+ * suspended, so they don't use it.
+ */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define COMPACT_PAGE_WORDS  1024            /*!< Page size of compaction */
+#define COMPACT_BLOCK_SIZE  (256 * 1024)    /*!< Size of a block of a pool */
+
+struct compact_block;
+
+/**
+ * Compacted page.
+ */
+struct compact_page {
+    uint32_t * data;                /*!< Encoded page or NULL if dropped */
+    struct compact_block * block;   /*!< Block holding data */
+    uint32_t len;                   /*!< Length of data in words */
+};
+
+/**
+ * Instance managed by a pool.
+ */
+struct compact_inst {
+    struct vm_state * state;
+    uint32_t * mem;
+    const uint32_t * image;     /*!< Pristine image of the program */
+    int image_size;             /*!< Size of the image in words */
+
+    /* Rest of variables are for internal use */
+    uint64_t suspended_at;      /*!< Time of suspension */
+    struct compact_page * pages; /*!< Pages if compacted, otherwise NULL */
+    struct compact_inst * prev;
+    struct compact_inst * next;
+};
+
+struct compact_pool {
+    uint64_t idle;              /*!< Suspended time before compaction */
+    struct compact_inst * head; /*!< Suspended instances, oldest first */
+    struct compact_inst * tail;
+    struct compact_inst * pending; /*!< Oldest instance not compacted */
+    struct compact_block * blocks;
+    size_t bytes;               /*!< Size of the blocks */
+    size_t stored;              /*!< Bytes of encoded pages */
+};
+
+/**
+ * Initialize a pool.
+ * @param idle time an instance is suspended before it's compacted, in the
+ *             units of the times given to the pool.
+ */
+void compact_pool_init(struct compact_pool * pool, uint64_t idle);
+
+/**
+ * Free a pool, suspended instances are resumed.
+ */
+void compact_pool_free(struct compact_pool * pool);
+
+/**
+ * Suspend an instance.
+ * state, mem, image and image_size of the instance must be set.
+ * @param now current time.
+ */
+void compact_suspend(struct compact_pool * pool, struct compact_inst * inst,
+                     uint64_t now);
+
+/**
+ * Resume a suspended instance.
+ */
+void compact_resume(struct compact_pool * pool, struct compact_inst * inst);
+
+/**
+ * Compact the instances suspended for longer than the idle time of a pool.
+ * Compaction stops if the pool runs out of memory.
+ * @param now current time.
+ * @return number of instances compacted.
+ */
+int compact_idle(struct compact_pool * pool, uint64_t now);
+
+#endif /* COMPACT_H */
@@ -0,0 +1,137 @@
+/**
+ *******************************************************************************
+ * @file    debug.c
+ * @author  Olli Vanhoja
+ * @brief   Debugger.
+ *******************************************************************************
+ */
+
+#include <stddef.h>
+#include "code.h"
+#include "fuse.h"
+#include "debug.h"
+
+static struct dbg_breakpoint * find_bkpt(const struct dbg_state * dbg, int addr)
+{
+    int i;
+
+    for (i = 0; i < dbg->count; i++) {
+        if (dbg->bkpt[i].addr == addr)
+            return (struct dbg_breakpoint *)&(dbg->bkpt[i]);
+    }
+    return NULL;
+}
+
+void dbg_init(struct dbg_state * dbg)
+{
+    dbg->count = 0;
+    dbg->code = NULL;
+}
+
+void dbg_deinit(struct dbg_state * dbg)
+{
+    code_free(dbg->code);
+    dbg->code = NULL;
+}
+
+int dbg_break_set(struct dbg_state * dbg, struct vm_state * state,
+                  uint32_t * mem, int addr)
+{
+    struct dbg_breakpoint * bp;
+
+    if (addr < 0 || addr > state->code_sec_end || addr >= state->memsize)
+        return 1;
+    if (find_bkpt(dbg, addr))
+        return 0; /* Already set */
+    if (dbg->count >= DBG_MAX_BREAKPOINTS)
+        return 2;
+
+    bp = &(dbg->bkpt[dbg->count++]);
+    bp->addr = addr;
+    bp->instr = mem[addr];
+    mem[addr] = (uint32_t)(PTTK91_BKPT);
+
+    if (state->code && state->code != dbg->code) {
+        code_free(dbg->code);
+        if (state->code->removed || state->code->threaded) {
+            /* Optimizations can bypass the trap, decode again with the
+             * traps already in the memory. */
+            dbg->code = code_decode(mem, state->code->len);
+            if (dbg->code)
+                fuse_code(dbg->code, NULL);
+        } else {
+            dbg->code = code_clone(state->code);
+        }
+        /* Fall back to decoding from memory if out of memory */
+        state->code = dbg->code;
+    }
+    if (dbg->code)
+        code_patch(dbg->code, addr, (uint32_t)(PTTK91_BKPT));
+
+    return 0;
+}
+
+int dbg_break_clear(struct dbg_state * dbg, uint32_t * mem, int addr)
+{
+    struct dbg_breakpoint * bp;
+
+    bp = find_bkpt(dbg, addr);
+    if (!bp)
+        return 1;
+
+    mem[addr] = bp->instr;
+    if (dbg->code)
+        code_patch(dbg->code, addr, bp->instr);
+    *bp = dbg->bkpt[--dbg->count];
+
+    return 0;
+}
+
+int dbg_read_mem(const struct dbg_state * dbg, const struct vm_state * state,
+                 const uint32_t * mem, int addr, uint32_t * value)
+{
+    const struct dbg_breakpoint * bp;
+
+    if (addr < 0 || addr >= state->memsize)
+        return 1;
+
+    bp = find_bkpt(dbg, addr);
+    *value = (bp) ? bp->instr : mem[addr];
+
+    return 0;
+}
+
+int dbg_step(struct dbg_state * dbg, struct vm_state * state, uint32_t * mem)
+{
+    struct dbg_breakpoint * bp;
+    int addr = state->pc;
+    int error_code;
+
+    bp = find_bkpt(dbg, addr);
+    if (!bp)
+        return vm_step(state, mem);
+
+    /* Execute the original instruction in place and patch the trap back. */
+    mem[addr] = bp->instr;
+    error_code = vm_step(state, mem);
+    bp->instr = mem[addr]; /* The instruction may have modified itself. */
+    mem[addr] = (uint32_t)(PTTK91_BKPT);
+
+    return error_code;
+}
+
+int dbg_continue(struct dbg_state * dbg, struct vm_state * state, uint32_t * mem)
+{
+    state->running = 1;
+
+    if (find_bkpt(dbg, state->pc)) {
+        /* Step over the breakpoint we are sitting on. */
+        state->stop = VM_STOP_HALT;
+        dbg_step(dbg, state, mem);
+        if (!state->running)
+            return state->stop;
+    }
+
+    vm_run(state, mem);
+    return state->stop;
+}
@@ -0,0 +1,78 @@
+/**
+ *******************************************************************************
+ * @file    debug.h
+ * @author  Olli Vanhoja
+ * @brief   Debugger interface.
+ *******************************************************************************
+ */
+
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+#include "vm.h"
+
+#define DBG_MAX_BREAKPOINTS 16
+
+/**
+ * Breakpoint.
+ * Breakpoints are implemented by replacing the instruction word with
+ * PTTK91_BKPT so the VM runs at full speed until a trap is actually hit.
+ */
+struct dbg_breakpoint {
+    int addr;       /*!< Address of the patched instruction */
+    uint32_t instr; /*!< Original instruction word */
+};
+
+/**
+ * Debugger state.
+ */
+struct dbg_state {
+    int count; /*!< Number of breakpoints set */
+    struct dbg_breakpoint bkpt[DBG_MAX_BREAKPOINTS];
+    struct vm_code * code; /*!< Private copy of decoded code with the traps */
+};
+
+void dbg_init(struct dbg_state * dbg);
+void dbg_deinit(struct dbg_state * dbg);
+
+/**
+ * Set a breakpoint.
+ * If the vm runs decoded code the trap is also patched to a private copy of
+ * the decoded code that replaces the shared one in state.
+ * @param dbg debugger state.
+ * @param state vm state.
+ * @param mem pointer to the memory of the vm.
+ * @param addr address of the instruction.
+ * @return 0 if no error; 1 if the address is invalid; 2 if out of breakpoints.
+ */
+int dbg_break_set(struct dbg_state * dbg, struct vm_state * state,
+                  uint32_t * mem, int addr);
+
+/**
+ * Clear a breakpoint and restore the original instruction.
+ * @return 0 if no error; 1 if there is no breakpoint at addr.
+ */
+int dbg_break_clear(struct dbg_state * dbg, uint32_t * mem, int addr);
+
+/**
+ * Read a memory location as the program sees it, ie. without traps.
+ * @return 0 if no error; 1 if the address is out of bounds.
+ */
+int dbg_read_mem(const struct dbg_state * dbg, const struct vm_state * state,
+                 const uint32_t * mem, int addr, uint32_t * value);
+
+/**
+ * Execute one instruction, emulating the original instruction if there
+ * is a breakpoint at PC.
+ * @return error code, zero if no error.
+ */
+int dbg_step(struct dbg_state * dbg, struct vm_state * state, uint32_t * mem);
+
+/**
+ * Continue running after a breakpoint or from the current PC.
+ * @return stop reason, see VM_STOP_x.
+ */
+int dbg_continue(struct dbg_state * dbg, struct vm_state * state, uint32_t * mem);
+
+#endif /* DEBUG_H */
@@ -0,0 +1,335 @@
+/**
+ *******************************************************************************
+ * @file    footprint.c
+ * @author  Olli Vanhoja
+ * @brief   Static memory footprint analysis of programs.
+ *******************************************************************************
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include "svc.h"
+#include "footprint.h"
+
+#define NO_HEIGHT   INT_MIN /*!< Instruction not reached */
+
+/* Analysis state of a subroutine */
+#define FUNC_NEW        0
+#define FUNC_ACTIVE     1
+#define FUNC_DONE       2
+
+struct func {
+    int state;  /*!< FUNC_x */
+    int depth;  /*!< Maximum stack depth above the entry SP */
+    int pop;    /*!< Parameters removed by EXIT, NO_HEIGHT if never returns */
+};
+
+struct analysis {
+    const struct vm_insn * insn;
+    const int * valid;      /*!< Decoded successfully */
+    int len;                /*!< Number of code words */
+    struct func * func;     /*!< Indexed by entry address */
+    struct func outside;    /*!< Entry outside the code, never returns */
+    struct footprint * fp;
+    int oom;
+};
+
+static void unbounded(struct analysis * an, int flag, int pc)
+{
+    if (!an->fp->unbounded)
+        an->fp->unbounded_pc = pc;
+    an->fp->unbounded |= flag;
+}
+
+static int direct(const struct vm_insn * ins)
+{
+    return ins->m == PTTK91_ADDRMOD_0 && ins->ri == 0;
+}
+
+static void note_address(struct analysis * an, int addr)
+{
+    if (addr > an->fp->max_direct)
+        an->fp->max_direct = addr;
+}
+
+/**
+ * Record the direct memory accesses of an instruction.
+ */
+static void note_access(struct analysis * an, const struct vm_insn * ins)
+{
+    if (ins->ri != 0)
+        return;
+
+    /* The address part is fetched from the memory */
+    if (ins->m != PTTK91_ADDRMOD_0) {
+        note_address(an, ins->imm);
+        return;
+    }
+
+    /* The operand is an address */
+    switch (ins->opcode) {
+    case PTTK91_STORE:
+    case PTTK91_CAS:
+    case PTTK91_XADD:
+        note_address(an, ins->imm);
+        break;
+    case PTTK91_VLOAD:
+    case PTTK91_VSTORE:
+        note_address(an, ins->imm + PTTK91_VLEN - 1);
+        break;
+    }
+}
+
+/**
+ * Check if an instruction writes its Rj register.
+ */
+static int writes_rj(int opcode)
+{
+    switch (opcode) {
+    case PTTK91_LOAD:
+    case PTTK91_IN:
+    case PTTK91_MUL:
+    case PTTK91_DIV:
+    case PTTK91_MOD:
+    case PTTK91_AND:
+    case PTTK91_OR:
+    case PTTK91_XOR:
+    case PTTK91_SHL:
+    case PTTK91_SHR:
+    case PTTK91_NOT:
+    case PTTK91_SHRA:
+    case PTTK91_XADD:
+        return 1;
+    }
+    return 0;
+}
+
+static struct func * analyze_func(struct analysis * an, int entry);
+
+/**
+ * Walk a subroutine from its entry.
+ */
+static void walk(struct analysis * an, int entry, struct func * f)
+{
+    const int len = an->len;
+    int * height;
+    int * work;
+    int nwork = 0;
+    int pc, h, next;
+
+    height = malloc(len * sizeof(int));
+    work = malloc(2 * (len + 1) * sizeof(int));
+    if (!height || !work) {
+        an->oom = 1;
+        goto out;
+    }
+    for (pc = 0; pc < len; pc++)
+        height[pc] = NO_HEIGHT;
+
+    work[nwork++] = entry;
+    work[nwork++] = 0;
+    while (nwork > 0) {
+        h = work[--nwork];
+        pc = work[--nwork];
+
+        while (pc >= 0 && pc < len) {
+            const struct vm_insn * ins = &an->insn[pc];
+            struct func * callee;
+
+            if (height[pc] != NO_HEIGHT) {
+                if (height[pc] != h)
+                    unbounded(an, FOOTPRINT_UNBALANCED, pc);
+                break;
+            }
+            height[pc] = h;
+            if (!an->valid[pc])
+                break;
+            note_access(an, ins);
+            next = pc + 1;
+
+            switch (ins->opcode) {
+            case PTTK91_PUSH:
+                h++;
+                break;
+            case PTTK91_POP:
+                if (ins->ri == PTTK91_SP)
+                    unbounded(an, FOOTPRINT_SP_WRITE, pc);
+                h--;
+                break;
+            case PTTK91_PUSHR:
+                h += PTTK91_NUM_REGS - 1;
+                break;
+            case PTTK91_POPR:
+                h -= PTTK91_NUM_REGS - 1;
+                break;
+            case PTTK91_ADD:
+            case PTTK91_SUB:
+                if (ins->rj != PTTK91_SP)
+                    break;
+                if (!direct(ins))
+                    unbounded(an, FOOTPRINT_SP_WRITE, pc);
+                else
+                    h += (ins->opcode == PTTK91_ADD) ? ins->imm : -ins->imm;
+                break;
+
+            case PTTK91_CALL:
+                if (!direct(ins)) {
+                    unbounded(an, FOOTPRINT_INDIRECT, pc);
+                    next = -1;
+                    break;
+                }
+                callee = analyze_func(an, ins->imm);
+                if (!callee) {
+                    unbounded(an, FOOTPRINT_RECURSION, pc);
+                    next = -1;
+                    break;
+                }
+                if (h + 2 + callee->depth > f->depth)
+                    f->depth = h + 2 + callee->depth;
+                /* A subroutine that never returns ends the path */
+                if (callee->pop == NO_HEIGHT)
+                    next = -1;
+                else
+                    h -= callee->pop;
+                break;
+            case PTTK91_EXIT:
+                if (!direct(ins))
+                    unbounded(an, FOOTPRINT_SP_WRITE, pc);
+                else if (f->pop == NO_HEIGHT)
+                    f->pop = ins->imm;
+                else if (f->pop != ins->imm)
+                    unbounded(an, FOOTPRINT_UNBALANCED, pc);
+                next = -1;
+                break;
+
+            case PTTK91_JUMP:
+                next = ins->imm;
+                /* Falls through */
+            case PTTK91_JNEG:
+            case PTTK91_JZER:
+            case PTTK91_JPOS:
+            case PTTK91_JNNEG:
+            case PTTK91_JNZER:
+            case PTTK91_JNPOS:
+            case PTTK91_JLES:
+            case PTTK91_JEQU:
+            case PTTK91_JGRE:
+            case PTTK91_JNLES:
+            case PTTK91_JNEQU:
+            case PTTK91_JNGRE:
+                if (!direct(ins)) {
+                    unbounded(an, FOOTPRINT_INDIRECT, pc);
+                    next = -1;
+                } else if (ins->opcode != PTTK91_JUMP) {
+                    work[nwork++] = ins->imm;
+                    work[nwork++] = h;
+                }
+                break;
+
+            case PTTK91_SVC:
+                if (direct(ins) && ins->imm == svc_halt)
+                    next = -1;
+                break;
+
+            default:
+                if (ins->rj == PTTK91_SP && writes_rj(ins->opcode))
+                    unbounded(an, FOOTPRINT_SP_WRITE, pc);
+            }
+
+            if (h > f->depth)
+                f->depth = h;
+            pc = next;
+        }
+    }
+
+out:
+    free(height);
+    free(work);
+}
+
+/**
+ * Analyze a subroutine and its callees.
+ * @return the subroutine or NULL if it's already being analyzed.
+ */
+static struct func * analyze_func(struct analysis * an, int entry)
+{
+    struct func * f;
+
+    if (entry < 0 || entry >= an->len)
+        return &an->outside;
+
+    f = &an->func[entry];
+    if (f->state == FUNC_ACTIVE)
+        return NULL;
+    if (f->state == FUNC_DONE)
+        return f;
+
+    f->state = FUNC_ACTIVE;
+    f->depth = 0;
+    f->pop = NO_HEIGHT;
+    walk(an, entry, f);
+    f->state = FUNC_DONE;
+
+    return f;
+}
+
+int footprint_analyze(const uint32_t * image, int code_size, int image_size,
+                      struct footprint * fp)
+{
+    /* code_size is the address of the last instruction */
+    const int len = (code_size < image_size) ? code_size + 1 : image_size;
+    struct analysis an;
+    struct vm_insn * insn;
+    int * valid;
+    int pc, need;
+
+    fp->code_size = len;
+    fp->data_size = (image_size > len) ? image_size - len : 0;
+    fp->max_direct = -1;
+    fp->stack_depth = 0;
+    fp->unbounded = 0;
+    fp->unbounded_pc = -1;
+    fp->memsize = 0;
+
+    insn = calloc(len + 1, sizeof(struct vm_insn));
+    valid = calloc(len + 1, sizeof(int));
+    an.func = calloc(len + 1, sizeof(struct func));
+    if (!insn || !valid || !an.func) {
+        free(insn);
+        free(valid);
+        free(an.func);
+        return 1;
+    }
+    for (pc = 0; pc < len; pc++)
+        valid[pc] = !vm_decode(&insn[pc], image[pc]);
+
+    an.insn = insn;
+    an.valid = valid;
+    an.len = len;
+    an.fp = fp;
+    an.oom = 0;
+    an.outside.state = FUNC_DONE;
+    an.outside.depth = 0;
+    an.outside.pop = NO_HEIGHT;
+    fp->stack_depth = analyze_func(&an, 0)->depth;
+
+    free(insn);
+    free(valid);
+    free(an.func);
+    if (an.oom)
+        return 1;
+
+    if (fp->unbounded) {
+        fp->stack_depth = FOOTPRINT_UNBOUNDED;
+        return 0;
+    }
+
+    need = image_size;
+    if (fp->max_direct + 1 > need)
+        need = fp->max_direct + 1;
+    if (code_size + fp->stack_depth > need)
+        need = code_size + fp->stack_depth;
+    fp->memsize = need;
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+/**
+ *******************************************************************************
+ * @file    footprint.h
+ * @author  Olli Vanhoja
+ * @brief   Static memory footprint analysis of programs.
+ *******************************************************************************
+ */
+
+/* Memory footprint
+ * ================
+ * The code reachable from address 0 is walked along its direct jumps and
+ * calls to find the static footprint of a program:
+ *
+ * + the static data size after the code,
+ * + the highest address accessed directly, without an index register,
+ * + the maximum stack depth of PUSH, PUSHR, CALL and SP adjustments by
+ *   ADD and SUB of a constant, including the frames of nested calls.
+ *
+ * The stack depth is unbounded if the program recurses, jumps or calls
+ * through a computed address, writes SP otherwise or if the stack height
+ * differs where paths join, e.g. a loop pushing every iteration. Indexed
+ * and indirect accesses are assumed to stay in the image.
+ *
+ * The stack starts at code_size - 1 and grows up, so a program needs
+ * max(image_size, max_direct + 1, code_size + stack_depth) words.
+ */
+
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define FOOTPRINT_UNBOUNDED     -1
+
+/* Reasons why the stack depth is unbounded */
+#define FOOTPRINT_RECURSION     0x1 /*!< Recursive CALL */
+#define FOOTPRINT_INDIRECT      0x2 /*!< Computed jump or call target */
+#define FOOTPRINT_SP_WRITE      0x4 /*!< SP written by other instructions */
+#define FOOTPRINT_UNBALANCED    0x8 /*!< Stack height differs at a join */
+
+#define FOOTPRINT_LOAD_MAX      65536 /*!< Words directly addressable */
+
+/**
+ * Result of the analysis.
+ */
+struct footprint {
+    int code_size;      /*!< Words of code */
+    int data_size;      /*!< Words of static data after the code */
+    int max_direct;     /*!< Highest directly accessed address, -1 if none */
+    int stack_depth;    /*!< Maximum stack depth or FOOTPRINT_UNBOUNDED */
+    int unbounded;      /*!< FOOTPRINT_x flags why the depth is unbounded */
+    int unbounded_pc;   /*!< Address of the first such instruction */
+    int memsize;        /*!< Words needed or 0 if the depth is unbounded */
+};
+
+/**
+ * Analyze the footprint of a program.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int footprint_analyze(const uint32_t * image, int code_size, int image_size,
+                      struct footprint * fp);
+
+#endif /* FOOTPRINT_H */
@@ -0,0 +1,174 @@
+/**
+ *******************************************************************************
+ * @file    fuse.c
+ * @author  Olli Vanhoja
+ * @brief   Instruction fusion.
+ *******************************************************************************
+ */
+
+#include <string.h>
+#include "fuse.h"
+
+/* Hot pairs of the benchmark programs, used when there is no profile */
+static const uint32_t default_pairs[][2] = {
+    { PTTK91_LOAD,  PTTK91_LOAD },
+    { PTTK91_LOAD,  PTTK91_ADD },
+    { PTTK91_LOAD,  PTTK91_SUB },
+    { PTTK91_LOAD,  PTTK91_MUL },
+    { PTTK91_LOAD,  PTTK91_STORE },
+    { PTTK91_LOAD,  PTTK91_COMP },
+    { PTTK91_LOAD,  PTTK91_PUSH },
+    { PTTK91_ADD,   PTTK91_STORE },
+    { PTTK91_SUB,   PTTK91_STORE },
+    { PTTK91_MUL,   PTTK91_STORE },
+    { PTTK91_MUL,   PTTK91_LOAD },
+    { PTTK91_STORE, PTTK91_LOAD },
+    { PTTK91_PUSH,  PTTK91_PUSH },
+    { PTTK91_POP,   PTTK91_POP },
+};
+
+void fuse_profile_init(struct fuse_profile * profile)
+{
+    memset(profile, 0, sizeof(struct fuse_profile));
+}
+
+static int is_jcc(int opcode)
+{
+    return opcode >= (PTTK91_JLES) && opcode <= (PTTK91_JNGRE);
+}
+
+/**
+ * Test if an instruction always continues to the next instruction.
+ */
+static int is_straight(int opcode)
+{
+    switch (opcode) {
+    case PTTK91_NOP:
+    case PTTK91_STORE:
+    case PTTK91_LOAD:
+    case PTTK91_ADD:
+    case PTTK91_SUB:
+    case PTTK91_MUL:
+    case PTTK91_DIV:
+    case PTTK91_MOD:
+    case PTTK91_AND:
+    case PTTK91_OR:
+    case PTTK91_XOR:
+    case PTTK91_SHL:
+    case PTTK91_SHR:
+    case PTTK91_NOT:
+    case PTTK91_SHRA:
+    case PTTK91_COMP:
+    case PTTK91_PUSH:
+    case PTTK91_POP:
+    case PTTK91_PUSHR:
+    case PTTK91_POPR:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Build the table of hot pairs.
+ */
+static void hot_pairs(uint8_t hot[FUSE_NUM_OPS][FUSE_NUM_OPS],
+                      const struct fuse_profile * profile)
+{
+    uint64_t total = 0;
+    size_t i, j;
+
+    memset(hot, 0, FUSE_NUM_OPS * FUSE_NUM_OPS);
+
+    if (!profile) {
+        for (i = 0; i < sizeof(default_pairs) / sizeof(default_pairs[0]); i++) {
+            hot[FUSE_OP_INDEX(default_pairs[i][0])][FUSE_OP_INDEX(default_pairs[i][1])] = 1;
+        }
+        return;
+    }
+
+    for (i = 0; i < FUSE_NUM_OPS; i++) {
+        for (j = 0; j < FUSE_NUM_OPS; j++)
+            total += profile->pairs[i][j];
+    }
+    for (i = 0; i < FUSE_NUM_OPS; i++) {
+        for (j = 0; j < FUSE_NUM_OPS; j++) {
+            hot[i][j] = profile->pairs[i][j] > 0
+                && (uint64_t)profile->pairs[i][j] * 100 >= total * FUSE_HOT_PERCENT;
+        }
+    }
+}
+
+/**
+ * Test for load rj, x ; add/sub rj, =k ; store rj, x
+ */
+static int is_load_add_store(const struct vm_insn * ins)
+{
+    return ins[0].opcode == PTTK91_LOAD && ins[0].m == PTTK91_ADDRMOD_1
+        && ins[0].ri == 0
+        && (ins[1].opcode == PTTK91_ADD || ins[1].opcode == PTTK91_SUB)
+        && ins[1].m == PTTK91_ADDRMOD_0 && ins[1].ri == 0
+        && ins[1].rj == ins[0].rj
+        && ins[2].opcode == PTTK91_STORE && ins[2].m == PTTK91_ADDRMOD_0
+        && ins[2].ri == 0 && ins[2].rj == ins[0].rj
+        && ins[2].imm == ins[0].imm;
+}
+
+/**
+ * Match a fixed superinstruction at i.
+ * @return length of the sequence or zero if no match.
+ */
+static int match_xop(const struct vm_code * code, int i, int * xop)
+{
+    const struct vm_insn * ins = &(code->insn[i]);
+
+    if (i + 2 < code->len && is_load_add_store(ins)) {
+        *xop = VM_XOP_LOAD_ADD_STORE;
+        return 3;
+    }
+    if (i + 1 < code->len && ins[0].opcode == PTTK91_COMP && is_jcc(ins[1].opcode)) {
+        *xop = VM_XOP_COMP_JCC;
+        return 2;
+    }
+    return 0;
+}
+
+int fuse_code(struct vm_code * code, const struct fuse_profile * profile)
+{
+    uint8_t hot[FUSE_NUM_OPS][FUSE_NUM_OPS];
+    struct vm_insn * ins;
+    int i, n, xop, next_xop;
+    int count = 0;
+
+    hot_pairs(hot, profile);
+
+    for (i = 0; i < code->len; i += n) {
+        ins = &(code->insn[i]);
+        if (ins->xop) {
+            /* Already optimized */
+            n = ins->len;
+            continue;
+        }
+
+        n = match_xop(code, i, &xop);
+        if (n == 0) {
+            /* Extend a sequence of hot pairs up to the next fixed match */
+            xop = VM_XOP_SEQ;
+            n = 1;
+            while (i + n < code->len && n < VM_XOP_MAX_LEN
+                   && is_straight(ins[n - 1].opcode)
+                   && hot[FUSE_OP_INDEX(ins[n - 1].opcode)][FUSE_OP_INDEX(ins[n].opcode)]
+                   && !ins[n].xop && !match_xop(code, i + n, &next_xop)) {
+                n++;
+            }
+        }
+
+        if (n > 1) {
+            ins->xop = xop;
+            ins->len = n;
+            count++;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,82 @@
+/**
+ *******************************************************************************
+ * @file    fuse.h
+ * @author  Olli Vanhoja
+ * @brief   Instruction fusion.
+ *******************************************************************************
+ */
+
+/* Fusion
+ * ======
+ * Instruction sequences of decoded code are replaced with superinstructions
+ * that run with one dispatch. Only the first record of a sequence is marked
+ * with an internal operation (vm_insn.xop) and the rest of the records are
+ * left intact so branching into the middle of a sequence is always safe.
+ *
+ * + COMP + Jcc             fused compare and branch
+ * + LOAD + ADD/SUB + STORE increment of a variable
+ * + other hot pairs        run as a sequence without returning to dispatch
+ *
+ * Hot pairs are selected from an opcode pair profile recorded with a
+ * VM_PROFILE build or from a built-in default set.
+ */
+
+#ifndef FUSE_H
+#define FUSE_H
+
+#include <stdint.h>
+#include "pttk91.h"
+#include "vm.h"
+#include "config.h"
+
+#if VM_PROFILE != 0 && VM_PROFILE != 1
+#error Incorrect value of VM_PROFILE
+#endif
+
+#define FUSE_NUM_OPS   128 /*!< Number of profiled opcodes */
+#define FUSE_HOT_PERCENT  1 /*!< Share of all pairs to consider a pair hot */
+
+/**
+ * Opcode pair profile.
+ */
+struct fuse_profile {
+    int prev;   /*!< Index of the previous opcode */
+    uint32_t pairs[FUSE_NUM_OPS][FUSE_NUM_OPS]; /*!< Counts of opcode pairs */
+};
+
+#define FUSE_OP_INDEX(opcode) \
+    (((unsigned int)(opcode) >> PTTK91_OPCODE_POS) & (FUSE_NUM_OPS - 1))
+
+/* Count an executed opcode */
+#define FUSE_PROFILE_COUNT(profile, opcode) do {                                \
+        const int op_ = FUSE_OP_INDEX(opcode);                                  \
+        (profile)->pairs[(profile)->prev][op_]++;                               \
+        (profile)->prev = op_;                                                  \
+    } while (0)
+
+void fuse_profile_init(struct fuse_profile * profile);
+
+/**
+ * Fuse instruction sequences of decoded code.
+ * Records that are already optimized are left intact.
+ * @param code decoded code.
+ * @param profile opcode pair profile or NULL to use the default pairs.
+ * @return number of fused sequences.
+ */
+int fuse_code(struct vm_code * code, const struct fuse_profile * profile);
+
+/* Portable functions */
+/**
+ * Save a profile as text lines "opcode opcode count".
+ * @return 0 if no error.
+ */
+int fuse_profile_save(const struct fuse_profile * profile, const char * path);
+
+/**
+ * Load and accumulate a profile saved with fuse_profile_save().
+ * @return 0 if no error.
+ */
+int fuse_profile_load(struct fuse_profile * profile, const char * path);
+/* End of portable functions */
+
+#endif /* FUSE_H */
@@ -12,6 +12,10 @@
 #include "pttk91.h"
 #include "config.h"
 
+/* Portable IN devices */
+#define INP_KBD     0x1
+/* End of Portable devices */
+
 /* Portable functions */
 /**
  * Portable input handler.
@@ -0,0 +1,168 @@
+/**
+ *******************************************************************************
+ * @file    libpttk91.c
+ * @author  Olli Vanhoja
+ * @brief   Embedding API of the PTTK91 library.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "mem.h"
+#include "footprint.h"
+#include "program.h"
+#include "libpttk91.h"
+
+#if PTTK91_STOP_HALT != VM_STOP_HALT || PTTK91_STOP_ERROR != VM_STOP_ERROR \
+    || PTTK91_STOP_BREAKPOINT != VM_STOP_BREAKPOINT || PTTK91_STOP_WATCH != VM_STOP_WATCH \
+    || PTTK91_STOP_RETURN != VM_STOP_RETURN || PTTK91_STOP_WAIT != VM_STOP_WAIT \
+    || PTTK91_IO_WAIT != VM_IO_WAIT
+#error "Stop reasons of libpttk91.h differ from vm.h"
+#endif
+
+struct pttk91_vm {
+    struct vm_state state;
+    uint32_t * mem;             /*!< Memory of the instance */
+    struct pttk91_host host;    /*!< Host callbacks */
+    struct vm_io io;            /*!< Callbacks of the VM, arg is the instance */
+};
+
+static void * host_alloc(const struct pttk91_host * host, size_t size)
+{
+    return (host->alloc) ? host->alloc(host->arg, size) : malloc(size);
+}
+
+static void host_free(const struct pttk91_host * host, void * ptr, size_t size)
+{
+    if (host->free)
+        host->free(host->arg, ptr, size);
+    else
+        free(ptr);
+}
+
+static int vm_in(void * arg, int device, int * value)
+{
+    const struct pttk91_host * host = &((struct pttk91_vm *)arg)->host;
+
+    return host->in(host->arg, device, value);
+}
+
+static int vm_out(void * arg, int device, int value)
+{
+    const struct pttk91_host * host = &((struct pttk91_vm *)arg)->host;
+
+    return host->out(host->arg, device, value);
+}
+
+static int vm_svc(void * arg, struct vm_state * state, uint32_t * mem, int call_code)
+{
+    struct pttk91_vm * vm = (struct pttk91_vm *)arg;
+
+    return vm->host.svc(vm->host.arg, vm, call_code);
+}
+
+struct pttk91_vm * pttk91_create(const struct pttk91_host * host, const uint32_t * image,
+                                 int image_size, int code_size, int memsize,
+                                 const struct vm_code * code)
+{
+    static const struct pttk91_host platform_host;
+    struct pttk91_vm * vm;
+    struct footprint fp;
+
+    if (!host)
+        host = &platform_host;
+    if (memsize == PROGRAM_MEMSIZE_AUTO) {
+        if (code_size > image_size || footprint_analyze(image, code_size, image_size, &fp))
+            return NULL;
+        memsize = (fp.memsize) ? fp.memsize : PROGRAM_MEMSIZE_DEFAULT;
+        if (memsize < image_size)
+            memsize = image_size;
+    }
+    if (memsize <= 0 || image_size < 0 || image_size > memsize
+        || (host->alloc == NULL) != (host->free == NULL)) {
+        return NULL;
+    }
+
+    vm = host_alloc(host, sizeof(struct pttk91_vm));
+    if (!vm)
+        return NULL;
+    vm->host = *host;
+
+    /* NULL callbacks stay NULL so that the VM uses the platform defaults */
+    memset(&vm->io, 0, sizeof(vm->io));
+    vm->io.arg = vm;
+    if (host->in)
+        vm->io.in = vm_in;
+    if (host->out)
+        vm->io.out = vm_out;
+    if (host->svc)
+        vm->io.svc = vm_svc;
+
+    if (host->alloc) {
+        vm->mem = host->alloc(host->arg, (size_t)memsize * sizeof(uint32_t));
+        if (vm->mem)
+            memset(vm->mem, 0, (size_t)memsize * sizeof(uint32_t));
+    } else {
+        vm->mem = vm_mem_alloc(memsize);
+    }
+    if (!vm->mem) {
+        host_free(host, vm, sizeof(struct pttk91_vm));
+        return NULL;
+    }
+    memcpy(vm->mem, image, (size_t)image_size * sizeof(uint32_t));
+
+    vm_init_state(&vm->state, code_size, memsize);
+    vm->state.code = code;
+    vm->state.io = &vm->io;
+
+    return vm;
+}
+
+int pttk91_run(struct pttk91_vm * vm)
+{
+    vm_run(&vm->state, vm->mem);
+    return vm->state.stop;
+}
+
+int pttk91_call(struct pttk91_vm * vm, int entry, const int * args, int nargs,
+                int * result)
+{
+    return vm_call(&vm->state, vm->mem, entry, args, nargs, result);
+}
+
+int pttk91_error(const struct pttk91_vm * vm)
+{
+    return vm->state.error;
+}
+
+int pttk91_reg(const struct pttk91_vm * vm, int reg)
+{
+    if (reg < 0 || reg >= PTTK91_NUM_REGS)
+        return 0;
+    return vm->state.regs[reg];
+}
+
+void pttk91_set_reg(struct pttk91_vm * vm, int reg, int value)
+{
+    if (reg >= 0 && reg < PTTK91_NUM_REGS)
+        vm->state.regs[reg] = value;
+}
+
+uint32_t * pttk91_mem(struct pttk91_vm * vm, int * memsize)
+{
+    if (memsize)
+        *memsize = vm->state.memsize;
+    return vm->mem;
+}
+
+void pttk91_destroy(struct pttk91_vm * vm)
+{
+    const struct pttk91_host host = vm->host;
+
+    if (host.alloc)
+        host.free(host.arg, vm->mem, (size_t)vm->state.memsize * sizeof(uint32_t));
+    else
+        vm_mem_free(vm->mem, vm->state.memsize);
+    host_free(&host, vm, sizeof(struct pttk91_vm));
+}
@@ -0,0 +1,433 @@
+/**
+ *******************************************************************************
+ * @file    lockstep.c
+ * @author  Olli Vanhoja
+ * @brief   Lockstep execution of many instances of one program.
+ *******************************************************************************
+ */
+
+#include <stddef.h>
+#include <limits.h>
+#include "inp.h"
+#include "outp.h"
+#include "lockstep.h"
+
+static int lane_in(void * arg, int device, int * value)
+{
+    struct lockstep_lane * lane = (struct lockstep_lane *)arg;
+
+    if (device != INP_KBD || lane->input_pos >= lane->input_len)
+        return 1;
+    *value = lane->input[lane->input_pos++];
+    return 0;
+}
+
+static int lane_out(void * arg, int device, int value)
+{
+    struct lockstep_lane * lane = (struct lockstep_lane *)arg;
+
+    if (device != OUTP_CRT)
+        return 1;
+    if (lane->output && lane->output_len < lane->output_size)
+        lane->output[lane->output_len] = value;
+    lane->output_len++;
+    return 0;
+}
+
+int lockstep_init(struct lockstep * ls, const struct vm_code * code, int code_size,
+                  int memsize, struct lockstep_lane * lane, int lanes)
+{
+    int i, k;
+
+    if (lanes < 0 || lanes > LOCKSTEP_MAX_LANES)
+        return 1;
+
+    ls->lanes = lanes;
+#if VM_CODE_AREA_RW == 1
+    /* Lanes may modify their code */
+    ls->code = NULL;
+#else
+    ls->code = code;
+#endif
+    ls->lane = lane;
+    ls->nrunning = lanes;
+
+    for (k = 0; k < lanes; k++) {
+        vm_init_state(&(lane[k].state), code_size, memsize);
+        ls->io[k].in = lane_in;
+        ls->io[k].out = lane_out;
+        ls->io[k].arg = &lane[k];
+        lane[k].state.io = &(ls->io[k]);
+        lane[k].output_len = 0;
+        lane[k].input_pos = 0;
+
+        for (i = 0; i < PTTK91_NUM_REGS; i++)
+            ls->regs[i][k] = lane[k].state.regs[i];
+        ls->pc[k] = lane[k].state.pc;
+        ls->cmp[k] = lane[k].state.cmp;
+        ls->count[k] = 0;
+        ls->running[k] = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Execute one instruction of a lane on its own.
+ */
+static void step_lane(struct lockstep * ls, int k)
+{
+    struct lockstep_lane * lane = &(ls->lane[k]);
+    struct vm_state * state = &(lane->state);
+    int i;
+
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        state->regs[i] = ls->regs[i][k];
+    state->pc = ls->pc[k];
+    state->cmp = ls->cmp[k];
+
+    vm_step(state, lane->mem);
+
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        ls->regs[i][k] = state->regs[i];
+    ls->pc[k] = state->pc;
+    ls->cmp[k] = state->cmp;
+    if (!state->running) {
+        ls->running[k] = 0;
+        ls->nrunning--;
+    }
+}
+
+/**
+ * Run a lane to the end on its own.
+ */
+static void run_lane(struct lockstep * ls, int k)
+{
+    struct lockstep_lane * lane = &(ls->lane[k]);
+    struct vm_state * state = &(lane->state);
+    int i;
+
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        state->regs[i] = ls->regs[i][k];
+    state->pc = ls->pc[k];
+    state->cmp = ls->cmp[k];
+
+    state->code = ls->code;
+    vm_run(state, lane->mem);
+    state->code = NULL;
+
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        ls->regs[i][k] = state->regs[i];
+    ls->pc[k] = state->pc;
+    ls->cmp[k] = state->cmp;
+    ls->running[k] = 0;
+    ls->nrunning--;
+}
+
+/* Lane masks are 0 or ~0 so that the lane loops compile without branches */
+#define LANES_SELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+/* Apply a binary operation to Rj of the lanes in mask */
+#define LANES_OP(ls, rj, mask, v, op) do {                                      \
+        int k_;                                                                 \
+        for (k_ = 0; k_ < (ls)->lanes; k_++) {                                  \
+            const unsigned int r_ = (unsigned int)(ls)->regs[rj][k_];           \
+            (ls)->regs[rj][k_] = LANES_SELECT((mask)[k_],                       \
+                                              (int)(r_ op (unsigned int)(v)[k_]), \
+                                              (int)r_);                         \
+        }                                                                       \
+    } while (0)
+
+/* Compute the branch condition of the lanes to t */
+#define LANES_COND(ls, rj, t, expr) do {                                            \
+        int k_;                                                                 \
+        for (k_ = 0; k_ < (ls)->lanes; k_++) {                                  \
+            const int r_ = (ls)->regs[rj][k_];                                  \
+            const int64_t cmp_ = (ls)->cmp[k_];                                 \
+            (void)r_;                                                           \
+            (void)cmp_;                                                         \
+            (t)[k_] = -(int32_t)(expr);                                         \
+        }                                                                       \
+    } while (0)
+
+/**
+ * Execute an instruction of a lane that would fail in lockstep on its own.
+ */
+static void fall_back(struct lockstep * ls, int32_t * mask, int k, int pc)
+{
+    mask[k] = 0;
+    ls->pc[k] = pc;
+    step_lane(ls, k);
+}
+
+/**
+ * Execute an instruction for the lanes in mask.
+ * ls->pc of the lanes in mask is not read, all of them are at pc.
+ * Lanes for which the instruction would fail are executed on their own and
+ * removed from mask.
+ * @param next returns the next PC if the lanes in mask didn't diverge.
+ * @return 1 if executed and the lanes in mask continue at next, ls->pc is
+ *         not updated; 0 if executed and ls->pc is updated; -1 if the
+ *         instruction is not handled in lockstep.
+ */
+static int step_lanes(struct lockstep * ls, const struct vm_insn * ins, int pc,
+                      int32_t * mask, int * next)
+{
+    const int opcode = ins->opcode;
+    const int rj = ins->rj;
+    const int ri = ins->ri;
+    const int memsize = ls->lane[0].state.memsize;
+    int32_t v[LOCKSTEP_MAX_LANES];
+    int32_t t[LOCKSTEP_MAX_LANES];
+    int diverged = 0;
+    int taken = 0, n = 0;
+    int k;
+
+    switch (opcode) {
+    case PTTK91_NOP:
+    case PTTK91_STORE:
+    case PTTK91_LOAD:
+    case PTTK91_ADD:
+    case PTTK91_SUB:
+    case PTTK91_MUL:
+    case PTTK91_DIV:
+    case PTTK91_MOD:
+    case PTTK91_AND:
+    case PTTK91_OR:
+    case PTTK91_XOR:
+    case PTTK91_COMP:
+        break;
+    default:
+        if (opcode < PTTK91_JUMP || opcode > PTTK91_JNGRE)
+            return -1;
+    }
+    if (ins->m != PTTK91_ADDRMOD_0 && ins->m != PTTK91_ADDRMOD_1)
+        return -1;
+
+    /* Second operand */
+    if (ri) {
+        for (k = 0; k < ls->lanes; k++)
+            v[k] = ins->imm + ls->regs[ri][k];
+    } else {
+        for (k = 0; k < ls->lanes; k++)
+            v[k] = ins->imm;
+    }
+    if (ins->m == PTTK91_ADDRMOD_1) {
+        for (k = 0; k < ls->lanes; k++) {
+            if (!mask[k])
+                continue;
+            if (v[k] < 0 || v[k] >= memsize) {
+                fall_back(ls, mask, k, pc);
+                diverged = 1;
+                continue;
+            }
+            v[k] = (int32_t)ls->lane[k].mem[v[k]];
+        }
+    }
+
+    *next = pc + 1;
+    switch (opcode) {
+    case PTTK91_NOP:
+        break;
+    case PTTK91_STORE:
+        for (k = 0; k < ls->lanes; k++) {
+            if (!mask[k])
+                continue;
+            /* Stores to the code section are left to the interpreter */
+            if (v[k] < ls->code->len || v[k] >= memsize) {
+                fall_back(ls, mask, k, pc);
+                diverged = 1;
+                continue;
+            }
+            ls->lane[k].mem[v[k]] = ls->regs[rj][k];
+        }
+        break;
+    case PTTK91_LOAD:
+        for (k = 0; k < ls->lanes; k++)
+            ls->regs[rj][k] = LANES_SELECT(mask[k], v[k], ls->regs[rj][k]);
+        break;
+    case PTTK91_ADD:
+        LANES_OP(ls, rj, mask, v, +);
+        break;
+    case PTTK91_SUB:
+        LANES_OP(ls, rj, mask, v, -);
+        break;
+    case PTTK91_MUL:
+        LANES_OP(ls, rj, mask, v, *);
+        break;
+    case PTTK91_AND:
+        LANES_OP(ls, rj, mask, v, &);
+        break;
+    case PTTK91_OR:
+        LANES_OP(ls, rj, mask, v, |);
+        break;
+    case PTTK91_XOR:
+        LANES_OP(ls, rj, mask, v, ^);
+        break;
+    case PTTK91_DIV:
+    case PTTK91_MOD:
+        for (k = 0; k < ls->lanes; k++) {
+            if (!mask[k])
+                continue;
+            if (v[k] == 0) {
+                /* Division by zero */
+                fall_back(ls, mask, k, pc);
+                diverged = 1;
+                continue;
+            }
+            ls->regs[rj][k] = (opcode == PTTK91_DIV) ? ls->regs[rj][k] / v[k]
+                                                     : ls->regs[rj][k] % v[k];
+        }
+        break;
+    case PTTK91_COMP:
+        for (k = 0; k < ls->lanes; k++) {
+            const int64_t d = (int64_t)ls->regs[rj][k] - v[k];
+            ls->cmp[k] = (mask[k]) ? d : ls->cmp[k];
+        }
+        break;
+    default: /* Branches */
+        switch (opcode) {
+        case PTTK91_JUMP:
+            LANES_COND(ls, rj, t, 1);
+            break;
+        case PTTK91_JNEG:
+            LANES_COND(ls, rj, t, r_ < 0);
+            break;
+        case PTTK91_JZER:
+            LANES_COND(ls, rj, t, r_ == 0);
+            break;
+        case PTTK91_JPOS:
+            LANES_COND(ls, rj, t, r_ > 0);
+            break;
+        case PTTK91_JNNEG:
+            LANES_COND(ls, rj, t, r_ >= 0);
+            break;
+        case PTTK91_JNZER:
+            LANES_COND(ls, rj, t, r_ != 0);
+            break;
+        case PTTK91_JNPOS:
+            LANES_COND(ls, rj, t, r_ <= 0);
+            break;
+        case PTTK91_JLES:
+            LANES_COND(ls, rj, t, cmp_ < 0);
+            break;
+        case PTTK91_JEQU:
+            LANES_COND(ls, rj, t, cmp_ == 0);
+            break;
+        case PTTK91_JGRE:
+            LANES_COND(ls, rj, t, cmp_ > 0 && cmp_ != VM_CMP_NONE);
+            break;
+        case PTTK91_JNLES:
+            LANES_COND(ls, rj, t, cmp_ >= 0 && cmp_ != VM_CMP_NONE);
+            break;
+        case PTTK91_JNEQU:
+            LANES_COND(ls, rj, t, cmp_ != 0 && cmp_ != VM_CMP_NONE);
+            break;
+        default: /* PTTK91_JNGRE */
+            LANES_COND(ls, rj, t, cmp_ <= 0);
+            break;
+        }
+
+        for (k = 0; k < ls->lanes; k++) {
+            t[k] &= mask[k];
+            taken -= t[k];
+            n -= mask[k];
+        }
+        if (taken == n && ri == 0 && ins->m == PTTK91_ADDRMOD_0) {
+            /* Every lane branches to the same target */
+            *next = ins->imm;
+        } else if (taken != 0) {
+            diverged = 1;
+        }
+        if (diverged) {
+            for (k = 0; k < ls->lanes; k++) {
+                ls->pc[k] = LANES_SELECT(mask[k], LANES_SELECT(t[k], v[k], pc + 1),
+                                         ls->pc[k]);
+            }
+        }
+        break;
+    }
+
+    if (opcode < PTTK91_JUMP && diverged) {
+        for (k = 0; k < ls->lanes; k++)
+            ls->pc[k] = LANES_SELECT(mask[k], pc + 1, ls->pc[k]);
+    }
+
+    return !diverged;
+}
+
+void lockstep_run(struct lockstep * ls)
+{
+    const struct vm_code * code = ls->code;
+    int32_t mask[LOCKSTEP_MAX_LANES];
+    int uniform = 0; /* All running lanes are in mask and at pc */
+    int i, k, n = 0, pc = 0, next;
+
+    while (ls->nrunning > 0) {
+        if (!uniform) {
+            /* Lanes at the lowest PC run next */
+            pc = INT_MAX;
+            for (k = 0; k < ls->lanes; k++) {
+                if (ls->running[k] && ls->pc[k] < pc)
+                    pc = ls->pc[k];
+            }
+
+            n = 0;
+            for (k = 0; k < ls->lanes; k++) {
+                mask[k] = -(int32_t)(ls->running[k] && ls->pc[k] == pc);
+                n -= mask[k];
+            }
+        }
+
+        if (n == 1 || n * LOCKSTEP_MIN_SHARE < ls->nrunning) {
+            /* Not worth the lane loops */
+            for (k = 0; k < ls->lanes; k++) {
+                if (mask[k]) {
+                    ls->pc[k] = pc;
+                    run_lane(ls, k);
+                }
+            }
+            uniform = 0;
+            continue;
+        }
+
+        if (code && pc >= 0 && pc < code->len) {
+            i = step_lanes(ls, &(code->insn[pc]), pc, mask, &next);
+            if (i >= 0) {
+                for (k = 0; k < ls->lanes; k++)
+                    ls->count[k] -= mask[k];
+            }
+            switch (i) {
+            case 1:
+                if (n == ls->nrunning) {
+                    uniform = 1;
+                    pc = next;
+                    continue;
+                }
+                for (k = 0; k < ls->lanes; k++)
+                    ls->pc[k] = LANES_SELECT(mask[k], next, ls->pc[k]);
+                /* Fall through */
+            case 0:
+                uniform = 0;
+                continue;
+            }
+        }
+
+        for (k = 0; k < ls->lanes; k++) {
+            if (mask[k]) {
+                ls->pc[k] = pc;
+                step_lane(ls, k);
+            }
+        }
+        uniform = 0;
+    }
+
+    /* Registers of the final states */
+    for (k = 0; k < ls->lanes; k++) {
+        for (i = 0; i < PTTK91_NUM_REGS; i++)
+            ls->lane[k].state.regs[i] = ls->regs[i][k];
+        ls->lane[k].state.pc = ls->pc[k];
+        ls->lane[k].state.cmp = ls->cmp[k];
+        ls->lane[k].state.count += ls->count[k];
+    }
+}
@@ -0,0 +1,90 @@
+/**
+ *******************************************************************************
+ * @file    lockstep.h
+ * @author  Olli Vanhoja
+ * @brief   Lockstep execution of many instances of one program.
+ *******************************************************************************
+ */
+
+/* Lockstep execution
+ * ==================
+ * Lanes are instances of the same decoded program, each with its own memory
+ * and inputs. Registers, PC and the comparison result of all lanes are kept
+ * in struct-of-arrays layout. On every step the lanes at the lowest PC
+ * execute that instruction together with one dispatch and loops over the
+ * lanes that the compiler can vectorize. Lanes at other PCs wait, so lanes
+ * that diverged reconverge at the lowest PC.
+ *
+ * Lanes that diverged to a PC shared by too few lanes are dropped from the
+ * lockstep and run to the end with vm_run(). A lane executes a single
+ * instruction on its own with vm_step() if the instruction is not handled
+ * in lockstep (e.g. CALL, SVC or an indirect operand) or if it would fail
+ * for that lane. The result of every lane is the same as with a separate
+ * vm_run().
+ *
+ * IN from KBD reads the input values of the lane and OUT to CRT appends to
+ * the output of the lane, other devices are invalid.
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define LOCKSTEP_MAX_LANES 64
+#define LOCKSTEP_MIN_SHARE 4 /*!< Lanes in groups smaller than 1/n of the
+                              *   running lanes run on their own */
+
+/**
+ * Lane of a lockstep run.
+ */
+struct lockstep_lane {
+    uint32_t * mem;     /*!< Memory with the program loaded */
+    const int * input;  /*!< Values read with IN */
+    int input_len;
+    int * output;       /*!< Buffer for values written with OUT, can be NULL */
+    int output_size;    /*!< Size of the output buffer */
+
+    /* Results */
+    int output_len;     /*!< Number of values written, can exceed output_size */
+    int input_pos;      /*!< Number of values read */
+    struct vm_state state; /*!< Final state of the lane */
+};
+
+/**
+ * Lockstep run.
+ */
+struct lockstep {
+    int lanes;
+    const struct vm_code * code;
+    struct lockstep_lane * lane;
+    struct vm_io io[LOCKSTEP_MAX_LANES];
+
+    int nrunning;       /*!< Number of running lanes */
+
+    /* Lane state in struct-of-arrays layout, other state is in lane.state */
+    int regs[PTTK91_NUM_REGS][LOCKSTEP_MAX_LANES];
+    int pc[LOCKSTEP_MAX_LANES];
+    int64_t cmp[LOCKSTEP_MAX_LANES];
+    uint64_t count[LOCKSTEP_MAX_LANES]; /*!< Instructions executed in lockstep */
+    uint8_t running[LOCKSTEP_MAX_LANES];
+};
+
+/**
+ * Initialize a lockstep run.
+ * @param code decoded code of the program or NULL.
+ * @param code_size end address of the code section.
+ * @param lane lanes with memory and inputs set.
+ * @return 0 if no error; 1 if too many lanes.
+ */
+int lockstep_init(struct lockstep * ls, const struct vm_code * code, int code_size,
+                  int memsize, struct lockstep_lane * lane, int lanes);
+
+/**
+ * Run all lanes until they stop.
+ */
+void lockstep_run(struct lockstep * ls);
+
+#endif /* LOCKSTEP_H */
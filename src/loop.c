@@ -0,0 +1,186 @@
+/**
+ *******************************************************************************
+ * @file    loop.c
+ * @author  Olli Vanhoja
+ * @brief   Loop idiom recognition.
+ *******************************************************************************
+ */
+
+#include "pttk91.h"
+#include "loop.h"
+
+static int is_imm(const struct vm_insn * ins)
+{
+    return ins->m == PTTK91_ADDRMOD_0 && ins->ri == 0;
+}
+
+/**
+ * Match the loop control at ins.
+ * @return number of records matched or 0.
+ */
+static int match_control(const struct vm_insn * ins, int head, int n,
+                         struct loop_desc * loop)
+{
+    const int x = loop->x;
+
+    if (n < 2 || ins[0].rj != x || !is_imm(&ins[0]) || ins[0].imm == 0)
+        return 0;
+    if (ins[0].opcode == PTTK91_ADD)
+        loop->step = ins[0].imm;
+    else if (ins[0].opcode == PTTK91_SUB)
+        loop->step = -ins[0].imm;
+    else
+        return 0;
+
+    if (ins[1].opcode == PTTK91_COMP) {
+        if (n < 3 || ins[1].rj != x || !is_imm(&ins[1])
+            || !is_imm(&ins[2]) || ins[2].imm != head) {
+            return 0;
+        }
+        loop->comp = 1;
+        loop->limit = ins[1].imm;
+        switch (ins[2].opcode) {
+        case PTTK91_JLES:
+            loop->cond = LOOP_LT;
+            break;
+        case PTTK91_JNGRE:
+            loop->cond = LOOP_LE;
+            break;
+        case PTTK91_JNEQU:
+            loop->cond = LOOP_NE;
+            break;
+        case PTTK91_JGRE:
+            loop->cond = LOOP_GT;
+            break;
+        case PTTK91_JNLES:
+            loop->cond = LOOP_GE;
+            break;
+        default:
+            return 0;
+        }
+        return 3;
+    }
+
+    if (ins[1].rj != x || !is_imm(&ins[1]) || ins[1].imm != head)
+        return 0;
+    loop->comp = 0;
+    loop->limit = 0;
+    switch (ins[1].opcode) {
+    case PTTK91_JNEG:
+        loop->cond = LOOP_LT;
+        break;
+    case PTTK91_JNPOS:
+        loop->cond = LOOP_LE;
+        break;
+    case PTTK91_JNZER:
+        loop->cond = LOOP_NE;
+        break;
+    case PTTK91_JPOS:
+        loop->cond = LOOP_GT;
+        break;
+    case PTTK91_JNNEG:
+        loop->cond = LOOP_GE;
+        break;
+    default:
+        return 0;
+    }
+    return 2;
+}
+
+int loop_match(const struct vm_insn * ins, int head, int n, struct loop_desc * loop)
+{
+    int body, control;
+
+    if (n < 1 || ins[0].ri == 0 || ins[0].ri == ins[0].rj)
+        return 0;
+    loop->x = ins[0].ri;
+    loop->r = ins[0].rj;
+    loop->base = ins[0].imm;
+    loop->src = 0;
+
+    if (ins[0].opcode == PTTK91_STORE && ins[0].m == PTTK91_ADDRMOD_0) {
+        loop->kind = LOOP_FILL;
+        body = 1;
+    } else if (ins[0].opcode == PTTK91_ADD && ins[0].m == PTTK91_ADDRMOD_1) {
+        loop->kind = LOOP_SUM;
+        body = 1;
+    } else if (ins[0].opcode == PTTK91_LOAD && ins[0].m == PTTK91_ADDRMOD_1
+               && n > 1 && ins[1].opcode == PTTK91_STORE
+               && ins[1].m == PTTK91_ADDRMOD_0 && ins[1].rj == loop->r
+               && ins[1].ri == loop->x) {
+        loop->kind = LOOP_COPY;
+        loop->src = ins[0].imm;
+        loop->base = ins[1].imm;
+        body = 2;
+    } else {
+        return 0;
+    }
+
+    control = match_control(&ins[body], head, n - body, loop);
+    if (!control)
+        return 0;
+    loop->len = body + control;
+
+    return 1;
+}
+
+int loop_count(const struct loop_desc * loop, int x0, int64_t * iter)
+{
+    const int64_t step = loop->step;
+    const int64_t s = (step > 0) ? step : -step;
+    /* Distance to the limit in the direction of the step */
+    const int64_t dist = (step > 0) ? (int64_t)loop->limit - x0 : (int64_t)x0 - loop->limit;
+    int64_t n;
+
+    switch (loop->cond) {
+    case LOOP_LT: /* Continue while x < limit */
+    case LOOP_GT:
+        if ((loop->cond == LOOP_LT) != (step > 0))
+            return 1;
+        n = (dist > s) ? (dist + s - 1) / s : 1;
+        break;
+    case LOOP_LE:
+    case LOOP_GE:
+        if ((loop->cond == LOOP_LE) != (step > 0))
+            return 1;
+        n = (dist >= s) ? dist / s + 1 : 1;
+        break;
+    default: /* LOOP_NE */
+        if (dist <= 0 || dist % s)
+            return 1;
+        n = dist / s;
+        break;
+    }
+
+    /* The index must not overflow */
+    if (x0 + n * step > INT32_MAX || x0 + n * step < INT32_MIN)
+        return 1;
+
+    *iter = n;
+    return 0;
+}
+
+int loop_code(struct vm_code * code)
+{
+    struct loop_desc loop;
+    struct vm_insn * ins;
+    int i, j;
+    int count = 0;
+
+    for (i = 0; i < code->len; i++) {
+        ins = &(code->insn[i]);
+        if (ins->xop || !loop_match(ins, i, code->len - i, &loop))
+            continue;
+
+        for (j = 1; j < loop.len && !ins[j].xop; j++);
+        if (j < loop.len)
+            continue;
+
+        ins->xop = VM_XOP_LOOP;
+        ins->len = loop.len;
+        count++;
+        i += loop.len - 1;
+    }
+
+    return count;
+}
@@ -0,0 +1,86 @@
+/**
+ *******************************************************************************
+ * @file    loop.h
+ * @author  Olli Vanhoja
+ * @brief   Loop idiom recognition.
+ *******************************************************************************
+ */
+
+/* Loop idioms
+ * ===========
+ * Counted loops over an index register x are executed as host loops. The
+ * body is one of
+ *
+ * + fill   store r, base(x)
+ * + copy   load r, src(x) ; store r, dst(x)
+ * + sum    add r, base(x)
+ *
+ * followed by the loop control
+ *
+ *     add|sub x, =step ; comp x, =limit ; jcc head
+ *     add|sub x, =step ; jxx x, head
+ *
+ * The head record of a loop is marked with VM_XOP_LOOP. The number of
+ * iterations is computed when the loop is entered and the loop is executed
+ * on the host only if it terminates and every memory access would succeed,
+ * otherwise it's interpreted as usual. The final registers, comparison
+ * result and memory are the same as after interpreting the loop.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+#include "vm.h"
+
+#define LOOP_FILL   1
+#define LOOP_COPY   2
+#define LOOP_SUM    3
+
+/* Continue condition of a loop, x ? limit */
+#define LOOP_LT     1
+#define LOOP_LE     2
+#define LOOP_NE     3
+#define LOOP_GT     4
+#define LOOP_GE     5
+
+/**
+ * Matched loop.
+ */
+struct loop_desc {
+    int kind;   /*!< LOOP_x */
+    int len;    /*!< Number of instructions in the loop */
+    int x;      /*!< Index register */
+    int r;      /*!< Value, temporary or accumulator register */
+    int base;   /*!< Base address, destination of a copy */
+    int src;    /*!< Source address of a copy */
+    int step;
+    int limit;
+    int cond;   /*!< Continue condition, LOOP_x */
+    int comp;   /*!< Loop control uses COMP */
+};
+
+/**
+ * Match a loop starting at ins.
+ * @param head address of ins.
+ * @param n number of records available at ins.
+ * @return 1 if a loop was matched; otherwise 0.
+ */
+int loop_match(const struct vm_insn * ins, int head, int n, struct loop_desc * loop);
+
+/**
+ * Compute the number of iterations.
+ * @param x0 value of the index register when entering the loop.
+ * @param iter returns the number of iterations.
+ * @return 0 if the loop terminates; otherwise 1.
+ */
+int loop_count(const struct loop_desc * loop, int x0, int64_t * iter);
+
+/**
+ * Mark the loops of decoded code.
+ * Must be run before fusion.
+ * @return number of loops found.
+ */
+int loop_code(struct vm_code * code);
+
+#endif /* LOOP_H */
@@ -0,0 +1,56 @@
+/**
+ *******************************************************************************
+ * @file    mem.h
+ * @author  Olli Vanhoja
+ * @brief   VM memory allocation.
+ *******************************************************************************
+ */
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/* Portable functions */
+/**
+ * Allocate memory for a vm.
+ * The address space is reserved up front but pages are committed and
+ * zero-filled only when first touched. The returned memory is page aligned.
+ * @param memsize size of the memory area in words.
+ * @return pointer to the memory or NULL if out of memory.
+ */
+uint32_t * vm_mem_alloc(int memsize);
+
+/**
+ * Free memory allocated with vm_mem_alloc().
+ */
+void vm_mem_free(uint32_t * mem, int memsize);
+
+/**
+ * Release the pages of vm memory.
+ * The memory stays reserved and reads as zero until written.
+ * @param first first word of the range, page aligned.
+ * @param len length of the range in words.
+ */
+void vm_mem_discard(uint32_t * mem, int first, int len);
+
+/**
+ * Get the size of the mapping of vm memory.
+ * @return size in bytes, a multiple of the page size.
+ */
+size_t vm_mem_bytes(int memsize);
+
+/**
+ * Get the committed footprint of vm memory.
+ * @return number of bytes backed by physical memory.
+ */
+size_t vm_mem_committed(const uint32_t * mem, int memsize);
+/* End of portable functions */
+
+#ifndef VM_PLATFORM
+#error Please select VM_PLATFORM
+#endif
+
+#endif /* MEM_H */
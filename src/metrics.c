@@ -0,0 +1,166 @@
+/**
+ *******************************************************************************
+ * @file    metrics.c
+ * @author  Olli Vanhoja
+ * @brief   Live metrics of running vm instances.
+ *******************************************************************************
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include "metrics.h"
+
+/* Label values of the runtime errors */
+static const char * const error_names[METRICS_NUM_ERRORS] = {
+    "no_error",
+    "invalid_opcode",
+    "param_error",
+    "address_out_of_bounds",
+    "wr_address_out_of_bounds",
+    "register_out_of_bounds",
+    "pc_out_of_bounds",
+    "bad_access_mode",
+    "illegal_svc",
+    "invalid_device",
+    "trace_diverged"
+};
+
+int metrics_worker_init(struct metrics_worker * w, struct metrics_shm * shm)
+{
+    uint32_t i;
+
+    memset(&w->local, 0, sizeof(w->local));
+    w->shared = NULL;
+    if (!shm)
+        return 0;
+
+    i = __atomic_fetch_add(&shm->nworkers, 1, __ATOMIC_RELAXED);
+    if (i >= shm->max_workers)
+        return 1;
+    w->shared = &shm->slot[i].c;
+
+    return 0;
+}
+
+void metrics_mark(struct metrics_mark * mark, const struct vm_state * state)
+{
+    mark->count = state->count;
+#if VM_METRICS == 1
+    mark->svcs = state->svc_count;
+    mark->ins = state->in_count;
+    mark->outs = state->out_count;
+#else
+    mark->svcs = 0;
+    mark->ins = 0;
+    mark->outs = 0;
+#endif
+}
+
+void metrics_account(struct metrics_worker * w, const struct vm_state * state,
+                     struct metrics_mark * mark)
+{
+    struct metrics_mark now;
+    struct metrics_counters * c = &w->local;
+
+    metrics_mark(&now, state);
+    if (mark) {
+        c->instructions += now.count - mark->count;
+        c->svcs += now.svcs - mark->svcs;
+        c->ins += now.ins - mark->ins;
+        c->outs += now.outs - mark->outs;
+        *mark = now;
+    } else {
+        c->instructions += now.count;
+        c->svcs += now.svcs;
+        c->ins += now.ins;
+        c->outs += now.outs;
+    }
+
+    switch (state->stop) {
+    case VM_STOP_WAIT:
+        c->suspends++;
+        break;
+    case VM_STOP_ERROR:
+        if (state->error >= 0 && state->error < METRICS_NUM_ERRORS)
+            c->errors[state->error]++;
+        /* Falls through */
+    case VM_STOP_HALT:
+        c->runs++;
+        break;
+    }
+}
+
+void metrics_publish(struct metrics_worker * w)
+{
+    const uint64_t * src = (const uint64_t *)&w->local;
+    uint64_t * dst = (uint64_t *)w->shared;
+    size_t i;
+
+    if (!dst)
+        return;
+    for (i = 0; i < sizeof(struct metrics_counters) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Print a counter of every worker.
+ * @param help help text or NULL if the counter continues the previous one.
+ * @param offset offset of the counter in struct metrics_counters.
+ * @param label more labels of the counter.
+ */
+static void export_counter(const struct metrics_shm * shm, uint32_t n, FILE * out,
+                           const char * name, const char * help, size_t offset,
+                           const char * label)
+{
+    uint64_t value;
+    uint32_t i;
+
+    if (help) {
+        fprintf(out, "# HELP pttk91_%s %s\n", name, help);
+        fprintf(out, "# TYPE pttk91_%s counter\n", name);
+    }
+    for (i = 0; i < n; i++) {
+        value = __atomic_load_n((const uint64_t *)((const uint8_t *)&shm->slot[i].c + offset),
+                                __ATOMIC_RELAXED);
+        fprintf(out, "pttk91_%s{worker=\"%" PRIu32 "\"%s} %" PRIu64 "\n",
+                name, i, label, value);
+    }
+}
+
+#define COUNTER(name, help, field) \
+    export_counter(shm, n, out, name, help, offsetof(struct metrics_counters, field), "")
+
+void metrics_export(const struct metrics_shm * shm, FILE * out)
+{
+    char label[48];
+    uint32_t n;
+    int i;
+
+    n = __atomic_load_n(&shm->nworkers, __ATOMIC_RELAXED);
+    if (n > shm->max_workers)
+        n = shm->max_workers;
+
+    fprintf(out, "# HELP pttk91_workers Workers publishing metrics.\n");
+    fprintf(out, "# TYPE pttk91_workers gauge\n");
+    fprintf(out, "pttk91_workers %" PRIu32 "\n", n);
+
+    COUNTER("instructions_total", "Instructions executed.", instructions);
+    COUNTER("svc_total", "SVC instructions executed.", svcs);
+    COUNTER("in_total", "IN instructions executed.", ins);
+    COUNTER("out_total", "OUT instructions executed.", outs);
+    COUNTER("runs_total", "Runs halted or stopped on an error.", runs);
+    COUNTER("suspends_total", "Runs suspended on a blocking IN or OUT.", suspends);
+    COUNTER("resumes_total", "Suspended runs resumed.", resumes);
+
+    for (i = 1; i < METRICS_NUM_ERRORS; i++) {
+        snprintf(label, sizeof(label), ",error=\"%s\"", error_names[i]);
+        export_counter(shm, n, out, "errors_total",
+                       (i == 1) ? "Runs stopped on a runtime error." : NULL,
+                       offsetof(struct metrics_counters, errors) + i * sizeof(uint64_t),
+                       label);
+    }
+}
+
+#undef COUNTER
@@ -0,0 +1,158 @@
+/**
+ *******************************************************************************
+ * @file    metrics.h
+ * @author  Olli Vanhoja
+ * @brief   Live metrics of running vm instances.
+ *******************************************************************************
+ */
+
+/* Metrics
+ * =======
+ * Every instance counts the instructions it executes (vm_state.count) per
+ * straight-line run of code, not per instruction, and with VM_METRICS = 1
+ * the SVC, IN and OUT instructions it executes. No other work is done per
+ * instruction.
+ *
+ * A worker is a host thread running instances, e.g. a batch or server
+ * thread or a stage of a pipeline. It adds the counters of an instance to
+ * its private totals with metrics_account() at the end of every slice,
+ * i.e. when a run stops or suspends and at least every METRICS_SLICE
+ * instructions of a long run, see vm_state.slice, and publishes the totals
+ * with metrics_publish(). The totals are copied to the slot of the worker in a
+ * shared memory segment. Each slot has one writer, so publishing needs no
+ * locks and a reader may see a slot that is being updated, e.g. with the
+ * instructions of a slice but not its runs.
+ *
+ * Another process samples the segment with metrics_attach() and
+ * metrics_export() prints the counters of every slot in the Prometheus text
+ * format, summing the workers is left to the queries:
+ *
+ *     pttk91_instructions_total{worker="0"} 4042
+ *     pttk91_errors_total{worker="0",error="invalid_device"} 1
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define METRICS_MAGIC       "PTTK91MT"
+#define METRICS_VERSION     1
+#define METRICS_MAX_WORKERS 256
+#define METRICS_NUM_ERRORS  (VM_ERR_TRACE_DIVERGED + 1)
+#define METRICS_SLOT_SIZE   256 /*!< Size of a slot, a multiple of cache lines */
+#define METRICS_SLICE       (1 << 20) /*!< Instructions run between publishes */
+
+/**
+ * Counters of a worker.
+ */
+struct metrics_counters {
+    uint64_t instructions;  /*!< Instructions executed */
+    uint64_t svcs;          /*!< SVC instructions executed */
+    uint64_t ins;           /*!< IN instructions executed */
+    uint64_t outs;          /*!< OUT instructions executed */
+    uint64_t runs;          /*!< Runs halted or stopped on an error */
+    uint64_t suspends;      /*!< Runs suspended, see VM_STOP_WAIT */
+    uint64_t resumes;       /*!< Suspended runs resumed */
+    uint64_t errors[METRICS_NUM_ERRORS]; /*!< Runs stopped by VM_ERR_x */
+};
+
+union metrics_slot {
+    struct metrics_counters c;
+    uint8_t pad[METRICS_SLOT_SIZE];
+};
+
+/**
+ * Shared memory segment.
+ */
+struct metrics_shm {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_workers;
+    uint32_t nworkers;      /*!< Slots claimed by workers */
+    uint32_t reserved[11];
+    union metrics_slot slot[];
+};
+
+/**
+ * Counters of a worker, owned by its thread.
+ */
+struct metrics_worker {
+    struct metrics_counters local;
+    struct metrics_counters * shared; /*!< Slot in the segment or NULL */
+};
+
+/**
+ * Counters of an instance already accounted.
+ */
+struct metrics_mark {
+    uint64_t count;
+    uint64_t svcs;
+    uint64_t ins;
+    uint64_t outs;
+};
+
+/**
+ * Initialize a worker and claim a slot for it.
+ * @param shm shared segment or NULL to keep the counters private.
+ * @return 0 if no error; 1 if the segment has no free slots, the worker
+ *         counts privately.
+ */
+int metrics_worker_init(struct metrics_worker * w, struct metrics_shm * shm);
+
+/**
+ * Mark the current counters of an instance accounted.
+ */
+void metrics_mark(struct metrics_mark * mark, const struct vm_state * state);
+
+/**
+ * Add the counters of an instance since the mark to a worker.
+ * @param mark counters already accounted, updated; NULL if the counters of
+ *             the instance were zero when it started running.
+ */
+void metrics_account(struct metrics_worker * w, const struct vm_state * state,
+                     struct metrics_mark * mark);
+
+/**
+ * Copy the counters of a worker to its slot.
+ */
+void metrics_publish(struct metrics_worker * w);
+
+/**
+ * Print a segment in the Prometheus text format.
+ */
+void metrics_export(const struct metrics_shm * shm, FILE * out);
+
+/* Portable functions */
+/**
+ * Create a shared segment.
+ * A segment of the same name must not exist, e.g. one left behind by a VM
+ * that was killed must be removed first.
+ * @param name name of the segment.
+ * @param max_workers number of slots.
+ * @return the segment or NULL on error; errno is EEXIST if the name is
+ *         taken.
+ */
+struct metrics_shm * metrics_create(const char * name, int max_workers);
+
+/**
+ * Remove a segment created by metrics_create().
+ */
+void metrics_destroy(struct metrics_shm * shm, const char * name);
+
+/**
+ * Attach to a segment of another process for reading.
+ * @return the segment or NULL on error.
+ */
+const struct metrics_shm * metrics_attach(const char * name);
+
+/**
+ * Detach from a segment.
+ */
+void metrics_detach(const struct metrics_shm * shm);
+/* End of portable functions */
+
+#endif /* METRICS_H */
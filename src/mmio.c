@@ -0,0 +1,136 @@
+/**
+ *******************************************************************************
+ * @file    mmio.c
+ * @author  Olli Vanhoja
+ * @brief   Memory mapped I/O window and ring buffer devices.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include "mmio.h"
+
+int mmio_init(struct vm_mmio * mmio, int base, int npages)
+{
+    mmio->base = base;
+    mmio->npages = npages;
+    mmio->page = calloc(npages + 1, sizeof(struct vm_mmio_dev *));
+
+    return (mmio->page) ? 0 : 1;
+}
+
+int mmio_map(struct vm_mmio * mmio, int addr, int npages,
+             const struct vm_mmio_dev * dev)
+{
+    int first, i;
+
+    if (addr < mmio->base || (addr - mmio->base) % MMIO_PAGE_WORDS)
+        return 1;
+    first = (addr - mmio->base) >> VM_MMIO_SHIFT;
+    if (npages < 0 || first + npages > mmio->npages)
+        return 1;
+
+    for (i = first; i < first + npages; i++) {
+        mmio->page[i] = dev;
+    }
+
+    return 0;
+}
+
+void mmio_free(struct vm_mmio * mmio)
+{
+    free(mmio->page);
+    mmio->page = NULL;
+    mmio->npages = 0;
+}
+
+uint32_t mmio_ring_push(struct mmio_ring * ring, const uint32_t * src, uint32_t n)
+{
+    const uint32_t mask = ring->size - 1;
+    uint32_t head = ring->head;
+    uint32_t space, i;
+
+    space = ring->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if (n > space)
+        n = space;
+
+    for (i = 0; i < n; i++) {
+        ring->buf[(head + i) & mask] = src[i];
+    }
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+uint32_t mmio_ring_pop(struct mmio_ring * ring, uint32_t * dst, uint32_t max)
+{
+    const uint32_t mask = ring->size - 1;
+    uint32_t tail = ring->tail;
+    uint32_t n, i;
+
+    n = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if (n > max)
+        n = max;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = ring->buf[(tail + i) & mask];
+    }
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+uint32_t mmio_ring_count(const struct mmio_ring * ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+           - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static int ring_read(void * arg, int offset, int * value)
+{
+    struct mmio_ring * ring = (struct mmio_ring *)arg;
+
+    switch (offset) {
+    case MMIO_RING_DATA:
+        return !mmio_ring_pop(ring, (uint32_t *)value, 1);
+    case MMIO_RING_COUNT:
+        *value = (int)mmio_ring_count(ring);
+        return 0;
+    case MMIO_RING_FREE:
+        *value = (int)(ring->size - mmio_ring_count(ring));
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+static int ring_write(void * arg, int offset, int value)
+{
+    struct mmio_ring * ring = (struct mmio_ring *)arg;
+    const uint32_t word = (uint32_t)value;
+
+    if (offset != MMIO_RING_DATA)
+        return 1;
+    return !mmio_ring_push(ring, &word, 1);
+}
+
+int mmio_ring_init(struct mmio_ring * ring, uint32_t size)
+{
+    if (size == 0 || (size & (size - 1)))
+        return 2;
+
+    ring->buf = malloc(size * sizeof(uint32_t));
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dev.read = ring_read;
+    ring->dev.write = ring_write;
+    ring->dev.arg = ring;
+
+    return (ring->buf) ? 0 : 1;
+}
+
+void mmio_ring_free(struct mmio_ring * ring)
+{
+    free(ring->buf);
+    ring->buf = NULL;
+}
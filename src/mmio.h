@@ -0,0 +1,115 @@
+/**
+ *******************************************************************************
+ * @file    mmio.h
+ * @author  Olli Vanhoja
+ * @brief   Memory mapped I/O window and ring buffer devices.
+ *******************************************************************************
+ */
+
+/* Memory mapped I/O
+ * =================
+ * The MMIO window of an instance is a range of addresses at or above the
+ * memory size, divided into pages of 2^VM_MMIO_SHIFT words. Each page is
+ * mapped to a device or left unmapped. LOAD and the other instructions
+ * reading their operand from the memory, and STORE, call the handler of the
+ * device when the address is in a mapped page. The window is only looked up
+ * after the bounds check of the memory fails, so ordinary memory accesses
+ * cost nothing extra. An access to an unmapped address fails with the usual
+ * out of bounds error and a failing handler stops the instance with
+ * VM_ERR_INVALID_DEVICE.
+ *
+ * The atomic and vector instructions, AOT translated code, loop idioms and
+ * lockstep lanes don't access the window themselves, they fall back to the
+ * interpreter or fail as before.
+ *
+ * A ring device is a lock-free single producer single consumer ring of
+ * words. The guest is one end of the ring and the host the other, so the
+ * host moves data in batches without a callback per word:
+ *
+ * + MMIO_RING_DATA     LOAD pops a word, STORE pushes a word
+ * + MMIO_RING_COUNT    LOAD returns the number of words in the ring
+ * + MMIO_RING_FREE     LOAD returns the free space of the ring
+ *
+ * Popping an empty ring or pushing to a full one is a device error, the
+ * guest polls COUNT or FREE first if the other end may fall behind.
+ */
+
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define MMIO_PAGE_WORDS (1 << VM_MMIO_SHIFT)
+
+/* Registers of a ring device */
+#define MMIO_RING_DATA  0
+#define MMIO_RING_COUNT 1
+#define MMIO_RING_FREE  2
+
+/**
+ * Lock-free single producer single consumer word ring.
+ */
+struct mmio_ring {
+    struct vm_mmio_dev dev; /*!< Device to map to the window */
+    uint32_t * buf;
+    uint32_t size;  /*!< Size of buf in words, power of 2 */
+    uint32_t head;  /*!< Write index, owned by the producer */
+    uint32_t tail;  /*!< Read index, owned by the consumer */
+};
+
+/**
+ * Initialize an empty MMIO window.
+ * @param base first address of the window, a multiple of MMIO_PAGE_WORDS and
+ *             at least the memory size of the instance.
+ * @param npages size of the window in pages.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int mmio_init(struct vm_mmio * mmio, int base, int npages);
+
+/**
+ * Map a device to pages of a window.
+ * @param addr first address of the device, page aligned.
+ * @param npages number of pages mapped.
+ * @param dev device or NULL to unmap the pages.
+ * @return 0 if no error; 1 if the pages are not in the window.
+ */
+int mmio_map(struct vm_mmio * mmio, int addr, int npages,
+             const struct vm_mmio_dev * dev);
+
+/**
+ * Free a window.
+ */
+void mmio_free(struct vm_mmio * mmio);
+
+/**
+ * Initialize a ring device.
+ * @param size size of the ring in words, power of 2.
+ * @return 0 if no error; 1 if out of memory; 2 if size is not a power of 2.
+ */
+int mmio_ring_init(struct mmio_ring * ring, uint32_t size);
+
+/**
+ * Push words to a ring.
+ * @return number of words pushed.
+ */
+uint32_t mmio_ring_push(struct mmio_ring * ring, const uint32_t * src, uint32_t n);
+
+/**
+ * Pop words from a ring.
+ * @return number of words popped.
+ */
+uint32_t mmio_ring_pop(struct mmio_ring * ring, uint32_t * dst, uint32_t max);
+
+/**
+ * Get the number of words in a ring.
+ */
+uint32_t mmio_ring_count(const struct mmio_ring * ring);
+
+/**
+ * Free a ring device.
+ */
+void mmio_ring_free(struct mmio_ring * ring);
+
+#endif /* MMIO_H */
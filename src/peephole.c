@@ -0,0 +1,110 @@
+/**
+ *******************************************************************************
+ * @file    peephole.c
+ * @author  Olli Vanhoja
+ * @brief   Peephole optimizer for decoded code.
+ *******************************************************************************
+ */
+
+#include "pttk91.h"
+#include "peephole.h"
+
+#define MAX_JUMP_CHAIN  8 /*!< Maximum number of jumps followed */
+
+static int is_imm(const struct vm_insn * ins)
+{
+    return ins->m == PTTK91_ADDRMOD_0 && ins->ri == 0;
+}
+
+/**
+ * Test if an instruction has no effect.
+ */
+static int is_noop(const struct vm_insn * ins)
+{
+    switch (ins->opcode) {
+    case PTTK91_ADD:
+    case PTTK91_SUB:
+    case PTTK91_OR:
+    case PTTK91_XOR:
+    case PTTK91_SHL:
+    case PTTK91_SHR:
+    case PTTK91_SHRA:
+        return is_imm(ins) && ins->imm == 0;
+    case PTTK91_MUL:
+    case PTTK91_DIV:
+        return is_imm(ins) && ins->imm == 1;
+    case PTTK91_LOAD: /* load r, r */
+        return ins->m == PTTK91_ADDRMOD_0 && ins->ri == ins->rj && ins->imm == 0;
+    default:
+        return 0;
+    }
+}
+
+static int is_direct_jump(const struct vm_insn * ins)
+{
+    return ins->opcode >= (PTTK91_JUMP) && ins->opcode <= (PTTK91_JNGRE) && is_imm(ins);
+}
+
+/**
+ * Test for store r, x ; load r, x
+ */
+static int is_store_load(const struct vm_insn * ins)
+{
+    return ins[0].opcode == PTTK91_STORE && is_imm(&ins[0])
+        && ins[1].opcode == PTTK91_LOAD && ins[1].m == PTTK91_ADDRMOD_1
+        && ins[1].ri == 0 && ins[1].rj == ins[0].rj && ins[1].imm == ins[0].imm;
+}
+
+int peephole_code(struct vm_code * code)
+{
+    struct vm_insn * ins;
+    int i, n, target, hops;
+    int removed = 0;
+
+    for (i = 0; i < code->len; i++) {
+        ins = &(code->insn[i]);
+
+        if (is_noop(ins)) {
+            ins->opcode = PTTK91_NOP;
+            removed++;
+        } else if (is_direct_jump(ins)) {
+            /* Follow a chain of unconditional jumps */
+            target = ins->imm;
+            for (hops = 0; hops < MAX_JUMP_CHAIN && target < code->len; hops++) {
+                const struct vm_insn * next = &(code->insn[target]);
+
+                if (next->opcode != PTTK91_JUMP || !is_imm(next) || next->imm == target)
+                    break;
+                target = next->imm;
+            }
+            /* The jumps of the chain stay in the code, they are only
+             * skipped by this jump */
+            if (ins->imm != target)
+                code->threaded++;
+            ins->imm = target;
+        }
+    }
+
+    for (i = 0; i < code->len; i += n) {
+        ins = &(code->insn[i]);
+        n = 1;
+
+        if (i + 1 < code->len && is_store_load(ins)) {
+            n = 2;
+        } else if (ins->opcode == PTTK91_NOP) {
+            while (i + n < code->len && n < VM_XOP_MAX_LEN
+                   && ins[n].opcode == PTTK91_NOP) {
+                n++;
+            }
+        }
+
+        if (n > 1) {
+            ins->xop = VM_XOP_DROP;
+            ins->len = n;
+            removed += n - 1;
+        }
+    }
+
+    code->removed += removed;
+    return removed;
+}
@@ -0,0 +1,42 @@
+/**
+ *******************************************************************************
+ * @file    peephole.h
+ * @author  Olli Vanhoja
+ * @brief   Peephole optimizer for decoded code.
+ *******************************************************************************
+ */
+
+/* Peephole optimization
+ * =====================
+ * The optimizer rewrites decoded records, the image in the memory of the vm
+ * is never modified. Every rewrite keeps the record valid when it's entered
+ * by a branch, so the rest of a sequence is skipped only by the record at
+ * its head (VM_XOP_DROP).
+ *
+ * + Instructions without any effect, e.g. ADD r, =0 become NOPs
+ * + Runs of NOPs are skipped
+ * + LOAD r, x after STORE r, x is skipped, unless x is above the memory,
+ *   e.g. in the MMIO window where a device may read back another value
+ * + Jumps to unconditional jumps are retargeted to the final target
+ *
+ * Retargeted jumps change the branch events of an execution trace so
+ * optimized code shouldn't be used when tracing. The jumps they skip are not
+ * executed, so vm_state.count is lower than when running the unoptimized
+ * code by the number of skipped jumps. Removed instructions are still
+ * counted as executed.
+ */
+
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "vm.h"
+
+/**
+ * Optimize decoded code.
+ * Must be run before fusion.
+ * @return number of instructions removed, jumps skipped by retargeted jumps
+ *         are not included, they are counted in code->threaded.
+ */
+int peephole_code(struct vm_code * code);
+
+#endif /* PEEPHOLE_H */
@@ -0,0 +1,65 @@
+/**
+ *******************************************************************************
+ * @file    asmfile.c
+ * @author  Olli Vanhoja
+ * @brief   TTK91 assembler source files for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "asm.h"
+
+int asm_load(uint32_t * mem, int memsize, int * code_size, int * image_size,
+             struct symtab * symtab, const char * name)
+{
+    struct asm_state as;
+    FILE * fp;
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int retval = 0;
+
+    *code_size = 0;
+    *image_size = 0;
+
+    fp = fopen(name, "r");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file %s\n", name);
+        return 1;
+    }
+    if (asm_init(&as)) {
+        fclose(fp);
+        return 2;
+    }
+
+    while ((len = getline(&line, &line_size, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (asm_line(&as, line)) {
+            retval = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (retval == 0 && asm_finish(&as))
+        retval = 1;
+    if (retval) {
+        fprintf(stderr, "%s:%i: %s\n", name, as.error_line, as.error);
+    } else {
+        retval = asm_image(&as, mem, memsize, code_size, image_size, symtab);
+    }
+
+#if VM_DEBUG == 1
+    if (retval == 0)
+        fprintf(stderr, "K91 file assembled: %s\ncode_size = %i\n", name, *code_size);
+#endif
+
+    asm_free(&as);
+    return retval;
+}
@@ -33,8 +33,24 @@ enum dsections {
  * @return 0 if no error; 1 if can't open the given file; 2 if out of memory.
  */
 int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const char * name)
+{
+    int image_size;
+
+    return b91_loader_load(mem, memsize, code_size, &image_size, NULL, name);
+}
+
+/**
+ * Load B91 binary file and its symbol table.
+ * @param image_size returns the number of words loaded.
+ * @param symtab symbol table where symbols are added, can be NULL.
+ * @return same as b91_loader_read_file().
+ */
+int b91_loader_load(uint32_t * mem, int memsize, int * code_size, int * image_size,
+                    struct symtab * symtab, const char * name)
 {
     char str[80];
+    char sym_name[80];
+    int sym_i = 0;
     FILE * pFile;
     enum dsections state = header;
     uint32_t mem_i = 0;
@@ -44,6 +60,7 @@ int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const cha
 #endif
 
     *code_size = 0;
+    *image_size = 0;
 
     pFile = fopen(name, "r");
     if (!pFile)
@@ -88,6 +105,7 @@ int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const cha
 
             /* Store line to the memory location */
             mem[mem_i++] = (uint32_t)atoi(str);
+            *image_size = mem_i;
             break;
         case data_b:
             state = data_e;
@@ -101,15 +119,21 @@ int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const cha
                 break;
             }
 
+            if (sym_i++ % 2 == 0) {
+                strcpy(sym_name, str);
+            } else if (symtab) {
+                symtab_add(symtab, sym_name, atoi(str));
+            }
+
 #if VM_DEBUG == 1
             /* Print symbol */
             if (sym_cnt == 0) {
-                printf("=== Symbols ===\n");
+                fprintf(stderr, "=== Symbols ===\n");
             }
             if (sym_cnt++ % 2) {
-                printf("%s\n", str);
+                fprintf(stderr, "%s\n", str);
             } else {
-                printf("%s\t", str);
+                fprintf(stderr, "%s\t", str);
             }
 #endif
             break;
@@ -120,9 +144,45 @@ int b91_loader_read_file(uint32_t * mem, int memsize, int * code_size, const cha
     }
 
 #if VM_DEBUG == 1
-    printf("\nB91 file loaded: %s\ncode_size = %i\n", name, *code_size);
+    fprintf(stderr, "\nB91 file loaded: %s\ncode_size = %i\n", name, *code_size);
 #endif
 
     fclose(pFile);
     return 0;
 }
+
+/**
+ * Write an image to a B91 binary file.
+ * @param code_size end address of the code section.
+ * @param image_size size of the image in words.
+ * @param symtab symbol table, can be NULL.
+ * @return 0 if no error; 1 if can't write the given file.
+ */
+int b91_write(const uint32_t * mem, int code_size, int image_size,
+              const struct symtab * symtab, const char * name)
+{
+    FILE * pFile;
+    int i;
+
+    pFile = fopen(name, "w");
+    if (!pFile) {
+        fprintf(stderr, "Unable to open file %s\n", name);
+        return 1;
+    }
+
+    fprintf(pFile, "___b91___\n___code___\n0 %i\n", code_size);
+    for (i = 0; i <= code_size && i < image_size; i++) {
+        fprintf(pFile, "%i\n", (int)mem[i]);
+    }
+    fprintf(pFile, "___data___\n%i %i\n", code_size + 1, image_size - 1);
+    for (; i < image_size; i++) {
+        fprintf(pFile, "%i\n", (int)mem[i]);
+    }
+    fprintf(pFile, "___symboltable___\n");
+    for (i = 0; symtab && i < symtab->count; i++) {
+        fprintf(pFile, "%s %i\n", symtab->syms[i].name, symtab->syms[i].value);
+    }
+    fprintf(pFile, "___end___\n");
+
+    return fclose(pFile) != 0;
+}
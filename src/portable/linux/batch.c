@@ -0,0 +1,457 @@
+/**
+ *******************************************************************************
+ * @file    batch.c
+ * @author  Olli Vanhoja
+ * @brief   Batch runs on a thread pool for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "vm.h"
+#include "inp.h"
+#include "outp.h"
+#include "metrics.h"
+#include "batch.h"
+
+struct batch_job {
+    int id;
+    char * name;            /*!< Program file */
+    char * input;           /*!< Input file or NULL */
+    struct program * prog;  /*!< NULL if the program could not be loaded */
+};
+
+/**
+ * Loaded program by file name.
+ */
+struct batch_prog {
+    struct batch_prog * next;
+    char * name;
+    struct program * prog;
+};
+
+struct batch {
+    struct program_cache * pc;
+    int memsize;
+    FILE * out;
+    struct metrics_shm * metrics;
+    struct batch_prog * progs; /*!< Only accessed by the reading thread */
+    int jobs;                  /*!< Number of jobs read */
+
+    /* Queue of jobs waiting for a thread */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct batch_job * queue[BATCH_QUEUE_LEN];
+    int head;
+    int len;
+    int done;                  /*!< No more jobs will be queued */
+};
+
+/**
+ * Device I/O of a job.
+ */
+struct job_io {
+    int * input;
+    int input_len;
+    int input_pos;
+    int * output;
+    int output_len;
+    int output_size;
+};
+
+static int job_in(void * arg, int device, int * value)
+{
+    struct job_io * jio = (struct job_io *)arg;
+
+    if (device != INP_KBD || jio->input_pos >= jio->input_len)
+        return 1;
+    *value = jio->input[jio->input_pos++];
+    return 0;
+}
+
+static int job_out(void * arg, int device, int value)
+{
+    struct job_io * jio = (struct job_io *)arg;
+    int * output;
+    int size;
+
+    if (device != OUTP_CRT)
+        return 1;
+    if (jio->output_len == jio->output_size) {
+        size = (jio->output_size) ? 2 * jio->output_size : 16;
+        output = realloc(jio->output, size * sizeof(int));
+        if (!output)
+            return 1;
+        jio->output = output;
+        jio->output_size = size;
+    }
+    jio->output[jio->output_len++] = value;
+    return 0;
+}
+
+/**
+ * Read the input values of a job.
+ * @return 0 if no error.
+ */
+static int read_input(struct job_io * jio, const char * name)
+{
+    FILE * fp;
+    int * input;
+    int value, size = 0;
+
+    if (!name)
+        return 0;
+    fp = fopen(name, "r");
+    if (!fp)
+        return 1;
+
+    while (fscanf(fp, "%i", &value) == 1) {
+        if (jio->input_len == size) {
+            size = (size) ? 2 * size : 16;
+            input = realloc(jio->input, size * sizeof(int));
+            if (!input) {
+                fclose(fp);
+                return 1;
+            }
+            jio->input = input;
+        }
+        jio->input[jio->input_len++] = value;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void put_string(FILE * out, const char * s)
+{
+    if (!s) {
+        fputs("null", out);
+        return;
+    }
+
+    putc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            putc('\\', out);
+            putc(*s, out);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned char)*s);
+        } else {
+            putc(*s, out);
+        }
+    }
+    putc('"', out);
+}
+
+static uint64_t elapsed_us(const struct timespec * start, const struct timespec * end)
+{
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000
+           + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void run_job(struct batch * b, const struct batch_job * job,
+                    struct program_instance * inst, struct metrics_worker * metrics)
+{
+    struct job_io jio;
+    const struct vm_io io = { job_in, job_out, &jio };
+    struct vm_state * state = &inst->state;
+    struct timespec start, end;
+    struct metrics_mark mark;
+    const char * stop;
+    int error = 0;
+    uint64_t count = 0;
+    int i;
+
+    memset(&jio, 0, sizeof(jio));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!job->prog) {
+        stop = "load";
+    } else if (read_input(&jio, job->input)) {
+        stop = "input";
+    } else if (program_instance_get(inst, job->prog,
+                                    program_memsize(job->prog, b->memsize))) {
+        stop = "memory";
+    } else {
+        /* Long jobs publish their metrics at the end of every slice */
+        state->io = &io;
+        state->slice = METRICS_SLICE;
+        metrics_mark(&mark, state);
+        do {
+            state->running = 1;
+            vm_run(state, inst->mem);
+            metrics_account(metrics, state, &mark);
+            metrics_publish(metrics);
+        } while (state->stop == VM_STOP_SLICE);
+        state->slice = 0;
+        state->io = NULL;
+        stop = vm_stop_name(state->stop);
+        error = state->error;
+        count = state->count;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* One line at a time */
+    flockfile(b->out);
+    fprintf(b->out, "{\"job\":%i,\"program\":", job->id);
+    put_string(b->out, job->name);
+    fputs(",\"input\":", b->out);
+    put_string(b->out, job->input);
+    fprintf(b->out, ",\"stop\":\"%s\",\"error\":%i,\"output\":[", stop, error);
+    for (i = 0; i < jio.output_len; i++) {
+        fprintf(b->out, (i) ? ",%i" : "%i", jio.output[i]);
+    }
+    fprintf(b->out, "],\"instructions\":%" PRIu64 ",\"wall_us\":%" PRIu64 "}\n",
+            count, elapsed_us(&start, &end));
+    fflush(b->out);
+    funlockfile(b->out);
+
+    free(jio.input);
+    free(jio.output);
+}
+
+static void * batch_thread(void * arg)
+{
+    struct batch * b = (struct batch *)arg;
+    struct program_instance inst;
+    struct metrics_worker metrics;
+    struct batch_job * job;
+
+    /* Consecutive jobs of the same program reuse the memory */
+    memset(&inst, 0, sizeof(inst));
+    metrics_worker_init(&metrics, b->metrics);
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        while (b->len == 0 && !b->done)
+            pthread_cond_wait(&b->not_empty, &b->lock);
+        if (b->len == 0) {
+            pthread_mutex_unlock(&b->lock);
+            program_instance_free(&inst);
+            return NULL;
+        }
+        job = b->queue[b->head];
+        b->head = (b->head + 1) % BATCH_QUEUE_LEN;
+        b->len--;
+        pthread_cond_signal(&b->not_full);
+        pthread_mutex_unlock(&b->lock);
+
+        run_job(b, job, &inst, &metrics);
+        free(job->name);
+        free(job->input);
+        free(job);
+    }
+}
+
+/**
+ * Get a program by file name, every file is loaded once.
+ */
+static struct program * get_program(struct batch * b, const char * name)
+{
+    struct batch_prog * bp;
+
+    for (bp = b->progs; bp; bp = bp->next) {
+        if (strcmp(bp->name, name) == 0)
+            return bp->prog;
+    }
+
+    bp = malloc(sizeof(struct batch_prog));
+    if (!bp)
+        return NULL;
+    bp->name = strdup(name);
+    if (!bp->name) {
+        free(bp);
+        return NULL;
+    }
+    bp->prog = program_load(b->pc, b->memsize, NULL, name);
+    bp->next = b->progs;
+    b->progs = bp;
+
+    return bp->prog;
+}
+
+/**
+ * Queue a job, waits while the queue is full.
+ * @return 0 if no error.
+ */
+static int add_job(struct batch * b, const char * name, const char * input)
+{
+    struct batch_job * job;
+
+    job = calloc(1, sizeof(struct batch_job));
+    if (!job)
+        return 1;
+    job->name = strdup(name);
+    job->input = (input) ? strdup(input) : NULL;
+    if (!job->name || (input && !job->input)) {
+        free(job->name);
+        free(job->input);
+        free(job);
+        return 1;
+    }
+    job->id = b->jobs++;
+    job->prog = get_program(b, name);
+
+    pthread_mutex_lock(&b->lock);
+    while (b->len == BATCH_QUEUE_LEN)
+        pthread_cond_wait(&b->not_full, &b->lock);
+    b->queue[(b->head + b->len) % BATCH_QUEUE_LEN] = job;
+    b->len++;
+    pthread_cond_signal(&b->not_empty);
+    pthread_mutex_unlock(&b->lock);
+
+    return 0;
+}
+
+/**
+ * Queue the jobs of a manifest.
+ */
+static int read_manifest(struct batch * b, FILE * fp)
+{
+    char * line = NULL;
+    char * name, * input, * save;
+    size_t size = 0;
+    int err = 0;
+
+    while (!err && getline(&line, &size, fp) != -1) {
+        name = strtok_r(line, " \t\r\n", &save);
+        if (!name || name[0] == '#')
+            continue;
+        input = strtok_r(NULL, " \t\r\n", &save);
+        err = add_job(b, name, input);
+    }
+
+    free(line);
+    return err;
+}
+
+static int is_program(const struct dirent * d)
+{
+    const char * ext = strrchr(d->d_name, '.');
+
+    return ext && (strcasecmp(ext, ".b91") == 0 || strcasecmp(ext, ".k91") == 0);
+}
+
+/**
+ * Queue every program of a directory.
+ */
+static int read_dir(struct batch * b, const char * dir)
+{
+    struct dirent ** list;
+    char * name, * input;
+    int i, n, err = 0;
+
+    n = scandir(dir, &list, is_program, alphasort);
+    if (n < 0)
+        return 1;
+
+    for (i = 0; i < n; i++) {
+        if (!err) {
+            name = malloc(strlen(dir) + strlen(list[i]->d_name) + 5);
+            if (name) {
+                sprintf(name, "%s/%s", dir, list[i]->d_name);
+                input = strdup(name);
+                if (input) {
+                    strcpy(strrchr(input, '.'), ".in");
+                    err = add_job(b, name, (access(input, R_OK) == 0) ? input : NULL) ? 2 : 0;
+                    free(input);
+                } else {
+                    err = 2;
+                }
+                free(name);
+            } else {
+                err = 2;
+            }
+        }
+        free(list[i]);
+    }
+
+    free(list);
+    return err;
+}
+
+int batch_run(struct program_cache * pc, const char * source, int threads,
+              int memsize, FILE * out, struct metrics_shm * metrics)
+{
+    struct batch b;
+    struct batch_prog * bp;
+    pthread_t * tids;
+    struct stat st;
+    FILE * fp = NULL;
+    int i, n, retval = 0;
+
+    if (strcmp(source, "-") == 0) {
+        fp = stdin;
+    } else if (stat(source, &st)) {
+        return 1;
+    } else if (!S_ISDIR(st.st_mode)) {
+        fp = fopen(source, "r");
+        if (!fp)
+            return 1;
+    }
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    tids = malloc(threads * sizeof(pthread_t));
+    if (!tids) {
+        if (fp && fp != stdin)
+            fclose(fp);
+        return 2;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.pc = pc;
+    b.memsize = memsize;
+    b.out = out;
+    b.metrics = metrics;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.not_empty, NULL);
+    pthread_cond_init(&b.not_full, NULL);
+
+    for (n = 0; n < threads; n++) {
+        if (pthread_create(&tids[n], NULL, batch_thread, &b))
+            break;
+    }
+    if (n == 0) {
+        retval = 2;
+    } else if (fp) {
+        retval = read_manifest(&b, fp) ? 2 : 0;
+    } else {
+        retval = read_dir(&b, source);
+    }
+
+    pthread_mutex_lock(&b.lock);
+    b.done = 1;
+    pthread_cond_broadcast(&b.not_empty);
+    pthread_mutex_unlock(&b.lock);
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+
+    while (b.progs) {
+        bp = b.progs;
+        b.progs = bp->next;
+        if (bp->prog)
+            program_put(pc, bp->prog);
+        free(bp->name);
+        free(bp);
+    }
+    pthread_cond_destroy(&b.not_full);
+    pthread_cond_destroy(&b.not_empty);
+    pthread_mutex_destroy(&b.lock);
+    free(tids);
+    if (fp && fp != stdin)
+        fclose(fp);
+
+    return retval;
+}
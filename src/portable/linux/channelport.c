@@ -0,0 +1,127 @@
+/**
+ *******************************************************************************
+ * @file    channelport.c
+ * @author  Olli Vanhoja
+ * @brief   Pipelines of vm instances on Linux threads.
+ *******************************************************************************
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "channel.h"
+
+#define SPIN_COUNT      4096    /*!< Polls of a channel before sleeping */
+#define PARK_TIMEOUT_NS 1000000 /*!< Longest sleep between polls */
+
+struct stage_thread {
+    pthread_t tid;
+    struct channel_stage * stage;
+    struct metrics_shm * metrics;
+};
+
+void channel_wake(struct channel * ch)
+{
+    __atomic_add_fetch(&ch->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ch->waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ch->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Wait until a suspended stage can continue.
+ * Spins first and then sleeps on the channel the port waits for.
+ */
+static void wait_ready(struct channel_port * port)
+{
+    struct channel * ch = (port->wait == CHANNEL_WAIT_IN) ? port->in : port->out;
+    const struct timespec timeout = { 0, PARK_TIMEOUT_NS };
+    uint32_t seq;
+    int i = 0;
+
+    while (!channel_port_ready(port)) {
+        /* Let the consumer progress while waiting */
+        channel_port_flush(port);
+        if (++i < SPIN_COUNT)
+            continue;
+
+        /* Only registered waiters are woken, so check again after
+         * registering. The timeout retries output left in the port while
+         * it waits for input. */
+        __atomic_add_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&ch->seq, __ATOMIC_SEQ_CST);
+        if (!channel_port_ready(port))
+            syscall(SYS_futex, &ch->seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+        __atomic_sub_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    port->wait = 0;
+}
+
+static void * stage_main(void * arg)
+{
+    struct stage_thread * th = (struct stage_thread *)arg;
+    struct channel_stage * stage = th->stage;
+    struct vm_state * state = stage->state;
+    struct channel_port * port = &stage->port;
+    struct metrics_worker metrics;
+    struct metrics_mark mark;
+
+    metrics_worker_init(&metrics, th->metrics);
+    metrics_mark(&mark, state);
+
+    state->slice = CHANNEL_SLICE;
+    vm_run(state, stage->mem);
+    metrics_account(&metrics, state, &mark);
+    metrics_publish(&metrics);
+    while (state->stop == VM_STOP_WAIT || state->stop == VM_STOP_SLICE) {
+        channel_port_flush(port);
+        if (state->stop == VM_STOP_WAIT) {
+            wait_ready(port);
+            metrics.local.resumes++;
+        }
+        state->running = 1;
+        vm_run(state, stage->mem);
+        metrics_account(&metrics, state, &mark);
+        metrics_publish(&metrics);
+    }
+
+    /* The rest of the output, unless the consumer has stopped */
+    while (channel_port_flush(port) > 0) {
+        port->wait = CHANNEL_WAIT_OUT;
+        wait_ready(port);
+    }
+    channel_port_close(port);
+
+    return NULL;
+}
+
+int channel_run(struct channel_stage * stage, int n, struct metrics_shm * metrics)
+{
+    struct stage_thread thread[CHANNEL_MAX_STAGES];
+    int i, started;
+
+    if (n < 0 || n > CHANNEL_MAX_STAGES)
+        return 1;
+
+    for (started = 0; started < n; started++) {
+        thread[started].stage = &stage[started];
+        thread[started].metrics = metrics;
+        if (pthread_create(&thread[started].tid, NULL, stage_main, &thread[started]))
+            break;
+    }
+    if (started < n) {
+        /* Stop the stages that are running, their neighbours never come */
+        for (i = started; i < n; i++)
+            channel_port_close(&stage[i].port);
+        for (i = 0; i < started; i++)
+            stage[i].state->running = 0;
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(thread[i].tid, NULL);
+    }
+
+    return (started < n) ? 1 : 0;
+}
@@ -0,0 +1,344 @@
+/**
+ *******************************************************************************
+ * @file    checkpoint.c
+ * @author  Olli Vanhoja
+ * @brief   Forking, snapshots and checkpoints for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mem.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC    "PTTK91CK"
+#define CHECKPOINT_VERSION  1
+#define PAGE_BYTES          (CHECKPOINT_PAGE_WORDS * sizeof(uint32_t))
+
+/**
+ * Checkpoint file header.
+ * The header is followed by the vector registers if VM_VECTOR is set, the
+ * page numbers of the stored pages and the stored pages at data_offset.
+ */
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_words;
+    uint32_t vector;        /*!< VM_VECTOR of the build */
+    uint32_t npages;        /*!< Number of stored pages */
+    uint64_t data_offset;   /*!< File offset of the first stored page */
+    int32_t memsize;
+    int32_t code_sec_end;
+    int32_t regs[PTTK91_NUM_REGS];
+    int32_t pc;
+    int32_t running;
+    int32_t stop;
+    int32_t error;
+    uint32_t sr;            /*!< Flags of the state register */
+    int64_t cmp;
+    uint64_t count;
+};
+
+static int page_is_zero(const uint32_t * page, size_t words)
+{
+    size_t i;
+
+    for (i = 0; i < words; i++) {
+        if (page[i])
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Get the number of words of a page of the memory.
+ * The last page of the memory may be partial.
+ */
+static size_t page_words(int memsize, uint32_t page)
+{
+    const size_t first = (size_t)page * CHECKPOINT_PAGE_WORDS;
+
+    return ((size_t)memsize - first < CHECKPOINT_PAGE_WORDS)
+        ? (size_t)memsize - first : CHECKPOINT_PAGE_WORDS;
+}
+
+static int write_all(int fd, const void * buf, size_t len, off_t off)
+{
+    const char * p = (const char *)buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, p, len, off);
+        if (n <= 0)
+            return 1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int vm_snapshot(struct vm_snapshot * snap, const struct vm_state * state,
+                const uint32_t * mem)
+{
+    const uint32_t npages = (state->memsize + CHECKPOINT_PAGE_WORDS - 1)
+                            / CHECKPOINT_PAGE_WORDS;
+    uint32_t page;
+    size_t words;
+
+    snap->fd = memfd_create("pttk91-snapshot", MFD_CLOEXEC);
+    if (snap->fd < 0)
+        return 1;
+    if (ftruncate(snap->fd, vm_mem_bytes(state->memsize)))
+        goto fail;
+
+    /* Zero pages stay holes of the file */
+    for (page = 0; page < npages; page++) {
+        const uint32_t * p = mem + (size_t)page * CHECKPOINT_PAGE_WORDS;
+
+        words = page_words(state->memsize, page);
+        if (!page_is_zero(p, words)
+            && write_all(snap->fd, p, words * sizeof(uint32_t), (off_t)page * PAGE_BYTES)) {
+            goto fail;
+        }
+    }
+
+    snap->state = *state;
+    snap->state.trace = NULL;
+    snap->state.profile = NULL;
+    snap->state.smp = NULL;
+    snap->state.dirty = NULL;
+
+    return 0;
+fail:
+    close(snap->fd);
+    snap->fd = -1;
+    return 1;
+}
+
+uint32_t * vm_fork(const struct vm_snapshot * snap, struct vm_state * state)
+{
+    void * mem;
+
+    mem = mmap(NULL, vm_mem_bytes(snap->state.memsize), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_NORESERVE, snap->fd, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    *state = snap->state;
+
+    return (uint32_t *)mem;
+}
+
+int vm_restore(const struct vm_snapshot * snap, struct vm_state * state,
+               uint32_t * mem)
+{
+    void * p;
+
+    if (state->memsize != snap->state.memsize)
+        return 1;
+
+    /* Replaces the old pages of the instance */
+    p = mmap(mem, vm_mem_bytes(snap->state.memsize), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, snap->fd, 0);
+    if (p == MAP_FAILED)
+        return 1;
+    *state = snap->state;
+
+    return 0;
+}
+
+void vm_snapshot_free(struct vm_snapshot * snap)
+{
+    if (snap->fd >= 0)
+        close(snap->fd);
+    snap->fd = -1;
+}
+
+static void header_from_state(struct checkpoint_header * hdr,
+                              const struct vm_state * state)
+{
+    int i;
+
+    memcpy(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic));
+    hdr->version = CHECKPOINT_VERSION;
+    hdr->page_words = CHECKPOINT_PAGE_WORDS;
+    hdr->vector = VM_VECTOR;
+    hdr->memsize = state->memsize;
+    hdr->code_sec_end = state->code_sec_end;
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        hdr->regs[i] = state->regs[i];
+    hdr->pc = state->pc;
+    hdr->running = state->running;
+    hdr->stop = state->stop;
+    hdr->error = state->error;
+    hdr->sr = vm_get_sr(state);
+    hdr->cmp = state->cmp;
+    hdr->count = state->count;
+}
+
+static void state_from_header(struct vm_state * state,
+                              const struct checkpoint_header * hdr)
+{
+    int i;
+
+    vm_init_state(state, hdr->code_sec_end, hdr->memsize);
+    for (i = 0; i < PTTK91_NUM_REGS; i++)
+        state->regs[i] = hdr->regs[i];
+    state->pc = hdr->pc;
+    state->running = hdr->running;
+    state->stop = hdr->stop;
+    state->error = hdr->error;
+    state->sr.ovf = (hdr->sr >> VM_SR_BIT_OVF) & 1;
+    state->sr.div = (hdr->sr >> VM_SR_BIT_DIV) & 1;
+    state->sr.uni = (hdr->sr >> VM_SR_BIT_UNI) & 1;
+    state->sr.fma = (hdr->sr >> VM_SR_BIT_FMA) & 1;
+    state->sr.dei = (hdr->sr >> VM_SR_BIT_DEI) & 1;
+    state->sr.svc = (hdr->sr >> VM_SR_BIT_SVC) & 1;
+    state->sr.pri = (hdr->sr >> VM_SR_BIT_PRI) & 1;
+    state->sr.nin = (hdr->sr >> VM_SR_BIT_NIN) & 1;
+    state->cmp = hdr->cmp;
+    state->count = hdr->count;
+}
+
+int checkpoint_save(const struct vm_snapshot * snap, const char * path)
+{
+    const int memsize = snap->state.memsize;
+    const uint32_t npages = (memsize + CHECKPOINT_PAGE_WORDS - 1) / CHECKPOINT_PAGE_WORDS;
+    struct checkpoint_header hdr;
+    uint32_t * mem;
+    uint32_t * index;
+    uint32_t page;
+    size_t meta;
+    off_t off;
+    int fd, err = 1;
+
+    mem = mmap(NULL, vm_mem_bytes(memsize), PROT_READ, MAP_SHARED, snap->fd, 0);
+    if (mem == MAP_FAILED)
+        return 1;
+    index = malloc((npages + 1) * sizeof(uint32_t));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!index || fd < 0)
+        goto out;
+
+    memset(&hdr, 0, sizeof(hdr));
+    header_from_state(&hdr, &snap->state);
+    for (page = 0; page < npages; page++) {
+        if (!page_is_zero(mem + (size_t)page * CHECKPOINT_PAGE_WORDS,
+                          page_words(memsize, page))) {
+            index[hdr.npages++] = page;
+        }
+    }
+
+    meta = sizeof(hdr) + hdr.npages * sizeof(uint32_t);
+#if VM_VECTOR == 1
+    meta += sizeof(snap->state.vregs);
+#endif
+    hdr.data_offset = meta;
+
+    off = 0;
+    if (write_all(fd, &hdr, sizeof(hdr), off))
+        goto out;
+    off += sizeof(hdr);
+#if VM_VECTOR == 1
+    if (write_all(fd, snap->state.vregs, sizeof(snap->state.vregs), off))
+        goto out;
+    off += sizeof(snap->state.vregs);
+#endif
+    if (write_all(fd, index, hdr.npages * sizeof(uint32_t), off))
+        goto out;
+
+    for (page = 0; page < hdr.npages; page++) {
+        if (write_all(fd, mem + (size_t)index[page] * CHECKPOINT_PAGE_WORDS,
+                      page_words(memsize, index[page]) * sizeof(uint32_t),
+                      hdr.data_offset + (off_t)page * PAGE_BYTES)) {
+            goto out;
+        }
+    }
+    /* The last page is padded so every stored page is PAGE_BYTES long */
+    err = ftruncate(fd, hdr.data_offset + (off_t)hdr.npages * PAGE_BYTES) ? 1 : 0;
+
+out:
+    if (fd >= 0 && close(fd))
+        err = 1;
+    free(index);
+    munmap(mem, vm_mem_bytes(memsize));
+    return err;
+}
+
+int checkpoint_load(struct vm_snapshot * snap, const char * path)
+{
+    struct checkpoint_header hdr;
+    struct stat st;
+    const char * file = MAP_FAILED;
+    const uint32_t * index;
+    size_t meta;
+    uint32_t page;
+    int fd, err = 1;
+
+    snap->fd = -1;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(hdr))
+        goto out;
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED)
+        goto out;
+
+    err = 2;
+    memcpy(&hdr, file, sizeof(hdr));
+    meta = sizeof(hdr) + (size_t)hdr.npages * sizeof(uint32_t);
+#if VM_VECTOR == 1
+    meta += sizeof(snap->state.vregs);
+#endif
+    if (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic))
+        || hdr.version != CHECKPOINT_VERSION
+        || hdr.page_words != CHECKPOINT_PAGE_WORDS
+        || hdr.vector != VM_VECTOR
+        || hdr.memsize <= 0
+        || hdr.npages > ((uint32_t)hdr.memsize + CHECKPOINT_PAGE_WORDS - 1) / CHECKPOINT_PAGE_WORDS
+        || hdr.data_offset < meta
+        || hdr.data_offset > (uint64_t)st.st_size
+        || (uint64_t)hdr.npages * PAGE_BYTES > (uint64_t)st.st_size - hdr.data_offset) {
+        goto out;
+    }
+
+    state_from_header(&snap->state, &hdr);
+#if VM_VECTOR == 1
+    memcpy(snap->state.vregs, file + sizeof(hdr), sizeof(snap->state.vregs));
+    index = (const uint32_t *)(file + sizeof(hdr) + sizeof(snap->state.vregs));
+#else
+    index = (const uint32_t *)(file + sizeof(hdr));
+#endif
+
+    err = 1;
+    snap->fd = memfd_create("pttk91-snapshot", MFD_CLOEXEC);
+    if (snap->fd < 0 || ftruncate(snap->fd, vm_mem_bytes(hdr.memsize)))
+        goto out;
+    for (page = 0; page < hdr.npages; page++) {
+        if (index[page] >= ((uint32_t)hdr.memsize + CHECKPOINT_PAGE_WORDS - 1)
+                           / CHECKPOINT_PAGE_WORDS) {
+            err = 2;
+            goto out;
+        }
+        if (write_all(snap->fd, file + hdr.data_offset + (size_t)page * PAGE_BYTES,
+                      page_words(hdr.memsize, index[page]) * sizeof(uint32_t),
+                      (off_t)index[page] * PAGE_BYTES)) {
+            goto out;
+        }
+    }
+    err = 0;
+
+out:
+    if (err && snap->fd >= 0)
+        vm_snapshot_free(snap);
+    if (file != MAP_FAILED)
+        munmap((void *)file, st.st_size);
+    close(fd);
+    return err;
+}
@@ -9,8 +9,6 @@
 #include <stdio.h>
 #include "inp.h"
 
-#define INP_KBD 0x1
-
 int inp_handler(int device, int * ret_val)
 {
     int ch, err;
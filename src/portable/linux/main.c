@@ -8,30 +8,528 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include "vm.h"
+#include "mem.h"
+#include "debug.h"
+#include "watch.h"
+#include "smp.h"
+#include "symtab.h"
+#include "trace.h"
+#include "program.h"
+#include "fuse.h"
+#include "aot.h"
 #include "b91loader.h"
+#include "batch.h"
+#include "server.h"
+#include "checkpoint.h"
+#include "footprint.h"
+#include "channel.h"
+#include "metrics.h"
+
+/* VM stopped by SIGINT when checkpointing */
+static struct vm_state * volatile stop_state;
+static volatile sig_atomic_t stopped;
+
+/* Metrics published with -M */
+static struct metrics_shm * metrics;
+static const char * metrics_name;
+
+static void print_watch_hit(const struct watch_hit * hit, void * arg)
+{
+    const struct symtab * symtab = (const struct symtab *)arg;
+    const char * name = "";
+    int i;
+
+    for (i = 0; i < symtab->count; i++) {
+        if (symtab->syms[i].value == hit->addr) {
+            name = symtab->syms[i].name;
+            break;
+        }
+    }
+
+    printf("=== Watch %i %s: pc = %i, old = %i, new = %i ===\n",
+           hit->addr, name, hit->pc,
+           (int)hit->old_value, (int)hit->new_value);
+}
+
+/**
+ * Add a watchpoint given as sym[:len] or addr[:len].
+ */
+static int add_watch(struct watch_state * ws, const struct symtab * symtab, const char * arg)
+{
+    char name[SYMTAB_NAME_MAX];
+    const struct symbol * sym;
+    const char * len_str;
+    int addr, len = 1;
+
+    len_str = strchr(arg, ':');
+    if (len_str) {
+        len = atoi(len_str + 1);
+    } else {
+        len_str = arg + strlen(arg);
+    }
+    if (len_str - arg >= SYMTAB_NAME_MAX)
+        return 1;
+    memcpy(name, arg, len_str - arg);
+    name[len_str - arg] = '\0';
+
+    if (isdigit((unsigned char)name[0])) {
+        addr = atoi(name);
+    } else {
+        sym = symtab_find(symtab, name);
+        if (!sym)
+            return 1;
+        addr = sym->value;
+    }
+
+    return watch_add(ws, addr, len);
+}
+
+/**
+ * Translate a program to a C file.
+ * Symbols of the generated file are prefixed with the base name of the
+ * program file.
+ * @return 0 if no error.
+ */
+static int translate(const struct program * prog, const char * file_name,
+                     const char * out_name)
+{
+    char name[SYMTAB_NAME_MAX];
+    const char * p;
+    FILE * out;
+    size_t i;
+    int retval;
+
+    p = strrchr(file_name, '/');
+    p = (p) ? p + 1 : file_name;
+    for (i = 0; i < sizeof(name) - 1 && p[i] != '\0' && p[i] != '.'; i++) {
+        name[i] = (isalnum((unsigned char)p[i])) ? p[i] : '_';
+    }
+    name[i] = '\0';
+    if (i == 0 || isdigit((unsigned char)name[0]))
+        strcpy(name, "prog");
+
+    out = fopen(out_name, "w");
+    if (!out)
+        return 1;
+    retval = aot_translate(out, prog->image, prog->image_size, prog->code_size, name);
+    if (fclose(out) || retval < 0)
+        return 1;
+
+    printf("Translated %s to %s, %i of %i instructions interpreted\n",
+           file_name, out_name, retval, prog->code_size);
+    return 0;
+}
+
+/**
+ * Print the static memory footprint of a program.
+ * @return 0 if no error.
+ */
+static int analyze(const struct program * prog)
+{
+    struct footprint fp;
+
+    if (footprint_analyze(prog->image, prog->code_size, prog->image_size, &fp)) {
+        fprintf(stderr, "Can't allocate memory for the analysis.\n");
+        return 2;
+    }
+
+    printf("Code:           %i words\n", fp.code_size);
+    printf("Data:           %i words\n", fp.data_size);
+    printf("Max direct:     %i\n", fp.max_direct);
+    if (fp.stack_depth == FOOTPRINT_UNBOUNDED) {
+        printf("Stack depth:    unbounded at pc = %i (%s%s%s%s)\n", fp.unbounded_pc,
+               (fp.unbounded & FOOTPRINT_RECURSION) ? " recursion" : "",
+               (fp.unbounded & FOOTPRINT_INDIRECT) ? " indirect" : "",
+               (fp.unbounded & FOOTPRINT_SP_WRITE) ? " sp-write" : "",
+               (fp.unbounded & FOOTPRINT_UNBALANCED) ? " unbalanced" : "");
+        printf("Memory:         unbounded\n");
+    } else {
+        printf("Stack depth:    %i words\n", fp.stack_depth);
+        printf("Memory:         %i words\n", fp.memsize);
+    }
+    return 0;
+}
+
+/**
+ * Serve on a socket until SIGINT or SIGTERM.
+ * @return 0 if no error.
+ */
+static int run_server(struct program_cache * programs, const char * path,
+                      int threads, int memsize)
+{
+    struct server * srv;
+    sigset_t set;
+    int sig;
+
+    /* Signals are only taken by sigwait() */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    srv = server_start(programs, path, threads, memsize, metrics);
+    if (!srv) {
+        fprintf(stderr, "Can't listen on %s.\n", path);
+        return 2;
+    }
+    printf("=== Listening on %s ===\n", path);
+    fflush(stdout);
+
+    sigwait(&set, &sig);
+    server_stop(srv);
+    return 0;
+}
+
+/**
+ * Run a program on a server with the values read from stdin as input.
+ * @return 0 if no error.
+ */
+static int call_server(const char * path, const struct program * prog)
+{
+    struct server_result res;
+    int * input = NULL;
+    int * p;
+    int value, input_len = 0, size = 0;
+    int retval;
+
+    while (scanf("%i", &value) == 1) {
+        if (input_len == size) {
+            size = (size) ? 2 * size : 16;
+            p = realloc(input, size * sizeof(int));
+            if (!p) {
+                free(input);
+                fprintf(stderr, "Can't allocate memory for the input.\n");
+                return 2;
+            }
+            input = p;
+        }
+        input[input_len++] = value;
+    }
+
+    printf("=== Run ===\n");
+    retval = server_call(path, prog, input, input_len, NULL, &res);
+    free(input);
+    if (retval) {
+        fprintf(stderr, "Can't run on the server %s.\n", path);
+        return retval;
+    }
+
+    printf("=== %s: error %i, %llu instructions, %llu us ===\n",
+           (res.stop == VM_STOP_HALT) ? "Halt" : "Error", res.error,
+           (unsigned long long)res.count, (unsigned long long)res.wall_us);
+    return 0;
+}
+
+static void stop_on_signal(int sig)
+{
+    stopped = 1;
+    if (stop_state)
+        stop_state->running = 0;
+}
+
+/**
+ * Stop a vm on SIGINT instead of terminating.
+ */
+static void stop_on_sigint(struct vm_state * state)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_on_signal;
+    sigemptyset(&sa.sa_mask);
+    stop_state = state;
+    sigaction(SIGINT, &sa, NULL);
+}
+
+/**
+ * Save a checkpoint of a vm stopped by SIGINT.
+ * @return 0 if no error.
+ */
+static int save_checkpoint(const struct vm_state * state, const uint32_t * mem,
+                           const char * path)
+{
+    struct vm_snapshot snap;
+    int retval;
+
+    if (!stopped)
+        return 0;
+    if (vm_snapshot(&snap, state, mem)) {
+        fprintf(stderr, "Can't allocate memory for the checkpoint.\n");
+        return 2;
+    }
+    retval = checkpoint_save(&snap, path);
+    vm_snapshot_free(&snap);
+    if (retval) {
+        fprintf(stderr, "Can't save the checkpoint to %s.\n", path);
+        return 1;
+    }
+
+    printf("=== Checkpoint saved to %s at pc = %i ===\n", path, state->pc);
+    return 0;
+}
+
+/**
+ * Resume a vm from a checkpoint.
+ * @param save_path where to save a new checkpoint on SIGINT or NULL.
+ * @return 0 if no error.
+ */
+static int resume(const char * path, const char * save_path)
+{
+    struct vm_snapshot snap;
+    struct vm_state state;
+    uint32_t * mem;
+    int retval = 0;
+
+    if (checkpoint_load(&snap, path)) {
+        fprintf(stderr, "Can't load the checkpoint %s.\n", path);
+        return 3;
+    }
+    mem = vm_fork(&snap, &state);
+    vm_snapshot_free(&snap);
+    if (!mem) {
+        fprintf(stderr, "Can't allocate memory for the VM.\n");
+        return 2;
+    }
+
+    if (save_path)
+        stop_on_sigint(&state);
+    printf("=== Resume at pc = %i ===\n", state.pc);
+    state.running = 1;
+    vm_run(&state, mem);
+    if (save_path)
+        retval = save_checkpoint(&state, mem, save_path);
+
+    vm_mem_free(mem, state.memsize);
+    return retval;
+}
+
+/**
+ * Run a pipeline of programs, the output of each program is the input of the
+ * next one.
+ * @return 0 if no error.
+ */
+static int pipeline(struct program_cache * programs, const char ** files, int n,
+                    int memsize)
+{
+    struct program * prog[CHANNEL_MAX_STAGES];
+    struct vm_state state[CHANNEL_MAX_STAGES];
+    uint32_t * mem[CHANNEL_MAX_STAGES];
+    int size[CHANNEL_MAX_STAGES];
+    struct channel_stage stage[CHANNEL_MAX_STAGES];
+    struct channel ch[CHANNEL_MAX_STAGES - 1];
+    int loaded, mapped = 0, channels = 0;
+    int i, retval = 0;
+
+    for (loaded = 0; loaded < n; loaded++) {
+        prog[loaded] = program_load(programs, memsize, NULL, files[loaded]);
+        if (!prog[loaded]) {
+            fprintf(stderr, "Error while loading a program file %s.\n", files[loaded]);
+            retval = 3;
+            goto out;
+        }
+    }
+
+    for (mapped = 0; mapped < n; mapped++) {
+        size[mapped] = program_memsize(prog[mapped], memsize);
+        mem[mapped] = vm_mem_alloc(size[mapped]);
+        if (!mem[mapped])
+            break;
+        if (program_map(prog[mapped], mem[mapped], size[mapped])) {
+            vm_mem_free(mem[mapped], size[mapped]);
+            break;
+        }
+        vm_init_state(&state[mapped], prog[mapped]->code_size, size[mapped]);
+        state[mapped].code = prog[mapped]->code;
+    }
+    for (channels = 0; channels < n - 1; channels++) {
+        if (channel_init(&ch[channels], CHANNEL_SIZE)) {
+            channel_free(&ch[channels]);
+            break;
+        }
+    }
+    if (mapped < n || channels < n - 1) {
+        fprintf(stderr, "Can't allocate memory for the VM.\n");
+        retval = 2;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        stage[i].state = &state[i];
+        stage[i].mem = mem[i];
+        channel_port_init(&stage[i].port, (i > 0) ? &ch[i - 1] : NULL,
+                          (i < n - 1) ? &ch[i] : NULL);
+        state[i].io = &stage[i].port.io;
+    }
+
+    printf("=== Run ===\n");
+    if (channel_run(stage, n, metrics)) {
+        fprintf(stderr, "Can't start the pipeline.\n");
+        retval = 2;
+    }
+
+out:
+    for (i = 0; i < channels; i++)
+        channel_free(&ch[i]);
+    for (i = 0; i < mapped; i++)
+        vm_mem_free(mem[i], size[i]);
+    for (i = 0; i < loaded; i++)
+        program_put(programs, prog[i]);
+    return retval;
+}
+
+static void remove_metrics(void)
+{
+    metrics_destroy(metrics, metrics_name);
+}
+
+/**
+ * Print the metrics of a running VM.
+ * @return 0 if no error.
+ */
+static int export_metrics(const char * name)
+{
+    const struct metrics_shm * shm;
+
+    shm = metrics_attach(name);
+    if (!shm) {
+        fprintf(stderr, "Can't read the metrics %s.\n", name);
+        return 1;
+    }
+    metrics_export(shm, stdout);
+    metrics_detach(shm);
+    return 0;
+}
 
 int main(int argc, const char * argv[])
 {
     uint32_t * mem;
-    int memsize = 1024;
-    int code_size;
+    int memsize = PROGRAM_MEMSIZE_DEFAULT;
+    struct program_cache programs;
+    struct program * prog;
     struct vm_state state;
+    struct dbg_state dbg;
+    int bkpts[DBG_MAX_BREAKPOINTS];
+    int bkpt_count = 0;
+    struct watch_state ws;
+    const char * watches[WATCH_MAX];
+    int watch_count = 0;
+    struct symtab symtab;
+    struct trace trace;
+    const char * trace_file = NULL;
+    int trace_mode = 0;
+    struct fuse_profile * profile = NULL;
+    const char * profile_file = NULL;
+    const char * fuse_file = NULL;
+    const char * aot_file = NULL;
+    const char * b91_file = NULL;
+    const char * batch_source = NULL;
+    const char * server_path = NULL;
+    const char * client_path = NULL;
+    const char * checkpoint_file = NULL;
+    const char * resume_file = NULL;
+    const char * stages[CHANNEL_MAX_STAGES];
+    int stage_count = 1;
+    int threads = 0;
+    int optimize = 0;
+    int footprint = 0;
 
     char * file_name = NULL;
-    int c;
+    int c, i;
 
     opterr = 0;
-    while ((c = getopt(argc, (char * const*)argv, "f:m:")) != -1) {
+    while ((c = getopt(argc, (char * const*)argv, "ab:B:c:E:f:F:j:k:K:Lm:M:o:Op:P:r:s:S:t:w:")) != -1) {
         switch (c) {
+        case 'a': /* Analyze the memory footprint */
+            footprint = 1;
+            break;
+        case 'b': /* Breakpoint address */
+            if (bkpt_count >= DBG_MAX_BREAKPOINTS) {
+                fprintf(stderr, "Too many breakpoints.\n");
+                exit(1);
+            }
+            bkpts[bkpt_count++] = atoi(optarg);
+            break;
+        case 'B': /* Batch of jobs */
+            batch_source = optarg;
+            break;
+        case 'c': /* Translate to C */
+            aot_file = optarg;
+            break;
+        case 'E': /* Export the metrics of a running VM */
+            return export_metrics(optarg);
         case 'f': /* File name */
             file_name = optarg;
             break;
+        case 'F': /* Fuse instructions using a profile */
+            fuse_file = optarg;
+            break;
+        case 'j': /* Number of threads in batch mode */
+            threads = atoi(optarg);
+            break;
+        case 'k': /* Checkpoint on SIGINT */
+            checkpoint_file = optarg;
+            break;
+        case 'K': /* Resume from a checkpoint */
+            resume_file = optarg;
+            break;
         case 'm': /* Amount of memory to be allocated */
-            memsize = atoi(optarg);
+            if (strcmp(optarg, "auto") == 0)
+                memsize = PROGRAM_MEMSIZE_AUTO;
+            else if ((memsize = atoi(optarg)) <= 0)
+                memsize = -1;
+            break;
+        case 'L': /* Execute loop idioms on the host */
+            optimize |= PROGRAM_LOOPS;
+            break;
+        case 'M': /* Publish metrics */
+            metrics_name = optarg;
+            break;
+        case 'o': /* Write the program to a b91 file */
+            b91_file = optarg;
+            break;
+        case 'O': /* Optimize */
+            optimize |= PROGRAM_PEEPHOLE;
+            break;
+        case 'p': /* Record an opcode pair profile */
+#if VM_PROFILE == 1
+            profile_file = optarg;
+#else
+            fprintf(stderr, "Profiling is not enabled in this build.\n");
+            exit(1);
+#endif
+            break;
+        case 'P': /* Pipe the output to the next program */
+            if (stage_count >= CHANNEL_MAX_STAGES) {
+                fprintf(stderr, "Too many programs in the pipeline.\n");
+                exit(1);
+            }
+            stages[stage_count++] = optarg;
+            break;
+        case 's': /* Run on a server */
+            client_path = optarg;
+            break;
+        case 'S': /* Serve on a socket */
+            server_path = optarg;
+            break;
+        case 'r': /* Replay a trace */
+        case 't': /* Record a trace */
+            trace_file = optarg;
+            trace_mode = (c == 'r') ? TRACE_REPLAY : TRACE_RECORD;
+            break;
+        case 'w': /* Watchpoint */
+            if (watch_count >= WATCH_MAX) {
+                fprintf(stderr, "Too many watchpoints.\n");
+                exit(1);
+            }
+            watches[watch_count++] = optarg;
             break;
         case '?':
             if (optopt == 'c')
@@ -46,22 +544,251 @@ int main(int argc, const char * argv[])
         }
     }
 
-    mem = (uint32_t *)malloc(memsize);
-    if (mem == NULL) {
+    if (memsize < 0 || program_cache_init(&programs)) {
         fprintf(stderr, "Can't allocate memory for the VM.\n");
         exit(2);
     }
 
-    if (b91_loader_read_file(mem, memsize, &code_size, file_name)) {
-        fprintf(stderr, "Error while loading a b91 binary file.\n");
-        free(mem);
+    if (metrics_name && !batch_source && !server_path && stage_count == 1) {
+        fprintf(stderr, "Metrics are published in batch, server and pipeline modes.\n");
+        exit(1);
+    }
+    if (metrics_name) {
+        metrics = metrics_create(metrics_name, METRICS_MAX_WORKERS);
+        if (!metrics && errno == EEXIST) {
+            fprintf(stderr, "The metrics %s already exist, another VM uses them or /dev/shm/%s is stale.\n",
+                    metrics_name, metrics_name + (metrics_name[0] == '/'));
+            exit(1);
+        } else if (!metrics) {
+            fprintf(stderr, "Can't create the metrics %s.\n", metrics_name);
+            exit(1);
+        }
+        atexit(remove_metrics);
+    }
+
+    if (profile_file || fuse_file) {
+        profile = malloc(sizeof(struct fuse_profile));
+        if (!profile) {
+            fprintf(stderr, "Can't allocate memory for the VM.\n");
+            exit(2);
+        }
+        fuse_profile_init(profile);
+    }
+    if (fuse_file) {
+        if (fuse_profile_load(profile, fuse_file)) {
+            fprintf(stderr, "Invalid profile %s.\n", fuse_file);
+            exit(1);
+        }
+        programs.profile = profile;
+    }
+
+    if (optimize && trace_mode) {
+        fprintf(stderr, "Optimization is disabled when tracing.\n");
+    } else if (optimize) {
+        programs.flags |= optimize;
+    }
+
+    if ((batch_source || server_path || client_path)
+        && (bkpt_count || watch_count || trace_mode || profile_file || aot_file || b91_file
+            || footprint || (file_name && !client_path))) {
+        fprintf(stderr, "Option not supported in batch or server mode.\n");
+        exit(1);
+    }
+    if (resume_file
+        && (batch_source || server_path || client_path || file_name || bkpt_count
+            || watch_count || trace_mode || profile_file || aot_file || b91_file || footprint)) {
+        fprintf(stderr, "Option not supported when resuming a checkpoint.\n");
+        exit(1);
+    }
+
+    if (stage_count > 1
+        && (batch_source || server_path || client_path || resume_file || !file_name
+            || bkpt_count || watch_count || trace_mode || profile_file || aot_file
+            || b91_file || footprint || checkpoint_file)) {
+        fprintf(stderr, "Option not supported in a pipeline.\n");
+        exit(1);
+    }
+
+    if (stage_count > 1) {
+        stages[0] = file_name;
+        i = pipeline(&programs, stages, stage_count, memsize);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (batch_source) {
+        i = batch_run(&programs, batch_source, threads, memsize, stdout, metrics);
+        if (i == 1)
+            fprintf(stderr, "Can't read the batch %s.\n", batch_source);
+        else if (i)
+            fprintf(stderr, "Can't allocate memory for the batch.\n");
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (resume_file) {
+        i = resume(resume_file, checkpoint_file);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (server_path) {
+        i = run_server(&programs, server_path, threads, memsize);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+    if (client_path) {
+        /* The server decodes the program */
+        programs.flags = 0;
+    }
+
+    symtab_init(&symtab);
+    prog = program_load(&programs, memsize, &symtab, file_name);
+    if (!prog) {
+        fprintf(stderr, "Error while loading a program file.\n");
         exit(3);
     }
 
-    vm_init_state(&state, code_size, memsize);
+    if (footprint) {
+        i = analyze(prog);
+        symtab_free(&symtab);
+        program_put(&programs, prog);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (b91_file) {
+        i = b91_write(prog->image, prog->code_size, prog->image_size, &symtab, b91_file);
+        symtab_free(&symtab);
+        program_put(&programs, prog);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (aot_file) {
+        i = translate(prog, file_name, aot_file);
+        if (i)
+            fprintf(stderr, "Can't translate to %s.\n", aot_file);
+        symtab_free(&symtab);
+        program_put(&programs, prog);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if (client_path) {
+        i = call_server(client_path, prog);
+        symtab_free(&symtab);
+        program_put(&programs, prog);
+        program_cache_free(&programs);
+        free(profile);
+        return i;
+    }
+
+    if ((programs.flags & PROGRAM_PEEPHOLE) && prog->code) {
+        printf("Optimized: %i instructions removed, %i jumps retargeted\n",
+               prog->code->removed, prog->code->threaded);
+    }
+
+    /* memsize is given in words */
+    if (memsize == PROGRAM_MEMSIZE_AUTO) {
+        memsize = program_memsize(prog, memsize);
+        printf("Memory: %i words%s\n", memsize, (prog->memsize) ? "" : ", stack unbounded");
+    }
+    mem = vm_mem_alloc(memsize);
+    if (mem == NULL || program_map(prog, mem, memsize)) {
+        fprintf(stderr, "Can't allocate memory for the VM.\n");
+        exit(2);
+    }
+
+    vm_init_state(&state, prog->code_size, memsize);
+    if (profile_file) {
+        /* Profile the undecoded instruction stream */
+        state.profile = profile;
+    } else {
+        state.code = prog->code;
+    }
+    /* Writes of other CPUs would not be reported to watchpoints */
+    if (!watch_count && smp_init(&state, mem)) {
+        fprintf(stderr, "Can't allocate memory for the VM.\n");
+        exit(2);
+    }
+
+    if (watch_count && watch_init(&ws, &state, mem)) {
+        fprintf(stderr, "Can't initialize watchpoints.\n");
+        watch_count = 0;
+    }
+    for (i = 0; i < watch_count; i++) {
+        if (add_watch(&ws, &symtab, watches[i])) {
+            fprintf(stderr, "Invalid watchpoint %s.\n", watches[i]);
+        }
+    }
+
+    dbg_init(&dbg);
+    for (i = 0; i < bkpt_count; i++) {
+        if (dbg_break_set(&dbg, &state, mem, bkpts[i])) {
+            fprintf(stderr, "Invalid breakpoint address %i.\n", bkpts[i]);
+        }
+    }
+
+    if (trace_mode) {
+        if ((trace_mode == TRACE_RECORD) ? trace_open_record(&trace, trace_file)
+                                         : trace_open_replay(&trace, trace_file)) {
+            vm_mem_free(mem, memsize);
+            exit(4);
+        }
+        state.trace = &trace;
+    }
+    if (checkpoint_file)
+        stop_on_sigint(&state);
+
     printf("=== Run ===\n");
-    vm_run(&state, mem);
+    while (1) {
+        if (watch_count) {
+            watch_run(&ws, print_watch_hit, &symtab);
+        } else {
+            vm_run(&state, mem);
+        }
+        if (state.stop != VM_STOP_BREAKPOINT)
+            break;
+
+        printf("=== Breakpoint at %i ===\n", state.pc);
+        vm_show_regs(&state);
+
+        /* Step over the trap and continue, watchpoints need watch_run() */
+        state.running = 1;
+        if (dbg_step(&dbg, &state, mem) || !state.running)
+            break;
+    }
+
+    if (checkpoint_file)
+        save_checkpoint(&state, mem, checkpoint_file);
+    smp_free(&state);
+    if (trace_mode && trace_close(&trace, &state)) {
+        fprintf(stderr, "Replay diverged from the trace.\n");
+    }
+    if (watch_count)
+        watch_deinit(&ws);
+    dbg_deinit(&dbg);
+    symtab_free(&symtab);
+    if (profile_file && fuse_profile_save(profile, profile_file)) {
+        fprintf(stderr, "Can't save the profile to %s.\n", profile_file);
+    }
+    free(profile);
 
-    free(mem);
+#if VM_DEBUG == 1
+    printf("Committed memory: %lu of %lu bytes\n",
+           (unsigned long)vm_mem_committed(mem, memsize),
+           (unsigned long)memsize * sizeof(uint32_t));
+#endif
+    vm_mem_free(mem, memsize);
+    program_put(&programs, prog);
+    program_cache_free(&programs);
     return 0;
 }
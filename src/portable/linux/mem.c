@@ -0,0 +1,75 @@
+/**
+ *******************************************************************************
+ * @file    mem.c
+ * @author  Olli Vanhoja
+ * @brief   VM memory allocation for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mem.h"
+
+size_t vm_mem_bytes(int memsize)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    return ((size_t)memsize * sizeof(uint32_t) + page_size - 1) / page_size * page_size;
+}
+
+uint32_t * vm_mem_alloc(int memsize)
+{
+    void * mem;
+
+    if (memsize <= 0)
+        return NULL;
+
+    /* Anonymous private mappings are committed and zero-filled by the
+     * kernel on the first touch of each page. */
+    mem = mmap(NULL, vm_mem_bytes(memsize), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    return (uint32_t *)mem;
+}
+
+void vm_mem_free(uint32_t * mem, int memsize)
+{
+    if (mem)
+        munmap(mem, vm_mem_bytes(memsize));
+}
+
+void vm_mem_discard(uint32_t * mem, int first, int len)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t start = (size_t)first * sizeof(uint32_t);
+    const size_t end = (size_t)(first + len) * sizeof(uint32_t) / page_size * page_size;
+
+    /* Partial pages at the end are kept */
+    if (end > start)
+        madvise((char *)mem + start, end - start, MADV_DONTNEED);
+}
+
+size_t vm_mem_committed(const uint32_t * mem, int memsize)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t npages = vm_mem_bytes(memsize) / page_size;
+    unsigned char * vec;
+    size_t i, committed = 0;
+
+    vec = malloc(npages);
+    if (!vec || mincore((void *)mem, npages * page_size, vec)) {
+        free(vec);
+        return 0;
+    }
+
+    for (i = 0; i < npages; i++) {
+        if (vec[i] & 1)
+            committed += page_size;
+    }
+    free(vec);
+
+    return committed;
+}
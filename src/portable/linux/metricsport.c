@@ -0,0 +1,118 @@
+/**
+ *******************************************************************************
+ * @file    metricsport.c
+ * @author  Olli Vanhoja
+ * @brief   Shared memory segment of metrics on Linux.
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+/**
+ * Get the POSIX shared memory object name of a segment.
+ * @return 0 if no error.
+ */
+static int shm_name(char * buf, size_t size, const char * name)
+{
+    int n;
+
+    n = snprintf(buf, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+    return (n < 0 || (size_t)n >= size || strchr(buf + 1, '/'));
+}
+
+static size_t shm_bytes(uint32_t max_workers)
+{
+    return sizeof(struct metrics_shm) + max_workers * sizeof(union metrics_slot);
+}
+
+struct metrics_shm * metrics_create(const char * name, int max_workers)
+{
+    struct metrics_shm * shm;
+    char path[256];
+    size_t size;
+    int fd;
+
+    if (max_workers <= 0 || max_workers > METRICS_MAX_WORKERS
+        || shm_name(path, sizeof(path), name))
+        return NULL;
+    size = shm_bytes(max_workers);
+
+    /* Never take over the segment of another VM */
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size)) {
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        shm_unlink(path);
+        return NULL;
+    }
+
+    /* The segment is zeroed, the magic is written last */
+    shm->version = METRICS_VERSION;
+    shm->max_workers = max_workers;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shm->magic, METRICS_MAGIC, sizeof(shm->magic));
+
+    return shm;
+}
+
+void metrics_destroy(struct metrics_shm * shm, const char * name)
+{
+    char path[256];
+
+    if (!shm)
+        return;
+    munmap(shm, shm_bytes(shm->max_workers));
+    if (!shm_name(path, sizeof(path), name))
+        shm_unlink(path);
+}
+
+const struct metrics_shm * metrics_attach(const char * name)
+{
+    struct metrics_shm * shm;
+    struct stat st;
+    char path[256];
+    int fd;
+
+    if (shm_name(path, sizeof(path), name))
+        return NULL;
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct metrics_shm)) {
+        close(fd);
+        return NULL;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+
+    if (memcmp(shm->magic, METRICS_MAGIC, sizeof(shm->magic))
+        || shm->version != METRICS_VERSION
+        || shm->max_workers > METRICS_MAX_WORKERS
+        || shm_bytes(shm->max_workers) > (size_t)st.st_size) {
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+
+    return shm;
+}
+
+void metrics_detach(const struct metrics_shm * shm)
+{
+    if (shm)
+        munmap((void *)shm, shm_bytes(shm->max_workers));
+}
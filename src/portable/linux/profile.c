@@ -0,0 +1,53 @@
+/**
+ *******************************************************************************
+ * @file    profile.c
+ * @author  Olli Vanhoja
+ * @brief   Opcode pair profile files for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include "fuse.h"
+
+int fuse_profile_save(const struct fuse_profile * profile, const char * path)
+{
+    FILE * fp;
+    int i, j;
+
+    fp = fopen(path, "w");
+    if (!fp)
+        return 1;
+
+    for (i = 0; i < FUSE_NUM_OPS; i++) {
+        for (j = 0; j < FUSE_NUM_OPS; j++) {
+            if (profile->pairs[i][j])
+                fprintf(fp, "%02x %02x %u\n", i, j, (unsigned int)profile->pairs[i][j]);
+        }
+    }
+
+    return fclose(fp) != 0;
+}
+
+int fuse_profile_load(struct fuse_profile * profile, const char * path)
+{
+    FILE * fp;
+    unsigned int i, j, count;
+    int retval = 0;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return 1;
+
+    while (fscanf(fp, "%x %x %u", &i, &j, &count) == 3) {
+        if (i >= FUSE_NUM_OPS || j >= FUSE_NUM_OPS) {
+            retval = 1;
+            break;
+        }
+        profile->pairs[i][j] += count;
+    }
+    if (!feof(fp))
+        retval = 1;
+
+    fclose(fp);
+    return retval;
+}
@@ -0,0 +1,269 @@
+/**
+ *******************************************************************************
+ * @file    programport.c
+ * @author  Olli Vanhoja
+ * @brief   Shared programs for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "code.h"
+#include "fuse.h"
+#include "peephole.h"
+#include "loop.h"
+#include "asm.h"
+#include "b91loader.h"
+#include "footprint.h"
+#include "program.h"
+
+/**
+ * Shared copy of a program image.
+ */
+struct program_file {
+    int fd;         /*!< memfd holding the image */
+    size_t len;     /*!< Length of the mapping */
+};
+
+static size_t page_round(size_t len)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    return (len + page_size - 1) / page_size * page_size;
+}
+
+int program_cache_init(struct program_cache * pc)
+{
+    pthread_mutex_t * lock;
+
+    lock = malloc(sizeof(pthread_mutex_t));
+    if (!lock)
+        return 1;
+    pthread_mutex_init(lock, NULL);
+
+    pc->head = NULL;
+    pc->lock = lock;
+    pc->flags = PROGRAM_DECODE | PROGRAM_FUSE;
+    pc->profile = NULL;
+
+    return 0;
+}
+
+static void program_free(struct program * prog)
+{
+    struct program_file * pf = (struct program_file *)prog->port;
+
+    code_free(prog->code);
+    munmap((void *)prog->image, pf->len);
+    close(pf->fd);
+    free(pf);
+    free(prog);
+}
+
+void program_cache_free(struct program_cache * pc)
+{
+    struct program * prog;
+
+    while (pc->head) {
+        prog = pc->head;
+        pc->head = prog->next;
+        program_free(prog);
+    }
+
+    pthread_mutex_destroy((pthread_mutex_t *)pc->lock);
+    free(pc->lock);
+    pc->lock = NULL;
+}
+
+static struct program * program_new(const struct program_cache * pc,
+                                    const uint32_t * image, int image_size,
+                                    int code_size, uint64_t hash)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    struct program * prog;
+    struct program_file * pf;
+    struct footprint fp;
+    uint32_t * copy;
+
+    prog = calloc(1, sizeof(struct program));
+    pf = calloc(1, sizeof(struct program_file));
+    if (!prog || !pf)
+        goto fail;
+
+    pf->len = page_round((size_t)image_size * sizeof(uint32_t));
+    if (pf->len == 0)
+        pf->len = page_size;
+    pf->fd = memfd_create("pttk91-program", MFD_CLOEXEC);
+    if (pf->fd < 0)
+        goto fail;
+    if (ftruncate(pf->fd, pf->len))
+        goto fail_fd;
+
+    copy = mmap(NULL, pf->len, PROT_READ | PROT_WRITE, MAP_SHARED, pf->fd, 0);
+    if (copy == MAP_FAILED)
+        goto fail_fd;
+    memcpy(copy, image, (size_t)image_size * sizeof(uint32_t));
+
+    prog->hash = hash;
+    prog->refcnt = 1;
+    prog->code_size = code_size;
+    prog->image_size = image_size;
+    prog->image = copy;
+    /* Only full pages of code can be shared. The page containing the end of
+     * the code section is copied with the data. */
+    prog->shared_size = (int)((size_t)(code_size + 1) * sizeof(uint32_t)
+                              / page_size * page_size / sizeof(uint32_t));
+    if (prog->shared_size > image_size)
+        prog->shared_size = 0;
+    prog->port = pf;
+    if (code_size <= image_size && !footprint_analyze(image, code_size, image_size, &fp))
+        prog->memsize = fp.memsize;
+
+    /* Running without decoded code is always possible */
+    if ((pc->flags & PROGRAM_DECODE) && code_size <= image_size) {
+        prog->code = code_decode(image, code_size);
+        if (prog->code && (pc->flags & PROGRAM_PEEPHOLE))
+            peephole_code(prog->code);
+        if (prog->code && (pc->flags & PROGRAM_LOOPS))
+            loop_code(prog->code);
+        if (prog->code && (pc->flags & PROGRAM_FUSE))
+            fuse_code(prog->code, pc->profile);
+    }
+
+    return prog;
+
+fail_fd:
+    close(pf->fd);
+fail:
+    free(pf);
+    free(prog);
+    return NULL;
+}
+
+static struct program * find_locked(struct program_cache * pc, uint64_t hash,
+                                    const uint32_t * image, int image_size,
+                                    int code_size)
+{
+    struct program * prog;
+
+    for (prog = pc->head; prog; prog = prog->next) {
+        if (prog->hash != hash)
+            continue;
+        if (image && (prog->image_size != image_size || prog->code_size != code_size
+                      || memcmp(prog->image, image, image_size * sizeof(uint32_t)))) {
+            continue;
+        }
+        prog->refcnt++;
+        return prog;
+    }
+
+    return NULL;
+}
+
+struct program * program_get(struct program_cache * pc, const uint32_t * image,
+                             int image_size, int code_size)
+{
+    const uint64_t hash = program_hash(image, image_size, code_size);
+    struct program * prog;
+
+    pthread_mutex_lock((pthread_mutex_t *)pc->lock);
+    prog = find_locked(pc, hash, image, image_size, code_size);
+    if (!prog) {
+        prog = program_new(pc, image, image_size, code_size, hash);
+        if (prog) {
+            prog->next = pc->head;
+            pc->head = prog;
+        }
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)pc->lock);
+
+    return prog;
+}
+
+struct program * program_find(struct program_cache * pc, uint64_t hash)
+{
+    struct program * prog;
+
+    pthread_mutex_lock((pthread_mutex_t *)pc->lock);
+    prog = find_locked(pc, hash, NULL, 0, 0);
+    pthread_mutex_unlock((pthread_mutex_t *)pc->lock);
+
+    return prog;
+}
+
+void program_put(struct program_cache * pc, struct program * prog)
+{
+    struct program ** pp;
+
+    pthread_mutex_lock((pthread_mutex_t *)pc->lock);
+    if (--prog->refcnt == 0) {
+        for (pp = &(pc->head); *pp; pp = &((*pp)->next)) {
+            if (*pp == prog) {
+                *pp = prog->next;
+                break;
+            }
+        }
+        program_free(prog);
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)pc->lock);
+}
+
+struct program * program_load(struct program_cache * pc, int memsize,
+                              struct symtab * symtab, const char * name)
+{
+    struct program * prog;
+    uint32_t * image;
+    const char * ext;
+    int code_size, image_size;
+    int err;
+
+    if (memsize == PROGRAM_MEMSIZE_AUTO)
+        memsize = FOOTPRINT_LOAD_MAX;
+    image = calloc(memsize, sizeof(uint32_t));
+    if (!image)
+        return NULL;
+
+    ext = strrchr(name, '.');
+    if (ext && strcasecmp(ext, ".k91") == 0) {
+        err = asm_load(image, memsize, &code_size, &image_size, symtab, name);
+    } else {
+        err = b91_loader_load(image, memsize, &code_size, &image_size, symtab, name);
+    }
+    if (err) {
+        free(image);
+        return NULL;
+    }
+
+    prog = program_get(pc, image, image_size, code_size);
+    free(image);
+
+    return prog;
+}
+
+int program_map(const struct program * prog, uint32_t * mem, int memsize)
+{
+    const struct program_file * pf = (const struct program_file *)prog->port;
+    const size_t shared_bytes = (size_t)prog->shared_size * sizeof(uint32_t);
+    void * p;
+
+    if (prog->image_size > memsize)
+        return 1;
+
+    if (shared_bytes > 0) {
+        /* Private file mapping: pages are shared with the other instances
+         * until an instance writes to them. */
+        p = mmap(mem, shared_bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, pf->fd, 0);
+        if (p == MAP_FAILED)
+            return 2;
+    }
+    memcpy(mem + prog->shared_size, prog->image + prog->shared_size,
+           (size_t)(prog->image_size - prog->shared_size) * sizeof(uint32_t));
+
+    return 0;
+}
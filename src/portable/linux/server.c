@@ -0,0 +1,578 @@
+/**
+ *******************************************************************************
+ * @file    server.c
+ * @author  Olli Vanhoja
+ * @brief   VM server on a Unix domain socket for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "inp.h"
+#include "outp.h"
+#include "footprint.h"
+#include "metrics.h"
+#include "server.h"
+
+#define SEP " \t\r\n"
+
+/**
+ * Worker thread of a server.
+ */
+struct server_thread {
+    struct server * srv;
+    pthread_t tid;
+    int fd;                  /*!< Served connection or -1 */
+    struct vm_state * state; /*!< Running job or NULL */
+    struct program_instance inst; /*!< Instance of the last job */
+    struct metrics_worker metrics;
+};
+
+struct server {
+    struct program_cache * pc;
+    int memsize;
+    struct metrics_shm * metrics;
+    int fd;                  /*!< Listening socket */
+    char * path;
+    pthread_t acceptor;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int queue[SERVER_QUEUE_LEN]; /*!< Accepted connections */
+    int head;
+    int len;
+    int done;                /*!< The server is stopping */
+
+    struct program ** progs; /*!< Programs referenced by the server */
+    int nprogs;
+    int progs_size;
+
+    int threads;
+    struct server_thread * thread;
+};
+
+/**
+ * I/O of a job run for a connection.
+ */
+struct conn_io {
+    FILE * out;
+    const int * input;
+    int input_len;
+    int input_pos;
+};
+
+static int conn_in(void * arg, int device, int * value)
+{
+    struct conn_io * cio = (struct conn_io *)arg;
+
+    if (device != INP_KBD || cio->input_pos >= cio->input_len)
+        return 1;
+    *value = cio->input[cio->input_pos++];
+    return 0;
+}
+
+static int conn_out(void * arg, int device, int value)
+{
+    struct conn_io * cio = (struct conn_io *)arg;
+
+    if (device != OUTP_CRT)
+        return 1;
+    /* Stop the job if the client is gone */
+    fprintf(cio->out, "out %i\n", value);
+    return fflush(cio->out) == EOF;
+}
+
+/**
+ * Parse the next number of a request.
+ * @return 0 if no error.
+ */
+static int next_number(char ** save, int base, long long * value)
+{
+    char * tok = strtok_r(NULL, SEP, save);
+    char * end;
+
+    if (!tok)
+        return 1;
+    errno = 0;
+    *value = strtoll(tok, &end, base);
+    return (errno || *end != '\0');
+}
+
+static void handle_load(struct server * srv, FILE * out, char ** save)
+{
+    struct program * prog;
+    uint32_t * image;
+    struct program ** progs;
+    long long code_size, image_size, word;
+    int i;
+
+    if (next_number(save, 0, &code_size) || next_number(save, 0, &image_size)
+        || image_size <= 0
+        || image_size > ((srv->memsize) ? srv->memsize : FOOTPRINT_LOAD_MAX)
+        || code_size < 0 || code_size > image_size) {
+        fprintf(out, "err size\n");
+        return;
+    }
+
+    image = malloc(image_size * sizeof(uint32_t));
+    if (!image) {
+        fprintf(out, "err memory\n");
+        return;
+    }
+    for (i = 0; i < image_size; i++) {
+        if (next_number(save, 0, &word) || word < INT32_MIN || word > UINT32_MAX) {
+            fprintf(out, "err image\n");
+            free(image);
+            return;
+        }
+        image[i] = (uint32_t)word;
+    }
+
+    pthread_mutex_lock(&srv->lock);
+    prog = program_get(srv->pc, image, (int)image_size, (int)code_size);
+    if (prog) {
+        for (i = 0; i < srv->nprogs && srv->progs[i] != prog; i++);
+        if (i < srv->nprogs) {
+            /* Already referenced by the server */
+            program_put(srv->pc, prog);
+        } else if (srv->nprogs < srv->progs_size
+                   || (progs = realloc(srv->progs, 2 * (srv->progs_size + 8)
+                                                   * sizeof(struct program *)))) {
+            if (srv->nprogs == srv->progs_size) {
+                srv->progs = progs;
+                srv->progs_size = 2 * (srv->progs_size + 8);
+            }
+            srv->progs[srv->nprogs++] = prog;
+        } else {
+            program_put(srv->pc, prog);
+            prog = NULL;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    free(image);
+
+    if (prog)
+        fprintf(out, "ok %016" PRIx64 "\n", prog->hash);
+    else
+        fprintf(out, "err memory\n");
+}
+
+static uint64_t elapsed_us(const struct timespec * start, const struct timespec * end)
+{
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000
+           + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void handle_run(struct server_thread * th, FILE * out, char ** save)
+{
+    struct server * srv = th->srv;
+    struct conn_io cio;
+    const struct vm_io io = { conn_in, conn_out, &cio };
+    struct vm_state * state = &th->inst.state;
+    struct timespec start, end;
+    struct metrics_mark mark;
+    struct program * prog;
+    int * input = NULL;
+    int * p;
+    int input_len = 0, size = 0;
+    char * tok, * hash_end;
+    long long value;
+    uint64_t hash;
+    int err = 0;
+
+    tok = strtok_r(NULL, SEP, save);
+    if (tok) {
+        errno = 0;
+        hash = strtoull(tok, &hash_end, 16);
+    }
+    if (!tok || errno || *hash_end != '\0' || *tok == '-') {
+        fprintf(out, "err hash\n");
+        return;
+    }
+
+    while (!next_number(save, 0, &value)) {
+        if (input_len == size) {
+            size = (size) ? 2 * size : 16;
+            p = realloc(input, size * sizeof(int));
+            if (!p) {
+                err = 1;
+                break;
+            }
+            input = p;
+        }
+        input[input_len++] = (int)value;
+    }
+    if (err) {
+        fprintf(out, "err memory\n");
+        free(input);
+        return;
+    }
+
+    prog = program_find(srv->pc, hash);
+    if (!prog) {
+        fprintf(out, "err unknown\n");
+        free(input);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (program_instance_get(&th->inst, prog,
+                             program_memsize(prog, srv->memsize))) {
+        fprintf(out, "err memory\n");
+        program_put(srv->pc, prog);
+        free(input);
+        return;
+    }
+
+    cio.out = out;
+    cio.input = input;
+    cio.input_len = input_len;
+    cio.input_pos = 0;
+    state->io = &io;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->done)
+        state->running = 0;
+    th->state = state;
+    pthread_mutex_unlock(&srv->lock);
+
+    /* Long jobs publish their metrics at the end of every slice */
+    state->slice = METRICS_SLICE;
+    metrics_mark(&mark, state);
+    vm_run(state, th->inst.mem);
+    metrics_account(&th->metrics, state, &mark);
+    metrics_publish(&th->metrics);
+    while (state->stop == VM_STOP_SLICE) {
+        /* server_stop() clears running under the lock */
+        pthread_mutex_lock(&srv->lock);
+        if (srv->done)
+            state->stop = VM_STOP_HALT;
+        else
+            state->running = 1;
+        pthread_mutex_unlock(&srv->lock);
+        if (state->stop != VM_STOP_SLICE)
+            break;
+        vm_run(state, th->inst.mem);
+        metrics_account(&th->metrics, state, &mark);
+        metrics_publish(&th->metrics);
+    }
+    state->slice = 0;
+    state->io = NULL;
+
+    pthread_mutex_lock(&srv->lock);
+    th->state = NULL;
+    pthread_mutex_unlock(&srv->lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fprintf(out, "end %s %i %" PRIu64 " %" PRIu64 "\n",
+            (state->stop == VM_STOP_HALT) ? "halt" : "error", state->error,
+            state->count, elapsed_us(&start, &end));
+
+    program_put(srv->pc, prog);
+    free(input);
+}
+
+/**
+ * Serve the requests of a connection until it's closed.
+ */
+static void serve(struct server_thread * th, int fd)
+{
+    FILE * in, * out;
+    char * line = NULL;
+    char * cmd, * save;
+    size_t size = 0;
+    const struct timeval timeout = { SERVER_IDLE_TIMEOUT, 0 };
+
+    /* Don't let an idle client hold the thread */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    in = fdopen(dup(fd), "r");
+    out = fdopen(dup(fd), "w");
+    if (!in || !out)
+        goto out;
+
+    while (getline(&line, &size, in) != -1) {
+        cmd = strtok_r(line, SEP, &save);
+        if (!cmd)
+            continue;
+        if (strcmp(cmd, "load") == 0)
+            handle_load(th->srv, out, &save);
+        else if (strcmp(cmd, "run") == 0)
+            handle_run(th, out, &save);
+        else
+            fprintf(out, "err request\n");
+        if (fflush(out) == EOF)
+            break;
+    }
+
+out:
+    free(line);
+    if (in)
+        fclose(in);
+    if (out)
+        fclose(out);
+}
+
+static void * server_thread(void * arg)
+{
+    struct server_thread * th = (struct server_thread *)arg;
+    struct server * srv = th->srv;
+    int fd;
+
+    metrics_worker_init(&th->metrics, srv->metrics);
+    while (1) {
+        pthread_mutex_lock(&srv->lock);
+        while (srv->len == 0 && !srv->done)
+            pthread_cond_wait(&srv->not_empty, &srv->lock);
+        if (srv->done) {
+            pthread_mutex_unlock(&srv->lock);
+            program_instance_free(&th->inst);
+            return NULL;
+        }
+        fd = srv->queue[srv->head];
+        srv->head = (srv->head + 1) % SERVER_QUEUE_LEN;
+        srv->len--;
+        th->fd = fd;
+        pthread_cond_signal(&srv->not_full);
+        pthread_mutex_unlock(&srv->lock);
+
+        serve(th, fd);
+
+        pthread_mutex_lock(&srv->lock);
+        th->fd = -1;
+        pthread_mutex_unlock(&srv->lock);
+        close(fd);
+    }
+}
+
+static void * accept_thread(void * arg)
+{
+    struct server * srv = (struct server *)arg;
+    int fd;
+
+    while (1) {
+        fd = accept4(srv->fd, NULL, NULL, SOCK_CLOEXEC);
+
+        pthread_mutex_lock(&srv->lock);
+        while (fd >= 0 && srv->len == SERVER_QUEUE_LEN && !srv->done)
+            pthread_cond_wait(&srv->not_full, &srv->lock);
+        if (srv->done) {
+            pthread_mutex_unlock(&srv->lock);
+            if (fd >= 0)
+                close(fd);
+            return NULL;
+        }
+        if (fd >= 0) {
+            srv->queue[(srv->head + srv->len) % SERVER_QUEUE_LEN] = fd;
+            srv->len++;
+            pthread_cond_signal(&srv->not_empty);
+        }
+        pthread_mutex_unlock(&srv->lock);
+    }
+}
+
+struct server * server_start(struct program_cache * pc, const char * path,
+                             int threads, int memsize, struct metrics_shm * metrics)
+{
+    struct server * srv;
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || memsize < 0)
+        return NULL;
+
+    srv = calloc(1, sizeof(struct server));
+    if (!srv)
+        return NULL;
+    srv->pc = pc;
+    srv->memsize = memsize;
+    srv->metrics = metrics;
+    srv->path = strdup(path);
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    srv->thread = calloc(threads, sizeof(struct server_thread));
+    if (!srv->path || !srv->thread)
+        goto fail;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv->fd < 0)
+        goto fail;
+    unlink(path);
+    if (bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(srv->fd, SERVER_QUEUE_LEN)) {
+        goto fail_fd;
+    }
+
+    /* Writes to closed connections must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->not_empty, NULL);
+    pthread_cond_init(&srv->not_full, NULL);
+    for (i = 0; i < threads; i++) {
+        srv->thread[i].srv = srv;
+        srv->thread[i].fd = -1;
+        if (pthread_create(&srv->thread[i].tid, NULL, server_thread, &srv->thread[i]))
+            break;
+    }
+    srv->threads = i;
+    if (i == 0 || pthread_create(&srv->acceptor, NULL, accept_thread, srv)) {
+        srv->acceptor = pthread_self();
+        server_stop(srv);
+        return NULL;
+    }
+
+    return srv;
+
+fail_fd:
+    close(srv->fd);
+fail:
+    free(srv->thread);
+    free(srv->path);
+    free(srv);
+    return NULL;
+}
+
+void server_stop(struct server * srv)
+{
+    int i;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->done = 1;
+    for (i = 0; i < srv->threads; i++) {
+        if (srv->thread[i].fd >= 0)
+            shutdown(srv->thread[i].fd, SHUT_RDWR);
+        if (srv->thread[i].state)
+            srv->thread[i].state->running = 0;
+    }
+    pthread_cond_broadcast(&srv->not_empty);
+    pthread_cond_broadcast(&srv->not_full);
+    pthread_mutex_unlock(&srv->lock);
+
+    /* Wakes up accept() */
+    shutdown(srv->fd, SHUT_RDWR);
+    if (!pthread_equal(srv->acceptor, pthread_self()))
+        pthread_join(srv->acceptor, NULL);
+    for (i = 0; i < srv->threads; i++)
+        pthread_join(srv->thread[i].tid, NULL);
+
+    for (; srv->len > 0; srv->len--) {
+        close(srv->queue[srv->head]);
+        srv->head = (srv->head + 1) % SERVER_QUEUE_LEN;
+    }
+    for (i = 0; i < srv->nprogs; i++)
+        program_put(srv->pc, srv->progs[i]);
+
+    close(srv->fd);
+    unlink(srv->path);
+    pthread_cond_destroy(&srv->not_full);
+    pthread_cond_destroy(&srv->not_empty);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv->progs);
+    free(srv->thread);
+    free(srv->path);
+    free(srv);
+}
+
+static void send_run(FILE * out, const struct program * prog,
+                     const int * input, int input_len)
+{
+    int i;
+
+    fprintf(out, "run %016" PRIx64, prog->hash);
+    for (i = 0; i < input_len; i++)
+        fprintf(out, " %i", input[i]);
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+int server_call(const char * path, const struct program * prog,
+                const int * input, int input_len, const struct vm_io * io,
+                struct server_result * res)
+{
+    struct sockaddr_un addr;
+    FILE * in = NULL, * out = NULL;
+    char * line = NULL;
+    size_t size = 0;
+    char stop[8];
+    unsigned long long count, wall_us;
+    int fd, i, value, loaded = 0;
+    int retval = 1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return 1;
+    }
+    in = fdopen(fd, "r");
+    out = fdopen(dup(fd), "w");
+    if (!in || !out) {
+        if (!in)
+            close(fd);
+        goto out;
+    }
+
+    send_run(out, prog, input, input_len);
+    while (getline(&line, &size, in) != -1) {
+        if (sscanf(line, "out %i", &value) == 1) {
+            if (io)
+                io->out(io->arg, OUTP_CRT, value);
+            else
+                outp_handler(OUTP_CRT, value);
+        } else if (sscanf(line, "end %7s %i %llu %llu", stop, &res->error,
+                          &count, &wall_us) == 4) {
+            res->stop = (strcmp(stop, "halt") == 0) ? VM_STOP_HALT : VM_STOP_ERROR;
+            res->count = count;
+            res->wall_us = wall_us;
+            retval = 0;
+            break;
+        } else if (strncmp(line, "err unknown", 11) == 0 && !loaded) {
+            /* Send the image and retry */
+            fprintf(out, "load %i %i", prog->code_size, prog->image_size);
+            for (i = 0; i < prog->image_size; i++)
+                fprintf(out, " 0x%08x", prog->image[i]);
+            fprintf(out, "\n");
+            fflush(out);
+            loaded = 1;
+        } else if (strncmp(line, "ok ", 3) == 0 && loaded == 1) {
+            send_run(out, prog, input, input_len);
+            loaded = 2;
+        } else {
+            retval = 2;
+            break;
+        }
+    }
+
+out:
+    free(line);
+    if (in)
+        fclose(in);
+    if (out)
+        fclose(out);
+    return retval;
+}
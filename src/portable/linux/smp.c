@@ -0,0 +1,167 @@
+/**
+ *******************************************************************************
+ * @file    smp.c
+ * @author  Olli Vanhoja
+ * @brief   Virtual CPUs on host threads for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "svc.h"
+#include "smp.h"
+
+#define CPU_FREE    0
+#define CPU_RUNNING 1
+#define CPU_JOINING 2 /*!< Being joined by some CPU */
+
+struct smp_cpu {
+    struct vm_state state;
+    uint32_t * mem;
+    pthread_t thread;
+    int status; /*!< One of CPU_x */
+};
+
+struct smp {
+    pthread_mutex_t lock;
+    uint32_t * mem;
+    struct smp_cpu cpus[SMP_MAX_CPUS];
+};
+
+static void * cpu_thread(void * arg)
+{
+    struct smp_cpu * cpu = (struct smp_cpu *)arg;
+
+    vm_run(&cpu->state, cpu->mem);
+    return NULL;
+}
+
+int smp_init(struct vm_state * boot, uint32_t * mem)
+{
+    struct smp * smp;
+
+    smp = calloc(1, sizeof(struct smp));
+    if (!smp)
+        return 2;
+
+    pthread_mutex_init(&smp->lock, NULL);
+    smp->mem = mem;
+    boot->smp = smp;
+
+    return 0;
+}
+
+void smp_free(struct vm_state * boot)
+{
+    struct smp * smp = boot->smp;
+    struct smp_cpu * cpu;
+    int i;
+
+    if (!smp)
+        return;
+
+    /* Running CPUs may still spawn more CPUs until they are stopped.
+     * CPUs being joined are freed by the CPU joining them. */
+    do {
+        cpu = NULL;
+        pthread_mutex_lock(&smp->lock);
+        for (i = 0; i < SMP_MAX_CPUS; i++) {
+            if (smp->cpus[i].status == CPU_RUNNING) {
+                cpu = &smp->cpus[i];
+                cpu->status = CPU_JOINING;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&smp->lock);
+
+        if (cpu) {
+            cpu->state.running = 0;
+            pthread_join(cpu->thread, NULL);
+            pthread_mutex_lock(&smp->lock);
+            cpu->status = CPU_FREE;
+            pthread_mutex_unlock(&smp->lock);
+        }
+    } while (cpu);
+
+    pthread_mutex_destroy(&smp->lock);
+    free(smp);
+    boot->smp = NULL;
+}
+
+void svc_spawn_fn(struct vm_state * state, uint32_t * mem)
+{
+    struct smp * smp = state->smp;
+    struct smp_cpu * cpu = NULL;
+    int i;
+
+    state->regs[0] = -1;
+    if (!smp)
+        return;
+
+    pthread_mutex_lock(&smp->lock);
+    for (i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp->cpus[i].status == CPU_FREE) {
+            cpu = &smp->cpus[i];
+            break;
+        }
+    }
+    if (!cpu) {
+        pthread_mutex_unlock(&smp->lock);
+        return;
+    }
+
+    vm_init_state(&cpu->state, state->code_sec_end, state->memsize);
+    cpu->state.pc = state->regs[1];
+    cpu->state.regs[1] = state->regs[2];
+    cpu->state.regs[PTTK91_SP] = state->regs[3];
+    cpu->state.regs[PTTK91_FP] = state->regs[3];
+    cpu->state.code = state->code;
+    cpu->state.io = state->io;
+    cpu->state.dirty = state->dirty;
+    cpu->state.mmio = state->mmio;
+    cpu->state.smp = smp;
+    cpu->mem = mem;
+
+    /* Thread creation orders the memory written by the parent before the
+     * first instruction of the new CPU. */
+    if (pthread_create(&cpu->thread, NULL, cpu_thread, cpu) == 0) {
+        cpu->status = CPU_RUNNING;
+        state->regs[0] = i + 1;
+    }
+    pthread_mutex_unlock(&smp->lock);
+}
+
+void svc_join_fn(struct vm_state * state, uint32_t * mem)
+{
+    struct smp * smp = state->smp;
+    struct smp_cpu * cpu;
+    const int id = state->regs[1];
+
+    state->regs[1] = -1;
+    if (!smp || id < 1 || id > SMP_MAX_CPUS)
+        return;
+
+    pthread_mutex_lock(&smp->lock);
+    cpu = &smp->cpus[id - 1];
+    if (cpu->status != CPU_RUNNING || &cpu->state == state) {
+        pthread_mutex_unlock(&smp->lock);
+        return;
+    }
+    cpu->status = CPU_JOINING;
+    pthread_mutex_unlock(&smp->lock);
+
+    pthread_join(cpu->thread, NULL);
+    state->regs[0] = cpu->state.regs[0];
+    switch (cpu->state.stop) {
+    case VM_STOP_HALT:
+    case VM_STOP_ERROR:
+        state->regs[1] = cpu->state.error;
+        break;
+    default:
+        state->regs[1] = -2;
+    }
+
+    pthread_mutex_lock(&smp->lock);
+    cpu->status = CPU_FREE;
+    pthread_mutex_unlock(&smp->lock);
+}
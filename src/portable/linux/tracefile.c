@@ -0,0 +1,166 @@
+/**
+ *******************************************************************************
+ * @file    tracefile.c
+ * @author  Olli Vanhoja
+ * @brief   Trace files for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "trace.h"
+
+#define FLUSH_CHUNK 4096
+
+struct trace_file {
+    FILE * fp;
+    pthread_t flusher;
+    int stop;
+    uint8_t * data; /*!< Replay data */
+};
+
+/**
+ * Background flusher thread.
+ */
+static void * flush_thread(void * arg)
+{
+    struct trace * t = (struct trace *)arg;
+    struct trace_file * tf = (struct trace_file *)t->port;
+    const struct timespec delay = { 0, 1000000 };
+    uint8_t buf[FLUSH_CHUNK];
+    size_t n;
+
+    while (1) {
+        n = trace_ring_read(&(t->ring), buf, sizeof(buf));
+        if (n > 0) {
+            fwrite(buf, 1, n, tf->fp);
+        } else if (__atomic_load_n(&(tf->stop), __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            nanosleep(&delay, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int trace_open_record(struct trace * t, const char * name)
+{
+    struct trace_file * tf;
+
+    tf = calloc(1, sizeof(struct trace_file));
+    if (!tf)
+        return 1;
+
+    tf->fp = fopen(name, "wb");
+    if (!tf->fp) {
+        fprintf(stderr, "Unable to open file %s\n", name);
+        free(tf);
+        return 1;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), tf->fp);
+
+    if (trace_ring_init(&(t->ring), TRACE_RING_SIZE)) {
+        fclose(tf->fp);
+        free(tf);
+        return 1;
+    }
+
+    t->mode = TRACE_RECORD;
+    t->last_pc = 0;
+    t->port = tf;
+
+    if (pthread_create(&(tf->flusher), NULL, flush_thread, t)) {
+        trace_ring_free(&(t->ring));
+        fclose(tf->fp);
+        free(tf);
+        return 1;
+    }
+
+    return 0;
+}
+
+int trace_open_replay(struct trace * t, const char * name)
+{
+    struct trace_file * tf;
+    const size_t magic_len = strlen(TRACE_MAGIC);
+    long len;
+    FILE * fp;
+
+    fp = fopen(name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file %s\n", name);
+        return 1;
+    }
+
+    len = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        len = ftell(fp);
+        if (fseek(fp, 0, SEEK_SET))
+            len = -1;
+    }
+
+    tf = (len >= 0) ? calloc(1, sizeof(struct trace_file)) : NULL;
+    if (tf)
+        tf->data = malloc(len + 1);
+    if (!tf || !tf->data || fread(tf->data, 1, len, fp) != (size_t)len
+        || (size_t)len < magic_len || memcmp(tf->data, TRACE_MAGIC, magic_len)) {
+        fprintf(stderr, "Invalid trace file %s\n", name);
+        if (tf)
+            free(tf->data);
+        free(tf);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    t->mode = TRACE_REPLAY;
+    t->last_pc = 0;
+    t->rbuf = tf->data + magic_len;
+    t->rlen = len - magic_len;
+    t->rpos = 0;
+    t->port = tf;
+
+    if (trace_check(t)) {
+        fprintf(stderr, "Trace %s can't be replayed\n", name);
+        free(tf->data);
+        free(tf);
+        t->port = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+int trace_close(struct trace * t, const struct vm_state * state)
+{
+    struct trace_file * tf = (struct trace_file *)t->port;
+    int error = state->error;
+    int diverged = 0;
+
+    if (t->mode == TRACE_RECORD) {
+        trace_hook(t, TRACE_EV_END, state->pc, state->stop, &error);
+
+        __atomic_store_n(&(tf->stop), 1, __ATOMIC_RELEASE);
+        pthread_join(tf->flusher, NULL);
+        fclose(tf->fp);
+        trace_ring_free(&(t->ring));
+    } else {
+        diverged = trace_hook(t, TRACE_EV_END, state->pc, state->stop, &error);
+        free(tf->data);
+    }
+
+    free(tf);
+    t->port = NULL;
+
+    return diverged;
+}
+
+void trace_port_wait(void)
+{
+    sched_yield();
+}
@@ -0,0 +1,221 @@
+/**
+ *******************************************************************************
+ * @file    watch.c
+ * @author  Olli Vanhoja
+ * @brief   Memory watchpoints for the Linux port of PTTK91.
+ *******************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "watch.h"
+
+/* Watch state of the vm currently run by this thread */
+static __thread struct watch_state * watch_cur;
+static struct sigaction old_action;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+static long page_size;
+
+#define WORDS_PER_PAGE ((int)(page_size / sizeof(uint32_t)))
+
+static int page_watched(const struct watch_state * ws, int page)
+{
+    int i;
+
+    for (i = 0; i < ws->count; i++) {
+        const struct watch_range * r = &(ws->range[i]);
+
+        if (page >= r->addr / WORDS_PER_PAGE
+            && page <= (r->addr + r->len - 1) / WORDS_PER_PAGE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void protect_pages(const struct watch_state * ws, int prot)
+{
+    int page, last = (ws->vm->memsize - 1) / WORDS_PER_PAGE;
+
+    for (page = 0; page <= last; page++) {
+        if (page_watched(ws, page)) {
+            mprotect(ws->mem + page * WORDS_PER_PAGE, page_size, prot);
+        }
+    }
+}
+
+/**
+ * SIGSEGV handler.
+ * Makes the faulting page writable so the instruction can complete and
+ * stops the vm after the current instruction.
+ */
+static void fault_handler(int sig, siginfo_t * si, void * context)
+{
+    struct watch_state * ws = watch_cur;
+    uint32_t * addr = (uint32_t *)si->si_addr;
+    int page;
+
+    /* A watched page faults once until it's protected again, so there is
+     * always room for it. */
+    if (ws && addr >= ws->mem && addr < ws->mem + ws->vm->memsize
+        && ws->npending < ws->max_pending) {
+        page = (int)(addr - ws->mem) / WORDS_PER_PAGE;
+
+        if (page_watched(ws, page)) {
+            uint32_t * page_addr = ws->mem + page * WORDS_PER_PAGE;
+
+            if (ws->npending == 0)
+                ws->pending_pc = ws->vm->pc - 1;
+            memcpy(ws->pending_copy + ws->npending * WORDS_PER_PAGE,
+                   page_addr, page_size);
+            ws->pending_page[ws->npending++] = page;
+            mprotect(page_addr, page_size, PROT_READ | PROT_WRITE);
+
+            /* Keep the reason if the vm was already stopping */
+            if (ws->vm->running)
+                ws->vm->stop = VM_STOP_WATCH;
+            ws->vm->running = 0;
+            return;
+        }
+    }
+
+    /* Not a watchpoint, fault again with the original handler. */
+    sigaction(SIGSEGV, &old_action, NULL);
+}
+
+/**
+ * Report changed watched words on pages written by the last instruction
+ * and write protect the pages again.
+ */
+static void process_pending(struct watch_state * ws, watch_cb_t cb, void * arg)
+{
+    struct watch_hit hit;
+    int i, j, addr, first, last;
+
+    hit.pc = ws->pending_pc;
+    for (i = 0; i < ws->npending; i++) {
+        const int page = ws->pending_page[i];
+        const uint32_t * old = ws->pending_copy + i * WORDS_PER_PAGE;
+
+        for (j = 0; j < ws->count; j++) {
+            first = ws->range[j].addr;
+            last = first + ws->range[j].len - 1;
+            if (first < page * WORDS_PER_PAGE)
+                first = page * WORDS_PER_PAGE;
+            if (last >= (page + 1) * WORDS_PER_PAGE)
+                last = (page + 1) * WORDS_PER_PAGE - 1;
+
+            for (addr = first; addr <= last; addr++) {
+                hit.addr = addr;
+                hit.old_value = old[addr - page * WORDS_PER_PAGE];
+                hit.new_value = ws->mem[addr];
+                if (hit.old_value != hit.new_value && cb)
+                    cb(&hit, arg);
+            }
+        }
+        mprotect(ws->mem + page * WORDS_PER_PAGE, page_size, PROT_READ);
+    }
+    ws->npending = 0;
+}
+
+/**
+ * Install the SIGSEGV handler shared by all watch states.
+ */
+static void install_handler(void)
+{
+    struct sigaction sa;
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &old_action);
+}
+
+int watch_init(struct watch_state * ws, struct vm_state * state, uint32_t * mem)
+{
+    pthread_once(&handler_once, install_handler);
+    if ((uintptr_t)mem % page_size)
+        return 1;
+    if (state->smp)
+        return 2;
+
+    ws->vm = state;
+    ws->mem = mem;
+    ws->count = 0;
+    ws->npending = 0;
+    ws->max_pending = 0;
+    ws->pending_page = NULL;
+    ws->pending_copy = NULL;
+
+    return 0;
+}
+
+void watch_deinit(struct watch_state * ws)
+{
+    free(ws->pending_copy);
+    free(ws->pending_page);
+    ws->pending_copy = NULL;
+    ws->pending_page = NULL;
+    ws->max_pending = 0;
+    ws->count = 0;
+}
+
+int watch_add(struct watch_state * ws, int addr, int len)
+{
+    int pages;
+    int * page;
+    uint32_t * copy;
+
+    if (addr < 0 || len <= 0 || len > ws->vm->memsize - addr)
+        return 1;
+    if (ws->count >= WATCH_MAX)
+        return 2;
+
+    /* Room for the old contents of every page of the range */
+    pages = (addr + len - 1) / WORDS_PER_PAGE - addr / WORDS_PER_PAGE + 1;
+    page = realloc(ws->pending_page, (ws->max_pending + pages) * sizeof(int));
+    if (!page)
+        return 2;
+    ws->pending_page = page;
+    copy = realloc(ws->pending_copy, (size_t)(ws->max_pending + pages) * page_size);
+    if (!copy)
+        return 2;
+    ws->pending_copy = copy;
+    ws->max_pending += pages;
+
+    ws->range[ws->count].addr = addr;
+    ws->range[ws->count].len = len;
+    ws->count++;
+
+    return 0;
+}
+
+int watch_run(struct watch_state * ws, watch_cb_t cb, void * arg)
+{
+    struct watch_state * prev = watch_cur;
+
+    watch_cur = ws;
+    protect_pages(ws, PROT_READ);
+
+    while (1) {
+        vm_run(ws->vm, ws->mem);
+        process_pending(ws, cb, arg);
+        if (ws->vm->stop != VM_STOP_WATCH)
+            break;
+        ws->vm->running = 1;
+    }
+
+    protect_pages(ws, PROT_READ | PROT_WRITE);
+    watch_cur = prev;
+
+    return ws->vm->stop;
+}
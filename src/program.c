@@ -0,0 +1,82 @@
+/**
+ *******************************************************************************
+ * @file    program.c
+ * @author  Olli Vanhoja
+ * @brief   Loaded programs shared between vm instances.
+ *******************************************************************************
+ */
+
+#include "mem.h"
+#include "program.h"
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+/**
+ * FNV-1a hash of the image and the code section boundary.
+ */
+uint64_t program_hash(const uint32_t * image, int image_size, int code_size)
+{
+    uint64_t hash = FNV_OFFSET;
+    int i, j;
+
+    for (i = -1; i < image_size; i++) {
+        uint32_t w = (i < 0) ? (uint32_t)code_size : image[i];
+
+        for (j = 0; j < 4; j++) {
+            hash ^= (w >> (8 * j)) & 0xff;
+            hash *= FNV_PRIME;
+        }
+    }
+
+    return hash;
+}
+
+int program_memsize(const struct program * prog, int memsize)
+{
+    if (memsize != PROGRAM_MEMSIZE_AUTO)
+        return memsize;
+    if (prog->memsize > 0)
+        return prog->memsize;
+    return (prog->image_size > PROGRAM_MEMSIZE_DEFAULT) ? prog->image_size
+                                                         : PROGRAM_MEMSIZE_DEFAULT;
+}
+
+int program_instance_get(struct program_instance * inst, const struct program * prog,
+                         int memsize)
+{
+    if (inst->prog == prog && inst->memsize == memsize) {
+        snapshot_reset(&inst->snap, &inst->state, inst->mem);
+        return 0;
+    }
+
+    program_instance_free(inst);
+    inst->mem = vm_mem_alloc(memsize);
+    if (!inst->mem)
+        return 1;
+    inst->memsize = memsize;
+    if (program_map(prog, inst->mem, memsize)) {
+        program_instance_free(inst);
+        return 1;
+    }
+
+    vm_init_state(&inst->state, prog->code_size, memsize);
+    inst->state.code = prog->code;
+    if (snapshot_init(&inst->snap, &inst->state, inst->mem, prog->image_size)) {
+        program_instance_free(inst);
+        return 1;
+    }
+    inst->prog = prog;
+
+    return 0;
+}
+
+void program_instance_free(struct program_instance * inst)
+{
+    if (inst->prog)
+        snapshot_free(&inst->snap);
+    if (inst->mem)
+        vm_mem_free(inst->mem, inst->memsize);
+    inst->prog = NULL;
+    inst->mem = NULL;
+}
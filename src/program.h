@@ -0,0 +1,146 @@
+/**
+ *******************************************************************************
+ * @file    program.h
+ * @author  Olli Vanhoja
+ * @brief   Loaded programs shared between vm instances.
+ *******************************************************************************
+ */
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "snapshot.h"
+#include "config.h"
+
+struct symtab;
+
+#define PROGRAM_DECODE  0x1 /*!< Pre-decode the code section */
+#define PROGRAM_FUSE    0x2 /*!< Fuse instruction sequences of decoded code */
+#define PROGRAM_PEEPHOLE 0x4 /*!< Peephole optimize decoded code */
+#define PROGRAM_LOOPS   0x8 /*!< Execute loop idioms of decoded code on the host */
+
+#define PROGRAM_MEMSIZE_AUTO    0    /*!< Size the memory by the footprint */
+#define PROGRAM_MEMSIZE_DEFAULT 1024 /*!< Memory size if the footprint is
+                                      *   unbounded */
+
+/**
+ * Loaded program.
+ * A program is a pristine copy of a loaded image identified by its content
+ * hash. The code section is mapped to every instance running the program so
+ * that full code pages are shared and each instance only commits its own
+ * data and stack pages. Caches derived from the code belong to the program.
+ */
+struct program {
+    struct program * next;
+    uint64_t hash;          /*!< Content hash of the image */
+    int refcnt;
+    int code_size;          /*!< End address of the code section */
+    int image_size;         /*!< Size of the image in words */
+    const uint32_t * image; /*!< Pristine image */
+    int shared_size;        /*!< Number of words mapped shared to instances */
+    int memsize;            /*!< Words needed by the program, 0 if unbounded,
+                             *   see footprint.h */
+    struct vm_code * code;  /*!< Decoded code or NULL */
+    void * port;            /*!< Platform specific data */
+};
+
+/**
+ * Cache of loaded programs.
+ */
+struct program_cache {
+    struct program * head;
+    void * lock;
+    int flags;                              /*!< PROGRAM_x flags */
+    const struct fuse_profile * profile;    /*!< Profile used for fusion */
+};
+
+/**
+ * Instance of a program that is reset instead of reloaded between runs.
+ */
+struct program_instance {
+    const struct program * prog; /*!< Loaded program or NULL */
+    uint32_t * mem;
+    int memsize;
+    struct vm_state state;
+    struct snapshot snap;
+};
+
+uint64_t program_hash(const uint32_t * image, int image_size, int code_size);
+
+/**
+ * Get the memory size of an instance of a program.
+ * @param memsize size given by the user or PROGRAM_MEMSIZE_AUTO.
+ * @return memsize or the size needed by the program.
+ */
+int program_memsize(const struct program * prog, int memsize);
+
+/**
+ * Prepare an instance for a run of a program.
+ * If the instance ran the same program last time, only the pages it wrote
+ * are reset, otherwise the program is mapped to new memory. The instance
+ * must be zeroed before its first use and the program must stay referenced
+ * while the instance holds it. inst->state is ready to run, with only the
+ * decoded code of the program set.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int program_instance_get(struct program_instance * inst, const struct program * prog,
+                         int memsize);
+
+/**
+ * Free the memory of an instance.
+ */
+void program_instance_free(struct program_instance * inst);
+
+/* Portable functions */
+int program_cache_init(struct program_cache * pc);
+void program_cache_free(struct program_cache * pc);
+
+/**
+ * Get a program from the cache or add a new one.
+ * @param image loaded image.
+ * @param image_size size of the image in words.
+ * @param code_size end address of the code section.
+ * @return pointer to a referenced program or NULL if out of memory.
+ */
+struct program * program_get(struct program_cache * pc, const uint32_t * image,
+                             int image_size, int code_size);
+
+/**
+ * Load a program from a b91 file or assemble it from a k91 file to the
+ * cache.
+ * @param memsize maximum size of the image in words or PROGRAM_MEMSIZE_AUTO.
+ * @param symtab symbol table where symbols are added, can be NULL.
+ * @return pointer to a referenced program or NULL on error.
+ */
+struct program * program_load(struct program_cache * pc, int memsize,
+                              struct symtab * symtab, const char * name);
+
+/**
+ * Find a program by its content hash.
+ * @return pointer to a referenced program or NULL if not found.
+ */
+struct program * program_find(struct program_cache * pc, uint64_t hash);
+
+/**
+ * Release a reference to a program.
+ */
+void program_put(struct program_cache * pc, struct program * prog);
+
+/**
+ * Map a program to the memory of a vm instance.
+ * Full pages of the code section are mapped copy-on-write from the shared
+ * copy and the rest of the image is copied.
+ * @param mem vm memory allocated with vm_mem_alloc().
+ * @param memsize size of the memory area.
+ * @return 0 if no error; 1 if the image doesn't fit; 2 if mapping failed.
+ */
+int program_map(const struct program * prog, uint32_t * mem, int memsize);
+/* End of portable functions */
+
+#ifndef VM_PLATFORM
+#error Please select VM_PLATFORM
+#endif
+
+#endif /* PROGRAM_H */
@@ -23,6 +23,7 @@
  * + R5
  * + R6 (SP)  Stack Pointer
  * + R7 (FP)  Frame Pointer
+ * + V0..V7   Vector registers of the optional vector extension
  */
 
 #ifndef PTTK91_H
@@ -32,6 +33,8 @@
 #define PTTK91_NUM_REGS     8
 #define PTTK91_SP           6 /*!< Default SP */
 #define PTTK91_FP           7 /*!< Defaulr FP */
+#define PTTK91_NUM_VREGS    8 /*!< Vector registers, see vector.h */
+#define PTTK91_VLEN         8 /*!< Words in a vector register */
 
 /* Instruction word definitions */
 #define PTTK91_OPCODE_POS   24
@@ -91,8 +94,29 @@
 #define PTTK91_PUSHR    0x35 << PTTK91_OPCODE_POS
 #define PTTK91_POPR     0x36 << PTTK91_OPCODE_POS
 
+/* Atomic instructions */
+#define PTTK91_CAS      0x37 << PTTK91_OPCODE_POS /*!< Compare R0 and swap */
+#define PTTK91_XADD     0x38 << PTTK91_OPCODE_POS /*!< Fetch and add */
+
+/* Vector instructions, see vector.h */
+#define PTTK91_VLOAD    0x40 << PTTK91_OPCODE_POS
+#define PTTK91_VSTORE   0x41 << PTTK91_OPCODE_POS
+#define PTTK91_VSPLAT   0x42 << PTTK91_OPCODE_POS
+#define PTTK91_VADD     0x43 << PTTK91_OPCODE_POS
+#define PTTK91_VSUB     0x44 << PTTK91_OPCODE_POS
+#define PTTK91_VMUL     0x45 << PTTK91_OPCODE_POS
+#define PTTK91_VAND     0x46 << PTTK91_OPCODE_POS
+#define PTTK91_VOR      0x47 << PTTK91_OPCODE_POS
+#define PTTK91_VCOMP    0x48 << PTTK91_OPCODE_POS
+#define PTTK91_VSUM     0x49 << PTTK91_OPCODE_POS
+#define PTTK91_VMIN     0x4a << PTTK91_OPCODE_POS
+#define PTTK91_VMAX     0x4b << PTTK91_OPCODE_POS
+
 /* System calls */
 #define PTTK91_SVC      0x70 << PTTK91_OPCODE_POS
+
+/* Debugging */
+#define PTTK91_BKPT     0x7f << PTTK91_OPCODE_POS /*!< Reserved breakpoint trap */
 /* End of PTTK91 opcodes *****************************************************/
 
 /* Addressing modes */
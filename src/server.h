@@ -0,0 +1,85 @@
+/**
+ *******************************************************************************
+ * @file    server.h
+ * @author  Olli Vanhoja
+ * @brief   VM server on a local socket.
+ *******************************************************************************
+ */
+
+/* Server protocol
+ * ===============
+ * The server accepts connections on a Unix domain stream socket. A client
+ * sends requests as lines of whitespace separated numbers and may send any
+ * number of requests on one connection:
+ *
+ *     load <code_size> <image_size> <word>...
+ *         Load an image. Replies "ok <hash>" with the content hash of the
+ *         image as 16 hex digits. Images stay cached until the server stops.
+ *     run <hash> [<value>...]
+ *         Run a loaded program, KBD reads the given values. Replies
+ *         "out <value>" for every value written to CRT as it is written and
+ *         finally "end <halt|error> <error> <instructions> <wall_us>".
+ *
+ * Failed requests are replied with "err <reason>", "err unknown" if the
+ * hash of a run request is not cached. Jobs run on a pool of threads
+ * started with the server, one connection at a time on each thread. A
+ * connection that sends no request for SERVER_IDLE_TIMEOUT seconds is
+ * closed.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "program.h"
+#include "metrics.h"
+#include "config.h"
+
+#define SERVER_QUEUE_LEN 64 /*!< Connections waiting for a thread */
+#define SERVER_IDLE_TIMEOUT 30 /*!< Seconds a connection may be idle */
+
+struct server;
+
+/**
+ * Result of a job run on a server.
+ */
+struct server_result {
+    int stop;               /*!< VM_STOP_HALT or VM_STOP_ERROR */
+    int error;              /*!< Runtime error code */
+    uint64_t count;         /*!< Number of instructions executed */
+    uint64_t wall_us;       /*!< Run time on the server */
+};
+
+/* Portable functions */
+/**
+ * Start a server.
+ * @param path path of the socket.
+ * @param threads number of threads or 0 for one per CPU.
+ * @param memsize size of the memory of every job in words or
+ *                PROGRAM_MEMSIZE_AUTO to size it for each program.
+ * @param metrics segment where the threads publish metrics or NULL.
+ * @return the server or NULL on error.
+ */
+struct server * server_start(struct program_cache * pc, const char * path,
+                             int threads, int memsize, struct metrics_shm * metrics);
+
+/**
+ * Stop a server, running jobs are stopped and connections closed.
+ */
+void server_stop(struct server * srv);
+
+/**
+ * Run a program on a server.
+ * The image is sent only if the server doesn't have it cached.
+ * @param io output handler for values written to CRT, NULL for the platform
+ *           output handler.
+ * @return 0 if no error; 1 if the server can't be reached; 2 if the server
+ *         failed the request.
+ */
+int server_call(const char * path, const struct program * prog,
+                const int * input, int input_len, const struct vm_io * io,
+                struct server_result * res);
+/* End of portable functions */
+
+#endif /* SERVER_H */
@@ -0,0 +1,70 @@
+/**
+ *******************************************************************************
+ * @file    smp.h
+ * @author  Olli Vanhoja
+ * @brief   Multiple virtual CPUs sharing one memory image.
+ *******************************************************************************
+ */
+
+/* SMP
+ * ===
+ * A program may start more virtual CPUs with SVC spawn. Every CPU has its
+ * own register file and runs on a separate host thread but all CPUs share
+ * the memory image, the decoded code and the host callbacks (vm_io) of the
+ * boot CPU, so the callbacks must be thread safe.
+ *
+ *     R1 = entry address, R2 = argument, R3 = initial SP and FP
+ *     svc sp, =spawn      R0 = CPU id or -1 if no CPU is available
+ *
+ *     R1 = CPU id
+ *     svc sp, =join       R0 = R0 of the CPU when it stopped,
+ *                         R1 = its error code, -1 if the id is invalid or
+ *                         -2 if it stopped for another reason, e.g. on a
+ *                         breakpoint
+ *
+ * The new CPU starts at the entry address with the argument in R1 and other
+ * registers cleared. It runs until it halts or stops on an error and it must
+ * be joined to free the CPU. When the boot CPU stops, the CPUs still running
+ * are stopped too.
+ *
+ * Memory model
+ * ------------
+ * + Aligned word reads and writes never tear but plain LOAD and STORE, as
+ *   well as fused or host executed sequences, are not ordered between CPUs.
+ * + CAS and XADD are atomic and sequentially consistent with each other,
+ *   they are the only way to synchronize CPUs in the guest.
+ * + Everything written before SVC spawn is visible to the new CPU and
+ *   everything a CPU wrote is visible after SVC join returns.
+ *
+ * Traces apply to the boot CPU only and other CPUs stop if they hit a
+ * breakpoint. Watchpoints can't be used with SMP, the fault handler finds
+ * the watchpoints of the thread that faulted and other CPUs have none.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define SMP_MAX_CPUS    16 /*!< Maximum number of spawned CPUs */
+
+struct smp;
+
+/* Portable functions */
+/**
+ * Create a SMP context for the boot CPU.
+ * @param boot state of the boot CPU, state->smp is set.
+ * @param mem shared memory.
+ * @return 0 if no error; 2 if out of memory.
+ */
+int smp_init(struct vm_state * boot, uint32_t * mem);
+
+/**
+ * Stop and join all CPUs still running and free the SMP context.
+ */
+void smp_free(struct vm_state * boot);
+/* End of portable functions */
+
+#endif /* SMP_H */
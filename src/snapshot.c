@@ -0,0 +1,83 @@
+/**
+ *******************************************************************************
+ * @file    snapshot.c
+ * @author  Olli Vanhoja
+ * @brief   Reset of a vm instance to its state after loading.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+
+#define PAGE_WORDS (1 << VM_DIRTY_SHIFT)
+
+int snapshot_init(struct snapshot * snap, struct vm_state * state,
+                  const uint32_t * mem, int image_size)
+{
+    if (image_size > state->memsize)
+        image_size = state->memsize;
+    if (image_size < 0)
+        image_size = 0;
+
+    snap->npages = (state->memsize + PAGE_WORDS - 1) >> VM_DIRTY_SHIFT;
+    snap->image_size = image_size;
+    snap->image = malloc((size_t)image_size * sizeof(uint32_t) + 1);
+    snap->dirty = calloc(snap->npages, sizeof(uint8_t));
+    if (!snap->image || !snap->dirty) {
+        free(snap->image);
+        free(snap->dirty);
+        return 1;
+    }
+    memcpy(snap->image, mem, (size_t)image_size * sizeof(uint32_t));
+
+    state->dirty = snap->dirty;
+    snap->state = *state;
+
+    return 0;
+}
+
+void snapshot_reset(struct snapshot * snap, struct vm_state * state, uint32_t * mem)
+{
+    uint8_t * const end = snap->dirty + snap->npages;
+    uint8_t * p = snap->dirty;
+    int first, last, copy;
+
+    while ((p = memchr(p, 1, end - p)) != NULL) {
+        first = (int)(p - snap->dirty) << VM_DIRTY_SHIFT;
+        last = first + PAGE_WORDS;
+        if (last > snap->state.memsize)
+            last = snap->state.memsize;
+
+        /* Recorded words are copied back, the rest was zero */
+        copy = (snap->image_size > first) ? snap->image_size - first : 0;
+        if (copy > last - first)
+            copy = last - first;
+        memcpy(mem + first, snap->image + first, (size_t)copy * sizeof(uint32_t));
+        memset(mem + first + copy, 0, (size_t)(last - first - copy) * sizeof(uint32_t));
+
+        *p++ = 0;
+    }
+
+    *state = snap->state;
+}
+
+void snapshot_dirty(struct snapshot * snap, int first, int last)
+{
+    int page;
+
+    if (first < 0)
+        first = 0;
+    if (last >= snap->state.memsize)
+        last = snap->state.memsize - 1;
+    for (page = first >> VM_DIRTY_SHIFT; page <= (last >> VM_DIRTY_SHIFT); page++)
+        snap->dirty[page] = 1;
+}
+
+void snapshot_free(struct snapshot * snap)
+{
+    free(snap->image);
+    free(snap->dirty);
+    snap->image = NULL;
+    snap->dirty = NULL;
+}
@@ -0,0 +1,63 @@
+/**
+ *******************************************************************************
+ * @file    snapshot.h
+ * @author  Olli Vanhoja
+ * @brief   Reset of a vm instance to its state after loading.
+ *******************************************************************************
+ */
+
+/* Snapshots
+ * =========
+ * A snapshot records the state and the memory image of a loaded instance.
+ * While the snapshot is attached, the interpreter marks every page of
+ * 2^VM_DIRTY_SHIFT words it writes in the dirty page map of the state and a
+ * reset copies back only the dirty pages. The cost of a reset is
+ * proportional to the memory the last run wrote, plus a scan of one byte per
+ * page.
+ *
+ * Writes that bypass the interpreter, e.g. by the host or by AOT translated
+ * code, must be marked with snapshot_dirty().
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+struct snapshot {
+    struct vm_state state;  /*!< State after loading */
+    uint32_t * image;       /*!< Copy of the first image_size words of the memory */
+    int image_size;         /*!< Size of image in words */
+    uint8_t * dirty;        /*!< Dirty page map */
+    int npages;
+};
+
+/**
+ * Take a snapshot of a loaded instance and start tracking writes.
+ * @param image_size number of words from the beginning of the memory to
+ *                   record, the rest must be zero.
+ * @return 0 if no error; 1 if out of memory.
+ */
+int snapshot_init(struct snapshot * snap, struct vm_state * state,
+                  const uint32_t * mem, int image_size);
+
+/**
+ * Reset an instance to the snapshot.
+ */
+void snapshot_reset(struct snapshot * snap, struct vm_state * state, uint32_t * mem);
+
+/**
+ * Mark words first..last dirty.
+ */
+void snapshot_dirty(struct snapshot * snap, int first, int last);
+
+/**
+ * Free a snapshot.
+ * The dirty page map of the instance is freed, clear state->dirty before
+ * running the instance again.
+ */
+void snapshot_free(struct snapshot * snap);
+
+#endif /* SNAPSHOT_H */
@@ -12,7 +12,7 @@
 
 void svc_halt_fn(struct vm_state * state, uint32_t * mem);
 
-svc_handler_t svc_callmap[] = {
+static const svc_handler_t svc_callmap[] = {
                             #define SVC_MAP_X(value) value##_fn,
                             FOR_ALL_SVC(SVC_MAP_X)
                             #undef SVC_MAP_X
@@ -21,6 +21,14 @@ svc_handler_t svc_callmap[] = {
 int svc_handler(struct vm_state * state, uint32_t * mem, int call_code)
 {
     svc_handler_t fpt;
+    int retval;
+
+    if (state->io && state->io->svc) {
+        retval = state->io->svc(state->io->arg, state, mem, call_code);
+        if (retval >= 0)
+            return retval;
+    }
+
     call_code -= 10;
 
     if ((call_code >= sizeof(svc_callmap) / sizeof(void *))
@@ -37,7 +45,8 @@ int svc_handler(struct vm_state * state, uint32_t * mem, int call_code)
 void svc_halt_fn(struct vm_state * state, uint32_t * mem)
 {
 #if VM_DEBUG == 1
-    printf("SVC halt\n");
+    fprintf(stderr, "SVC halt\n");
 #endif
+    state->stop = VM_STOP_HALT;
     state->running = 0;
 }
@@ -20,6 +20,8 @@
 #define svc_write   0x0d
 #define svc_time    0x0e
 #define svc_date    0x0f
+#define svc_spawn   0x10    /*!< Start a CPU, see smp.h */
+#define svc_join    0x11    /*!< Wait for a CPU to stop */
 
 /** For all SVCs; X Macro */
 #define FOR_ALL_SVC(apply) \
@@ -28,7 +30,9 @@
     apply(svc_read)        \
     apply(svc_write)       \
     apply(svc_time)        \
-    apply(svc_date)
+    apply(svc_date)        \
+    apply(svc_spawn)       \
+    apply(svc_join)
 
 #ifndef VM_PLATFORM
 #error Please select VM_PLATFORM
@@ -51,6 +55,8 @@ void svc_read_fn(struct vm_state * state, uint32_t * mem);
 void svc_write_fn(struct vm_state * state, uint32_t * mem);
 void svc_time_fn(struct vm_state * state, uint32_t * mem);
 void svc_date_fn(struct vm_state * state, uint32_t * mem);
+void svc_spawn_fn(struct vm_state * state, uint32_t * mem);
+void svc_join_fn(struct vm_state * state, uint32_t * mem);
 /* End of portable functions */
 
 #endif /* SVC_H */
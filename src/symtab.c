@@ -0,0 +1,111 @@
+/**
+ *******************************************************************************
+ * @file    symtab.c
+ * @author  Olli Vanhoja
+ * @brief   Symbol table.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "symtab.h"
+
+static unsigned int symtab_hash(const char * name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the index slot of a name.
+ * @return pointer to the slot containing the symbol or the empty slot where
+ *         it should be inserted.
+ */
+static int * find_slot(const struct symtab * tab, const char * name)
+{
+    const unsigned int mask = 2 * tab->size - 1;
+    unsigned int i = symtab_hash(name) & mask;
+
+    while (tab->index[i] >= 0 && strcmp(tab->syms[tab->index[i]].name, name)) {
+        i = (i + 1) & mask;
+    }
+    return &(tab->index[i]);
+}
+
+void symtab_init(struct symtab * tab)
+{
+    tab->count = 0;
+    tab->size = 0;
+    tab->syms = NULL;
+    tab->index = NULL;
+}
+
+void symtab_free(struct symtab * tab)
+{
+    free(tab->syms);
+    free(tab->index);
+    symtab_init(tab);
+}
+
+int symtab_add(struct symtab * tab, const char * name, int value)
+{
+    struct symbol * sym;
+    int * slot;
+    int i;
+
+    if (strlen(name) >= SYMTAB_NAME_MAX)
+        return 1;
+
+    sym = (struct symbol *)symtab_find(tab, name);
+    if (sym) {
+        sym->value = value;
+        return 0;
+    }
+
+    if (tab->count >= tab->size) {
+        int size = (tab->size) ? 2 * tab->size : 16;
+        int * index;
+
+        sym = realloc(tab->syms, size * sizeof(struct symbol));
+        if (!sym)
+            return 2;
+        tab->syms = sym;
+
+        index = malloc(2 * size * sizeof(int));
+        if (!index)
+            return 2;
+        free(tab->index);
+        tab->index = index;
+        tab->size = size;
+
+        /* Rehash */
+        memset(index, 0xff, 2 * size * sizeof(int));
+        for (i = 0; i < tab->count; i++) {
+            *find_slot(tab, tab->syms[i].name) = i;
+        }
+    }
+
+    slot = find_slot(tab, name);
+    *slot = tab->count;
+    sym = &(tab->syms[tab->count++]);
+    strcpy(sym->name, name);
+    sym->value = value;
+
+    return 0;
+}
+
+const struct symbol * symtab_find(const struct symtab * tab, const char * name)
+{
+    int i;
+
+    if (tab->size == 0)
+        return NULL;
+
+    i = *find_slot(tab, name);
+    return (i >= 0) ? &(tab->syms[i]) : NULL;
+}
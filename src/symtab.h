@@ -0,0 +1,46 @@
+/**
+ *******************************************************************************
+ * @file    symtab.h
+ * @author  Olli Vanhoja
+ * @brief   Symbol table.
+ *******************************************************************************
+ */
+
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#define SYMTAB_NAME_MAX 32 /*!< Maximum length of a symbol name incl. '\0' */
+
+struct symbol {
+    char name[SYMTAB_NAME_MAX];
+    int value;
+};
+
+/**
+ * Symbol table.
+ * Symbols are kept in the order they were added and indexed with an open
+ * addressing hash table.
+ */
+struct symtab {
+    int count;  /*!< Number of symbols */
+    int size;   /*!< Allocated size of syms */
+    struct symbol * syms;
+    int * index;    /*!< Hash index to syms, -1 if empty, 2 * size entries */
+};
+
+void symtab_init(struct symtab * tab);
+void symtab_free(struct symtab * tab);
+
+/**
+ * Add a symbol or update the value of an existing symbol.
+ * @return 0 if no error; 1 if the name is too long; 2 if out of memory.
+ */
+int symtab_add(struct symtab * tab, const char * name, int value);
+
+/**
+ * Find a symbol by name.
+ * @return pointer to the symbol or NULL if not found.
+ */
+const struct symbol * symtab_find(const struct symtab * tab, const char * name);
+
+#endif /* SYMTAB_H */
@@ -0,0 +1,249 @@
+/**
+ *******************************************************************************
+ * @file    trace.c
+ * @author  Olli Vanhoja
+ * @brief   Execution trace recording and replay.
+ *******************************************************************************
+ */
+
+#include <stdlib.h>
+#include "svc.h"
+#include "trace.h"
+
+#define PC_DELTA_ESC 31 /*!< PC delta doesn't fit in the header byte */
+
+static uint32_t zigzag(int v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int unzigzag(uint32_t v)
+{
+    return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+static size_t put_varint(uint8_t * p, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/**
+ * Read a varint from the replay buffer.
+ * @return 0 if no error; 1 if end of trace.
+ */
+static int get_varint(struct trace * t, uint32_t * v)
+{
+    int shift = 0;
+    uint8_t b;
+
+    *v = 0;
+    do {
+        if (t->rpos >= t->rlen || shift > 28)
+            return 1;
+        b = t->rbuf[t->rpos++];
+        *v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    return 0;
+}
+
+/**
+ * Number of payload fields of an event type.
+ */
+static int event_nargs(int type)
+{
+    switch (type) {
+    case TRACE_EV_IN:
+    case TRACE_EV_OUT:
+    case TRACE_EV_END:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Control flow events continue from the branch target.
+ */
+static int event_next_pc(int type, int pc, int value)
+{
+    switch (type) {
+    case TRACE_EV_BRANCH:
+    case TRACE_EV_CALL:
+    case TRACE_EV_EXIT:
+        return value;
+    default:
+        return pc;
+    }
+}
+
+int trace_ring_init(struct trace_ring * ring, uint32_t size)
+{
+    ring->buf = malloc(size);
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return (ring->buf) ? 0 : 1;
+}
+
+void trace_ring_free(struct trace_ring * ring)
+{
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+static void trace_ring_write(struct trace_ring * ring, const uint8_t * src, size_t len)
+{
+    const uint32_t mask = ring->size - 1;
+    uint32_t head = ring->head;
+    size_t i;
+
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + len > ring->size) {
+        trace_port_wait();
+    }
+
+    for (i = 0; i < len; i++) {
+        ring->buf[(head + i) & mask] = src[i];
+    }
+    __atomic_store_n(&ring->head, head + (uint32_t)len, __ATOMIC_RELEASE);
+}
+
+size_t trace_ring_read(struct trace_ring * ring, uint8_t * dst, size_t max)
+{
+    const uint32_t mask = ring->size - 1;
+    uint32_t tail = ring->tail;
+    size_t i, n;
+
+    n = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    if (n > max)
+        n = max;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = ring->buf[(tail + i) & mask];
+    }
+    __atomic_store_n(&ring->tail, tail + (uint32_t)n, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static void record(struct trace * t, int type, int pc, int a, int value)
+{
+    uint8_t ev[TRACE_EVENT_MAX];
+    uint32_t delta = zigzag(pc - t->last_pc);
+    size_t n = 1;
+
+    if (delta < PC_DELTA_ESC) {
+        ev[0] = (uint8_t)(type | (delta << 3));
+    } else {
+        ev[0] = (uint8_t)(type | (PC_DELTA_ESC << 3));
+        n += put_varint(ev + n, delta);
+    }
+
+    switch (type) {
+    case TRACE_EV_BRANCH:
+    case TRACE_EV_CALL:
+    case TRACE_EV_EXIT:
+        n += put_varint(ev + n, zigzag(value - pc));
+        break;
+    case TRACE_EV_SVC:
+        n += put_varint(ev + n, zigzag(a));
+        break;
+    default:
+        n += put_varint(ev + n, zigzag(a));
+        n += put_varint(ev + n, zigzag(value));
+    }
+
+    trace_ring_write(&(t->ring), ev, n);
+    t->last_pc = event_next_pc(type, pc, value);
+}
+
+static int replay(struct trace * t, int type, int pc, int a, int * value)
+{
+    uint32_t hdr, delta, arg[2];
+    int i, ev_a, ev_value;
+
+    if (t->rpos >= t->rlen)
+        return 1;
+    hdr = t->rbuf[t->rpos++];
+
+    delta = hdr >> 3;
+    if (delta == PC_DELTA_ESC && get_varint(t, &delta))
+        return 1;
+    if ((int)(hdr & 0x7) != type || t->last_pc + unzigzag(delta) != pc)
+        return 1;
+
+    for (i = 0; i < event_nargs(type); i++) {
+        if (get_varint(t, &arg[i]))
+            return 1;
+    }
+
+    if (event_nargs(type) == 1) {
+        if (type == TRACE_EV_SVC) {
+            ev_a = unzigzag(arg[0]);
+            ev_value = *value;
+        } else {
+            ev_a = a;
+            ev_value = pc + unzigzag(arg[0]);
+        }
+    } else {
+        ev_a = unzigzag(arg[0]);
+        ev_value = unzigzag(arg[1]);
+    }
+
+    if (ev_a != a)
+        return 1;
+    if (type == TRACE_EV_IN) {
+        *value = ev_value;
+    } else if (ev_value != *value) {
+        return 1;
+    }
+
+    t->last_pc = event_next_pc(type, pc, ev_value);
+    return 0;
+}
+
+int trace_check(const struct trace * t)
+{
+    struct trace c = *t;
+    uint32_t hdr, delta, arg;
+    int i, type;
+
+    c.rpos = 0;
+    while (c.rpos < c.rlen) {
+        hdr = c.rbuf[c.rpos++];
+        type = (int)(hdr & 0x7);
+        if (type > TRACE_EV_END)
+            return 1;
+
+        delta = hdr >> 3;
+        if (delta == PC_DELTA_ESC && get_varint(&c, &delta))
+            return 1;
+        for (i = 0; i < event_nargs(type); i++) {
+            if (get_varint(&c, &arg))
+                return 1;
+            /* Only the number of an SVC is recorded, not its effects */
+            if (type == TRACE_EV_SVC && unzigzag(arg) != svc_halt)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+int trace_hook(struct trace * t, int type, int pc, int a, int * value)
+{
+    if (t->mode == TRACE_RECORD) {
+        record(t, type, pc, a, *value);
+        return 0;
+    }
+    return replay(t, type, pc, a, value);
+}
@@ -0,0 +1,148 @@
+/**
+ *******************************************************************************
+ * @file    trace.h
+ * @author  Olli Vanhoja
+ * @brief   Execution trace recording and replay.
+ *******************************************************************************
+ */
+
+/* Trace format
+ * ============
+ * A trace file starts with TRACE_MAGIC followed by a stream of events.
+ * Each event begins with a header byte:
+ *
+ *     +---------------------------+
+ *     ¦ PC delta      ¦ Event     ¦
+ *     ¦ 5 bits        ¦ 3 bits    ¦
+ *     +---------------------------+
+ *     7             3 2           0
+ *
+ * PC delta is the zigzag encoded difference between the address of the
+ * instruction and the previous event PC (the branch target for control flow
+ * events). Value 31 means that the delta follows as a varint. The header is
+ * followed by the event payload, each field is a zigzag encoded varint:
+ *
+ * + BRANCH, CALL, EXIT   target - pc
+ * + SVC                  svc number
+ * + IN, OUT              device, value
+ * + END                  stop reason, error code
+ *
+ * Only the number of an SVC is recorded, so a trace can be replayed only if
+ * its SVCs have no effects other than halting, see trace_check().
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vm.h"
+#include "config.h"
+
+#define TRACE_MAGIC         "PTTK91T1"
+#define TRACE_RING_SIZE     65536 /*!< Size of the record ring buffer, power of 2 */
+#define TRACE_EVENT_MAX     16    /*!< Maximum size of an encoded event */
+
+/* Trace modes */
+#define TRACE_RECORD    1
+#define TRACE_REPLAY    2
+
+/* Events */
+#define TRACE_EV_BRANCH 0 /*!< Taken branch */
+#define TRACE_EV_CALL   1
+#define TRACE_EV_EXIT   2
+#define TRACE_EV_SVC    3
+#define TRACE_EV_IN     4
+#define TRACE_EV_OUT    5
+#define TRACE_EV_END    6 /*!< End of trace */
+
+/**
+ * Lock-free single producer single consumer byte ring.
+ */
+struct trace_ring {
+    uint8_t * buf;
+    uint32_t size;  /*!< Size of buf, power of 2 */
+    uint32_t head;  /*!< Write index, owned by the producer */
+    uint32_t tail;  /*!< Read index, owned by the consumer */
+};
+
+/**
+ * Trace state of a vm instance.
+ */
+struct trace {
+    int mode;
+    int last_pc;
+
+    /* Record */
+    struct trace_ring ring;
+
+    /* Replay */
+    const uint8_t * rbuf;
+    size_t rlen;
+    size_t rpos;
+
+    void * port; /*!< Platform specific data */
+};
+
+int trace_ring_init(struct trace_ring * ring, uint32_t size);
+void trace_ring_free(struct trace_ring * ring);
+
+/**
+ * Read at most max bytes from the ring.
+ * Called from the consumer thread.
+ * @return number of bytes read.
+ */
+size_t trace_ring_read(struct trace_ring * ring, uint8_t * dst, size_t max);
+
+/**
+ * Record or replay an event.
+ * In record mode the event is appended to the trace. In replay mode the next
+ * event is read from the trace and compared against the arguments, for IN
+ * events the recorded value is returned in value.
+ * @param t trace.
+ * @param type event type.
+ * @param pc address of the instruction.
+ * @param a first event argument.
+ * @param value second event argument.
+ * @return 0 if no error; 1 if the execution diverged from the trace.
+ */
+int trace_hook(struct trace * t, int type, int pc, int a, int * value);
+
+/**
+ * Check that a trace opened for replay is well formed and can be replayed.
+ * @return 0 if no error; 1 if the trace is malformed or contains SVCs other
+ *         than halt.
+ */
+int trace_check(const struct trace * t);
+
+/* Portable functions */
+/**
+ * Open a trace file for recording.
+ * Events are flushed to the file in the background.
+ * @return 0 if no error.
+ */
+int trace_open_record(struct trace * t, const char * name);
+
+/**
+ * Open a trace file for replay.
+ * @return 0 if no error.
+ */
+int trace_open_replay(struct trace * t, const char * name);
+
+/**
+ * Record the end of the trace, flush and close.
+ * @return 0 if no error; 1 if the replayed execution diverged from the trace.
+ */
+int trace_close(struct trace * t, const struct vm_state * state);
+
+/**
+ * Wait for the consumer when the ring is full.
+ */
+void trace_port_wait(void);
+/* End of portable functions */
+
+#ifndef VM_PLATFORM
+#error Please select VM_PLATFORM
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,112 @@
+/**
+ *******************************************************************************
+ * @file    vector.c
+ * @author  Olli Vanhoja
+ * @brief   Vector instruction kernels.
+ *******************************************************************************
+ */
+
+#include <string.h>
+#include "vector.h"
+
+#if defined(__GNUC__)
+#define VECTOR_GCC
+typedef int32_t vec_s __attribute__((vector_size(PTTK91_VLEN * sizeof(int32_t))));
+typedef uint32_t vec_u __attribute__((vector_size(PTTK91_VLEN * sizeof(int32_t))));
+#endif
+
+#ifdef VECTOR_GCC
+void vector_op(int opcode, int32_t * vj, const int32_t * vi)
+{
+    vec_u a, b;
+    vec_s sa, sb;
+
+    /* Registers are not aligned for the vector types */
+    memcpy(&a, vj, sizeof(a));
+    memcpy(&b, vi, sizeof(b));
+
+    switch (opcode) {
+    case PTTK91_VADD:
+        a = a + b;
+        break;
+    case PTTK91_VSUB:
+        a = a - b;
+        break;
+    case PTTK91_VMUL:
+        a = a * b;
+        break;
+    case PTTK91_VAND:
+        a = a & b;
+        break;
+    case PTTK91_VOR:
+        a = a | b;
+        break;
+    case PTTK91_VCOMP:
+        /* Comparisons give -1 for true lanes */
+        sa = (vec_s)a;
+        sb = (vec_s)b;
+        a = (vec_u)((sa < sb) - (sa > sb));
+        break;
+    default:
+        return;
+    }
+
+    memcpy(vj, &a, sizeof(a));
+}
+#else
+void vector_op(int opcode, int32_t * vj, const int32_t * vi)
+{
+    int i;
+
+    for (i = 0; i < PTTK91_VLEN; i++) {
+        const uint32_t a = (uint32_t)vj[i];
+        const uint32_t b = (uint32_t)vi[i];
+
+        switch (opcode) {
+        case PTTK91_VADD:
+            vj[i] = (int32_t)(a + b);
+            break;
+        case PTTK91_VSUB:
+            vj[i] = (int32_t)(a - b);
+            break;
+        case PTTK91_VMUL:
+            vj[i] = (int32_t)(a * b);
+            break;
+        case PTTK91_VAND:
+            vj[i] = (int32_t)(a & b);
+            break;
+        case PTTK91_VOR:
+            vj[i] = (int32_t)(a | b);
+            break;
+        case PTTK91_VCOMP:
+            vj[i] = (vj[i] > vi[i]) - (vj[i] < vi[i]);
+            break;
+        }
+    }
+}
+#endif
+
+int vector_reduce(int opcode, const int32_t * vi)
+{
+    uint32_t sum = 0;
+    int32_t value = vi[0];
+    int i;
+
+    /* Simple enough for the compiler to vectorize */
+    switch (opcode) {
+    case PTTK91_VSUM:
+        for (i = 0; i < PTTK91_VLEN; i++)
+            sum += (uint32_t)vi[i];
+        return (int)sum;
+    case PTTK91_VMIN:
+        for (i = 1; i < PTTK91_VLEN; i++)
+            value = (vi[i] < value) ? vi[i] : value;
+        return value;
+    case PTTK91_VMAX:
+        for (i = 1; i < PTTK91_VLEN; i++)
+            value = (vi[i] > value) ? vi[i] : value;
+        return value;
+    default:
+        return 0;
+    }
+}
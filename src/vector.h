@@ -0,0 +1,59 @@
+/**
+ *******************************************************************************
+ * @file    vector.h
+ * @author  Olli Vanhoja
+ * @brief   Vector instruction extension.
+ *******************************************************************************
+ */
+
+/* Vector extension
+ * ================
+ * With VM_VECTOR = 1 the VM has eight vector registers V0..V7 of
+ * PTTK91_VLEN words. Vector registers are encoded in the Rj and Ri fields
+ * of the instruction word, lanes are signed 32-bit words and arithmetic
+ * wraps like the scalar instructions.
+ *
+ *     VLOAD  Vj, addr      Vj = mem[addr .. addr + VLEN - 1]
+ *     VSTORE Vj, addr      mem[addr .. addr + VLEN - 1] = Vj
+ *     VSPLAT Vj, operand   every lane of Vj = operand
+ *     VADD   Vj, Vi        Vj = Vj + Vi
+ *     VSUB   Vj, Vi        Vj = Vj - Vi
+ *     VMUL   Vj, Vi        Vj = Vj * Vi
+ *     VAND   Vj, Vi        Vj = Vj & Vi
+ *     VOR    Vj, Vi        Vj = Vj | Vi
+ *     VCOMP  Vj, Vi        Vj = -1, 0 or 1 as Vj is less, equal or greater
+ *     VSUM   Rj, Vi        Rj = sum of the lanes of Vi
+ *     VMIN   Rj, Vi        Rj = minimum of the lanes of Vi
+ *     VMAX   Rj, Vi        Rj = maximum of the lanes of Vi
+ *
+ * addr and operand are given as with STORE and LOAD. The whole range of
+ * VLOAD and VSTORE must be valid, otherwise nothing is transferred.
+ *
+ * Kernels are written with GCC vector types so the host compiler emits
+ * SSE2 or, with -mavx2, AVX2 code. Other compilers use scalar loops.
+ */
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <stdint.h>
+#include "pttk91.h"
+#include "config.h"
+
+#if VM_VECTOR != 0 && VM_VECTOR != 1
+#error Incorrect value of VM_VECTOR
+#endif
+
+/**
+ * Elementwise operation vj = vj op vi.
+ * @param opcode one of PTTK91_VADD .. PTTK91_VCOMP.
+ */
+void vector_op(int opcode, int32_t * vj, const int32_t * vi);
+
+/**
+ * Horizontal operation over the lanes of vi.
+ * @param opcode one of PTTK91_VSUM, PTTK91_VMIN and PTTK91_VMAX.
+ */
+int vector_reduce(int opcode, const int32_t * vi);
+
+#endif /* VECTOR_H */
@@ -12,24 +12,17 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "arit.h"
 #include "inp.h"
 #include "outp.h"
 #include "svc.h"
+#include "trace.h"
+#include "fuse.h"
+#include "loop.h"
+#include "vector.h"
 #include "vm.h"
 
-/* Error codes */
-#define VM_ERR_NO_ERROR                 0
-#define VM_ERR_INVALID_OPCODE           1
-#define VM_ERR_PARAM_ERROR              2
-#define VM_ERR_ADDRESS_OUT_OF_BOUNDS    3
-#define VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS 4
-#define VM_ERR_REGISTER_OUT_OF_BOUNDS   5
-#define VM_ERR_PC_OUT_OF_BOUNDS         6
-#define VM_ERR_BAD_ACCESS_MODE          7
-#define VM_ERR_ILLEGAL_SVC              8
-#define VM_ERR_INVALID_DEVICE           9
-
 /* Error message macros */
 #define VM_ERR_STR(code)        case code: fprintf(stderr, "%i, %s\n", code, #code); return
 #define VM_ERR_STR2(code, msg)  case code: return fprintf(stderr, "%i, %s\n", code, msg); return
@@ -53,6 +46,7 @@ static void print_error_msg(int error_code)
         VM_ERR_STR(VM_ERR_BAD_ACCESS_MODE);
         VM_ERR_STR(VM_ERR_ILLEGAL_SVC);
         VM_ERR_STR(VM_ERR_INVALID_DEVICE);
+        VM_ERR_STR(VM_ERR_TRACE_DIVERGED);
     }
 }
 #undef VM_ERR_STR
@@ -80,6 +74,78 @@ static void print_error_msg(int error_code)
 #else
 #error Incorrect value of VM_CODE_AREA_RW
 #endif
+
+/* Trace hooks are only called on control flow and I/O events */
+#if VM_TRACE == 1
+#define VM_TRACE_EVENT(state, type, a, value)                                   \
+    if ((state)->trace                                                          \
+        && trace_hook((state)->trace, type, (state)->pc - 1, a, value)) {       \
+        return VM_ERR_TRACE_DIVERGED;                                           \
+    }
+#define VM_TRACE_REPLAYING(state) ((state)->trace && (state)->trace->mode == TRACE_REPLAY)
+#elif VM_TRACE == 0
+#define VM_TRACE_EVENT(state, type, a, value)
+#define VM_TRACE_REPLAYING(state) 0
+#else
+#error Incorrect value of VM_TRACE
+#endif
+
+/* Decoded code must be dropped when the program writes to its code section */
+#if VM_CODE_AREA_RW == 1
+#define VM_CODE_WRITE(state, memaddr) do {                                      \
+        if ((state)->code && (memaddr) < (state)->code->len)                    \
+            (state)->code = NULL;                                               \
+    } while (0)
+#else
+/* Only the last word of the code section is writable and it's never decoded */
+#define VM_CODE_WRITE(state, memaddr)
+#endif
+
+/* Every write to the memory goes through this, first..last are the written
+ * words. Pages of the words are marked dirty for snapshot_reset(). */
+#define VM_MEM_WRITE(state, first, last) do {                                   \
+        if ((state)->dirty) {                                                   \
+            int p_;                                                             \
+            for (p_ = (first) >> VM_DIRTY_SHIFT;                                \
+                 p_ <= (last) >> VM_DIRTY_SHIFT; p_++) {                        \
+                (state)->dirty[p_] = 1;                                         \
+            }                                                                   \
+        }                                                                       \
+        VM_CODE_WRITE(state, first);                                            \
+    } while (0)
+
+/* Counters of SVC and I/O instructions, see metrics.h */
+#if VM_METRICS == 1
+#define VM_METRICS_INC(state, counter) ((state)->counter++)
+#elif VM_METRICS == 0
+#define VM_METRICS_INC(state, counter)
+#else
+#error Incorrect value of VM_METRICS
+#endif
+
+/* Take a branch */
+#define VM_BRANCH(state, target) do {                                           \
+        int target_ = (target);                                                 \
+        VM_TRACE_EVENT(state, TRACE_EV_BRANCH, 0, &target_);                    \
+        VM_JUMP(state, target_);                                                \
+    } while (0)
+
+/* Instructions are counted per straight-line run of code: count_pc is the
+ * address where the run started and the run is added to the count when the
+ * control leaves it */
+#define VM_COUNT_RUN(state)                                                     \
+    ((state)->count += (uint64_t)((state)->pc - (state)->count_pc))
+
+/* Transfer control, stops the VM at the end of its slice */
+#define VM_JUMP(state, target) do {                                             \
+        VM_COUNT_RUN(state);                                                    \
+        (state)->pc = (target);                                                 \
+        (state)->count_pc = (state)->pc;                                        \
+        if ((state)->count >= (state)->slice_end) {                             \
+            (state)->stop = VM_STOP_SLICE;                                      \
+            (state)->running = 0;                                               \
+        }                                                                       \
+    } while (0)
 /* End of Macros */
 
 /**
@@ -94,20 +160,17 @@ void vm_init_state(struct vm_state * state, int code_size, int memsize)
     for (i = 0; i < PTTK91_NUM_REGS; i++) {
         state->regs[i] = 0;
     }
+#if VM_VECTOR == 1
+    memset(state->vregs, 0, sizeof(state->vregs));
+#endif
     state->regs[PTTK91_SP] = code_size - 1;
     state->regs[PTTK91_FP] = code_size - 1;
 
     state->pc = 0;
-    state->opcode = 0;
-    state->rj = 0;
-    state->m = 0;
-    state->ri = 0;
-    state->imm = 0;
+    vm_decode(&(state->ir), 0);
 
     /* Clear status register */
-    state->sr.gre = 0;
-    state->sr.equ = 0;
-    state->sr.les = 0;
+    state->cmp = VM_CMP_NONE;
     state->sr.ovf = 0;
     state->sr.div = 0;
     state->sr.uni = 0;
@@ -120,6 +183,45 @@ void vm_init_state(struct vm_state * state, int code_size, int memsize)
     state->memsize = memsize;
     state->code_sec_end = code_size;
     state->running = 1;
+    state->stop = VM_STOP_HALT;
+    state->error = VM_ERR_NO_ERROR;
+    state->call_depth = 0;
+    state->count = 0;
+    state->count_pc = 0;
+    state->slice = 0;
+    state->slice_end = UINT64_MAX;
+#if VM_METRICS == 1
+    state->svc_count = 0;
+    state->in_count = 0;
+    state->out_count = 0;
+#endif
+    state->trace = NULL;
+    state->code = NULL;
+    state->profile = NULL;
+    state->smp = NULL;
+    state->io = NULL;
+    state->dirty = NULL;
+    state->mmio = NULL;
+}
+
+/**
+ * Get the state register as seen by the program.
+ * @param state vm state.
+ * @return SR word, see VM_SR_BIT_x.
+ */
+uint32_t vm_get_sr(const struct vm_state * state)
+{
+    return ((uint32_t)VM_SR_GRE(state) << VM_SR_BIT_GRE)
+         | ((uint32_t)VM_SR_EQU(state) << VM_SR_BIT_EQU)
+         | ((uint32_t)VM_SR_LES(state) << VM_SR_BIT_LES)
+         | ((uint32_t)state->sr.ovf << VM_SR_BIT_OVF)
+         | ((uint32_t)state->sr.div << VM_SR_BIT_DIV)
+         | ((uint32_t)state->sr.uni << VM_SR_BIT_UNI)
+         | ((uint32_t)state->sr.fma << VM_SR_BIT_FMA)
+         | ((uint32_t)state->sr.dei << VM_SR_BIT_DEI)
+         | ((uint32_t)state->sr.svc << VM_SR_BIT_SVC)
+         | ((uint32_t)state->sr.pri << VM_SR_BIT_PRI)
+         | ((uint32_t)state->sr.nin << VM_SR_BIT_NIN);
 }
 
 /**
@@ -138,71 +240,225 @@ static int fetch(uint32_t * instr, struct vm_state * state, const uint32_t * mem
 
 /**
  *  Decode a instruction word.
+ *  @param ins decoded instruction.
+ *  @param instr instruction word.
+ *  @return error code, zero if no error.
  */
-static int decode(struct vm_state * state, uint32_t instr)
+int vm_decode(struct vm_insn * ins, uint32_t instr)
 {
-    state->opcode   = (int)(instr & 0xFF000000);
-    state->rj       = (int)((instr & 0x00E00000) >> PTTK91_RJ_POS);
-    state->m        = (int)(instr & 0x00180000);
-    state->ri       = (int)((instr & 0x00070000) >> PTTK91_RI_POS);
-    state->imm      = (int)(instr & 0x0000ffff);
+    ins->opcode = (int)(instr & 0xFF000000);
+    ins->rj     = (int)((instr & 0x00E00000) >> PTTK91_RJ_POS);
+    ins->m      = (int)(instr & 0x00180000);
+    ins->ri     = (int)((instr & 0x00070000) >> PTTK91_RI_POS);
+    ins->imm    = (int)(instr & 0x0000ffff);
+    ins->xop    = 0;
+    ins->len    = 1;
 
-    if (VM_REG_OUT_OF_BOUNDS(state->rj) || VM_REG_OUT_OF_BOUNDS(state->ri)) {
+    if (VM_REG_OUT_OF_BOUNDS(ins->rj) || VM_REG_OUT_OF_BOUNDS(ins->ri)) {
         return VM_ERR_REGISTER_OUT_OF_BOUNDS;
     }
 
     return 0;
 }
 
+#if VM_MMIO == 1
 /**
- * Evaluate the last decoded instruction.
+ * Find the device of an address outside the memory.
+ * @param offset returns the offset of the address in the page.
+ * @return the device or NULL if the address is not mapped.
  */
-static int eval(struct vm_state * state, uint32_t * mem)
+static const struct vm_mmio_dev * mmio_dev(const struct vm_state * state, int addr,
+                                          int * offset)
 {
-    /* Copy some data for (hopefully) faster access */
-    int opcode = state->opcode;
-    int rj = state->rj;
-    int ri = state->ri;
-    int memsize = state->memsize;
+    const struct vm_mmio * mmio = state->mmio;
+    int page;
 
-    int param; /* Final second arg value will be stored to this variable */
-    int i, sp; /* Temp variables */
+    if (!mmio || addr < mmio->base)
+        return NULL;
+    page = (addr - mmio->base) >> VM_MMIO_SHIFT;
+    if (page >= mmio->npages)
+        return NULL;
+
+    *offset = (addr - mmio->base) & ((1 << VM_MMIO_SHIFT) - 1);
+    return mmio->page[page];
+}
+
+/**
+ * Read a word outside the memory.
+ * @return error code, zero if no error.
+ */
+static int mmio_read(const struct vm_state * state, int addr, int * value)
+{
+    const struct vm_mmio_dev * dev;
+    int offset;
+
+    dev = mmio_dev(state, addr, &offset);
+    if (!dev || !dev->read)
+        return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
+    return (dev->read(dev->arg, offset, value)) ? VM_ERR_INVALID_DEVICE : 0;
+}
+
+/**
+ * Write a word outside the memory.
+ * @return error code, zero if no error.
+ */
+static int mmio_write(const struct vm_state * state, int addr, int value)
+{
+    const struct vm_mmio_dev * dev;
+    int offset;
+
+    dev = mmio_dev(state, addr, &offset);
+    if (!dev || !dev->write)
+        return VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+    return (dev->write(dev->arg, offset, value)) ? VM_ERR_INVALID_DEVICE : 0;
+}
+#elif VM_MMIO == 0
+#define mmio_read(state, addr, value)   VM_ERR_ADDRESS_OUT_OF_BOUNDS
+#define mmio_write(state, addr, value)  VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS
+#else
+#error Incorrect value of VM_MMIO
+#endif
+
+/**
+ * Suspend the VM before an IN or OUT that would block.
+ * The instruction is executed again when the VM is resumed.
+ */
+static void io_wait(struct vm_state * state)
+{
+    state->pc--;
+    state->stop = VM_STOP_WAIT;
+    state->running = 0;
+}
 
-    param = state->imm; /* Starting point for "parsing" the final value */
-    if (ri != 0) {
+/**
+ * Get the value of the second operand.
+ * @param param returns the final value of the second operand.
+ * @return error code, zero if no error.
+ */
+static inline int operand(const struct vm_state * state, const uint32_t * mem,
+                          const struct vm_insn * ins, int * param)
+{
+    const int opcode = ins->opcode;
+    const int memsize = state->memsize;
+    int value;
+
+    value = ins->imm; /* Starting point for "parsing" the final value */
+    if (ins->ri != 0) {
         /* Add indexing register Ri */
-        param += state->regs[ri];
+        value += state->regs[ins->ri];
     }
-    if (state->m == PTTK91_ADDRMOD_1) { /* Direct memory fetch */
-        if (VM_MEM_OUT_OF_BOUNDS(param, memsize)) {
-            return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
+    if (ins->m == PTTK91_ADDRMOD_1) { /* Direct memory fetch */
+        if (VM_MEM_OUT_OF_BOUNDS(value, memsize)) {
+            return mmio_read(state, value, param);
         }
-        param = mem[param];
-    } else if (state->m == PTTK91_ADDRMOD_2) { /* Indirect meory fetch */
+        value = mem[value];
+    } else if (ins->m == PTTK91_ADDRMOD_2) { /* Indirect meory fetch */
         if ((opcode >= PTTK91_JUMP && opcode <= PTTK91_JNGRE)
-            || (opcode == PTTK91_STORE)) {
+            || (opcode == PTTK91_STORE)
+            || (opcode == PTTK91_CAS) || (opcode == PTTK91_XADD)
+            || (opcode == PTTK91_VLOAD) || (opcode == PTTK91_VSTORE)) {
             /* + For all branching instructions: mode 2 is bad access mode
-             * + PTTK91_STORE doesn't support mode 2
+             * + PTTK91_STORE, atomic and vector memory instructions don't
+             *   support mode 2
              */
             return VM_ERR_BAD_ACCESS_MODE;
         }
 
         /* First fetch */
-        if (VM_MEM_OUT_OF_BOUNDS(param, memsize)) {
+        if (VM_MEM_OUT_OF_BOUNDS(value, memsize)) {
             return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
         }
-        param = mem[param];
+        value = mem[value];
 
         /* Second fetch */
-        if (VM_MEM_OUT_OF_BOUNDS(param, memsize)) {
-            return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
+        if (VM_MEM_OUT_OF_BOUNDS(value, memsize)) {
+            return mmio_read(state, value, param);
         }
-        param = mem[param];
-    } else if (state->m == PTTK91_ADDRMOD_3) {
+        value = mem[value];
+    } else if (ins->m == PTTK91_ADDRMOD_3) {
         /* Mode 3 is not specified */
         return VM_ERR_BAD_ACCESS_MODE;
     }
 
+    *param = value;
+    return 0;
+}
+
+#if VM_VECTOR == 1
+/**
+ * Evaluate a vector instruction.
+ * @param param final value of the second operand.
+ */
+static int eval_vector(struct vm_state * state, uint32_t * mem,
+                       const struct vm_insn * ins, int param)
+{
+    int32_t * vj = state->vregs[ins->rj];
+    const int32_t * vi = state->vregs[ins->ri];
+    int i;
+
+    /* param is checked before the end of the vector so that it can't
+     * overflow */
+    switch (ins->opcode) {
+    case PTTK91_VLOAD:
+        if (VM_MEM_OUT_OF_BOUNDS(param, state->memsize)
+            || param > state->memsize - PTTK91_VLEN) {
+            return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
+        }
+        memcpy(vj, &mem[param], sizeof(state->vregs[0]));
+        return 0;
+    case PTTK91_VSTORE:
+        if (VM_MEM_OUT_OF_BOUNDS_STORE(param, state->code_sec_end, state->memsize)
+            || param > state->memsize - PTTK91_VLEN) {
+            state->sr.fma = 1;
+            return VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+        }
+        VM_MEM_WRITE(state, param, param + PTTK91_VLEN - 1);
+        memcpy(&mem[param], vj, sizeof(state->vregs[0]));
+        return 0;
+    case PTTK91_VSPLAT:
+        for (i = 0; i < PTTK91_VLEN; i++)
+            vj[i] = param;
+        return 0;
+    }
+
+    /* The second operand is a vector register */
+    if (ins->m != PTTK91_ADDRMOD_0 || ins->imm != 0)
+        return VM_ERR_BAD_ACCESS_MODE;
+
+    switch (ins->opcode) {
+    case PTTK91_VSUM:
+    case PTTK91_VMIN:
+    case PTTK91_VMAX:
+        state->regs[ins->rj] = vector_reduce(ins->opcode, vi);
+        break;
+    default:
+        vector_op(ins->opcode, vj, vi);
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Evaluate a decoded instruction.
+ */
+static int eval(struct vm_state * state, uint32_t * mem, const struct vm_insn * ins)
+{
+    /* Copy some data for (hopefully) faster access */
+    int opcode = ins->opcode;
+    int rj = ins->rj;
+    int ri = ins->ri;
+    int memsize = state->memsize;
+
+    int param; /* Final second arg value will be stored to this variable */
+    int i, sp; /* Temp variables */
+    uint32_t old;
+
+    i = operand(state, mem, ins, &param);
+    if (i != 0) {
+        return i;
+    }
+
     /* Execute */
     switch(opcode) {
     case PTTK91_NOP:
@@ -211,23 +467,57 @@ static int eval(struct vm_state * state, uint32_t * mem)
     /* Data transfer instructions */
     case PTTK91_STORE:
         if (VM_MEM_OUT_OF_BOUNDS_STORE(param, state->code_sec_end, memsize)) {
-            state->sr.fma = 1;
-            return VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+            i = (param >= memsize) ? mmio_write(state, param, state->regs[rj])
+                                   : VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+            if (i == 0)
+                break;
+            if (i == VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS)
+                state->sr.fma = 1;
+            return i;
         }
+        VM_MEM_WRITE(state, param, param);
         mem[param] = state->regs[rj];
         break;
     case PTTK91_LOAD:
         state->regs[rj] = param;
         break;
     case PTTK91_IN:
-        if (inp_handler(param, &(state->regs[rj]))) {
+        if (VM_TRACE_REPLAYING(state)) {
+            /* Read the recorded value instead of the device */
+            VM_TRACE_EVENT(state, TRACE_EV_IN, param, &(state->regs[rj]));
+            VM_METRICS_INC(state, in_count);
+            break;
+        }
+        i = (state->io && state->io->in) ? state->io->in(state->io->arg, param, &(state->regs[rj]))
+                                         : inp_handler(param, &(state->regs[rj]));
+        if (i == VM_IO_WAIT) {
+            io_wait(state);
+            break;
+        }
+        if (i) {
             return VM_ERR_INVALID_DEVICE;
         }
+        VM_TRACE_EVENT(state, TRACE_EV_IN, param, &(state->regs[rj]));
+        VM_METRICS_INC(state, in_count);
         break;
     case PTTK91_OUT:
-        if (outp_handler(param, state->regs[rj])) {
+        if (VM_TRACE_REPLAYING(state)) {
+            VM_TRACE_EVENT(state, TRACE_EV_OUT, param, &(state->regs[rj]));
+            VM_METRICS_INC(state, out_count);
+            break;
+        }
+        i = (state->io && state->io->out) ? state->io->out(state->io->arg, param, state->regs[rj])
+                                          : outp_handler(param, state->regs[rj]);
+        if (i == VM_IO_WAIT) {
+            /* Recorded when the OUT is executed again */
+            io_wait(state);
+            break;
+        }
+        VM_TRACE_EVENT(state, TRACE_EV_OUT, param, &(state->regs[rj]));
+        if (i) {
             return VM_ERR_INVALID_DEVICE;
         }
+        VM_METRICS_INC(state, out_count);
         break;
 
     /* Arithmetic instructions */
@@ -281,84 +571,73 @@ static int eval(struct vm_state * state, uint32_t * mem)
         break;
 
     case PTTK91_COMP:
-        if (state->regs[rj] > param) {
-            state->sr.gre = 1;
-            state->sr.equ = 0;
-            state->sr.les = 0;
-        } else if (state->regs[rj] < param) {
-            state->sr.gre = 0;
-            state->sr.equ = 0;
-            state->sr.les = 1;
-        } else {
-            state->sr.gre = 0;
-            state->sr.equ = 1;
-            state->sr.les = 0;
-        }
+        /* Flags are derived from the difference when needed */
+        state->cmp = (int64_t)state->regs[rj] - param;
         break;
 
     /* Branching instructions */
     case PTTK91_JUMP:
-        state->pc = param;
+        VM_BRANCH(state, param);
         break;
     case PTTK91_JNEG:
         if (state->regs[rj] < 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JZER:
         if (state->regs[rj] == 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JPOS:
         if (state->regs[rj] > 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNNEG:
         if (state->regs[rj] >= 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNZER:
         if (state->regs[rj] != 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNPOS:
         if (state->regs[rj] <= 0) {
-            state->pc = param;
+            VM_BRANCH(state, param);
         }
         break;
 
     case PTTK91_JLES:
-        if (state->sr.les) {
-            state->pc = param;
+        if (state->cmp < 0) {
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JEQU:
-        if (state->sr.equ) {
-            state->pc = param;
+        if (state->cmp == 0) {
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JGRE:
-        if (state->sr.gre) {
-            state->pc = param;
+        if (state->cmp > 0 && state->cmp != VM_CMP_NONE) {
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNLES:
-        if (state->sr.equ || state->sr.gre) {
-            state->pc = param;
+        if (state->cmp >= 0 && state->cmp != VM_CMP_NONE) {
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNEQU:
-        if (state->sr.les || state->sr.gre) {
-            state->pc = param;
+        if (state->cmp != 0 && state->cmp != VM_CMP_NONE) {
+            VM_BRANCH(state, param);
         }
         break;
     case PTTK91_JNGRE:
-        if (state->sr.les || state->sr.equ) {
-            state->pc = param;
+        if (state->cmp <= 0) {
+            VM_BRANCH(state, param);
         }
         break;
 
@@ -371,10 +650,12 @@ static int eval(struct vm_state * state, uint32_t * mem)
             return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
         }
 
+        VM_MEM_WRITE(state, state->regs[rj] - 1, state->regs[rj]);
         mem[state->regs[rj] - 1] = state->pc; /* Push PC */
         mem[state->regs[rj]] = state->regs[PTTK91_FP]; /* Push FP */
         state->regs[PTTK91_FP] = state->regs[rj]; /* Set new FP */
-        state->pc = param; /* Branch */
+        VM_TRACE_EVENT(state, TRACE_EV_CALL, 0, &param);
+        VM_JUMP(state, param); /* Branch */
         break;
     case PTTK91_EXIT:
         sp = state->regs[PTTK91_FP];
@@ -390,10 +671,13 @@ static int eval(struct vm_state * state, uint32_t * mem)
             return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
         }
 
+        i = mem[sp - 1];
+        VM_TRACE_EVENT(state, TRACE_EV_EXIT, 0, &i);
+
         /* Read back the original sp & fp values */
         state->regs[rj] = sp - 2 - param;
         state->regs[PTTK91_FP] = mem[sp];
-        state->pc = mem[sp - 1]; /* Return */
+        VM_JUMP(state, i); /* Return */
         break;
 
     /* Stack instructions */
@@ -405,13 +689,14 @@ static int eval(struct vm_state * state, uint32_t * mem)
         if (VM_MEM_OUT_OF_BOUNDS_STORE(sp, state->code_sec_end, memsize)) {
             return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
         }
+        VM_MEM_WRITE(state, sp, sp);
         mem[sp] = param;
         break;
     case PTTK91_POP:
         sp = state->regs[rj];
         /* POP: Second operand should be always a register */
 
-        if (state->m != 0) {
+        if (ins->m != 0) {
             return VM_ERR_BAD_ACCESS_MODE;
         }
 
@@ -429,6 +714,7 @@ static int eval(struct vm_state * state, uint32_t * mem)
             if (VM_MEM_OUT_OF_BOUNDS_STORE(sp, state->code_sec_end, memsize)) {
                 return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
             }
+            VM_MEM_WRITE(state, sp, sp);
             mem[sp++] = state->regs[i];
         }
         break;
@@ -442,15 +728,71 @@ static int eval(struct vm_state * state, uint32_t * mem)
         state->regs[rj] = state->regs[rj] - (PTTK91_NUM_REGS - 1);
         break;
 
+    /* Atomic instructions, see smp.h for the memory model */
+    case PTTK91_CAS:
+        if (VM_MEM_OUT_OF_BOUNDS_STORE(param, state->code_sec_end, memsize)) {
+            state->sr.fma = 1;
+            return VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+        }
+        VM_MEM_WRITE(state, param, param);
+        /* Store Rj if the word equals R0, R0 gets the old value and the
+         * flags are set as by COMP R0 so JEQU branches on success. */
+        i = state->regs[0];
+        old = (uint32_t)i;
+        __atomic_compare_exchange_n(&mem[param], &old, (uint32_t)state->regs[rj],
+                                    0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        state->regs[0] = (int)old;
+        state->cmp = (int64_t)(int)old - i;
+        break;
+    case PTTK91_XADD:
+        if (VM_MEM_OUT_OF_BOUNDS_STORE(param, state->code_sec_end, memsize)) {
+            state->sr.fma = 1;
+            return VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS;
+        }
+        VM_MEM_WRITE(state, param, param);
+        /* Add Rj to the word, Rj gets the old value */
+        state->regs[rj] = (int)__atomic_fetch_add(&mem[param], (uint32_t)state->regs[rj],
+                                                  __ATOMIC_SEQ_CST);
+        break;
+
+#if VM_VECTOR == 1
+    /* Vector instructions */
+    case PTTK91_VLOAD:
+    case PTTK91_VSTORE:
+    case PTTK91_VSPLAT:
+    case PTTK91_VADD:
+    case PTTK91_VSUB:
+    case PTTK91_VMUL:
+    case PTTK91_VAND:
+    case PTTK91_VOR:
+    case PTTK91_VCOMP:
+    case PTTK91_VSUM:
+    case PTTK91_VMIN:
+    case PTTK91_VMAX:
+        return eval_vector(state, mem, ins, param);
+#endif
+
     /* System calls */
     case PTTK91_SVC:
 #if VM_DEBUG == 1
-        printf("SVC %i\n", param);
+        fprintf(stderr, "SVC %i\n", param);
 #endif
+        VM_TRACE_EVENT(state, TRACE_EV_SVC, param, &param);
+        VM_METRICS_INC(state, svc_count);
         if (svc_handler(state, mem, param)) {
             return VM_ERR_ILLEGAL_SVC;
         }
         break;
+
+    /* Debugging */
+    case PTTK91_BKPT:
+        /* Stop at the trap so the debugger can restore the original
+         * instruction and resume from the same address. The trap doesn't
+         * retire, the instruction is counted when it's executed. */
+        state->pc--;
+        state->stop = VM_STOP_BREAKPOINT;
+        state->running = 0;
+        break;
     default:
         state->sr.uni = 1;
         return VM_ERR_INVALID_OPCODE;
@@ -459,16 +801,325 @@ static int eval(struct vm_state * state, uint32_t * mem)
     return 0;
 }
 
+/**
+ * Evaluate n decoded instructions starting from ins with one dispatch.
+ * Stops early if the sequence branches or stops the VM.
+ */
+static int eval_seq(struct vm_state * state, uint32_t * mem,
+                    const struct vm_insn * ins, int n)
+{
+    const int start = state->pc - 1;
+    int i = 0;
+    int error_code;
+
+    while (1) {
+        error_code = eval(state, mem, &ins[i]);
+        if (error_code != 0 || !state->running
+            || state->pc != start + i + 1 || ++i >= n) {
+            return error_code;
+        }
+        state->pc = start + i + 1;
+    }
+}
+
+/**
+ * Execute a counted loop on the host.
+ * @return 1 if the loop was executed; 0 if it must be interpreted.
+ */
+static int eval_loop(struct vm_state * state, uint32_t * mem, const struct vm_insn * ins)
+{
+    const int start = state->pc - 1;
+    struct loop_desc loop;
+    int64_t n, i, lo, hi;
+    int x0, a;
+    uint32_t sum = 0;
+
+    if (!loop_match(ins, start, ins->len, &loop))
+        return 0;
+    x0 = state->regs[loop.x];
+    if (loop_count(&loop, x0, &n))
+        return 0;
+
+    /* Range of the index */
+    lo = (loop.step > 0) ? x0 : x0 + (n - 1) * loop.step;
+    hi = (loop.step > 0) ? x0 + (n - 1) * loop.step : x0;
+
+    /* Every access must succeed */
+    if (loop.kind == LOOP_SUM || loop.kind == LOOP_COPY) {
+        const int64_t src = (loop.kind == LOOP_COPY) ? loop.src : loop.base;
+
+        if (src + lo < 0 || src + hi >= state->memsize)
+            return 0;
+    }
+    if (loop.kind == LOOP_FILL || loop.kind == LOOP_COPY) {
+        if (loop.base + lo < 0 || loop.base + hi > INT32_MAX
+            || VM_MEM_OUT_OF_BOUNDS_STORE((int)(loop.base + lo), state->code_sec_end, state->memsize)
+            || VM_MEM_OUT_OF_BOUNDS_STORE((int)(loop.base + hi), state->code_sec_end, state->memsize)) {
+            return 0;
+        }
+#if VM_CODE_AREA_RW == 1
+        if (loop.base + lo < state->code->len)
+            return 0;
+#endif
+    }
+    if (loop.kind == LOOP_COPY && loop.src != loop.base
+        && loop.src + hi >= loop.base + lo && loop.base + hi >= loop.src + lo) {
+        return 0; /* Overlapping copy */
+    }
+
+    if (loop.kind == LOOP_FILL || loop.kind == LOOP_COPY) {
+        VM_MEM_WRITE(state, (int)(loop.base + lo), (int)(loop.base + hi));
+        /* PC is past the STORE of the body while writing, as seen by
+         * watchpoints */
+        state->pc = start + ((loop.kind == LOOP_COPY) ? 2 : 1);
+    }
+
+    if (loop.step == 1 || loop.step == -1) {
+        /* Contiguous, the order doesn't matter */
+        uint32_t * dst = mem + loop.base + lo;
+        const uint32_t value = state->regs[loop.r];
+
+        switch (loop.kind) {
+        case LOOP_FILL:
+            for (i = 0; i <= hi - lo; i++)
+                dst[i] = value;
+            break;
+        case LOOP_COPY:
+            memmove(dst, mem + loop.src + lo, (size_t)(hi - lo + 1) * sizeof(uint32_t));
+            break;
+        default: /* LOOP_SUM */
+            for (i = 0; i <= hi - lo; i++)
+                sum += dst[i];
+            break;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            a = (int)(x0 + i * loop.step);
+            switch (loop.kind) {
+            case LOOP_FILL:
+                mem[loop.base + a] = state->regs[loop.r];
+                break;
+            case LOOP_COPY:
+                mem[loop.base + a] = mem[loop.src + a];
+                break;
+            default: /* LOOP_SUM */
+                sum += mem[loop.base + a];
+                break;
+            }
+        }
+    }
+
+    if (loop.kind == LOOP_COPY) {
+        /* Value loaded on the last iteration */
+        a = (int)(x0 + (n - 1) * loop.step);
+        state->regs[loop.r] = (int)mem[loop.src + a];
+    } else if (loop.kind == LOOP_SUM) {
+        state->regs[loop.r] = (int)((uint32_t)state->regs[loop.r] + sum);
+    }
+    state->regs[loop.x] = (int)(x0 + n * loop.step);
+    /* The run of the caller covers the first iteration */
+    state->count += (uint64_t)(n - 1) * loop.len;
+    if (loop.comp)
+        state->cmp = (int64_t)state->regs[loop.x] - loop.limit;
+    state->pc = start + loop.len;
+
+    return 1;
+}
+
+/**
+ * Evaluate a fused instruction sequence.
+ */
+static int eval_fused(struct vm_state * state, uint32_t * mem, const struct vm_insn * ins)
+{
+    const int start = state->pc - 1;
+    int param, addr, taken;
+    int error_code;
+
+    switch (ins->xop) {
+    case VM_XOP_COMP_JCC:
+        error_code = operand(state, mem, &ins[0], &param);
+        if (error_code != 0) {
+            return error_code;
+        }
+        state->cmp = (int64_t)state->regs[ins[0].rj] - param;
+
+        state->pc = start + 2;
+        error_code = operand(state, mem, &ins[1], &param);
+        if (error_code != 0) {
+            return error_code;
+        }
+
+        switch (ins[1].opcode) {
+        case PTTK91_JLES:
+            taken = state->cmp < 0;
+            break;
+        case PTTK91_JEQU:
+            taken = state->cmp == 0;
+            break;
+        case PTTK91_JGRE:
+            taken = state->cmp > 0;
+            break;
+        case PTTK91_JNLES:
+            taken = state->cmp >= 0;
+            break;
+        case PTTK91_JNEQU:
+            taken = state->cmp != 0;
+            break;
+        default: /* PTTK91_JNGRE */
+            taken = state->cmp <= 0;
+            break;
+        }
+        if (taken) {
+            VM_BRANCH(state, param);
+        }
+        break;
+
+    case VM_XOP_LOAD_ADD_STORE:
+        /* load rj, x ; add rj, =k ; store rj, x */
+        addr = ins[0].imm;
+        if (VM_MEM_OUT_OF_BOUNDS_STORE(addr, state->code_sec_end, state->memsize)) {
+            /* Let the instructions report the error */
+            return eval_seq(state, mem, ins, 3);
+        }
+
+        param = (int)mem[addr];
+        param = (ins[1].opcode == PTTK91_ADD) ? param + ins[1].imm : param - ins[1].imm;
+        state->regs[ins[0].rj] = param;
+        /* PC is past the STORE when it writes, as seen by watchpoints */
+        state->pc = start + 3;
+        VM_MEM_WRITE(state, addr, addr);
+        mem[addr] = param;
+        break;
+
+    case VM_XOP_LOOP:
+        if (eval_loop(state, mem, ins)) {
+            return 0;
+        }
+        return eval_seq(state, mem, ins, ins->len);
+
+    case VM_XOP_DROP:
+        if (ins->opcode == PTTK91_STORE && ins->imm >= state->memsize) {
+            /* A device may read back another value than was written */
+            return eval_seq(state, mem, ins, ins->len);
+        }
+        error_code = eval(state, mem, ins);
+        if (error_code == 0 && state->pc == start + 1) {
+            /* The dropped instructions count as executed */
+            state->pc = start + ins->len;
+        }
+        return error_code;
+
+    default: /* VM_XOP_SEQ */
+        return eval_seq(state, mem, ins, ins->len);
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the VM on a runtime error.
+ */
+static void halt_on_error(struct vm_state * state, int error_code)
+{
+    if (error_code == VM_ERR_PC_OUT_OF_BOUNDS && state->pc == VM_CALL_RETURN
+        && state->call_depth > 0) {
+        /* EXIT of the frame pushed by vm_call() */
+        state->stop = VM_STOP_RETURN;
+        state->running = 0;
+        return;
+    }
+
+    print_error_msg(error_code);
+    state->error = error_code;
+    state->stop = VM_STOP_ERROR;
+    state->running = 0;
+}
+
 /**
  * Print all registers.
  */
-static void showRegs(const struct vm_state * state)
+void vm_show_regs(const struct vm_state * state)
 {
     int i;
-    printf("regs = ");
+    fprintf(stderr, "regs = ");
     for(i = 0; i < PTTK91_NUM_REGS; i++)
-        printf( "r%i: %08X, ", i, (unsigned int)(state->regs[i]));
-    printf("PC: %i \n", state->pc);
+        fprintf(stderr, "r%i: %08X, ", i, (unsigned int)(state->regs[i]));
+    fprintf(stderr, "SR: %08X, PC: %i \n", (unsigned int)vm_get_sr(state), state->pc);
+}
+
+/**
+ * Name of a stop reason.
+ * @param stop one of VM_STOP_x.
+ */
+const char * vm_stop_name(int stop)
+{
+    switch (stop) {
+    case VM_STOP_HALT:
+        return "halt";
+    case VM_STOP_ERROR:
+        return "error";
+    case VM_STOP_BREAKPOINT:
+        return "breakpoint";
+    case VM_STOP_WATCH:
+        return "watch";
+    case VM_STOP_RETURN:
+        return "return";
+    case VM_STOP_WAIT:
+        return "wait";
+    case VM_STOP_SLICE:
+        return "slice";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * Fetch, decode and evaluate one instruction from the memory.
+ * @return error code, zero if no error.
+ */
+static int step(struct vm_state * state, uint32_t * mem)
+{
+    uint32_t instr = 0;
+    int error_code;
+
+    error_code = fetch(&instr, state, mem);
+    if (error_code == 0)
+        error_code = vm_decode(&(state->ir), instr);
+    if (error_code == 0)
+        error_code = eval(state, mem, &(state->ir));
+
+    if (error_code != 0) {
+        halt_on_error(state, error_code);
+    }
+    return error_code;
+}
+
+/**
+ * Run program from decoded code.
+ * Falls back to decoding from the memory outside of the decoded code.
+ */
+static void run_code(struct vm_state * state, uint32_t * mem)
+{
+    const struct vm_insn * ins;
+    int error_code;
+    int pc;
+
+    do {
+#if VM_DEBUG == 1
+        vm_show_regs(state);
+#endif
+        pc = state->pc;
+        if (state->code && pc >= 0 && pc < state->code->len) {
+            ins = &(state->code->insn[pc]);
+            state->pc = pc + 1;
+            error_code = (ins->xop) ? eval_fused(state, mem, ins) : eval(state, mem, ins);
+            if (error_code != 0) {
+                halt_on_error(state, error_code);
+            }
+        } else {
+            step(state, mem);
+        }
+    } while (state->running);
 }
 
 /**
@@ -483,21 +1134,31 @@ void vm_run(struct vm_state * state, uint32_t * mem)
     int error_code;
     int rstate = 0;
 
-    do {
+    state->stop = VM_STOP_HALT;
+    state->count_pc = state->pc;
+    state->slice_end = (state->slice) ? state->count + state->slice : UINT64_MAX;
+    if (state->code) {
+        run_code(state, mem);
+    } else do {
         switch (rstate) {
         case 0: /* Fetch */
 #if VM_DEBUG == 1
-            showRegs(state);
+            vm_show_regs(state);
 #endif
             error_code = fetch(&instr, state, mem);
         break;
 
         case 1: /* Decode */
-            error_code = decode(state, instr);
+            error_code = vm_decode(&(state->ir), instr);
             break;
 
         case 2: /* Evaluate */
-            error_code = eval(state, mem);
+#if VM_PROFILE == 1
+            if (state->profile) {
+                FUSE_PROFILE_COUNT(state->profile, state->ir.opcode);
+            }
+#endif
+            error_code = eval(state, mem, &(state->ir));
             break;
 
         default:
@@ -506,19 +1167,96 @@ void vm_run(struct vm_state * state, uint32_t * mem)
         }
         /* Halt on runtime error */
         if (error_code != 0) {
-            print_error_msg(error_code);
-            state->running = 0;
+            halt_on_error(state, error_code);
         }
 
         if (++rstate > 2)
             rstate = 0;
     } while (state->running);
+    VM_COUNT_RUN(state);
+    state->slice_end = UINT64_MAX;
 
 #if VM_DEBUG == 1
-    showRegs(state);
+    vm_show_regs(state);
 #endif
  }
 
+/**
+ * Execute exactly one instruction.
+ * @param state virtual machine state registers.
+ * @param mem program memory space.
+ * @return error code, zero if no error.
+ */
+int vm_step(struct vm_state * state, uint32_t * mem)
+{
+    int error_code;
+
+    /* No slice outside of vm_run() */
+    state->slice_end = UINT64_MAX;
+    state->count_pc = state->pc;
+    error_code = step(state, mem);
+    VM_COUNT_RUN(state);
+    return error_code;
+}
+
+/**
+ * Call a subroutine of a loaded program.
+ * Pushes a result slot and the arguments to the stack like the TTK91 calling
+ * convention does and executes the subroutine until its EXIT returns. The
+ * subroutine finds the arguments below its FP, the last argument at FP - 2,
+ * and stores its result to FP - 2 - nargs. The memory and the state are
+ * reused as is, so a program is called any number of times after it's
+ * loaded, e.g. after its main program has run. A jump to VM_CALL_RETURN is
+ * a return only while a vm_call() is running.
+ * @param state virtual machine state registers.
+ * @param mem program memory space.
+ * @param entry address of the subroutine, e.g. from the symbol table.
+ * @param args arguments pushed in order.
+ * @param result returns the result slot.
+ * @return zero if the subroutine returned; VM_ERR_ADDRESS_OUT_OF_BOUNDS if
+ *         the frame doesn't fit to the stack; otherwise -1 and state->stop
+ *         tells why the VM stopped before returning.
+ */
+int vm_call(struct vm_state * state, uint32_t * mem, int entry,
+            const int * args, int nargs, int * result)
+{
+    const int sp = state->regs[PTTK91_SP];
+    const int fp = state->regs[PTTK91_FP];
+    int i;
+
+    /* Result slot, arguments, return address and FP */
+    if (nargs < 0 || nargs > state->memsize
+        || VM_MEM_OUT_OF_BOUNDS_STORE(sp + 1, state->code_sec_end, state->memsize)
+        || VM_MEM_OUT_OF_BOUNDS_STORE(sp + nargs + 3, state->code_sec_end, state->memsize)) {
+        return VM_ERR_ADDRESS_OUT_OF_BOUNDS;
+    }
+    VM_MEM_WRITE(state, sp + 1, sp + nargs + 3);
+
+    mem[sp + 1] = 0;
+    for (i = 0; i < nargs; i++) {
+        mem[sp + 2 + i] = args[i];
+    }
+    mem[sp + nargs + 2] = (uint32_t)VM_CALL_RETURN;
+    mem[sp + nargs + 3] = fp;
+    state->regs[PTTK91_SP] = sp + nargs + 3;
+    state->regs[PTTK91_FP] = sp + nargs + 3;
+    state->pc = entry;
+    state->running = 1;
+    state->error = VM_ERR_NO_ERROR;
+
+    state->call_depth++;
+    vm_run(state, mem);
+    state->call_depth--;
+    if (state->stop != VM_STOP_RETURN)
+        return -1;
+
+    /* Pop the result even if EXIT didn't remove all of the arguments */
+    *result = (int)mem[sp + 1];
+    state->regs[PTTK91_SP] = sp;
+    state->regs[PTTK91_FP] = fp;
+    return 0;
+}
+
 /**
   * @}
   */
@@ -0,0 +1,86 @@
+/**
+ *******************************************************************************
+ * @file    watch.h
+ * @author  Olli Vanhoja
+ * @brief   Memory watchpoints.
+ *******************************************************************************
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "config.h"
+
+#define WATCH_MAX           16 /*!< Maximum number of watched ranges */
+
+/**
+ * Watchpoint hit.
+ */
+struct watch_hit {
+    int pc;             /*!< Address of the instruction that wrote */
+    int addr;           /*!< Address of the modified word */
+    uint32_t old_value;
+    uint32_t new_value;
+};
+
+typedef void (*watch_cb_t)(const struct watch_hit * hit, void * arg);
+
+struct watch_range {
+    int addr;
+    int len;
+};
+
+/**
+ * Watchpoint state of a vm instance.
+ * Watched pages of the vm memory are write protected by the platform so
+ * instructions not touching those pages run at full speed.
+ */
+struct watch_state {
+    struct vm_state * vm;
+    uint32_t * mem;
+    int count;
+    struct watch_range range[WATCH_MAX];
+
+    /* Pages written by the current instruction, for internal use. There is
+     * room for every watched page, so an instruction writing many pages,
+     * e.g. a host executed loop, is still reported. */
+    int npending;
+    int max_pending;
+    int pending_pc;
+    int * pending_page;
+    uint32_t * pending_copy; /*!< Old contents of the pending pages */
+};
+
+/* Portable functions */
+/**
+ * Initialize watchpoints for a vm instance.
+ * Watchpoints are not supported with SMP because writes of the other CPUs
+ * would not be reported.
+ * @param mem pointer to the memory of the vm, must be page aligned.
+ * @return 0 if no error; 1 if mem is not page aligned; 2 if state->smp is
+ *         set.
+ */
+int watch_init(struct watch_state * ws, struct vm_state * state, uint32_t * mem);
+void watch_deinit(struct watch_state * ws);
+
+/**
+ * Watch writes to len words starting from addr.
+ * @return 0 if no error; 1 if the range is invalid; 2 if out of watchpoints
+ *         or memory.
+ */
+int watch_add(struct watch_state * ws, int addr, int len);
+
+/**
+ * Run the vm and call cb for each modified watched word.
+ * @return stop reason, see VM_STOP_x.
+ */
+int watch_run(struct watch_state * ws, watch_cb_t cb, void * arg);
+/* End of portable functions */
+
+#ifndef VM_PLATFORM
+#error Please select VM_PLATFORM
+#endif
+
+#endif /* WATCH_H */
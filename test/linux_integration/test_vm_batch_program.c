@@ -0,0 +1,89 @@
+/* file test_vm_batch_program.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "program.h"
+#include "batch.h"
+
+#define JOBS 20
+
+static struct program_cache programs;
+static char manifest[] = "/tmp/pttk91-batch-XXXXXX";
+static char input[] = "/tmp/pttk91-input-XXXXXX";
+
+static void setup()
+{
+    FILE * fp;
+    int i;
+
+    program_cache_init(&programs);
+
+    fp = fdopen(mkstemp(input), "w");
+    fprintf(fp, "3\n5\n");
+    fclose(fp);
+
+    fp = fdopen(mkstemp(manifest), "w");
+    fprintf(fp, "# pow\n\n");
+    for (i = 0; i < JOBS; i++)
+        fprintf(fp, "asm/pow.b91 %s\n", input);
+    fprintf(fp, "asm/missing.b91\n");
+    fprintf(fp, "asm/pow.b91 /nonexistent/pow.in\n");
+    fclose(fp);
+}
+
+static void teardown()
+{
+    remove(manifest);
+    remove(input);
+    program_cache_free(&programs);
+}
+
+static char * test_batch_manifest()
+{
+    FILE * out;
+    char line[512];
+    char expected[128];
+    int seen[JOBS + 2] = { 0 };
+    int id, n = 0;
+
+    out = tmpfile();
+    pu_assert_equal("error, Batch failed", batch_run(&programs, manifest, 4, 1024, out, NULL), 0);
+    rewind(out);
+
+    snprintf(expected, sizeof(expected),
+             "\"input\":\"%s\",\"stop\":\"halt\",\"error\":0,\"output\":[3,5,243]", input);
+    while (fgets(line, sizeof(line), out)) {
+        pu_assert("error, Not a job", sscanf(line, "{\"job\":%i,", &id) == 1);
+        pu_assert("error, Job id", id >= 0 && id <= JOBS + 1 && !seen[id]);
+        seen[id] = 1;
+        if (id < JOBS) {
+            pu_assert("error, Result", strstr(line, expected) != NULL);
+        } else if (id == JOBS) {
+            pu_assert("error, Missing program", strstr(line, "\"stop\":\"load\"") != NULL);
+        } else {
+            pu_assert("error, Missing input", strstr(line, "\"stop\":\"input\"") != NULL);
+        }
+        n++;
+    }
+    fclose(out);
+
+    pu_assert_equal("error, Number of results", n, JOBS + 2);
+    pu_assert("error, Programs released", programs.head == NULL);
+
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_batch_manifest, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
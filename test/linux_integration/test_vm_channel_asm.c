@@ -0,0 +1,231 @@
+/* file test_vm_channel_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "channel.h"
+
+#define MEMSIZE 256
+#define STAGES  3
+#define COUNT   1000
+
+/* Each stage forwards the count and transforms that many values */
+static const char * stage_src[STAGES][9] = {
+    {
+        "        in r2, =kbd",
+        "        out r2, =crt",
+        "loop    jzer r2, done",
+        "        in r1, =kbd",
+        "        mul r1, =2",
+        "        out r1, =crt",
+        "        sub r2, =1",
+        "        jump loop",
+        "done    svc sp, =halt"
+    },
+    {
+        "        in r2, =kbd",
+        "        out r2, =crt",
+        "loop    jzer r2, done",
+        "        in r1, =kbd",
+        "        add r1, =1",
+        "        out r1, =crt",
+        "        sub r2, =1",
+        "        jump loop",
+        "done    svc sp, =halt"
+    },
+    {
+        "        in r2, =kbd",
+        "        out r2, =crt",
+        "loop    jzer r2, done",
+        "        in r1, =kbd",
+        "        mul r1, =3",
+        "        out r1, =crt",
+        "        sub r2, =1",
+        "        jump loop",
+        "done    svc sp, =halt"
+    }
+};
+
+/* Reads until the producer stops */
+static const char * forever[] = {
+    "loop    in r1, =kbd",
+    "        out r1, =crt",
+    "        jump loop"
+};
+
+/* Computes without end after its only OUT */
+static const char * busy[] = {
+    "        load r1, =7",
+    "        out r1, =crt",
+    "loop    jump loop"
+};
+
+static uint32_t mem[STAGES][MEMSIZE];
+static struct vm_state state[STAGES];
+static struct vm_code * code[STAGES];
+static struct channel ch[STAGES + 1];
+
+static void setup()
+{
+    int i;
+
+    /* The ends are filled and drained by the test, the channels between
+     * the stages are small to suspend the stages often */
+    channel_init(&ch[0], 2048);
+    channel_init(&ch[1], 16);
+    channel_init(&ch[2], 16);
+    channel_init(&ch[3], 2048);
+    memset(code, 0, sizeof(code));
+    for (i = 0; i < STAGES; i++)
+        memset(mem[i], 0, sizeof(mem[i]));
+}
+
+static void teardown()
+{
+    int i;
+
+    for (i = 0; i <= STAGES; i++)
+        channel_free(&ch[i]);
+    for (i = 0; i < STAGES; i++)
+        code_free(code[i]);
+}
+
+static void load(int i, const char ** src, int lines)
+{
+    struct asm_state as;
+    int code_size, image_size, j;
+
+    asm_init(&as);
+    for (j = 0; j < lines; j++)
+        asm_line(&as, src[j]);
+    asm_finish(&as);
+    asm_image(&as, mem[i], MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    vm_init_state(&state[i], code_size, MEMSIZE);
+    state[i].regs[PTTK91_SP] = image_size - 1;
+    state[i].regs[PTTK91_FP] = image_size - 1;
+    if (i == 1) {
+        /* Suspend in decoded code too */
+        code[i] = code_decode(mem[i], code_size);
+        state[i].code = code[i];
+    }
+}
+
+static char * test_pipeline()
+{
+    struct channel_stage stage[STAGES];
+    uint32_t values[COUNT + 1];
+    int i;
+
+    values[0] = COUNT;
+    for (i = 0; i < COUNT; i++)
+        values[i + 1] = i;
+    pu_assert_equal("error, Input", (int)mmio_ring_push(&ch[0].ring, values, COUNT + 1), COUNT + 1);
+    channel_close_write(&ch[0]);
+
+    for (i = 0; i < STAGES; i++) {
+        load(i, stage_src[i], 9);
+        stage[i].state = &state[i];
+        stage[i].mem = mem[i];
+        channel_port_init(&stage[i].port, &ch[i], &ch[i + 1]);
+        state[i].io = &stage[i].port.io;
+    }
+    pu_assert_equal("error, Run", channel_run(stage, STAGES, NULL), 0);
+
+    for (i = 0; i < STAGES; i++) {
+        pu_assert_equal("error, Halted", state[i].stop, VM_STOP_HALT);
+        pu_assert_equal("error, No error", state[i].error, VM_ERR_NO_ERROR);
+    }
+    pu_assert_equal("error, Instructions", (int)state[1].count, 3 + 6 * COUNT + 1);
+
+    pu_assert_equal("error, Output", (int)mmio_ring_pop(&ch[3].ring, values, COUNT + 1), COUNT + 1);
+    pu_assert_equal("error, Count", (int)values[0], COUNT);
+    for (i = 0; i < COUNT; i++) {
+        pu_assert_equal("error, Value", (int)values[i + 1], (2 * i + 1) * 3);
+    }
+    pu_assert("error, Closed", ch[3].eof && ch[0].broken);
+    return 0;
+}
+
+static char * test_end_of_input()
+{
+    struct channel_stage stage;
+    uint32_t values[8] = { 1, 2, 3, 4, 5 };
+
+    mmio_ring_push(&ch[0].ring, values, 5);
+    channel_close_write(&ch[0]);
+
+    load(0, forever, 3);
+    stage.state = &state[0];
+    stage.mem = mem[0];
+    channel_port_init(&stage.port, &ch[0], &ch[3]);
+    state[0].io = &stage.port.io;
+    pu_assert_equal("error, Run", channel_run(&stage, 1, NULL), 0);
+
+    /* The output is delivered before IN fails */
+    pu_assert_equal("error, Stopped", state[0].stop, VM_STOP_ERROR);
+    pu_assert_equal("error, End of input", state[0].error, VM_ERR_INVALID_DEVICE);
+    pu_assert_equal("error, Output", (int)mmio_ring_pop(&ch[3].ring, values, 8), 5);
+    pu_assert_equal("error, Last value", (int)values[4], 5);
+    return 0;
+}
+
+static int busy_done;
+
+static void * run_busy(void * arg)
+{
+    channel_run((struct channel_stage *)arg, 1, NULL);
+    __atomic_store_n(&busy_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static char * test_slice_flush()
+{
+    struct channel_stage stage;
+    pthread_t tid;
+    uint32_t value = 0;
+    int i;
+
+    load(0, busy, 3);
+    stage.state = &state[0];
+    stage.mem = mem[0];
+    channel_port_init(&stage.port, NULL, &ch[3]);
+    state[0].io = &stage.port.io;
+    busy_done = 0;
+    pu_assert_equal("error, Started", pthread_create(&tid, NULL, run_busy, &stage), 0);
+
+    /* The output is pushed at the end of a slice while the stage runs */
+    for (i = 0; i < 2000 && mmio_ring_count(&ch[3].ring) == 0; i++)
+        usleep(1000);
+    while (!__atomic_load_n(&busy_done, __ATOMIC_ACQUIRE)) {
+        state[0].running = 0;
+        usleep(1000);
+    }
+    pthread_join(tid, NULL);
+
+    pu_assert("error, Pushed while running", i < 2000);
+    pu_assert_equal("error, Output", (int)mmio_ring_pop(&ch[3].ring, &value, 1), 1);
+    pu_assert_equal("error, Value", (int)value, 7);
+    pu_assert_equal("error, Stopped by the host", state[0].stop, VM_STOP_HALT);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_pipeline, PU_RUN);
+    pu_def_test(test_end_of_input, PU_RUN);
+    pu_def_test(test_slice_flush, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,155 @@
+/* file test_vm_checkpoint_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "mem.h"
+#include "checkpoint.h"
+
+#define MEMSIZE 65536
+#define FORKS   64
+
+/* Initializes x and halts, every resumed run increments it */
+static const char * src[] = {
+    "x       dc 0",
+    "        load r1, =41",
+    "        store r1, x",
+    "        svc sp, =halt",
+    "        load r1, x",
+    "        add r1, =1",
+    "        store r1, x",
+    "        store r1, 40000",
+    "        svc sp, =halt"
+};
+
+static uint32_t * mem;
+static struct vm_state state;
+static int x;
+static char path[] = "/tmp/pttk91-checkpoint-XXXXXX";
+
+static void setup()
+{
+    struct asm_state as;
+    int code_size, image_size, i;
+
+    mem = vm_mem_alloc(MEMSIZE);
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+    x = code_size + 1;
+
+    /* The initialization is run once */
+    vm_init_state(&state, code_size, MEMSIZE);
+    vm_run(&state, mem);
+    close(mkstemp(path));
+}
+
+static void teardown()
+{
+    vm_mem_free(mem, MEMSIZE);
+    remove(path);
+}
+
+static char * test_fork()
+{
+    struct vm_snapshot snap;
+    struct vm_state fstate[FORKS];
+    uint32_t * fmem[FORKS];
+    int i;
+
+    pu_assert_equal("error, Initialized", (int)mem[x], 41);
+    pu_assert_equal("error, Snapshot", vm_snapshot(&snap, &state, mem), 0);
+
+    for (i = 0; i < FORKS; i++) {
+        fmem[i] = vm_fork(&snap, &fstate[i]);
+        pu_assert("error, Fork", fmem[i] != NULL);
+    }
+    for (i = 0; i < FORKS; i += 2) {
+        fstate[i].running = 1;
+        vm_run(&fstate[i], fmem[i]);
+        pu_assert_equal("error, Stop reason", fstate[i].stop, VM_STOP_HALT);
+    }
+    for (i = 0; i < FORKS; i++) {
+        pu_assert_equal("error, Fork private", (int)fmem[i][x], (i % 2) ? 41 : 42);
+        pu_assert_equal("error, Fork page", (int)fmem[i][40000], (i % 2) ? 0 : 42);
+    }
+    pu_assert_equal("error, Parent unchanged", (int)mem[x], 41);
+
+    pu_assert_equal("error, Restore", vm_restore(&snap, &fstate[0], fmem[0]), 0);
+    pu_assert_equal("error, Restored", (int)fmem[0][x], 41);
+    pu_assert_equal("error, Restored page", (int)fmem[0][40000], 0);
+    pu_assert_equal("error, Restored PC", fstate[0].pc, state.pc);
+
+    for (i = 0; i < FORKS; i++)
+        vm_mem_free(fmem[i], MEMSIZE);
+    vm_snapshot_free(&snap);
+    return 0;
+}
+
+static char * test_checkpoint()
+{
+    struct vm_snapshot snap, loaded;
+    struct vm_state rstate;
+    uint32_t * rmem;
+    struct stat st;
+    const uint64_t bad_offset = UINT64_MAX - 4095;
+    FILE * fp;
+
+    state.running = 0;
+    pu_assert_equal("error, Snapshot", vm_snapshot(&snap, &state, mem), 0);
+    pu_assert_equal("error, Save", checkpoint_save(&snap, path), 0);
+    vm_snapshot_free(&snap);
+
+    /* Only the page of the program is stored */
+    pu_assert("error, Stat", stat(path, &st) == 0);
+    pu_assert("error, Zero pages stored", st.st_size <= 2 * 4096);
+
+    pu_assert_equal("error, Load", checkpoint_load(&loaded, path), 0);
+    rmem = vm_fork(&loaded, &rstate);
+    pu_assert("error, Fork", rmem != NULL);
+    pu_assert_equal("error, Registers", rstate.regs[1], 41);
+    pu_assert_equal("error, PC", rstate.pc, state.pc);
+
+    rstate.running = 1;
+    vm_run(&rstate, rmem);
+    pu_assert_equal("error, Stop reason", rstate.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Resumed", (int)rmem[x], 42);
+    pu_assert("error, Count", rstate.count > state.count);
+
+    vm_mem_free(rmem, MEMSIZE);
+    vm_snapshot_free(&loaded);
+
+    /* data_offset after the magic, version, page size, vector and npages
+     * words wraps around when the stored pages are added to it */
+    fp = fopen(path, "r+b");
+    pu_assert("error, Open", fp != NULL);
+    fseek(fp, 24, SEEK_SET);
+    fwrite(&bad_offset, sizeof(bad_offset), 1, fp);
+    fclose(fp);
+    pu_assert_equal("error, Bad data offset", checkpoint_load(&loaded, path), 2);
+
+    /* Not a checkpoint */
+    pu_assert_equal("error, Bad file", checkpoint_load(&loaded, "asm/pow.b91"), 2);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_fork, PU_RUN);
+    pu_def_test(test_checkpoint, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,141 @@
+/* file test_vm_compact_mem.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "mem.h"
+#include "compact.h"
+#include "checkpoint.h"
+
+#define MEMSIZE     65536
+#define IMAGE_SIZE  3000
+#define INSTANCES   16
+
+static uint32_t image[IMAGE_SIZE];
+static struct vm_state state[INSTANCES];
+static struct compact_inst inst[INSTANCES];
+static uint32_t * expected[INSTANCES];
+
+static void setup()
+{
+    int i, j;
+
+    for (i = 0; i < IMAGE_SIZE; i++)
+        image[i] = i * 7 + 1;
+
+    for (i = 0; i < INSTANCES; i++) {
+        vm_init_state(&state[i], 100, MEMSIZE);
+        inst[i].state = &state[i];
+        inst[i].mem = vm_mem_alloc(MEMSIZE);
+        inst[i].image = image;
+        inst[i].image_size = IMAGE_SIZE;
+        memcpy(inst[i].mem, image, sizeof(image));
+
+        /* Data, stack and a heap page written by the guest */
+        inst[i].mem[2000] = i;
+        inst[i].mem[IMAGE_SIZE + 10] = i + 1;
+        for (j = 0; j < 100; j++)
+            inst[i].mem[MEMSIZE - 100 + j] = j * i;
+        if (i == 0) {
+            for (j = 0; j < 1024; j++)
+                inst[i].mem[40960 + j] = rand();
+        }
+
+        expected[i] = malloc(MEMSIZE * sizeof(uint32_t));
+        memcpy(expected[i], inst[i].mem, MEMSIZE * sizeof(uint32_t));
+    }
+}
+
+static void teardown()
+{
+    int i;
+
+    for (i = 0; i < INSTANCES; i++) {
+        vm_mem_free(inst[i].mem, MEMSIZE);
+        free(expected[i]);
+    }
+}
+
+static char * test_compact_idle()
+{
+    struct compact_pool pool;
+    int i;
+
+    compact_pool_init(&pool, 10);
+    for (i = 0; i < INSTANCES; i++)
+        compact_suspend(&pool, &inst[i], i);
+
+    /* Resumed before getting idle */
+    compact_resume(&pool, &inst[0]);
+    pu_assert_equal("error, Not idle yet", compact_idle(&pool, 5), 0);
+    compact_suspend(&pool, &inst[0], 5);
+
+    pu_assert_equal("error, Idle instances", compact_idle(&pool, 14), 4);
+    pu_assert_equal("error, Compacted", compact_idle(&pool, 100), INSTANCES - 4);
+    pu_assert_equal("error, Nothing left", compact_idle(&pool, 100), 0);
+
+    for (i = 0; i < INSTANCES; i++) {
+        pu_assert("error, Memory released", vm_mem_committed(inst[i].mem, MEMSIZE) == 0);
+    }
+    /* Only the written words are stored, a random page barely compresses */
+    pu_assert("error, Pages deduplicated", pool.stored < INSTANCES * 1024 + 5000);
+
+    for (i = 0; i < INSTANCES; i++) {
+        compact_resume(&pool, &inst[i]);
+        pu_assert("error, Memory restored",
+                  memcmp(inst[i].mem, expected[i], MEMSIZE * sizeof(uint32_t)) == 0);
+    }
+    pu_assert_equal("error, Pool empty", (int)pool.stored, 0);
+    pu_assert("error, Instances released", pool.head == NULL && pool.pending == NULL);
+
+    compact_pool_free(&pool);
+    return 0;
+}
+
+static char * test_compact_fork()
+{
+    struct compact_pool pool;
+    struct compact_inst finst;
+    struct vm_snapshot snap;
+    struct vm_state fstate;
+    uint32_t * fmem;
+
+    /* The snapshot has data on a page the fork clears */
+    inst[1].mem[20000] = 42;
+    pu_assert_equal("error, Snapshot", vm_snapshot(&snap, &state[1], inst[1].mem), 0);
+    fmem = vm_fork(&snap, &fstate);
+    pu_assert("error, Fork", fmem != NULL);
+    fmem[20000] = 0;
+
+    finst.state = &fstate;
+    finst.mem = fmem;
+    finst.image = image;
+    finst.image_size = IMAGE_SIZE;
+    compact_pool_init(&pool, 10);
+    compact_suspend(&pool, &finst, 100);
+    pu_assert_equal("error, Clock went backwards", compact_idle(&pool, 50), 0);
+    pu_assert_equal("error, Compacted", compact_idle(&pool, 110), 1);
+    compact_resume(&pool, &finst);
+    pu_assert_equal("error, Zero page restored", (int)fmem[20000], 0);
+    pu_assert_equal("error, Data restored", (int)fmem[2000], 1);
+
+    compact_pool_free(&pool);
+    vm_mem_free(fmem, MEMSIZE);
+    vm_snapshot_free(&snap);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_compact_idle, PU_RUN);
+    pu_def_test(test_compact_fork, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
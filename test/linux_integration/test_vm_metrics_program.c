@@ -0,0 +1,233 @@
+/* file test_vm_metrics_program.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "program.h"
+#include "batch.h"
+#include "metrics.h"
+
+#define JOBS 12
+
+static struct program_cache programs;
+static struct metrics_shm * shm;
+static char name[64];
+static char manifest[32];
+static char input[32];
+
+static void setup()
+{
+    FILE * fp;
+    int i;
+
+    program_cache_init(&programs);
+    snprintf(name, sizeof(name), "pttk91-test-%i", (int)getpid());
+    shm = metrics_create(name, 8);
+    strcpy(manifest, "/tmp/pttk91-batch-XXXXXX");
+    strcpy(input, "/tmp/pttk91-input-XXXXXX");
+
+    fp = fdopen(mkstemp(input), "w");
+    fprintf(fp, "3\n5\n");
+    fclose(fp);
+
+    fp = fdopen(mkstemp(manifest), "w");
+    for (i = 0; i < JOBS; i++)
+        fprintf(fp, "asm/pow.b91 %s\n", input);
+    fclose(fp);
+}
+
+static void teardown()
+{
+    remove(manifest);
+    remove(input);
+    metrics_destroy(shm, name);
+    program_cache_free(&programs);
+}
+
+static int wait_once(void * arg, int device, int * value)
+{
+    int * waited = (int *)arg;
+
+    if (!*waited) {
+        *waited = 1;
+        return VM_IO_WAIT;
+    }
+    *value = 7;
+    return 0;
+}
+
+static char * test_batch_metrics()
+{
+    const struct metrics_shm * reader;
+    struct metrics_counters sum;
+    FILE * out;
+    char line[256];
+    uint32_t i;
+    int found = 0;
+
+    pu_assert("error, Segment created", shm != NULL);
+    out = tmpfile();
+    pu_assert_equal("error, Batch failed", batch_run(&programs, manifest, 4, 1024, out, shm), 0);
+    fclose(out);
+
+    /* Read as another process would */
+    reader = metrics_attach(name);
+    pu_assert("error, Attached", reader != NULL);
+    pu_assert_equal("error, Workers", (int)reader->nworkers, 4);
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; i < reader->nworkers; i++) {
+        sum.instructions += reader->slot[i].c.instructions;
+        sum.ins += reader->slot[i].c.ins;
+        sum.outs += reader->slot[i].c.outs;
+        sum.svcs += reader->slot[i].c.svcs;
+        sum.runs += reader->slot[i].c.runs;
+    }
+    pu_assert_equal("error, Runs", (int)sum.runs, JOBS);
+    pu_assert("error, Instructions", sum.instructions > 0 && sum.instructions % JOBS == 0);
+#if VM_METRICS == 1
+    pu_assert_equal("error, IN", (int)sum.ins, 2 * JOBS);
+    pu_assert_equal("error, OUT", (int)sum.outs, 3 * JOBS);
+    pu_assert_equal("error, SVC", (int)sum.svcs, JOBS);
+#endif
+
+    out = tmpfile();
+    metrics_export(reader, out);
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        if (strncmp(line, "pttk91_runs_total{worker=\"", 26) == 0)
+            found++;
+    }
+    fclose(out);
+    pu_assert_equal("error, Exported", found, 4);
+
+    metrics_detach(reader);
+    return 0;
+}
+
+static char * test_slice_stops()
+{
+    static const char * src[] = {
+        "loop    add r1, =1",
+        "        comp r1, =100",
+        "        jles loop",
+        "        svc sp, =halt"
+    };
+    uint32_t mem[64];
+    struct vm_state state;
+    struct metrics_worker w;
+    struct metrics_mark mark;
+    struct asm_state as;
+    int code_size, image_size;
+    int slices = 0;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < 4; i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, 64, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    vm_init_state(&state, code_size, 64);
+    state.slice = 30;
+    metrics_worker_init(&w, NULL);
+    metrics_mark(&mark, &state);
+    do {
+        state.running = 1;
+        vm_run(&state, mem);
+        metrics_account(&w, &state, &mark);
+        if (state.stop == VM_STOP_SLICE) {
+            pu_assert("error, Slice ends on a jump", state.pc == 0);
+            slices++;
+        }
+    } while (state.stop == VM_STOP_SLICE);
+
+    pu_assert_equal("error, Halted", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Result", state.regs[1], 100);
+    pu_assert_equal("error, Slices", slices, 9);
+    pu_assert_equal("error, Instructions", (int)w.local.instructions, 3 * 100 + 1);
+    pu_assert_equal("error, Slices are not runs", (int)w.local.runs, 1);
+    pu_assert_equal("error, Nor suspends", (int)w.local.suspends, 0);
+    return 0;
+}
+
+static char * test_name_taken()
+{
+    pu_assert("error, Segment created", shm != NULL);
+    errno = 0;
+    pu_assert("error, Existing segment taken over", metrics_create(name, 8) == NULL);
+    pu_assert_equal("error, Name taken", errno, EEXIST);
+    pu_assert_equal("error, Segment kept", (int)shm->max_workers, 8);
+    return 0;
+}
+
+static char * test_slices()
+{
+    static const char * src[] = {
+        "        in r1, =kbd",
+        "        load r2, 5000",
+        "        svc sp, =halt"
+    };
+    uint32_t mem[64];
+    struct vm_state state;
+    struct metrics_worker w;
+    struct metrics_mark mark;
+    struct asm_state as;
+    int code_size, image_size;
+    int waited = 0;
+    struct vm_io io;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < 3; i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, 64, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    memset(&io, 0, sizeof(io));
+    io.in = wait_once;
+    io.arg = &waited;
+    vm_init_state(&state, code_size, 64);
+    state.io = &io;
+
+    metrics_worker_init(&w, NULL);
+    metrics_mark(&mark, &state);
+    vm_run(&state, mem);
+    pu_assert_equal("error, Suspended", state.stop, VM_STOP_WAIT);
+    metrics_account(&w, &state, &mark);
+    pu_assert_equal("error, Nothing executed", (int)w.local.instructions, 0);
+
+    state.running = 1;
+    vm_run(&state, mem);
+    metrics_account(&w, &state, &mark);
+    pu_assert_equal("error, Value read", state.regs[1], 7);
+    pu_assert_equal("error, Instructions", (int)w.local.instructions, 2);
+    pu_assert_equal("error, Suspends", (int)w.local.suspends, 1);
+    pu_assert_equal("error, Runs", (int)w.local.runs, 1);
+    pu_assert_equal("error, Error counted",
+                    (int)w.local.errors[VM_ERR_ADDRESS_OUT_OF_BOUNDS], 1);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_batch_metrics, PU_RUN);
+    pu_def_test(test_slice_stops, PU_RUN);
+    pu_def_test(test_name_taken, PU_RUN);
+    pu_def_test(test_slices, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
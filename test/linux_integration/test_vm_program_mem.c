@@ -0,0 +1,104 @@
+/* file test_vm_program_mem.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "mem.h"
+#include "program.h"
+
+#define CODE_WORDS  4096
+#define MEMSIZE     (4 * CODE_WORDS)
+
+static struct program_cache programs;
+static uint32_t image[CODE_WORDS + 2];
+
+static void setup()
+{
+    int i;
+
+    for (i = 0; i < CODE_WORDS - 1; i++) {
+        image[i] = 0x11200001; /* add r1, =1 */
+    }
+    image[CODE_WORDS - 1] = 0x70c0000b; /* svc sp, =halt */
+    image[CODE_WORDS] = 0x1234; /* data */
+    image[CODE_WORDS + 1] = 0x5678;
+
+    program_cache_init(&programs);
+}
+
+static void teardown()
+{
+    program_cache_free(&programs);
+}
+
+static char * test_program_cache()
+{
+    struct program * a;
+    struct program * b;
+
+    a = program_get(&programs, image, CODE_WORDS + 2, CODE_WORDS - 1);
+    b = program_get(&programs, image, CODE_WORDS + 2, CODE_WORDS - 1);
+
+    pu_assert("error, Program not loaded", a != NULL);
+    pu_assert("error, Same image should give the same program", a == b);
+    pu_assert_equal("error, Program should be referenced twice", a->refcnt, 2);
+    pu_assert("error, Full code pages should be shared", a->shared_size > 0);
+    pu_assert("error, Data should not be shared", a->shared_size <= CODE_WORDS);
+    pu_assert("error, Lookup by hash", program_find(&programs, a->hash) == a);
+
+    program_put(&programs, a);
+    program_put(&programs, a);
+    program_put(&programs, a);
+    pu_assert("error, Program should be freed", programs.head == NULL);
+    return 0;
+}
+
+static char * test_program_map()
+{
+    struct program * prog;
+    struct vm_state state_a, state_b;
+    uint32_t * mem_a;
+    uint32_t * mem_b;
+
+    prog = program_get(&programs, image, CODE_WORDS + 2, CODE_WORDS - 1);
+    mem_a = vm_mem_alloc(MEMSIZE);
+    mem_b = vm_mem_alloc(MEMSIZE);
+    pu_assert_equal("error, Map a", program_map(prog, mem_a, MEMSIZE), 0);
+    pu_assert_equal("error, Map b", program_map(prog, mem_b, MEMSIZE), 0);
+
+    pu_assert("error, Image mapped", memcmp(mem_a, image, sizeof(image)) == 0);
+
+    /* Writes are private to the instance */
+    mem_a[0] = 0x11200002; /* add r1, =2 */
+    mem_a[CODE_WORDS] = 0;
+    pu_assert_equal("error, Code write leaked to another instance", mem_b[0], 0x11200001);
+    pu_assert_equal("error, Code write leaked to the program", prog->image[0], 0x11200001);
+    pu_assert_equal("error, Data write leaked to another instance", mem_b[CODE_WORDS], 0x1234);
+
+    vm_init_state(&state_a, prog->code_size, MEMSIZE);
+    vm_init_state(&state_b, prog->code_size, MEMSIZE);
+    vm_run(&state_a, mem_a);
+    vm_run(&state_b, mem_b);
+    pu_assert_equal("error, Instance a", state_a.regs[1], CODE_WORDS);
+    pu_assert_equal("error, Instance b", state_b.regs[1], CODE_WORDS - 1);
+
+    vm_mem_free(mem_a, MEMSIZE);
+    vm_mem_free(mem_b, MEMSIZE);
+    program_put(&programs, prog);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_program_cache, PU_RUN);
+    pu_def_test(test_program_map, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,128 @@
+/* file test_vm_server_program.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "program.h"
+#include "server.h"
+
+static struct program_cache server_programs;
+static struct program_cache client_programs;
+static struct server * srv;
+static char path[64];
+
+struct out_buf {
+    int output[8];
+    int output_len;
+};
+
+static int buf_out(void * arg, int device, int value)
+{
+    struct out_buf * buf = (struct out_buf *)arg;
+
+    if (buf->output_len < 8)
+        buf->output[buf->output_len] = value;
+    buf->output_len++;
+    return 0;
+}
+
+static void setup()
+{
+    snprintf(path, sizeof(path), "/tmp/pttk91-test-%i.sock", (int)getpid());
+    program_cache_init(&server_programs);
+    program_cache_init(&client_programs);
+    client_programs.flags = 0;
+    srv = server_start(&server_programs, path, 2, 1024, NULL);
+}
+
+static void teardown()
+{
+    if (srv)
+        server_stop(srv);
+    program_cache_free(&client_programs);
+    program_cache_free(&server_programs);
+}
+
+static char * test_server_call()
+{
+    struct program * prog;
+    struct server_result res;
+    struct out_buf buf;
+    const struct vm_io io = { NULL, buf_out, &buf };
+    const int input[2][2] = { { 2, 4 }, { 3, 5 } };
+    const int expected[2] = { 16, 243 };
+    int i;
+
+    pu_assert("error, Server not started", srv != NULL);
+    prog = program_load(&client_programs, 1024, NULL, "asm/pow.b91");
+    pu_assert("error, Program not loaded", prog != NULL);
+
+    for (i = 0; i < 2; i++) {
+        memset(&buf, 0, sizeof(buf));
+        pu_assert_equal("error, Call failed",
+                        server_call(path, prog, input[i], 2, &io, &res), 0);
+        pu_assert_equal("error, Stop reason", res.stop, VM_STOP_HALT);
+        pu_assert_equal("error, Error", res.error, VM_ERR_NO_ERROR);
+        pu_assert("error, Instruction count", res.count > 0);
+        pu_assert_equal("error, Output length", buf.output_len, 3);
+        pu_assert_equal("error, Output", buf.output[2], expected[i]);
+        /* The image is sent only once */
+        pu_assert("error, Program cached", server_programs.head != NULL
+                  && server_programs.head->next == NULL
+                  && server_programs.head->hash == prog->hash);
+    }
+
+    /* Input runs out */
+    memset(&buf, 0, sizeof(buf));
+    pu_assert_equal("error, Call failed", server_call(path, prog, input[0], 1, &io, &res), 0);
+    pu_assert_equal("error, Stop reason", res.stop, VM_STOP_ERROR);
+    pu_assert_equal("error, Input error", res.error, VM_ERR_INVALID_DEVICE);
+
+    program_put(&client_programs, prog);
+    return 0;
+}
+
+static char * test_bad_hash()
+{
+    static const char * requests[] = { "run 12zz\n", "run -1\n",
+                                       "run 123456789abcdef01\n" };
+    struct sockaddr_un addr;
+    FILE * in;
+    char line[64];
+    int fd, i;
+
+    pu_assert("error, Server not started", srv != NULL);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    pu_assert_equal("error, Connect", connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    in = fdopen(fd, "r");
+
+    for (i = 0; i < 3; i++) {
+        write(fd, requests[i], strlen(requests[i]));
+        pu_assert("error, Reply", fgets(line, sizeof(line), in) != NULL);
+        pu_assert("error, Invalid hash", strcmp(line, "err hash\n") == 0);
+    }
+
+    fclose(in);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_server_call, PU_RUN);
+    pu_def_test(test_bad_hash, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,187 @@
+/* file test_vm_smp_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "fuse.h"
+#include "smp.h"
+
+uint32_t mem[1024];
+int memsize;
+
+/* Four CPUs count with XADD and with a CAS spin lock */
+static const char * src[] = {
+    "count   dc 0",
+    "lock    dc 0",
+    "shared  dc 0",
+    "total   dc 0",
+    "ids     ds 4",
+    "stacks  ds 400",
+    "        load r4, =0",
+    "start   load r1, =worker",
+    "        load r2, r4",
+    "        load r3, r4",
+    "        mul r3, =100",
+    "        add r3, =stacks",
+    "        svc sp, =spawn",
+    "        store r0, ids(r4)",
+    "        add r4, =1",
+    "        comp r4, =4",
+    "        jles start",
+    "        load r4, =0",
+    "wait    load r1, ids(r4)",
+    "        svc sp, =join",
+    "        xadd r0, total",
+    "        add r5, r1",
+    "        add r4, =1",
+    "        comp r4, =4",
+    "        jles wait",
+    "        svc sp, =halt",
+    "worker  load r2, =1000",
+    "wloop   load r3, =1",
+    "        xadd r3, count",
+    "acquire load r0, =0",
+    "        load r3, =1",
+    "        cas r3, lock",
+    "        jnequ acquire",
+    "        load r3, shared",
+    "        add r3, =1",
+    "        store r3, shared",
+    "        load r0, =1",
+    "        load r3, =0",
+    "        cas r3, lock",
+    "        sub r2, =1",
+    "        jpos r2, wloop",
+    "        load r0, r1",
+    "        svc sp, =halt"
+};
+
+static int code_size;
+
+static void setup()
+{
+    struct asm_state as;
+    int i, image_size;
+
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, memsize, &code_size, &image_size, NULL);
+    asm_free(&as);
+}
+
+static void teardown()
+{
+}
+
+static char * run_smp(const struct vm_code * code)
+{
+    struct vm_state state;
+
+    vm_init_state(&state, code_size, memsize);
+    state.code = code;
+    pu_assert_equal("error, SMP init", smp_init(&state, mem), 0);
+    vm_run(&state, mem);
+    smp_free(&state);
+
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Join errors", state.regs[5], 0);
+    pu_assert_equal("error, XADD count", (int)mem[code_size + 1], 4000);
+    pu_assert_equal("error, Lock released", (int)mem[code_size + 2], 0);
+    pu_assert_equal("error, Locked count", (int)mem[code_size + 3], 4000);
+    pu_assert_equal("error, Join results", (int)mem[code_size + 4], 0 + 1 + 2 + 3);
+
+    return 0;
+}
+
+static char * test_cpus_interpreted()
+{
+    return run_smp(NULL);
+}
+
+static char * test_cpus_fused()
+{
+    struct vm_code * code;
+    char * err;
+
+    code = code_decode(mem, code_size);
+    pu_assert("error, Decoding failed", code != NULL);
+    fuse_code(code, NULL);
+
+    err = run_smp(code);
+    code_free(code);
+    return err;
+}
+
+static char * test_spawn_without_smp()
+{
+    struct vm_state state;
+
+    vm_init_state(&state, code_size, memsize);
+    state.pc = 1; /* load r1, =worker */
+    vm_step(&state, mem);
+    state.pc = 6; /* svc sp, =spawn */
+    vm_step(&state, mem);
+
+    pu_assert_equal("error, Spawn should fail", state.regs[0], -1);
+
+    return 0;
+}
+
+static char * test_join_breakpoint()
+{
+    static const char * bsrc[] = {
+        "        load r1, =worker",
+        "        load r3, =100",
+        "        svc sp, =spawn",
+        "        load r1, =1",
+        "        svc sp, =join",
+        "        svc sp, =halt",
+        "worker  nop",
+        "        svc sp, =halt"
+    };
+    struct vm_state state;
+    struct asm_state as;
+    int i, bcode_size, image_size;
+
+    memset(mem, 0x0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(bsrc) / sizeof(bsrc[0])); i++)
+        asm_line(&as, bsrc[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, memsize, &bcode_size, &image_size, NULL);
+    asm_free(&as);
+    mem[6] = PTTK91_BKPT;
+
+    vm_init_state(&state, bcode_size, memsize);
+    pu_assert_equal("error, SMP init", smp_init(&state, mem), 0);
+    vm_run(&state, mem);
+    smp_free(&state);
+
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Breakpoint reported", state.regs[1], -2);
+
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_cpus_interpreted, PU_RUN);
+    pu_def_test(test_cpus_fused, PU_RUN);
+    pu_def_test(test_spawn_without_smp, PU_RUN);
+    pu_def_test(test_join_breakpoint, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
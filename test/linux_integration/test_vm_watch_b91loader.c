@@ -0,0 +1,156 @@
+/* file test_vm_watch_b91loader.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "punit.h"
+#include "unixunit.h"
+#include "config.h"
+#include "vm.h"
+#include "watch.h"
+#include "asm.h"
+#include "code.h"
+#include "loop.h"
+#include "smp.h"
+#include "symtab.h"
+#include "b91loader.h"
+
+uint32_t * mem;
+int memsize;
+
+static struct watch_hit hits[8];
+static int nhits;
+
+static void setup()
+{
+    memsize = 1024;
+    if (posix_memalign((void **)&mem, sysconf(_SC_PAGESIZE), memsize * sizeof(uint32_t)))
+        mem = NULL;
+    memset(mem, 0x0, memsize * sizeof(uint32_t));
+    nhits = 0;
+
+    uu_open_pipe();
+}
+
+static void teardown()
+{
+    free(mem);
+    uu_close_pipe();
+}
+
+static void record_hit(const struct watch_hit * hit, void * arg)
+{
+    if (nhits < sizeof(hits) / sizeof(hits[0]))
+        hits[nhits] = *hit;
+    nhits++;
+}
+
+static char * test_watch_pow()
+{
+    int code_size, image_size;
+    struct vm_state state;
+    struct watch_state ws;
+    struct symtab symtab;
+    char * input[] = {"2\n", "4\n"};
+
+    uu_open_stdin_writer();
+    uu_write_stdin(input[0]);
+    uu_write_stdin(input[1]);
+    uu_close_stdin_writer();
+
+    symtab_init(&symtab);
+    pu_assert_equal("Error while loading a b91 binary file.",
+                    b91_loader_load(mem, memsize, &code_size, &image_size, &symtab, "asm/pow.b91"), 0);
+    pu_assert("Symbol b loaded", symtab_find(&symtab, "b") != NULL);
+
+    vm_init_state(&state, code_size, memsize);
+    pu_assert_equal("Watch init", watch_init(&ws, &state, mem), 0);
+    watch_add(&ws, symtab_find(&symtab, "b")->value, 1);
+
+    watch_run(&ws, record_hit, NULL);
+    watch_deinit(&ws);
+    symtab_free(&symtab);
+
+    pu_assert_equal("Program ran to the end", state.stop, VM_STOP_HALT);
+    pu_assert_equal("Result of 2^4 == 16", state.regs[1], 16);
+    pu_assert_equal("One write to b", nhits, 1);
+    pu_assert_equal("Written by store r2, b", hits[0].pc, 4);
+    pu_assert_equal("Old value of b", hits[0].old_value, 0);
+    pu_assert_equal("New value of b", hits[0].new_value, 4);
+    return 0;
+}
+
+static char * test_watch_host_loop()
+{
+    static const char * src[] = {
+        "arr     ds 12288",
+        "        load r2, =42",
+        "        load r1, =0",
+        "fill    store r2, arr(r1)",
+        "        add r1, =1",
+        "        comp r1, =12288",
+        "        jles fill",
+        "        svc sp, =halt"
+    };
+    const int size = 16384;
+    uint32_t * big;
+    int code_size, image_size, i;
+    struct asm_state as;
+    struct vm_code * code;
+    struct vm_state state;
+    struct watch_state ws;
+
+    pu_assert("Memory", posix_memalign((void **)&big, sysconf(_SC_PAGESIZE),
+                                       size * sizeof(uint32_t)) == 0);
+    memset(big, 0, size * sizeof(uint32_t));
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, big, size, &code_size, &image_size, NULL);
+    asm_free(&as);
+    code = code_decode(big, code_size);
+    pu_assert_equal("Loop found", loop_code(code), 1);
+
+    /* The host loop writes every page of the range in one instruction */
+    vm_init_state(&state, code_size, size);
+    state.code = code;
+    pu_assert_equal("Watch init", watch_init(&ws, &state, big), 0);
+    pu_assert_equal("Watch added", watch_add(&ws, code_size + 1, 12288), 0);
+    watch_run(&ws, record_hit, NULL);
+    watch_deinit(&ws);
+    code_free(code);
+    free(big);
+
+    pu_assert_equal("Program ran to the end", state.stop, VM_STOP_HALT);
+    pu_assert_equal("Every word reported", nhits, 12288);
+    pu_assert_equal("Written by the store of the loop", hits[0].pc, 2);
+    pu_assert_equal("New value", hits[0].new_value, 42);
+    return 0;
+}
+
+static char * test_watch_smp()
+{
+    struct vm_state state;
+    struct watch_state ws;
+
+    vm_init_state(&state, 0, memsize);
+    pu_assert_equal("SMP init", smp_init(&state, mem), 0);
+    pu_assert_equal("Watchpoints refused with SMP", watch_init(&ws, &state, mem), 2);
+    smp_free(&state);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_watch_pow, PU_RUN);
+    pu_def_test(test_watch_host_loop, PU_RUN);
+    pu_def_test(test_watch_smp, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
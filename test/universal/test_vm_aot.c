@@ -0,0 +1,70 @@
+/* file test_vm_aot.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "aot.h"
+
+static void setup()
+{
+}
+
+static void teardown()
+{
+}
+
+static char * test_translate()
+{
+    FILE * out;
+    char line[80];
+    int found = 0, counted = 0;
+    int retval;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x11200002, /* add r1, =2 */
+                        0x20000000, /* jump 0 */
+                        0x20010000, /* jump 0(r1) */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+
+    out = tmpfile();
+    pu_assert("error, tmpfile", out != NULL);
+
+    retval = aot_translate(out, prog, 5, 5, "test");
+    pu_assert_equal("error, Computed jump and SVC are interpreted", retval, 2);
+
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        if (strstr(line, "void test_run(struct vm_state * state, uint32_t * mem)"))
+            found = 1;
+        if (strstr(line, "AOT_BRANCH(2, 0)"))
+            counted = 1;
+    }
+    fclose(out);
+    pu_assert("error, Run function not generated", found);
+    pu_assert("error, Branch doesn't count the block", counted);
+    return 0;
+}
+
+static char * test_invalid_image()
+{
+    FILE * out;
+    uint32_t prog[] = { 0x70c0000b }; /* svc sp, =halt */
+
+    out = tmpfile();
+    pu_assert_equal("error, Code larger than the image", aot_translate(out, prog, 1, 2, "test"), -1);
+    fclose(out);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_translate, PU_RUN);
+    pu_def_test(test_invalid_image, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -242,6 +242,34 @@ static char * test_exit()
 
 }
 
+static char * test_comp()
+{
+    struct vm_state state;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x29000004, /* jgre skip ; no comparison yet */
+                        0x2b000004, /* jnequ skip */
+                        0x02400001, /* load r2, =1 */
+                        0x1f200002, /* skip comp r1, =2 */
+                        0x27000007, /* jles less */
+                        0x70c0000b, /* svc sp, =halt */
+                        0x1f200001, /* less comp r1, =1 */
+                        0x2a00000a, /* jnles ge */
+                        0x70c0000b, /* svc sp, =halt */
+                        0x02600001, /* ge load r3, =1 */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+    test_init_vm(mem, prog, state, memsize);
+
+    pu_assert_equal("error, SR should be clear after reset", vm_get_sr(&state), 0);
+
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Flags should be clear before the first comp", state.regs[2], 1);
+    pu_assert_equal("error, Expected jles and jnles to branch", state.regs[3], 1);
+    pu_assert_equal("error, Expected SR equ", vm_get_sr(&state), 1u << VM_SR_BIT_EQU);
+    return 0;
+}
+
 
 static void all_tests()
 {
@@ -254,6 +282,7 @@ static void all_tests()
     pu_def_test(test_pushr, PU_RUN);
     pu_def_test(test_call, PU_RUN);
     pu_def_test(test_exit, PU_RUN);
+    pu_def_test(test_comp, PU_RUN);
 }
 
 int main(int argc, char **argv)
@@ -0,0 +1,121 @@
+/* file test_vm_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "asm.h"
+
+static struct asm_state as;
+
+static void setup()
+{
+    asm_init(&as);
+}
+
+static void teardown()
+{
+    asm_free(&as);
+}
+
+static int assemble(const char ** src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (asm_line(&as, src[i]))
+            return 1;
+    }
+    return asm_finish(&as);
+}
+
+static char * test_encoding()
+{
+    const char * src[] = {
+        "; c = a^b",
+        "        in r1, =kbd",
+        "        load r3, r1",
+        "loop    mul r1, r3",
+        "        jpos r2, loop",
+        "        out r3, =crt",
+        "        svc sp, =halt"
+    };
+
+    pu_assert_equal("error, Assembly failed", assemble(src, 7), 0);
+    pu_assert_equal("error, Code length", as.code_len, 6);
+    pu_assert_equal("error, in r1, =kbd", as.code[0], 52428801);
+    pu_assert_equal("error, load r3, r1", as.code[1], 39911424);
+    pu_assert_equal("error, mul r1, r3", as.code[2], 321060864);
+    pu_assert_equal("error, jpos r2, loop", as.code[3], 0x23400002);
+    pu_assert_equal("error, out r3, =crt", as.code[4], 73400320);
+    pu_assert_equal("error, svc sp, =halt", as.code[5], 1891631115);
+    return 0;
+}
+
+static char * test_data_and_fixups()
+{
+    uint32_t mem[64];
+    struct symtab symtab;
+    const struct symbol * sym;
+    int code_size, image_size;
+    const char * src[] = {
+        "Tbl ds 8",
+        "        store r2, Tbl(r1)",
+        "        load r2, erv",
+        "        jump end",
+        "erv dc 99999999",
+        "end     svc sp, =halt"
+    };
+
+    pu_assert_equal("error, Assembly failed", assemble(src, 6), 0);
+    pu_assert_equal("error, store r2, Tbl(r1)", as.code[0], 0x01410004);
+    pu_assert_equal("error, load r2, erv", as.code[1], 0x0248000c);
+    pu_assert_equal("error, jump end", as.code[2], 0x20000003);
+
+    symtab_init(&symtab);
+    pu_assert_equal("error, Image", asm_image(&as, mem, 64, &code_size, &image_size, &symtab), 0);
+    pu_assert_equal("error, code_size is the last code address", code_size, 3);
+    pu_assert_equal("error, image_size", image_size, 13);
+    pu_assert_equal("error, DC value", mem[12], 99999999);
+    sym = symtab_find(&symtab, "tbl");
+    pu_assert("error, Symbols are case insensitive", sym != NULL);
+    pu_assert_equal("error, Data follows code", sym->value, 4);
+    symtab_free(&symtab);
+    return 0;
+}
+
+static char * test_errors()
+{
+    const char * undef[] = { "jump nowhere" };
+    const char * mode[] = { "", "store r1, =5" };
+    const char * range[] = { "load r1, =65535", "load r1, =-1" };
+
+    pu_assert_equal("error, Undefined symbol", assemble(undef, 1), 1);
+    pu_assert_equal("error, Error line", as.error_line, 1);
+
+    asm_free(&as);
+    asm_init(&as);
+    pu_assert_equal("error, Invalid mode", assemble(mode, 2), 1);
+    pu_assert_equal("error, Error line", as.error_line, 2);
+
+    /* The address part is not sign extended */
+    asm_free(&as);
+    asm_init(&as);
+    pu_assert_equal("error, Negative value", assemble(range, 2), 1);
+    pu_assert_equal("error, Error line", as.error_line, 2);
+    pu_assert_equal("error, Largest value", as.code[0], 0x0220ffff);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_encoding, PU_RUN);
+    pu_def_test(test_data_and_fixups, PU_RUN);
+    pu_def_test(test_errors, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
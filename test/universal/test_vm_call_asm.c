@@ -0,0 +1,165 @@
+/* file test_vm_call_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "fuse.h"
+#include "symtab.h"
+
+#define MEMSIZE 256
+
+/* Main program initializes the scale, madd(a, b) = scale * a + b.
+ * Immediates are not sign extended, the frame is addressed through r2. */
+static const char * src[] = {
+    "scale   dc 0",
+    "calls   dc 0",
+    "        load r1, =3",
+    "        store r1, scale",
+    "        svc sp, =halt",
+    "madd    push sp, r1",
+    "        push sp, r2",
+    "        load r2, fp",
+    "        sub r2, =4",
+    "        load r1, 1(r2)",
+    "        mul r1, scale",
+    "        add r1, 2(r2)",
+    "        store r1, 0(r2)",
+    "        load r1, calls",
+    "        add r1, =1",
+    "        store r1, calls",
+    "        pop sp, r2",
+    "        pop sp, r1",
+    "        exit sp, =2",
+    "fail    svc sp, =halt"
+};
+
+static uint32_t mem[MEMSIZE];
+static struct symtab symtab;
+static int code_size, image_size;
+
+static void setup()
+{
+    struct asm_state as;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    symtab_init(&symtab);
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, &symtab);
+    asm_free(&as);
+}
+
+static void teardown()
+{
+    symtab_free(&symtab);
+}
+
+static char * test_call_repeatedly()
+{
+    struct vm_state state;
+    struct vm_code * code;
+    const int madd = symtab_find(&symtab, "madd")->value;
+    int args[2], result, i, sp;
+
+    code = code_decode(mem, code_size);
+    fuse_code(code, NULL);
+
+    /* The stack starts after the data like in Titokone */
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.regs[PTTK91_SP] = image_size - 1;
+    state.regs[PTTK91_FP] = image_size - 1;
+    state.code = code;
+    vm_run(&state, mem);
+    pu_assert_equal("error, Main program", state.stop, VM_STOP_HALT);
+    sp = state.regs[PTTK91_SP];
+
+    for (i = 0; i < 1000; i++) {
+        args[0] = i;
+        args[1] = -i / 2;
+        state.regs[1] = 42;
+        state.regs[2] = 43;
+        pu_assert_equal("error, Call failed", vm_call(&state, mem, madd, args, 2, &result), 0);
+        pu_assert_equal("error, Stop reason", state.stop, VM_STOP_RETURN);
+        pu_assert_equal("error, Result", result, 3 * i - i / 2);
+        pu_assert_equal("error, Registers restored", state.regs[1] + state.regs[2], 85);
+        pu_assert_equal("error, Stack restored", state.regs[PTTK91_SP], sp);
+    }
+    pu_assert_equal("error, Calls", (int)mem[symtab_find(&symtab, "calls")->value], 1000);
+
+    code_free(code);
+    return 0;
+}
+
+static char * test_call_stops()
+{
+    struct vm_state state;
+    int result;
+
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.regs[PTTK91_SP] = image_size - 1;
+    pu_assert_equal("error, Halt is not a return",
+                    vm_call(&state, mem, symtab_find(&symtab, "fail")->value, NULL, 0, &result), -1);
+    pu_assert_equal("error, Stop reason", state.stop, VM_STOP_HALT);
+
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.regs[PTTK91_SP] = MEMSIZE - 2;
+    pu_assert_equal("error, Stack overflow",
+                    vm_call(&state, mem, 0, NULL, 0, &result), VM_ERR_ADDRESS_OUT_OF_BOUNDS);
+
+    return 0;
+}
+
+static char * test_jump_to_return_address()
+{
+    static const char * jsrc[] = {
+        "        load r1, =1",
+        "        shl r1, =31",
+        "        jump 0(r1)"
+    };
+    uint32_t jmem[MEMSIZE];
+    struct vm_state state;
+    struct asm_state as;
+    int i, jcode_size, jimage_size, result;
+
+    memset(jmem, 0, sizeof(jmem));
+    asm_init(&as);
+    for (i = 0; i < 3; i++)
+        asm_line(&as, jsrc[i]);
+    asm_finish(&as);
+    asm_image(&as, jmem, MEMSIZE, &jcode_size, &jimage_size, NULL);
+    asm_free(&as);
+
+    /* Not a return outside of vm_call() */
+    vm_init_state(&state, jcode_size, MEMSIZE);
+    vm_run(&state, jmem);
+    pu_assert_equal("error, Stop reason", state.stop, VM_STOP_ERROR);
+    pu_assert_equal("error, PC out of bounds", state.error, VM_ERR_PC_OUT_OF_BOUNDS);
+
+    /* The error of the previous run is cleared */
+    state.regs[PTTK91_SP] = MEMSIZE / 2;
+    state.regs[PTTK91_FP] = MEMSIZE / 2;
+    pu_assert_equal("error, Call failed", vm_call(&state, jmem, 0, NULL, 0, &result), 0);
+    pu_assert_equal("error, Error cleared", state.error, VM_ERR_NO_ERROR);
+
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_call_repeatedly, PU_RUN);
+    pu_def_test(test_call_stops, PU_RUN);
+    pu_def_test(test_jump_to_return_address, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
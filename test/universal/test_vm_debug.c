@@ -0,0 +1,164 @@
+/* file test_vm_debug.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "code.h"
+#include "peephole.h"
+#include "debug.h"
+
+uint32_t mem[1024];
+int memsize;
+
+#define test_init_vm(mem, prog, state, memsize) do {\
+                                    memcpy((void*)mem, (void*)prog, sizeof(prog));\
+                                    vm_init_state(&state, sizeof(prog) / sizeof(uint32_t), memsize);\
+                                    } while(0)
+
+static void setup()
+{
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+}
+
+static void teardown()
+{
+}
+
+static char * test_breakpoint()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    uint32_t value;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x11200002, /* add r1, =2 */
+                        0x11200003, /* add r1, =3 */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+    test_init_vm(mem, prog, state, memsize);
+    dbg_init(&dbg);
+
+    pu_assert_equal("error, Breakpoint set", dbg_break_set(&dbg, &state, mem, 2), 0);
+    pu_assert_equal("error, Breakpoint outside of code", dbg_break_set(&dbg, &state, mem, 100), 1);
+
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Expected to stop on breakpoint", state.stop, VM_STOP_BREAKPOINT);
+    pu_assert_equal("error, PC should point to the trap", state.pc, 2);
+    pu_assert_equal("error, Instructions before the trap are executed", state.regs[1], 3);
+    pu_assert_equal("error, The trap is not counted", (int)state.count, 2);
+
+    dbg_read_mem(&dbg, &state, mem, 2, &value);
+    pu_assert_equal("error, Memory reads should see the original instruction", value, 0x11200003);
+
+    dbg_continue(&dbg, &state, mem);
+
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Original instruction emulated", state.regs[1], 6);
+    pu_assert_equal("error, Instruction count", (int)state.count, 4);
+    return 0;
+}
+
+static char * test_run_past_breakpoint()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x11200002, /* add r1, =2 */
+                        0x11200003, /* add r1, =3 */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+    int hits = 0;
+    test_init_vm(mem, prog, state, memsize);
+    dbg_init(&dbg);
+    dbg_break_set(&dbg, &state, mem, 1);
+
+    /* As the -b loop of the front end resumes */
+    while (1) {
+        vm_run(&state, mem);
+        if (state.stop != VM_STOP_BREAKPOINT)
+            break;
+        hits++;
+        state.running = 1;
+        if (dbg_step(&dbg, &state, mem) || !state.running)
+            break;
+    }
+
+    pu_assert_equal("error, Breakpoint hit once", hits, 1);
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Ran to the end", state.regs[1], 6);
+    return 0;
+}
+
+static char * test_breakpoint_optimized()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    struct vm_code * code;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x20000003, /* jump 3 */
+                        0x02200005, /* load r1, =5 */
+                        0x20000005, /* jump 5 */
+                        0x02200006, /* load r1, =6 */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+    test_init_vm(mem, prog, state, memsize);
+    code = code_decode(prog, sizeof(prog) / sizeof(uint32_t));
+    /* Only retargets the jump at 1 past the one at 3 */
+    pu_assert_equal("error, Nothing removed", peephole_code(code), 0);
+    pu_assert_equal("error, Jump retargeted", code->threaded, 1);
+    state.code = code;
+    dbg_init(&dbg);
+    dbg_break_set(&dbg, &state, mem, 3);
+
+    vm_run(&state, mem);
+    pu_assert_equal("error, Expected to stop on breakpoint", state.stop, VM_STOP_BREAKPOINT);
+    pu_assert_equal("error, PC should point to the trap", state.pc, 3);
+
+    dbg_continue(&dbg, &state, mem);
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, R1", state.regs[1], 1);
+
+    dbg_deinit(&dbg);
+    code_free(code);
+    return 0;
+}
+
+static char * test_step()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    uint32_t prog[] = { 0x02200001, /* load r1, =1 */
+                        0x11200002, /* add r1, =2 */
+                        0x70c0000b  /* svc sp, =halt */
+                      };
+    test_init_vm(mem, prog, state, memsize);
+    dbg_init(&dbg);
+    dbg_break_set(&dbg, &state, mem, 1);
+
+    dbg_step(&dbg, &state, mem);
+    pu_assert_equal("error, Step 1", state.regs[1], 1);
+    dbg_step(&dbg, &state, mem);
+    pu_assert_equal("error, Step over a breakpoint", state.regs[1], 3);
+    pu_assert_equal("error, Trap restored after step", mem[1], (uint32_t)(PTTK91_BKPT));
+
+    dbg_break_clear(&dbg, mem, 1);
+    pu_assert_equal("error, Original instruction restored", mem[1], 0x11200002);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_breakpoint, PU_RUN);
+    pu_def_test(test_run_past_breakpoint, PU_RUN);
+    pu_def_test(test_breakpoint_optimized, PU_RUN);
+    pu_def_test(test_step, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,125 @@
+/* file test_vm_footprint_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "footprint.h"
+
+#define MEMSIZE 1024
+
+/* f saves the registers and calls g, EXIT discards the saved registers and
+ * removes the parameters */
+static const char * nested[] = {
+    "x       dc 0",
+    "arr     ds 10",
+    "        push sp, =1",
+    "        push sp, =2",
+    "        call sp, f",
+    "        store r1, 500",
+    "        svc sp, =halt",
+    "f       pushr sp",
+    "        call sp, g",
+    "        exit sp, =2",
+    "g       push sp, r1",
+    "        pop sp, r1",
+    "        exit sp, =0"
+};
+
+static const char * recursive[] = {
+    "        call sp, f",
+    "        svc sp, =halt",
+    "f       call sp, f",
+    "        exit sp, =0"
+};
+
+static const char * growing[] = {
+    "loop    push sp, r1",
+    "        jump loop"
+};
+
+static uint32_t mem[MEMSIZE];
+static int code_size, image_size;
+
+static void setup()
+{
+}
+
+static void teardown()
+{
+}
+
+static void assemble(const char ** src, int lines)
+{
+    struct asm_state as;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < lines; i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+}
+
+static char * test_nested_calls()
+{
+    struct footprint fp;
+    struct vm_state state;
+    int depth = 0;
+
+    assemble(nested, sizeof(nested) / sizeof(nested[0]));
+    pu_assert_equal("error, Analysis", footprint_analyze(mem, code_size, image_size, &fp), 0);
+    pu_assert_equal("error, Data size", fp.data_size, image_size - code_size - 1);
+    pu_assert_equal("error, Code size", fp.code_size + fp.data_size, image_size);
+    pu_assert_equal("error, Max direct", fp.max_direct, 500);
+    /* Two parameters, frame of f, registers, frame of g and one push */
+    pu_assert_equal("error, Stack depth", fp.stack_depth, 2 + 2 + 7 + 2 + 1);
+    pu_assert_equal("error, Bounded", fp.unbounded, 0);
+    pu_assert_equal("error, Memory", fp.memsize, 501);
+
+    /* The stack never grows deeper than the analysis, it's moved after the
+     * data to keep the code intact */
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.regs[PTTK91_SP] = image_size - 1;
+    state.regs[PTTK91_FP] = image_size - 1;
+    while (state.running && !vm_step(&state, mem)) {
+        if (state.regs[PTTK91_SP] - (image_size - 1) > depth)
+            depth = state.regs[PTTK91_SP] - (image_size - 1);
+    }
+    pu_assert_equal("error, Halted", state.error, VM_ERR_NO_ERROR);
+    pu_assert_equal("error, Depth reached", depth, fp.stack_depth);
+    return 0;
+}
+
+static char * test_unbounded()
+{
+    struct footprint fp;
+
+    assemble(recursive, sizeof(recursive) / sizeof(recursive[0]));
+    pu_assert_equal("error, Analysis", footprint_analyze(mem, code_size, image_size, &fp), 0);
+    pu_assert_equal("error, Recursion", fp.unbounded, FOOTPRINT_RECURSION);
+    pu_assert_equal("error, Recursion at", fp.unbounded_pc, 2);
+    pu_assert_equal("error, Unbounded", fp.stack_depth, FOOTPRINT_UNBOUNDED);
+    pu_assert_equal("error, No memory size", fp.memsize, 0);
+
+    assemble(growing, sizeof(growing) / sizeof(growing[0]));
+    pu_assert_equal("error, Analysis", footprint_analyze(mem, code_size, image_size, &fp), 0);
+    pu_assert_equal("error, Unbalanced", fp.unbounded, FOOTPRINT_UNBALANCED);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_nested_calls, PU_RUN);
+    pu_def_test(test_unbounded, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
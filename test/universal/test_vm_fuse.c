@@ -0,0 +1,117 @@
+/* file test_vm_fuse.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "code.h"
+#include "fuse.h"
+#include "debug.h"
+
+uint32_t mem[1024];
+int memsize;
+
+#define test_init_vm(mem, prog, state, memsize) do {\
+                                    memcpy((void*)mem, (void*)prog, sizeof(prog));\
+                                    vm_init_state(&state, sizeof(prog) / sizeof(uint32_t), memsize);\
+                                    } while(0)
+
+/* Counter loop, the jump at 7 enters the middle of a fused sequence */
+static const uint32_t loop_prog[] = {
+    0x02200000, /* load r1, =0 */
+    0x01200014, /* store r1, 20 */
+    0x02280014, /* load r1, 20 */
+    0x11200001, /* add r1, =1 */
+    0x01200014, /* store r1, 20 */
+    0x1f20000a, /* comp r1, =10 */
+    0x27000002, /* jles 2 */
+    0x20000009, /* jump 9 */
+    0x02280014, /* load r1, 20 */
+    0x11200001, /* add r1, =1 */
+    0x01200014, /* store r1, 20 */
+    0x70c0000b  /* svc sp, =halt */
+};
+
+static void setup()
+{
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+}
+
+static void teardown()
+{
+}
+
+static char * test_fused_equals_unfused()
+{
+    struct vm_state ref, state;
+    struct vm_code * code;
+
+    test_init_vm(mem, loop_prog, ref, memsize);
+    vm_run(&ref, mem);
+    pu_assert_equal("error, Reference run", (int)mem[20], 11);
+
+    code = code_decode(loop_prog, sizeof(loop_prog) / sizeof(uint32_t));
+    pu_assert("error, Decoding failed", code != NULL);
+    pu_assert("error, Nothing fused", fuse_code(code, NULL) > 0);
+    pu_assert_equal("error, Increment fused", code->insn[2].xop, VM_XOP_LOAD_ADD_STORE);
+    pu_assert_equal("error, Compare and branch fused", code->insn[5].xop, VM_XOP_COMP_JCC);
+
+    memset(mem, 0x0, sizeof(mem));
+    test_init_vm(mem, loop_prog, state, memsize);
+    state.code = code;
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Stop reason", state.stop, ref.stop);
+    pu_assert_equal("error, Memory", (int)mem[20], 11);
+    pu_assert_equal("error, PC", state.pc, ref.pc);
+    pu_assert_equal("error, R1", state.regs[1], ref.regs[1]);
+    pu_assert_equal("error, SR", vm_get_sr(&state), vm_get_sr(&ref));
+
+    code_free(code);
+    return 0;
+}
+
+static char * test_breakpoint_in_sequence()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    struct vm_code * code;
+
+    code = code_decode(loop_prog, sizeof(loop_prog) / sizeof(uint32_t));
+    fuse_code(code, NULL);
+
+    test_init_vm(mem, loop_prog, state, memsize);
+    state.code = code;
+    dbg_init(&dbg);
+    dbg_break_set(&dbg, &state, mem, 3);
+
+    pu_assert("error, Shared code should not be patched", state.code != code);
+    pu_assert_equal("error, Shared code still fused", code->insn[2].xop, VM_XOP_LOAD_ADD_STORE);
+
+    vm_run(&state, mem);
+    pu_assert_equal("error, Expected to stop on breakpoint", state.stop, VM_STOP_BREAKPOINT);
+    pu_assert_equal("error, PC should point to the trap", state.pc, 3);
+
+    dbg_break_clear(&dbg, mem, 3);
+    dbg_continue(&dbg, &state, mem);
+    pu_assert_equal("error, Expected to halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Memory", (int)mem[20], 11);
+
+    dbg_deinit(&dbg);
+    code_free(code);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_fused_equals_unfused, PU_RUN);
+    pu_def_test(test_breakpoint_in_sequence, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
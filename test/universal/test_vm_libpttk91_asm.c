@@ -0,0 +1,149 @@
+/* file test_vm_libpttk91_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "libpttk91.h"
+
+#define MEMSIZE 256
+#define SVC_SQUARE 32
+
+/* Square the input with a host SVC and output it */
+static const char * src[] = {
+    "        in r1, =kbd",
+    "        svc sp, =32",
+    "        out r1, =crt",
+    "        svc sp, =halt"
+};
+
+static uint32_t image[MEMSIZE];
+static int code_size, image_size;
+
+/**
+ * Host of one instance.
+ */
+struct host {
+    int input;
+    int output;
+    int svcs;
+    size_t allocated;
+};
+
+static int host_in(void * arg, int device, int * value)
+{
+    *value = ((struct host *)arg)->input;
+    return 0;
+}
+
+static int host_out(void * arg, int device, int value)
+{
+    ((struct host *)arg)->output = value;
+    return 0;
+}
+
+static int host_svc(void * arg, struct pttk91_vm * vm, int call_code)
+{
+    int r1 = pttk91_reg(vm, 1);
+
+    if (call_code != SVC_SQUARE)
+        return -1;
+    ((struct host *)arg)->svcs++;
+    pttk91_set_reg(vm, 1, r1 * r1);
+    return 0;
+}
+
+static void * host_alloc(void * arg, size_t size)
+{
+    ((struct host *)arg)->allocated += size;
+    return malloc(size);
+}
+
+static void host_free(void * arg, void * ptr, size_t size)
+{
+    ((struct host *)arg)->allocated -= size;
+    free(ptr);
+}
+
+static void setup()
+{
+    struct asm_state as;
+    int i;
+
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, image, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+}
+
+static void teardown()
+{
+}
+
+static char * test_instances_have_own_hosts()
+{
+    struct host host[2] = { { 3 }, { 7 } };
+    struct pttk91_vm * vm[2];
+    struct vm_code * code;
+    int i;
+
+    code = code_decode(image, code_size);
+    for (i = 0; i < 2; i++) {
+        const struct pttk91_host io = { host_in, host_out, &host[i], host_svc,
+                                        host_alloc, host_free };
+
+        vm[i] = pttk91_create(&io, image, image_size, code_size, MEMSIZE, code);
+        pu_assert("error, Instance not created", vm[i] != NULL);
+        pu_assert("error, Memory from the host", host[i].allocated
+                  >= MEMSIZE * sizeof(uint32_t));
+    }
+
+    for (i = 0; i < 2; i++) {
+        pu_assert_equal("error, Stop reason", pttk91_run(vm[i]), PTTK91_STOP_HALT);
+        pu_assert_equal("error, SVC count", host[i].svcs, 1);
+    }
+    pu_assert_equal("error, Output of the first instance", host[0].output, 9);
+    pu_assert_equal("error, Output of the second instance", host[1].output, 49);
+
+    for (i = 0; i < 2; i++) {
+        pttk91_destroy(vm[i]);
+        pu_assert_equal("error, Memory returned", (int)host[i].allocated, 0);
+    }
+    code_free(code);
+
+    return 0;
+}
+
+static char * test_unknown_svc()
+{
+    struct host host = { 1 };
+    const struct pttk91_host io = { host_in, host_out, &host, NULL, NULL, NULL };
+    struct pttk91_vm * vm;
+
+    /* Without a SVC hook the built-in SVCs reject the call */
+    vm = pttk91_create(&io, image, image_size, code_size, MEMSIZE, NULL);
+    pu_assert("error, Instance not created", vm != NULL);
+    pu_assert_equal("error, Stop reason", pttk91_run(vm), PTTK91_STOP_ERROR);
+    pu_assert_equal("error, Illegal SVC", pttk91_error(vm), VM_ERR_ILLEGAL_SVC);
+    pttk91_destroy(vm);
+
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_instances_have_own_hosts, PU_RUN);
+    pu_def_test(test_unknown_svc, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
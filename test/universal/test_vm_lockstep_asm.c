@@ -0,0 +1,161 @@
+/* file test_vm_lockstep_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "fuse.h"
+#include "lockstep.h"
+
+#define LANES   40
+#define MEMSIZE 256
+
+uint32_t mem[LANES][MEMSIZE];
+uint32_t image[MEMSIZE];
+uint32_t ref_mem[MEMSIZE];
+int input[LANES][2];
+
+/* Collatz steps of the first input and 100 divided by the second input */
+static const char * src[] = {
+    "result  ds 1",
+    "        in r1, =kbd",
+    "        load r2, =0",
+    "loop    comp r1, =1",
+    "        jngre done",
+    "        load r3, r1",
+    "        mod r3, =2",
+    "        jzer r3, even",
+    "        mul r1, =3",
+    "        add r1, =1",
+    "        jump next",
+    "even    div r1, =2",
+    "next    add r2, =1",
+    "        jump loop",
+    "done    store r2, result",
+    "        out r2, =crt",
+    "        in r4, =kbd",
+    "        load r5, =100",
+    "        div r5, r4",
+    "        out r5, =crt",
+    "        svc sp, =halt"
+};
+
+static int code_size;
+
+struct ref_io {
+    const int * input;
+    int input_len;
+    int input_pos;
+    int output[4];
+    int output_len;
+};
+
+static int ref_in(void * arg, int device, int * value)
+{
+    struct ref_io * io = (struct ref_io *)arg;
+
+    if (io->input_pos >= io->input_len)
+        return 1;
+    *value = io->input[io->input_pos++];
+    return 0;
+}
+
+static int ref_out(void * arg, int device, int value)
+{
+    struct ref_io * io = (struct ref_io *)arg;
+
+    io->output[io->output_len++] = value;
+    return 0;
+}
+
+static void setup()
+{
+    struct asm_state as;
+    int i, image_size;
+
+    memset(mem, 0x0, sizeof(mem));
+
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    for (i = 0; i < LANES; i++) {
+        asm_image(&as, mem[i], MEMSIZE, &code_size, &image_size, NULL);
+        input[i][0] = i + 1;
+        input[i][1] = i % 5;
+    }
+    memcpy(image, mem[0], sizeof(image));
+    asm_free(&as);
+}
+
+static void teardown()
+{
+}
+
+static char * test_lanes_equal_vm_run()
+{
+    static struct lockstep ls;
+    struct lockstep_lane lane[LANES];
+    int output[LANES][4];
+    struct vm_code * code;
+    int i;
+
+    code = code_decode(mem[0], code_size);
+    fuse_code(code, NULL);
+
+    memset(lane, 0, sizeof(lane));
+    for (i = 0; i < LANES; i++) {
+        lane[i].mem = mem[i];
+        lane[i].input = input[i];
+        /* The last lane runs out of input */
+        lane[i].input_len = (i == LANES - 1) ? 1 : 2;
+        lane[i].output = output[i];
+        lane[i].output_size = 4;
+    }
+    pu_assert_equal("error, Init", lockstep_init(&ls, code, code_size, MEMSIZE, lane, LANES), 0);
+    lockstep_run(&ls);
+
+    for (i = 0; i < LANES; i++) {
+        struct vm_state ref;
+        struct ref_io ref_io = { input[i], lane[i].input_len, 0, { 0 }, 0 };
+        struct vm_io io = { ref_in, ref_out, &ref_io };
+
+        memcpy(ref_mem, image, sizeof(ref_mem));
+        vm_init_state(&ref, code_size, MEMSIZE);
+        ref.io = &io;
+        vm_run(&ref, ref_mem);
+
+        pu_assert_equal("error, Stop reason", lane[i].state.stop, ref.stop);
+        pu_assert_equal("error, Error", lane[i].state.error, ref.error);
+        pu_assert_equal("error, PC", lane[i].state.pc, ref.pc);
+        pu_assert("error, Registers",
+                  memcmp(lane[i].state.regs, ref.regs, sizeof(ref.regs)) == 0);
+        pu_assert_equal("error, SR", vm_get_sr(&lane[i].state), vm_get_sr(&ref));
+        pu_assert_equal("error, Output length", lane[i].output_len, ref_io.output_len);
+        pu_assert("error, Output",
+                  memcmp(output[i], ref_io.output, ref_io.output_len * sizeof(int)) == 0);
+        pu_assert("error, Memory", memcmp(mem[i], ref_mem, sizeof(ref_mem)) == 0);
+        pu_assert("error, Instruction count", lane[i].state.count == ref.count);
+    }
+    pu_assert_equal("error, Collatz steps of 27", output[26][0], 111);
+    pu_assert_equal("error, Division by zero", lane[5].state.error, VM_ERR_PARAM_ERROR);
+    pu_assert_equal("error, Input exhausted", lane[LANES - 1].state.error,
+                    VM_ERR_INVALID_DEVICE);
+
+    code_free(code);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_lanes_equal_vm_run, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,122 @@
+/* file test_vm_loop_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "loop.h"
+
+uint32_t mem[1024];
+uint32_t ref_mem[1024];
+int memsize;
+
+static const char * src[] = {
+    "arr     ds 100",
+    "dst     ds 100",
+    "        load r2, =42",
+    "        load r1, =0",
+    "fill    store r2, arr(r1)",
+    "        add r1, =1",
+    "        comp r1, =100",
+    "        jles fill",
+    "        load r1, =99",
+    "copy    load r3, arr(r1)",
+    "        store r3, dst(r1)",
+    "        sub r1, =1",
+    "        jnneg r1, copy",
+    "        load r1, =0",
+    "sum     add r4, dst(r1)",
+    "        add r1, =3",
+    "        comp r1, =100",
+    "        jles sum",
+    "        load r1, =0",
+    "oob     store r2, 1000(r1)",
+    "        add r1, =1",
+    "        comp r1, =100",
+    "        jles oob",
+    "        svc sp, =halt"
+};
+
+static int code_size;
+
+static void setup()
+{
+    struct asm_state as;
+    int i, image_size;
+
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, memsize, &code_size, &image_size, NULL);
+    asm_free(&as);
+}
+
+static void teardown()
+{
+}
+
+static char * test_loops_equal_interpreted()
+{
+    struct vm_state ref, state;
+    struct vm_code * code;
+
+    vm_init_state(&ref, code_size, memsize);
+    vm_run(&ref, mem);
+    memcpy(ref_mem, mem, sizeof(mem));
+    pu_assert_equal("error, Reference stops on the last loop", ref.stop, VM_STOP_ERROR);
+
+    setup();
+    code = code_decode(mem, code_size);
+    pu_assert_equal("error, Loops found", loop_code(code), 4);
+
+    vm_init_state(&state, code_size, memsize);
+    state.code = code;
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Stop reason", state.stop, ref.stop);
+    pu_assert_equal("error, Error", state.error, ref.error);
+    pu_assert_equal("error, PC", state.pc, ref.pc);
+    pu_assert("error, Registers", memcmp(state.regs, ref.regs, sizeof(ref.regs)) == 0);
+    pu_assert_equal("error, SR", vm_get_sr(&state), vm_get_sr(&ref));
+    pu_assert("error, Memory", memcmp(mem, ref_mem, sizeof(mem)) == 0);
+
+    code_free(code);
+    return 0;
+}
+
+static char * test_count()
+{
+    struct loop_desc loop;
+    int64_t n;
+
+    loop.step = 3;
+    loop.limit = 100;
+    loop.cond = LOOP_LT;
+    pu_assert_equal("error, Count", loop_count(&loop, 0, &n), 0);
+    pu_assert_equal("error, Iterations", (int)n, 34);
+    pu_assert_equal("error, Count on entry past the limit", loop_count(&loop, 200, &n), 0);
+    pu_assert_equal("error, Runs at least once", (int)n, 1);
+
+    loop.cond = LOOP_NE;
+    pu_assert_equal("error, Never terminates", loop_count(&loop, 0, &n), 1);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_loops_equal_interpreted, PU_RUN);
+    pu_def_test(test_count, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,184 @@
+/* file test_vm_mmio_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "peephole.h"
+#include "mmio.h"
+
+#define MEMSIZE 1024
+#define IN_RING (MEMSIZE)
+#define OUT_RING (MEMSIZE + MMIO_PAGE_WORDS)
+
+/* Doubles the words of the input ring to the output ring */
+static const char * doubler[] = {
+    "n       dc 0",
+    "loop    load r1, 1025",
+    "        jzer r1, done",
+    "        load r2, 1024",
+    "        mul r2, =2",
+    "        store r2, 1280",
+    "        load r3, n",
+    "        add r3, =1",
+    "        store r3, n",
+    "        jump loop",
+    "done    svc sp, =halt"
+};
+
+static const char * unmapped[] = {
+    "        load r1, 2000",
+    "        svc sp, =halt"
+};
+
+static const char * empty[] = {
+    "        load r1, 1024",
+    "        svc sp, =halt"
+};
+
+/* The load after the store pops the oldest word of the ring */
+static const char * store_load[] = {
+    "        load r1, =5",
+    "        store r1, 1024",
+    "        load r1, 1024",
+    "        svc sp, =halt"
+};
+
+static uint32_t mem[MEMSIZE];
+static int code_size, image_size;
+static struct vm_mmio mmio;
+static struct mmio_ring in, out;
+
+static void setup()
+{
+    mmio_init(&mmio, MEMSIZE, 2);
+    mmio_ring_init(&in, 16);
+    mmio_ring_init(&out, 16);
+    mmio_map(&mmio, IN_RING, 1, &in.dev);
+    mmio_map(&mmio, OUT_RING, 1, &out.dev);
+}
+
+static void teardown()
+{
+    mmio_free(&mmio);
+    mmio_ring_free(&in);
+    mmio_ring_free(&out);
+}
+
+static void run(const char ** src, int lines, struct vm_state * state)
+{
+    struct asm_state as;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < lines; i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    vm_init_state(state, code_size, MEMSIZE);
+    state->regs[PTTK91_SP] = image_size - 1;
+    state->regs[PTTK91_FP] = image_size - 1;
+    state->mmio = &mmio;
+    state->running = 1;
+    vm_run(state, mem);
+}
+
+static char * test_ring_loop()
+{
+    struct vm_state state;
+    uint32_t values[16];
+    int i;
+
+    for (i = 0; i < 10; i++)
+        values[i] = i + 1;
+    pu_assert_equal("error, Pushed", (int)mmio_ring_push(&in, values, 10), 10);
+
+    run(doubler, sizeof(doubler) / sizeof(doubler[0]), &state);
+    pu_assert_equal("error, Halted", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, No error", state.error, VM_ERR_NO_ERROR);
+    pu_assert_equal("error, Ordinary memory", (int)mem[code_size + 1], 10);
+
+    /* The host drains the output in one batch */
+    pu_assert_equal("error, Popped", (int)mmio_ring_pop(&out, values, 16), 10);
+    for (i = 0; i < 10; i++) {
+        pu_assert_equal("error, Doubled", (int)values[i], 2 * (i + 1));
+    }
+    return 0;
+}
+
+static char * test_errors()
+{
+    struct vm_state state;
+
+    run(unmapped, sizeof(unmapped) / sizeof(unmapped[0]), &state);
+    pu_assert_equal("error, Stopped", state.stop, VM_STOP_ERROR);
+    pu_assert_equal("error, Out of bounds", state.error, VM_ERR_ADDRESS_OUT_OF_BOUNDS);
+
+    run(empty, sizeof(empty) / sizeof(empty[0]), &state);
+    pu_assert_equal("error, Stopped", state.stop, VM_STOP_ERROR);
+    pu_assert_equal("error, Empty ring", state.error, VM_ERR_INVALID_DEVICE);
+    return 0;
+}
+
+static char * test_store_load_optimized()
+{
+    struct vm_state state;
+    struct vm_code * code;
+    struct asm_state as;
+    const uint32_t value = 7;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < 4; i++)
+        asm_line(&as, store_load[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    code = code_decode(mem, code_size);
+    pu_assert_equal("error, Load after store removed", peephole_code(code), 1);
+    mmio_ring_push(&in, &value, 1);
+
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.mmio = &mmio;
+    state.code = code;
+    vm_run(&state, mem);
+    pu_assert_equal("error, Halted", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Device read", state.regs[1], 7);
+    pu_assert_equal("error, Stored word left", (int)mmio_ring_count(&in), 1);
+
+    code_free(code);
+    return 0;
+}
+
+static char * test_ring_size()
+{
+    struct mmio_ring ring;
+
+    pu_assert_equal("error, Not a power of 2", mmio_ring_init(&ring, 12), 2);
+    pu_assert_equal("error, Zero size", mmio_ring_init(&ring, 0), 2);
+    pu_assert_equal("error, Power of 2", mmio_ring_init(&ring, 8), 0);
+    mmio_ring_free(&ring);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_ring_loop, PU_RUN);
+    pu_def_test(test_errors, PU_RUN);
+    pu_def_test(test_store_load_optimized, PU_RUN);
+    pu_def_test(test_ring_size, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,111 @@
+/* file test_vm_peephole.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "code.h"
+#include "peephole.h"
+#include "debug.h"
+
+uint32_t mem[1024];
+int memsize;
+
+#define test_init_vm(mem, prog, state, memsize) do {\
+                                    memcpy((void*)mem, (void*)prog, sizeof(prog));\
+                                    vm_init_state(&state, sizeof(prog) / sizeof(uint32_t), memsize);\
+                                    } while(0)
+
+static const uint32_t prog[] = {
+    0x02200005, /* load r1, =5 */
+    0x01200014, /* store r1, 20 */
+    0x02280014, /* load r1, 20 */
+    0x11200000, /* add r1, =0 */
+    0x00000000, /* nop */
+    0x00000000, /* nop */
+    0x20000008, /* jump 8 */
+    0x20000002, /* jump 2 */
+    0x20000009, /* jump 9 */
+    0x12200001, /* sub r1, =1 */
+    0x01200015, /* store r1, 21 */
+    0x22200007, /* jzer r1, 7 */
+    0x70c0000b  /* svc sp, =halt */
+};
+
+static void setup()
+{
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+}
+
+static void teardown()
+{
+}
+
+static char * test_optimized_equals_unoptimized()
+{
+    struct vm_state ref, state;
+    struct vm_code * code;
+    int removed;
+
+    test_init_vm(mem, prog, ref, memsize);
+    vm_run(&ref, mem);
+
+    code = code_decode(prog, sizeof(prog) / sizeof(uint32_t));
+    removed = peephole_code(code);
+    /* add =0, two nops and the load after store */
+    pu_assert_equal("error, Removed instructions", removed, 4);
+    pu_assert_equal("error, Jump retargeted", code->insn[6].imm, 9);
+
+    memset(mem, 0x0, sizeof(mem));
+    test_init_vm(mem, prog, state, memsize);
+    state.code = code;
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Stop reason", state.stop, ref.stop);
+    pu_assert_equal("error, PC", state.pc, ref.pc);
+    pu_assert_equal("error, R1", state.regs[1], ref.regs[1]);
+    pu_assert_equal("error, Memory", (int)mem[21], 4);
+    pu_assert_equal("error, Image not modified", mem[3], prog[3]);
+    /* The jump at 6 skips the jump at 8 */
+    pu_assert_equal("error, Skipped jump not counted", (int)state.count, (int)ref.count - 1);
+
+    code_free(code);
+    return 0;
+}
+
+static char * test_breakpoint_on_bypassed_jump()
+{
+    struct vm_state state;
+    struct dbg_state dbg;
+    struct vm_code * code;
+
+    code = code_decode(prog, sizeof(prog) / sizeof(uint32_t));
+    peephole_code(code);
+
+    test_init_vm(mem, prog, state, memsize);
+    state.code = code;
+    dbg_init(&dbg);
+    dbg_break_set(&dbg, &state, mem, 8);
+
+    vm_run(&state, mem);
+    pu_assert_equal("error, Expected to stop on breakpoint", state.stop, VM_STOP_BREAKPOINT);
+    pu_assert_equal("error, PC should point to the trap", state.pc, 8);
+
+    dbg_deinit(&dbg);
+    code_free(code);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_optimized_equals_unoptimized, PU_RUN);
+    pu_def_test(test_breakpoint_on_bypassed_jump, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
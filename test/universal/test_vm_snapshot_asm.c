@@ -0,0 +1,97 @@
+/* file test_vm_snapshot_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+#include "code.h"
+#include "snapshot.h"
+
+#define MEMSIZE 4096
+
+/* Writes to the data of the image and to a page after it */
+static const char * src[] = {
+    "x       dc 5",
+    "        load r1, x",
+    "        add r1, =2",
+    "        store r1, x",
+    "        load r2, =3000",
+    "        store r1, 0(r2)",
+    "        svc sp, =halt"
+};
+
+static uint32_t mem[MEMSIZE];
+static uint32_t image[MEMSIZE];
+static int code_size, image_size;
+
+static void setup()
+{
+    struct asm_state as;
+    int i;
+
+    memset(mem, 0, sizeof(mem));
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, MEMSIZE, &code_size, &image_size, NULL);
+    asm_free(&as);
+    memcpy(image, mem, sizeof(mem));
+}
+
+static void teardown()
+{
+}
+
+static char * test_snapshot_reset()
+{
+    struct vm_state state;
+    struct snapshot snap;
+    struct vm_code * code;
+    int i;
+
+    code = code_decode(mem, code_size);
+    vm_init_state(&state, code_size, MEMSIZE);
+    state.code = code;
+    pu_assert_equal("error, Snapshot", snapshot_init(&snap, &state, mem, image_size), 0);
+
+    for (i = 0; i < 3; i++) {
+        vm_run(&state, mem);
+        pu_assert_equal("error, Stop reason", state.stop, VM_STOP_HALT);
+        pu_assert_equal("error, Data written", (int)mem[code_size + 1], 7);
+        pu_assert_equal("error, Page written", (int)mem[3000], 7);
+        pu_assert("error, Pages marked", snap.dirty[0] && !snap.dirty[1] && snap.dirty[2]);
+
+        snapshot_reset(&snap, &state, mem);
+        pu_assert("error, Memory restored", memcmp(mem, image, sizeof(mem)) == 0);
+        pu_assert("error, Map cleared", !snap.dirty[0] && !snap.dirty[2]);
+        pu_assert_equal("error, State restored", (int)state.count, 0);
+        pu_assert_equal("error, PC restored", state.pc, 0);
+    }
+
+    /* Only the dirty pages are copied back */
+    mem[2000] = 9;
+    vm_run(&state, mem);
+    snapshot_reset(&snap, &state, mem);
+    pu_assert_equal("error, Clean page untouched", (int)mem[2000], 9);
+    snapshot_dirty(&snap, 2000, 2000);
+    snapshot_reset(&snap, &state, mem);
+    pu_assert_equal("error, Marked page restored", (int)mem[2000], 0);
+
+    snapshot_free(&snap);
+    code_free(code);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_snapshot_reset, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
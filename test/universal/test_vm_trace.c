@@ -0,0 +1,140 @@
+/* file test_vm_trace.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "trace.h"
+
+uint32_t mem[1024];
+int memsize;
+
+static uint8_t log_buf[TRACE_RING_SIZE];
+static size_t log_len;
+
+#define test_init_vm(mem, prog, state, memsize) do {\
+                                    memcpy((void*)mem, (void*)prog, sizeof(prog));\
+                                    vm_init_state(&state, sizeof(prog) / sizeof(uint32_t), memsize);\
+                                    } while(0)
+
+static void setup()
+{
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+}
+
+static void teardown()
+{
+}
+
+static uint32_t prog[] = { 0x02200003, /* load r1, =3 */
+                           0x12200001, /* loop sub r1, =1 */
+                           0x04200000, /* out r1, =crt */
+                           0x23200001, /* jpos r1, loop */
+                           0x70c0000b  /* svc sp, =halt */
+                         };
+
+static char * test_record()
+{
+    struct vm_state state;
+    struct trace trace;
+
+    test_init_vm(mem, prog, state, memsize);
+    memset(&trace, 0, sizeof(trace));
+    trace.mode = TRACE_RECORD;
+    trace_ring_init(&trace.ring, TRACE_RING_SIZE);
+    state.trace = &trace;
+
+    vm_run(&state, mem);
+    log_len = trace_ring_read(&trace.ring, log_buf, sizeof(log_buf));
+    trace_ring_free(&trace.ring);
+
+    pu_assert_equal("error, Program should halt", state.stop, VM_STOP_HALT);
+    /* 3 x OUT, 2 x branch, SVC */
+    pu_assert("error, Trace should be compact", log_len > 0 && log_len <= 6 * 3);
+    return 0;
+}
+
+static char * test_replay()
+{
+    struct vm_state state;
+    struct trace trace;
+
+    test_init_vm(mem, prog, state, memsize);
+    memset(&trace, 0, sizeof(trace));
+    trace.mode = TRACE_REPLAY;
+    trace.rbuf = log_buf;
+    trace.rlen = log_len;
+    state.trace = &trace;
+
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Replay should halt", state.stop, VM_STOP_HALT);
+    pu_assert_equal("error, Whole trace consumed", trace.rpos, log_len);
+    return 0;
+}
+
+static char * test_replay_diverged()
+{
+    struct vm_state state;
+    struct trace trace;
+
+    test_init_vm(mem, prog, state, memsize);
+    mem[0] = 0x02200004; /* load r1, =4 */
+    memset(&trace, 0, sizeof(trace));
+    trace.mode = TRACE_REPLAY;
+    trace.rbuf = log_buf;
+    trace.rlen = log_len;
+    state.trace = &trace;
+
+    vm_run(&state, mem);
+
+    pu_assert_equal("error, Replay should diverge", state.error, VM_ERR_TRACE_DIVERGED);
+    return 0;
+}
+
+static char * test_check()
+{
+    struct vm_state state;
+    struct trace trace;
+    uint32_t time_prog[] = { 0x70c0000e, /* svc sp, =time */
+                             0x70c0000b  /* svc sp, =halt */
+                           };
+
+    memset(&trace, 0, sizeof(trace));
+    trace.mode = TRACE_REPLAY;
+    trace.rbuf = log_buf;
+    trace.rlen = log_len;
+    pu_assert_equal("error, Trace can be replayed", trace_check(&trace), 0);
+    trace.rlen = log_len - 1;
+    pu_assert_equal("error, Truncated trace", trace_check(&trace), 1);
+
+    /* The result of SVC time is not recorded */
+    test_init_vm(mem, time_prog, state, memsize);
+    memset(&trace, 0, sizeof(trace));
+    trace.mode = TRACE_RECORD;
+    trace_ring_init(&trace.ring, TRACE_RING_SIZE);
+    state.trace = &trace;
+    vm_run(&state, mem);
+    trace.rlen = trace_ring_read(&trace.ring, log_buf, sizeof(log_buf));
+    trace_ring_free(&trace.ring);
+    trace.rbuf = log_buf;
+    trace.rpos = 0;
+    pu_assert_equal("error, SVC time can't be replayed", trace_check(&trace), 1);
+    return 0;
+}
+
+static void all_tests()
+{
+    pu_def_test(test_record, PU_RUN);
+    pu_def_test(test_replay, PU_RUN);
+    pu_def_test(test_replay_diverged, PU_RUN);
+    pu_def_test(test_check, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}
@@ -0,0 +1,165 @@
+/* file test_vm_vector_asm.c */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "punit.h"
+#include "config.h"
+#include "vm.h"
+#include "asm.h"
+
+uint32_t mem[1024];
+int memsize;
+
+/* Dot product of two 16 word arrays and lane operations */
+static const char * src[] = {
+    "a       ds 16",
+    "b       ds 16",
+    "prod    ds 8",
+    "cmp     ds 8",
+    "        load r1, =0",
+    "        vsplat v2, =0",
+    "loop    vload v0, a(r1)",
+    "        vload v1, b(r1)",
+    "        vmul v0, v1",
+    "        vadd v2, v0",
+    "        add r1, =8",
+    "        comp r1, =16",
+    "        jles loop",
+    "        vstore v2, prod",
+    "        vsum r2, v2",
+    "        vload v3, a",
+    "        vmin r3, v3",
+    "        vmax r4, v3",
+    "        vcomp v3, v1",
+    "        vstore v3, cmp",
+    "        vstore v3, 0",
+    "        svc sp, =halt"
+};
+
+static int code_size;
+static int data;
+
+static void setup()
+{
+    struct asm_state as;
+    int i, image_size;
+
+    memsize = sizeof(mem) / sizeof(uint32_t);
+    memset(mem, 0x0, sizeof(mem));
+
+    asm_init(&as);
+    for (i = 0; i < (int)(sizeof(src) / sizeof(src[0])); i++)
+        asm_line(&as, src[i]);
+    asm_finish(&as);
+    asm_image(&as, mem, memsize, &code_size, &image_size, NULL);
+    asm_free(&as);
+
+    data = code_size + 1;
+    for (i = 0; i < 16; i++) {
+        mem[data + i] = (uint32_t)(i * 3 - 20);
+        mem[data + 16 + i] = (uint32_t)(7 - i * i);
+    }
+}
+
+static void teardown()
+{
+}
+
+static char * test_vector_kernel()
+{
+    struct vm_state state;
+    int32_t prod[8];
+    int i, sum = 0;
+
+    for (i = 0; i < 8; i++)
+        prod[i] = (i * 3 - 20) * (7 - i * i) + ((i + 8) * 3 - 20) * (7 - (i + 8) * (i + 8));
+    for (i = 0; i < 8; i++)
+        sum += prod[i];
+
+    vm_init_state(&state, code_size, memsize);
+    vm_run(&state, mem);
+
+    /* The last store targets the code area */
+    pu_assert_equal("error, Expected to stop on the code write", state.stop, VM_STOP_ERROR);
+    pu_assert_equal("error, Error code", state.error, VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS);
+    pu_assert_equal("error, Code intact", mem[0], 0x02200000);
+
+    pu_assert("error, Products", memcmp(&mem[data + 32], prod, sizeof(prod)) == 0);
+    pu_assert_equal("error, Sum", state.regs[2], sum);
+    pu_assert_equal("error, Min", state.regs[3], -20);
+    pu_assert_equal("error, Max", state.regs[4], 1);
+    for (i = 0; i < 8; i++) {
+        const int a = i * 3 - 20;
+        const int b = 7 - (i + 8) * (i + 8);
+
+        pu_assert_equal("error, Compare", (int)mem[data + 40 + i], (a > b) - (a < b));
+    }
+
+    return 0;
+}
+
+static int run_at(const char * line, int index)
+{
+    uint32_t prog[4];
+    struct vm_state state;
+    struct asm_state as;
+    int size, image_size;
+
+    memset(prog, 0, sizeof(prog));
+    asm_init(&as);
+    asm_line(&as, line);
+    asm_line(&as, "svc sp, =halt");
+    asm_finish(&as);
+    asm_image(&as, prog, 4, &size, &image_size, NULL);
+    asm_free(&as);
+    memcpy(mem, prog, sizeof(prog));
+
+    vm_init_state(&state, size, memsize);
+    state.regs[1] = index;
+    vm_run(&state, mem);
+    return state.error;
+}
+
+static char * test_vector_bounds()
+{
+    pu_assert_equal("error, Load at the end", run_at("vload v0, 10(r1)", memsize - 18), 0);
+    pu_assert_equal("error, Load past the end", run_at("vload v0, 10(r1)", memsize - 17),
+                    VM_ERR_ADDRESS_OUT_OF_BOUNDS);
+    pu_assert_equal("error, Load near INT_MAX", run_at("vload v0, 10(r1)", INT_MAX - 12),
+                    VM_ERR_ADDRESS_OUT_OF_BOUNDS);
+    pu_assert_equal("error, Store past the end", run_at("vstore v0, 10(r1)", memsize - 17),
+                    VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS);
+    pu_assert_equal("error, Store near INT_MAX", run_at("vstore v0, 10(r1)", INT_MAX - 12),
+                    VM_ERR_WR_ADDRESS_OUT_OF_BOUNDS);
+    return 0;
+}
+
+static char * test_vector_syntax()
+{
+    struct asm_state as;
+
+    asm_init(&as);
+    pu_assert_equal("error, Scalar operand accepted", asm_line(&as, "vadd v1, =3"), 1);
+    pu_assert_equal("error, Scalar Rj accepted", asm_line(&as, "vload r1, 10"), 1);
+    pu_assert_equal("error, Valid line rejected", asm_line(&as, "vsplat v7, r2"), 0);
+    pu_assert_equal("error, Encoding", as.code[0], 0x42e20000);
+    asm_free(&as);
+
+    return 0;
+}
+
+static void all_tests()
+{
+#if VM_VECTOR == 1
+    pu_def_test(test_vector_kernel, PU_RUN);
+    pu_def_test(test_vector_bounds, PU_RUN);
+#endif
+    pu_def_test(test_vector_syntax, PU_RUN);
+}
+
+int main(int argc, char **argv)
+{
+    return pu_run_tests(&all_tests);
+}